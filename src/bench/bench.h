@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__BENCH__BENCH_H
+#define TEAVPN2__BENCH__BENCH_H
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <teavpn2/server/common.h>
+#include <teavpn2/server/linux/udp.h>
+
+
+/*
+ * Just enough server state for the session functions: the session
+ * array, the session map and the index depot, and @nr_threads epoll
+ * threads with their magazines. No socket, no TUN, no event loop.
+ */
+struct bench_srv {
+	struct srv_cfg		cfg;
+	struct srv_udp_state	state;
+};
+
+
+/*
+ * main.o is not linked in, the entry points still refer to it. Every
+ * benchmark is a single translation unit.
+ */
+void show_version(void)
+{
+}
+
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static inline int bench_srv_init(struct bench_srv *b, uint8_t nr_threads,
+				 uint16_t max_conn)
+{
+	int ret;
+	uint16_t i, mag_cap;
+	struct srv_udp_state *state = &b->state;
+
+	memset(b, 0, sizeof(*b));
+	b->cfg.sys.thread_num = nr_threads;
+	b->cfg.sock.max_conn  = max_conn;
+	state->cfg = &b->cfg;
+	mt_store(&state->flow_gen, 1u);
+
+	state->sess_arr = calloc_wrp(max_conn, sizeof(*state->sess_arr));
+	state->sess_map = calloc_wrp(0x100u * 0x100u,
+				     sizeof(struct udp_map_bucket));
+	state->epl_threads = calloc_wrp(nr_threads,
+					sizeof(*state->epl_threads));
+	if (!state->sess_arr || !state->sess_map || !state->epl_threads)
+		return -ENOMEM;
+
+	ret = mutex_init(&state->sess_map_lock, NULL);
+	if (ret)
+		return ret;
+
+	ret = al_slab_init(&state->bkt_slab, sizeof(struct udp_map_bucket),
+			   256u);
+	if (ret)
+		return ret;
+
+	if (!idx_depot_init(&state->sess_depot, max_conn))
+		return -errno;
+
+	for (i = max_conn; i--;) {
+		reset_udp_session(&state->sess_arr[i], i);
+		idx_depot_push(&state->sess_depot, i);
+	}
+
+	/*
+	 * The same magazine capacity as init_epoll_thread().
+	 */
+	mag_cap = max_conn / (nr_threads * 4u);
+	for (i = 0; i < nr_threads; i++) {
+		state->epl_threads[i].state = state;
+		state->epl_threads[i].idx   = i;
+		idx_mag_init(&state->epl_threads[i].sess_mag, mag_cap);
+	}
+
+	return tpool_init(&state->pool, 1u, 0u);
+}
+
+#endif /* #ifndef TEAVPN2__BENCH__BENCH_H */
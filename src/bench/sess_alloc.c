@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+/*
+ * Concurrent session create/close throughput.
+ *
+ * N threads open and close sessions as fast as they can, each keeps
+ * BENCH_HOLD of them open at a time. "mag" is get_udp_sess() and
+ * put_udp_session() as they are, the per-thread index magazines in
+ * front of the lock-free depot. "stack" is the bt_stack behind
+ * sess_stk_lock they replaced, held over the map update as it was.
+ * Both do the same work on the session and the session map, only
+ * the free index allocator differs.
+ *
+ *   make bench RELEASE_MODE=1
+ *   ./bench_sess_alloc [threads] [max_conn] [pairs per thread]
+ *
+ * The debug build is -O0 with the sanitizers on, measure a release
+ * build.
+ */
+
+/*
+ * The static session map helpers are needed for the old path.
+ */
+#include <teavpn2/server/linux/udp_session.c>
+#include <pthread.h>
+#include <teavpn2/stack.h>
+#include "bench.h"
+
+#define BENCH_HOLD	8u
+
+static struct bench_srv b;
+static struct tmutex sess_stk_lock;
+static struct bt_stack sess_stk;
+static pthread_barrier_t start_barrier;
+
+
+static struct udp_sess *stack_get_udp_sess(struct epl_thread *thread,
+					   uint32_t addr, uint16_t port)
+{
+	int32_t stk_ret;
+	struct udp_sess *sess, *ret;
+	struct srv_udp_state *state = thread->state;
+
+	mutex_lock(&sess_stk_lock);
+	stk_ret = bt_stack_pop(&sess_stk);
+	if (unlikely(stk_ret == -1)) {
+		ret = NULL;
+		goto out;
+	}
+
+	sess = &state->sess_arr[stk_ret];
+	reset_udp_session(sess, (uint16_t)stk_ret);
+	sess->owner    = (uint8_t)thread->idx;
+	sess->src_addr = addr;
+	sess->src_port = port;
+	ret = map_insert_udp_sess(state, addr, sess);
+	if (unlikely(!ret)) {
+		BUG_ON(bt_stack_push(&sess_stk, (uint16_t)stk_ret) == -1);
+		goto out;
+	}
+
+	addr = htonl(addr);
+	WARN_ON(!inet_ntop(AF_INET, &addr, sess->str_src_addr,
+			   sizeof(sess->str_src_addr)));
+
+	udp_sess_tv_update(sess);
+	mt_store(&sess->is_connected, true);
+	mt_fetch_add(&state->n_on_sess, 1);
+out:
+	mutex_unlock(&sess_stk_lock);
+	return ret;
+}
+
+
+static void stack_put_udp_session(struct epl_thread *thread,
+				  struct udp_sess *sess)
+{
+	struct srv_udp_state *state = thread->state;
+
+	mutex_lock(&sess_stk_lock);
+	BUG_ON(bt_stack_push(&sess_stk, sess->idx) == -1);
+	remove_sess_from_bkt(state, sess);
+	udp_sess_conn_close(sess);
+	udp_sess_acl_swap(sess, NULL);
+	reset_udp_session(sess, sess->idx);
+	srv_flow_flush(state);
+	mutex_unlock(&sess_stk_lock);
+	mt_fetch_sub(&state->n_on_sess, 1);
+}
+
+
+struct bench_arg {
+	struct epl_thread	*thread;
+	uint64_t		nr_pairs;
+	bool			use_stack;
+	uint64_t		fail;
+};
+
+
+static void *bench_thread(void *p)
+{
+	uint32_t k;
+	uint64_t i;
+	struct bench_arg *arg = p;
+	struct epl_thread *thread = arg->thread;
+	struct udp_sess *held[BENCH_HOLD] = { NULL };
+	const uint32_t base = (uint32_t)(thread->idx + 1u) << 24u;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < arg->nr_pairs; i++) {
+		k = (uint32_t)(i % BENCH_HOLD);
+		if (held[k]) {
+			if (arg->use_stack)
+				stack_put_udp_session(thread, held[k]);
+			else
+				put_udp_session(thread, held[k]);
+		}
+
+		if (arg->use_stack)
+			held[k] = stack_get_udp_sess(thread, base | (uint32_t)i,
+						     (uint16_t)i);
+		else
+			held[k] = get_udp_sess(thread, base | (uint32_t)i,
+					       (uint16_t)i);
+		if (unlikely(!held[k]))
+			arg->fail++;
+	}
+
+	for (k = 0; k < BENCH_HOLD; k++) {
+		if (!held[k])
+			continue;
+		if (arg->use_stack)
+			stack_put_udp_session(thread, held[k]);
+		else
+			put_udp_session(thread, held[k]);
+	}
+
+	return NULL;
+}
+
+
+static int run(const char *name, uint8_t nr_threads, uint64_t nr_pairs,
+	       bool use_stack)
+{
+	uint8_t i;
+	uint64_t t0, t1, fail = 0;
+	pthread_t tids[256];
+	struct bench_arg args[256];
+
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1u);
+	for (i = 0; i < nr_threads; i++) {
+		args[i].thread    = &b.state.epl_threads[i];
+		args[i].nr_pairs  = nr_pairs;
+		args[i].use_stack = use_stack;
+		args[i].fail      = 0;
+		if (pthread_create(&tids[i], NULL, bench_thread, &args[i]))
+			return -1;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	t0 = bench_now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(tids[i], NULL);
+		fail += args[i].fail;
+	}
+	t1 = bench_now_ns();
+	pthread_barrier_destroy(&start_barrier);
+
+	printf("%-6s threads=%-3hhu %8.2f M create+close/s  %7.1f ns/pair "
+	       "per thread  (%" PRIu64 " failed)\n", name, nr_threads,
+	       (double)(nr_pairs * nr_threads) * 1e3 / (double)(t1 - t0),
+	       (double)(t1 - t0) / (double)nr_pairs, fail);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint8_t nr_threads = (argc > 1) ? (uint8_t)atoi(argv[1]) : 4u;
+	uint16_t max_conn  = (argc > 2) ? (uint16_t)atoi(argv[2]) : 4096u;
+	uint64_t nr_pairs  = (argc > 3) ? strtoull(argv[3], NULL, 10) :
+					  1000000ull;
+	uint16_t i;
+
+#if defined(CONFIG_SINGLE_THREAD)
+	/*
+	 * The SINGLE_THREAD=1 build has no locks and plain atomics.
+	 */
+	nr_threads = 1u;
+#endif
+	if (!nr_threads || max_conn < nr_threads * 4u * BENCH_HOLD) {
+		fprintf(stderr, "usage: %s [threads] [max_conn] [pairs]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (bench_srv_init(&b, nr_threads, max_conn) ||
+	    mutex_init(&sess_stk_lock, NULL) ||
+	    !bt_stack_init(&sess_stk, max_conn)) {
+		fprintf(stderr, "Cannot initialize the benchmark\n");
+		return 1;
+	}
+
+	for (i = max_conn; i--;)
+		bt_stack_push(&sess_stk, i);
+
+	if (run("stack", nr_threads, nr_pairs, true) ||
+	    run("mag", nr_threads, nr_pairs, false))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+/*
+ * Cost of the per-datagram session operations: map_find_udp_sess()
+ * (the session map lock) and the is_connected / n_on_sess atomics.
+ * Build it both ways to see what SINGLE_THREAD=1 saves:
+ *
+ *   make bench RELEASE_MODE=1
+ *   ./bench_sess_ops
+ *   make clean
+ *   make bench RELEASE_MODE=1 SINGLE_THREAD=1
+ *   ./bench_sess_ops
+ *
+ * udp_session.c is included so the session code is built with the
+ * -DNDEBUG of the benchmark objects, whatever the main build is.
+ */
+#include <teavpn2/server/linux/udp_session.c>
+#include "bench.h"
+
+#define BENCH_SESS	1024u
+
+static struct bench_srv b;
+
+
+/*
+ * Keep the compiler from folding the plain SINGLE_THREAD=1 loads and
+ * stores across iterations, every operation has to touch memory.
+ */
+#define bench_barrier()	__asm__ volatile("" ::: "memory")
+
+
+static void report(const char *name, uint64_t nr, uint64_t t0, uint64_t t1)
+{
+	printf("%-24s %6.2f ns/op\n", name, (double)(t1 - t0) / (double)nr);
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint64_t i, nr = (argc > 1) ? strtoull(argv[1], NULL, 10) :
+				      20000000ull;
+	volatile uintptr_t sink = 0;
+	struct srv_udp_state *state = &b.state;
+	struct epl_thread *thread;
+	struct udp_sess *sess;
+	uint64_t t0, t1;
+	uint32_t k;
+
+#if defined(CONFIG_SINGLE_THREAD)
+	puts("SINGLE_THREAD=1 build");
+#else
+	puts("multi-thread build");
+#endif
+	if (bench_srv_init(&b, 1u, BENCH_SESS * 2u)) {
+		fprintf(stderr, "Cannot initialize the benchmark\n");
+		return 1;
+	}
+
+	thread = &state->epl_threads[0];
+	for (k = 0; k < BENCH_SESS; k++) {
+		if (!get_udp_sess(thread, 0xc0a80000u | k, (uint16_t)(k * 7u))) {
+			fprintf(stderr, "get_udp_sess() failed\n");
+			return 1;
+		}
+	}
+
+	t0 = bench_now_ns();
+	for (i = 0; i < nr; i++) {
+		k = (uint32_t)(i * 0x9e3779b1u) % BENCH_SESS;
+		sink += (uintptr_t)map_find_udp_sess(state, 0u,
+						     0xc0a80000u | k,
+						     (uint16_t)(k * 7u));
+	}
+	t1 = bench_now_ns();
+	report("map_find_udp_sess()", nr, t0, t1);
+
+	sess = &state->sess_arr[0];
+	t0 = bench_now_ns();
+	for (i = 0; i < nr; i++) {
+		sink += mt_load(&sess->is_connected);
+		bench_barrier();
+		mt_store(&sess->is_connected, true);
+		bench_barrier();
+	}
+	t1 = bench_now_ns();
+	report("is_connected load+store", nr, t0, t1);
+
+	t0 = bench_now_ns();
+	for (i = 0; i < nr; i++) {
+		mt_fetch_add(&state->n_on_sess, 1);
+		bench_barrier();
+		mt_fetch_sub(&state->n_on_sess, 1);
+		bench_barrier();
+	}
+	t1 = bench_now_ns();
+	report("n_on_sess add+sub", nr, t0, t1);
+
+	return (int)(sink & 0u);
+}
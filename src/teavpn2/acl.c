@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <teavpn2/acl.h>
+#include <teavpn2/allocator.h>
+#include <teavpn2/common.h>
+
+
+static int tacl_parse_proto(const char *str, int16_t *proto)
+{
+	char *end;
+	unsigned long val;
+
+	if (!strcmp(str, "any")) {
+		*proto = TACL_PROTO_ANY;
+	} else if (!strcmp(str, "icmp")) {
+		*proto = IPPROTO_ICMP;
+	} else if (!strcmp(str, "tcp")) {
+		*proto = IPPROTO_TCP;
+	} else if (!strcmp(str, "udp")) {
+		*proto = IPPROTO_UDP;
+	} else {
+		val = strtoul(str, &end, 10);
+		if (*end != '\0' || end == str || val > 255ul)
+			return -EINVAL;
+		*proto = (int16_t)val;
+	}
+
+	return 0;
+}
+
+
+static int tacl_parse_ports(const char *str, uint16_t *lo, uint16_t *hi)
+{
+	char *end;
+	unsigned long a, b;
+
+	a = strtoul(str, &end, 10);
+	if (end == str || a > 65535ul)
+		return -EINVAL;
+
+	b = a;
+	if (*end == '-') {
+		str = end + 1;
+		b = strtoul(str, &end, 10);
+		if (end == str || b > 65535ul)
+			return -EINVAL;
+	}
+
+	if (*end != '\0' || a > b)
+		return -EINVAL;
+
+	*lo = (uint16_t)a;
+	*hi = (uint16_t)b;
+	return 0;
+}
+
+
+/*
+ * Parse "<allow|deny> <addr>[/<len>] [<proto> [<port>[-<port>]]]".
+ */
+int tacl_parse_rule(const char *str, struct tacl_rule *rule)
+{
+	char *end;
+	char buf[128];
+	unsigned long len;
+	struct in_addr in;
+	char *tok[5], *save, *p;
+	unsigned nr_tok = 0;
+
+	if (strlen(str) >= sizeof(buf))
+		return -EINVAL;
+
+	strncpy2(buf, str, sizeof(buf));
+	for (p = strtok_r(buf, " \t", &save); p; p = strtok_r(NULL, " \t", &save)) {
+		if (nr_tok == 4)
+			return -EINVAL;
+		tok[nr_tok++] = p;
+	}
+
+	if (nr_tok < 2)
+		return -EINVAL;
+
+	memset(rule, 0, sizeof(*rule));
+	if (!strcmp(tok[0], "allow"))
+		rule->action = TACL_ALLOW;
+	else if (!strcmp(tok[0], "deny"))
+		rule->action = TACL_DENY;
+	else
+		return -EINVAL;
+
+	len = 32ul;
+	p = strchr(tok[1], '/');
+	if (p) {
+		*p++ = '\0';
+		len = strtoul(p, &end, 10);
+		if (*end != '\0' || end == p || len > 32ul)
+			return -EINVAL;
+	}
+
+	if (!inet_pton(AF_INET, tok[1], &in))
+		return -EINVAL;
+
+	rule->prefix_len = (uint8_t)len;
+	rule->addr = ntohl(in.s_addr);
+	if (len < 32ul)
+		rule->addr &= len ? ~(0xffffffffu >> len) : 0u;
+
+	rule->proto = TACL_PROTO_ANY;
+	if (nr_tok > 2 && tacl_parse_proto(tok[2], &rule->proto))
+		return -EINVAL;
+
+	if (nr_tok > 3) {
+		if (rule->proto != TACL_PROTO_ANY &&
+		    rule->proto != IPPROTO_TCP && rule->proto != IPPROTO_UDP)
+			return -EINVAL;
+		if (tacl_parse_ports(tok[3], &rule->port_lo, &rule->port_hi))
+			return -EINVAL;
+		rule->has_port = true;
+	}
+
+	return 0;
+}
+
+
+static int tacl_node_new(struct tacl **acl_p, uint16_t *cap)
+{
+	struct tacl *acl = *acl_p;
+	uint16_t idx = acl->nr_nodes;
+
+	if (idx == *cap) {
+		size_t size;
+		uint16_t ncap = (uint16_t)(*cap * 2u);
+
+		size = sizeof(*acl) + (size_t)ncap * sizeof(acl->nodes[0]);
+		acl = al64_realloc(acl, size);
+		if (unlikely(!acl))
+			return -ENOMEM;
+
+		*acl_p = acl;
+		*cap   = ncap;
+	}
+
+	memset(&acl->nodes[idx], 0, sizeof(acl->nodes[idx]));
+	acl->nr_nodes++;
+	return (int)idx;
+}
+
+
+/*
+ * Set @bit for the keys @lo..@hi under @node, which splits its range
+ * on bits @shift..@shift+7. A slot that the range covers only in part
+ * gets a child node.
+ */
+static int tacl_insert(struct tacl **acl_p, uint16_t *cap, uint16_t node,
+		       uint64_t lo, uint64_t hi, unsigned shift, uint64_t bit)
+{
+	int ret;
+	uint16_t child;
+	uint64_t s, base, end, clo, chi;
+	const uint64_t span = 1ull << shift;
+
+	for (s = (lo >> shift) & 0xffu; s <= ((hi >> shift) & 0xffu); s++) {
+		base = (lo & ~((span << 8u) - 1u)) | (s << shift);
+		end  = base + span - 1u;
+		clo  = (lo > base) ? lo : base;
+		chi  = (hi < end) ? hi : end;
+
+		if (clo == base && chi == end) {
+			(*acl_p)->nodes[node].bits[s] |= bit;
+			continue;
+		}
+
+		child = (*acl_p)->nodes[node].child[s];
+		if (!child) {
+			ret = tacl_node_new(acl_p, cap);
+			if (unlikely(ret < 0))
+				return ret;
+			child = (uint16_t)ret;
+			(*acl_p)->nodes[node].child[s] = child;
+		}
+
+		ret = tacl_insert(acl_p, cap, child, clo, chi, shift - 8u, bit);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static int tacl_add_rule(struct tacl **acl_p, uint16_t *cap,
+			 const struct tacl_rule *rule, uint16_t i)
+{
+	int ret;
+	uint64_t lo, hi;
+	const uint64_t bit = 1ull << i;
+	struct tacl *acl = *acl_p;
+
+	if (rule->action == TACL_ALLOW)
+		acl->allow |= bit;
+
+	if (rule->proto != TACL_PROTO_ANY) {
+		acl->proto[rule->proto] |= bit;
+	} else if (rule->has_port) {
+		/*
+		 * Only TCP and UDP have ports.
+		 */
+		acl->proto[IPPROTO_TCP] |= bit;
+		acl->proto[IPPROTO_UDP] |= bit;
+	} else {
+		for (lo = 0; lo < 256u; lo++)
+			acl->proto[lo] |= bit;
+	}
+
+	if (!rule->has_port)
+		acl->noport |= bit;
+
+	lo = rule->addr;
+	hi = lo | (0xffffffffull >> rule->prefix_len);
+	ret = tacl_insert(acl_p, cap, TACL_ADDR_ROOT, lo, hi, 24u, bit);
+	if (unlikely(ret))
+		return ret;
+
+	lo = rule->has_port ? rule->port_lo : 0u;
+	hi = rule->has_port ? rule->port_hi : 0xffffu;
+	return tacl_insert(acl_p, cap, TACL_PORT_ROOT, lo, hi, 8u, bit);
+}
+
+
+struct tacl *tacl_compile(const struct tacl_rule *rules, uint16_t nr_rules,
+			  bool def_allow)
+{
+	int ret;
+	uint16_t i, cap = 4u;
+	struct tacl *acl, *tmp;
+
+	if (unlikely(nr_rules > TACL_MAX_RULES)) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	acl = al64_calloc(1ul, sizeof(*acl) + cap * sizeof(acl->nodes[0]));
+	if (unlikely(!acl))
+		return NULL;
+
+	acl->nr_nodes  = 2u;
+	acl->nr_rules  = nr_rules;
+	acl->def_allow = def_allow;
+	for (i = 0; i < nr_rules; i++) {
+		ret = tacl_add_rule(&acl, &cap, &rules[i], i);
+		if (unlikely(ret)) {
+			al64_free(acl);
+			errno = -ret;
+			return NULL;
+		}
+	}
+
+	/*
+	 * Give back what the doubling left over.
+	 */
+	tmp = al64_realloc(acl, sizeof(*acl) +
+			   acl->nr_nodes * sizeof(acl->nodes[0]));
+	if (likely(tmp))
+		acl = tmp;
+
+	return acl;
+}
+
+
+void tacl_free(struct tacl *acl)
+{
+	al64_free(acl);
+}
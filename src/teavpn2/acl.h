@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__ACL_H
+#define TEAVPN2__ACL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <netinet/in.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Per-user access control list.
+ *
+ * The [acl] section of a user file holds up to TACL_MAX_RULES rules,
+ * the first one that matches a packet decides:
+ *
+ *   rule = allow 10.5.5.0/24 tcp 22
+ *   rule = deny 0.0.0.0/0 udp 53-53
+ *   default = deny
+ *
+ * A rule matches the far end of the traffic, the destination of the
+ * packets the client sends and the source of the packets it gets,
+ * so one rule covers both directions of a flow the client opens.
+ * (The server drops what a client sends from another address than
+ * its own tunnel address, with or without an ACL.)
+ *
+ * The rules are compiled into a bitmap-intersection classifier: each
+ * field is looked up on its own and gives the bitmap of the rules it
+ * matches, the lowest bit of the AND of them is the first matching
+ * rule. The address and the port are looked up in 8-bit stride tries
+ * (at most 4 and 2 steps) and the protocol in a table, the cost of a
+ * packet does not depend on the number of rules.
+ */
+#define TACL_MAX_RULES		64u
+
+#define TACL_DENY		0u
+#define TACL_ALLOW		1u
+
+#define TACL_PROTO_ANY		(-1)
+
+struct tacl_rule {
+	uint8_t			action;
+	uint8_t			prefix_len;
+	bool			has_port;
+	int16_t			proto;
+	uint32_t		addr;
+	uint16_t		port_lo;
+	uint16_t		port_hi;
+};
+
+/*
+ * A trie node, @bits[i] are the rules that cover the whole of slot i,
+ * @child[i] the node that splits it further (0 if none, the roots are
+ * never a child).
+ */
+struct tacl_node {
+	uint64_t		bits[256];
+	uint16_t		child[256];
+};
+
+#define TACL_ADDR_ROOT		0u
+#define TACL_PORT_ROOT		1u
+
+struct tacl {
+	uint64_t		proto[256];
+	uint64_t		noport;
+	uint64_t		allow;
+	uint16_t		nr_rules;
+	uint16_t		nr_nodes;
+	bool			def_allow;
+	struct tacl_node	nodes[];
+};
+
+extern int tacl_parse_rule(const char *str, struct tacl_rule *rule);
+extern struct tacl *tacl_compile(const struct tacl_rule *rules,
+				 uint16_t nr_rules, bool def_allow);
+extern void tacl_free(struct tacl *acl);
+
+
+static __always_inline uint64_t tacl_trie(const struct tacl *acl,
+					  uint16_t node, uint32_t key,
+					  unsigned shift)
+{
+	uint8_t s;
+	uint64_t m = 0;
+
+	for (;;) {
+		s = (uint8_t)(key >> shift);
+		m |= acl->nodes[node].bits[s];
+		node = acl->nodes[node].child[s];
+		if (!node || !shift)
+			return m;
+		shift -= 8u;
+	}
+}
+
+
+static __always_inline bool tacl_match(const struct tacl *acl, uint32_t addr,
+				       uint8_t proto, int32_t port)
+{
+	uint64_t m;
+
+	m = acl->proto[proto];
+	if (port < 0)
+		m &= acl->noport;
+	if (!m)
+		return acl->def_allow;
+
+	m &= tacl_trie(acl, TACL_ADDR_ROOT, addr, 24u);
+	if (m && port >= 0)
+		m &= tacl_trie(acl, TACL_PORT_ROOT, (uint32_t)port, 8u);
+	if (!m)
+		return acl->def_allow;
+
+	return (acl->allow >> __builtin_ctzll(m)) & 1u;
+}
+
+
+/*
+ * Take the addresses (host byte order), the protocol and the ports
+ * of the IPv4 packet @buf. The ports are -1 if the packet has none
+ * (not TCP or UDP, or not the first fragment).
+ */
+static __always_inline bool tacl_parse(const void *buf, size_t len,
+				       uint32_t *saddr, uint32_t *daddr,
+				       uint8_t *proto, int32_t *sport,
+				       int32_t *dport)
+{
+	size_t ihl;
+	const uint8_t *l4;
+	const struct iphdr *iph = buf;
+
+	if (unlikely(len < sizeof(*iph) || iph->version != 4))
+		return false;
+
+	ihl = (size_t)iph->ihl * 4u;
+	if (unlikely(ihl < sizeof(*iph) || ihl > len))
+		return false;
+
+	*saddr = ntohl(iph->saddr);
+	*daddr = ntohl(iph->daddr);
+	*proto = iph->protocol;
+	*sport = -1;
+	*dport = -1;
+
+	if ((iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP) ||
+	    (ntohs(iph->frag_off) & 0x1fffu) || len < ihl + 4u)
+		return true;
+
+	l4 = (const uint8_t *)buf + ihl;
+	*sport = (int32_t)((l4[0] << 8u) | l4[1]);
+	*dport = (int32_t)((l4[2] << 8u) | l4[3]);
+	return true;
+}
+
+
+/*
+ * A packet to the client.
+ */
+static __always_inline bool tacl_to_client(const struct tacl *acl,
+					   const void *buf, size_t len)
+{
+	uint8_t proto;
+	int32_t sport, dport;
+	uint32_t saddr, daddr;
+
+	if (!tacl_parse(buf, len, &saddr, &daddr, &proto, &sport, &dport))
+		return false;
+
+	return tacl_match(acl, saddr, proto, sport);
+}
+
+#endif /* #ifndef TEAVPN2__ACL_H */
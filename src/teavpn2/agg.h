@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__AGG_H
+#define TEAVPN2__AGG_H
+
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <teavpn2/qos.h>
+#include <teavpn2/packet.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Small-packet aggregation.
+ *
+ * A TCLI_PKT_TUN_AGG / TSRV_PKT_TUN_AGG packet carries several inner
+ * IP packets, each one prefixed with its length (16-bit, network
+ * byte order):
+ *
+ *   [type][pad_len][len] [len0][data0] [len1][data1] ...
+ *
+ * The @len of the packet header is the length of the whole payload.
+ *
+ * The sender collects the small packets of one TUN batch and builds
+ * the datagram as an iovec pointing into the TUN read buffers, so
+ * nothing is copied. An aggregate with a single packet goes out as
+ * a plain TUN_DATA packet.
+ */
+#define TAGG_SMALL_PKT		256u
+#define TAGG_DEF_SIZE		1400u
+#define TAGG_MIN_SIZE		(2u * (2u + TAGG_SMALL_PKT))
+/*
+ * Every peer can take TPKT_DATA_DEF bytes, whatever its MTU.
+ */
+#define TAGG_MAX_SIZE		TPKT_DATA_DEF
+#define TAGG_DEF_LATENCY_US	200u
+#define TAGG_IOV_NR		(2u + 2u * TQOS_BATCH)
+
+struct tagg {
+	/*
+	 * Number of inner packets and the payload size (including
+	 * the length prefixes).
+	 */
+	uint16_t		nr;
+	uint16_t		size;
+	uint8_t			head[PKT_MIN_LEN];
+	uint16_t		lens[TQOS_BATCH];
+
+	/*
+	 * @iov[0] is left free for the caller to prepend its own
+	 * header (e.g. struct pkt_lb_hdr), @iov[1] is @head.
+	 */
+	struct iovec		iov[TAGG_IOV_NR];
+};
+
+
+static inline void tagg_fix_limits(uint16_t *size, uint32_t *latency_us)
+{
+	if (!*size)
+		*size = TAGG_DEF_SIZE;
+	else if (*size < TAGG_MIN_SIZE)
+		*size = TAGG_MIN_SIZE;
+	else if (*size > TAGG_MAX_SIZE)
+		*size = TAGG_MAX_SIZE;
+
+	if (!*latency_us)
+		*latency_us = TAGG_DEF_LATENCY_US;
+}
+
+
+static __always_inline bool tagg_is_small(size_t len)
+{
+	return len <= TAGG_SMALL_PKT;
+}
+
+
+static inline void tagg_init(struct tagg *agg, uint8_t type)
+{
+	agg->nr   = 0;
+	agg->size = 0;
+	agg->head[0] = type;
+	agg->head[1] = 0;
+	agg->iov[1].iov_base = agg->head;
+	agg->iov[1].iov_len  = sizeof(agg->head);
+}
+
+
+/*
+ * Returns false if @len bytes more would not fit in @max_size, the
+ * caller should send the aggregate and start a new one.
+ */
+static inline bool tagg_add(struct tagg *agg, const void *data, uint16_t len,
+			    uint16_t max_size)
+{
+	struct iovec *iov;
+
+	if (unlikely(agg->nr == TQOS_BATCH))
+		return false;
+
+	if ((size_t)agg->size + 2u + len > max_size)
+		return false;
+
+	iov = &agg->iov[2u + 2u * agg->nr];
+	agg->lens[agg->nr] = htons(len);
+	iov[0].iov_base = &agg->lens[agg->nr];
+	iov[0].iov_len  = sizeof(agg->lens[0]);
+	iov[1].iov_base = (void *)(uintptr_t)data;
+	iov[1].iov_len  = len;
+	agg->size += 2u + len;
+	agg->nr++;
+	return true;
+}
+
+
+/*
+ * Fill in the packet header. Returns the number of iovecs starting
+ * from @agg->iov[1], @single_type is used if there is only one inner
+ * packet (the length prefix is dropped then).
+ */
+static inline int tagg_finish(struct tagg *agg, uint8_t single_type)
+{
+	uint16_t len;
+
+	if (agg->nr == 1) {
+		agg->head[0] = single_type;
+		agg->iov[2]  = agg->iov[3];
+		len = htons((uint16_t)agg->iov[2].iov_len);
+		memcpy(&agg->head[2], &len, sizeof(len));
+		return 2;
+	}
+
+	len = htons(agg->size);
+	memcpy(&agg->head[2], &len, sizeof(len));
+	return 1 + 2 * (int)agg->nr;
+}
+
+
+/*
+ * Walk the inner packets of a received aggregate payload in one pass.
+ * Returns false at the end or on a truncated entry.
+ */
+static __always_inline bool tagg_next(const uint8_t **p, size_t *rem,
+				       const uint8_t **data, uint16_t *len)
+{
+	uint16_t n;
+
+	if (*rem < sizeof(n))
+		return false;
+
+	memcpy(&n, *p, sizeof(n));
+	n = ntohs(n);
+	if (unlikely(!n || (size_t)n > *rem - sizeof(n)))
+		return false;
+
+	*data = *p + sizeof(n);
+	*len  = n;
+	*p   += sizeof(n) + n;
+	*rem -= sizeof(n) + n;
+	return true;
+}
+
+
+static __always_inline uint64_t tagg_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+#endif /* #ifndef TEAVPN2__AGG_H */
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include <teavpn2/allocator.h>
 #include <teavpn2/common.h>
 
@@ -96,3 +98,342 @@ __no_inline void *al64_realloc(void *user, size_t new_size)
 	assert(((uintptr_t)aligned % 64) == 0);
 	return aligned;
 }
+
+
+struct al_slab_chunk {
+	struct al_slab_chunk	*next;
+};
+
+
+struct al_slab_tcache {
+	void			*head;
+	uint32_t		nr;
+	uint32_t		gen;
+};
+
+
+static _Atomic(uint32_t) al_slab_next_id = 0;
+static _Atomic(uint32_t) al_slab_next_gen = 1;
+
+/*
+ * Per-thread free lists, indexed by slab id. A slot belongs to the
+ * slab whose generation it carries. When two live slabs share a slot,
+ * the objects cached for the other one are forgotten (they are still
+ * released when that slab is destroyed).
+ */
+static __thread struct al_slab_tcache al_tcache[AL_SLAB_MAX];
+
+
+int al_slab_init(struct al_slab *slab, size_t obj_size, uint32_t objs_per_chunk)
+{
+	int ret;
+
+	memset(slab, 0, sizeof(*slab));
+	ret = pthread_mutex_init(&slab->lock, NULL);
+	if (unlikely(ret))
+		return -ret;
+
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+
+	slab->obj_size       = (obj_size + sizeof(void *) - 1) &
+			       ~(sizeof(void *) - 1);
+	slab->objs_per_chunk = objs_per_chunk ? objs_per_chunk : 64u;
+	slab->id             = atomic_fetch_add(&al_slab_next_id, 1) % AL_SLAB_MAX;
+	slab->gen            = atomic_fetch_add(&al_slab_next_gen, 1);
+	return 0;
+}
+
+
+/*
+ * Must be called with @slab->lock held.
+ */
+static int al_slab_grow(struct al_slab *slab)
+{
+	uint32_t i;
+	char *objs;
+	struct al_slab_chunk *chunk;
+	const size_t hdr = 64u;
+
+	chunk = al64_malloc(hdr + slab->obj_size * slab->objs_per_chunk);
+	if (unlikely(!chunk))
+		return -ENOMEM;
+
+	chunk->next  = slab->chunks;
+	slab->chunks = chunk;
+
+	objs = (char *)chunk + hdr;
+	for (i = 0; i < slab->objs_per_chunk; i++) {
+		void *obj = objs + (size_t)i * slab->obj_size;
+
+		*(void **)obj   = slab->free_list;
+		slab->free_list = obj;
+	}
+	return 0;
+}
+
+
+static int al_slab_refill(struct al_slab *slab, struct al_slab_tcache *tc)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&slab->lock);
+	if (!slab->free_list) {
+		ret = al_slab_grow(slab);
+		if (unlikely(ret))
+			goto out;
+	}
+
+	while (slab->free_list && tc->nr < AL_SLAB_TCACHE_BATCH) {
+		void *obj = slab->free_list;
+
+		slab->free_list = *(void **)obj;
+		*(void **)obj   = tc->head;
+		tc->head        = obj;
+		tc->nr++;
+	}
+out:
+	pthread_mutex_unlock(&slab->lock);
+	return ret;
+}
+
+
+void *al_slab_alloc(struct al_slab *slab)
+{
+	void *obj;
+	struct al_slab_tcache *tc = &al_tcache[slab->id];
+
+	if (unlikely(tc->gen != slab->gen)) {
+		tc->gen  = slab->gen;
+		tc->head = NULL;
+		tc->nr   = 0;
+	}
+
+	if (unlikely(!tc->head) && unlikely(al_slab_refill(slab, tc))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	obj      = tc->head;
+	tc->head = *(void **)obj;
+	tc->nr--;
+	memset(obj, 0, slab->obj_size);
+	return obj;
+}
+
+
+void al_slab_free(struct al_slab *slab, void *obj)
+{
+	uint32_t i;
+	struct al_slab_tcache *tc = &al_tcache[slab->id];
+
+	if (unlikely(!obj))
+		return;
+
+	if (unlikely(tc->gen != slab->gen)) {
+		pthread_mutex_lock(&slab->lock);
+		*(void **)obj   = slab->free_list;
+		slab->free_list = obj;
+		pthread_mutex_unlock(&slab->lock);
+		return;
+	}
+
+	*(void **)obj = tc->head;
+	tc->head      = obj;
+	if (likely(++tc->nr < 2u * AL_SLAB_TCACHE_BATCH))
+		return;
+
+	/*
+	 * Too many cached objects on this thread, give a batch back.
+	 */
+	pthread_mutex_lock(&slab->lock);
+	for (i = 0; i < AL_SLAB_TCACHE_BATCH; i++) {
+		obj             = tc->head;
+		tc->head        = *(void **)obj;
+		*(void **)obj   = slab->free_list;
+		slab->free_list = obj;
+	}
+	tc->nr -= AL_SLAB_TCACHE_BATCH;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+
+void al_slab_destroy(struct al_slab *slab)
+{
+	struct al_slab_chunk *chunk, *next;
+
+	for (chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		al64_free(chunk);
+	}
+
+	/*
+	 * Per-thread lists still tagged with our generation are
+	 * dropped lazily, the generation is never reused.
+	 */
+	slab->chunks    = NULL;
+	slab->free_list = NULL;
+	slab->gen       = 0;
+	pthread_mutex_destroy(&slab->lock);
+}
+
+
+int al_arena_init(struct al_arena *arena, size_t size)
+{
+	int ret;
+	char *p, *aligned;
+	size_t map_size, head, tail;
+
+	memset(arena, 0, sizeof(*arena));
+	size = (size + AL_HUGE_PAGE_SIZE - 1) & ~(AL_HUGE_PAGE_SIZE - 1);
+	if (unlikely(!size))
+		size = AL_HUGE_PAGE_SIZE;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		arena->hugetlb = true;
+		aligned = p;
+		goto out;
+	}
+
+	/*
+	 * No reserved huge pages, map 2 MiB aligned normal pages and
+	 * let THP back them.
+	 */
+	map_size = size + AL_HUGE_PAGE_SIZE;
+	p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(p == MAP_FAILED)) {
+		ret = errno;
+		pr_err("mmap(%zu): " PRERF, map_size, PREAR(ret));
+		return -ret;
+	}
+
+	aligned = (char *)(((uintptr_t)p + AL_HUGE_PAGE_SIZE - 1) &
+			   ~(AL_HUGE_PAGE_SIZE - 1));
+	head = (size_t)(aligned - p);
+	tail = map_size - head - size;
+	if (head)
+		munmap(p, head);
+	if (tail)
+		munmap(aligned + size, tail);
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+out:
+	arena->base = aligned;
+	arena->size = size;
+	return 0;
+}
+
+
+void *al_arena_alloc(struct al_arena *arena, size_t nmemb, size_t size)
+{
+	void *ret;
+	size_t len;
+
+	if (unlikely(__builtin_mul_overflow(nmemb, size, &len))) {
+		errno = EOVERFLOW;
+		return NULL;
+	}
+
+	len = (len + 63ul) & ~63ul;
+	if (unlikely(len > arena->size - arena->used)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ret = (char *)arena->base + arena->used;
+	arena->used += len;
+	return ret;
+}
+
+
+/*
+ * Fault every page of the arena in now, so the first packets and
+ * the first burst of new sessions don't take page faults. With
+ * @lock, also pin the pages so they can't be swapped out.
+ */
+int al_arena_prefault(struct al_arena *arena, bool lock)
+{
+	int ret;
+	size_t off, step;
+	volatile char *p = arena->base;
+
+	if (unlikely(!p))
+		return -EINVAL;
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(arena->base, arena->size, MADV_POPULATE_WRITE))
+		goto out;
+#endif
+
+	/*
+	 * Older kernel without MADV_POPULATE_WRITE, touch the pages
+	 * by hand. The arena is zeroed, writing zero keeps it so.
+	 */
+	step = arena->hugetlb ? AL_HUGE_PAGE_SIZE : 4096ul;
+	for (off = 0; off < arena->size; off += step)
+		p[off] = 0;
+
+out:
+	if (!lock)
+		return 0;
+
+	if (unlikely(mlock(arena->base, arena->size))) {
+		ret = errno;
+		pr_err("mlock(%zu): " PRERF, arena->size, PREAR(ret));
+		if (ret == ENOMEM || ret == EPERM)
+			pr_err("Check RLIMIT_MEMLOCK (ulimit -l) or run with "
+			       "CAP_IPC_LOCK");
+		return -ret;
+	}
+
+	arena->locked = true;
+	return 0;
+}
+
+
+/*
+ * Number of bytes of the arena currently resident in memory.
+ */
+size_t al_arena_resident(struct al_arena *arena)
+{
+	size_t i, nr_pages, ret = 0;
+	unsigned char *vec;
+
+	if (unlikely(!arena->base))
+		return 0;
+
+	nr_pages = arena->size / 4096ul;
+	vec = malloc(nr_pages);
+	if (unlikely(!vec))
+		return 0;
+
+	if (unlikely(mincore(arena->base, arena->size, vec))) {
+		free(vec);
+		return 0;
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		ret += (vec[i] & 1u);
+
+	free(vec);
+	return ret * 4096ul;
+}
+
+
+void al_arena_destroy(struct al_arena *arena)
+{
+	if (!arena->base)
+		return;
+
+	if (arena->locked)
+		munlock(arena->base, arena->size);
+
+	munmap(arena->base, arena->size);
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+	arena->locked = false;
+}
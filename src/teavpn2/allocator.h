@@ -8,10 +8,72 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 extern void *al64_calloc(size_t nmemb, size_t size);
 extern void *al64_malloc(size_t size);
 extern void al64_free(void *user);
 extern void *al64_realloc(void *user, size_t new_size);
 
+
+/*
+ * Fixed-size object pool.
+ *
+ * Objects are carved from chunks of @objs_per_chunk objects. Each
+ * thread keeps a small free list per slab, so alloc and free only
+ * take @lock when that list runs empty or grows too long.
+ */
+#define AL_SLAB_MAX		8u
+#define AL_SLAB_TCACHE_BATCH	32u
+
+struct al_slab_chunk;
+
+struct al_slab {
+	pthread_mutex_t		lock;
+	void			*free_list;
+	struct al_slab_chunk	*chunks;
+	size_t			obj_size;
+	uint32_t		objs_per_chunk;
+	uint32_t		id;
+	uint32_t		gen;
+};
+
+extern int al_slab_init(struct al_slab *slab, size_t obj_size,
+			uint32_t objs_per_chunk);
+extern void *al_slab_alloc(struct al_slab *slab);
+extern void al_slab_free(struct al_slab *slab, void *obj);
+extern void al_slab_destroy(struct al_slab *slab);
+
+
+/*
+ * Bump allocator over a single huge-page backed mapping, for large
+ * long-lived tables. The memory is zeroed and is only released as
+ * a whole by al_arena_destroy().
+ */
+#define AL_HUGE_PAGE_SIZE	(2ul * 1024ul * 1024ul)
+
+struct al_arena {
+	void			*base;
+	size_t			size;
+	size_t			used;
+
+	/*
+	 * true if backed by MAP_HUGETLB, false if we fell back to
+	 * normal pages with MADV_HUGEPAGE (THP).
+	 */
+	bool			hugetlb;
+
+	/*
+	 * true if al_arena_prefault() locked the mapping.
+	 */
+	bool			locked;
+};
+
+extern int al_arena_init(struct al_arena *arena, size_t size);
+extern void *al_arena_alloc(struct al_arena *arena, size_t nmemb, size_t size);
+extern int al_arena_prefault(struct al_arena *arena, bool lock);
+extern size_t al_arena_resident(struct al_arena *arena);
+extern void al_arena_destroy(struct al_arena *arena);
+
 #endif /* #ifndef TEAVPN2__ALLOCATOR_H */
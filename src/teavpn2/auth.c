@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inih/inih.h>
+#include <teavpn2/acl.h>
 #include <teavpn2/common.h>
 
 const char *data_dir = NULL;
@@ -17,6 +18,12 @@ struct user_parse_ctx {
 	char		fuser[0x100];
 	char		fpass[0x100];
 	struct if_info	iff;
+	bool		want_acl;
+	bool		has_acl;
+	bool		acl_bad;
+	bool		acl_def_allow;
+	uint16_t	nr_rules;
+	struct tacl_rule rules[TACL_MAX_RULES];
 };
 
 
@@ -64,6 +71,41 @@ static int userfile_parse_iface(struct user_parse_ctx *ctx, const char *name,
 }
 
 
+static int userfile_parse_acl(struct user_parse_ctx *ctx, const char *name,
+			      const char *val, int lineno)
+{
+	ctx->has_acl = true;
+
+	if (!strcmp(name, "rule")) {
+		if (ctx->nr_rules == TACL_MAX_RULES) {
+			pr_warn("More than %u ACL rules in %s:%d",
+				TACL_MAX_RULES, ctx->userfile, lineno);
+			ctx->acl_bad = true;
+		} else if (tacl_parse_rule(val, &ctx->rules[ctx->nr_rules])) {
+			pr_warn("Invalid ACL rule \"%s\" in %s:%d", val,
+				ctx->userfile, lineno);
+			ctx->acl_bad = true;
+		} else {
+			ctx->nr_rules++;
+		}
+	} else if (!strcmp(name, "default")) {
+		if (!strcmp(val, "allow")) {
+			ctx->acl_def_allow = true;
+		} else if (!strcmp(val, "deny")) {
+			ctx->acl_def_allow = false;
+		} else {
+			pr_warn("Invalid ACL default \"%s\" in %s:%d", val,
+				ctx->userfile, lineno);
+			ctx->acl_bad = true;
+		}
+	} else {
+		pr_warn("Invalid name \"%s\" in section acl in %s:%d", name,
+			ctx->userfile, lineno);
+	}
+	return 1;
+}
+
+
 /*
  * If success, returns 1.
  * If failure, returns 0.
@@ -77,6 +119,12 @@ static int userfile_parser(void *user, const char *section, const char *name,
 		userfile_parse_auth(ctx, name, val, lineno);
 	} else if (!strcmp(section, "iface")) {
 		userfile_parse_iface(ctx, name, val, lineno);
+	} else if (!strcmp(section, "acl")) {
+		/*
+		 * Only teavpn2_user_acl() looks at it.
+		 */
+		if (ctx->want_acl)
+			userfile_parse_acl(ctx, name, val, lineno);
 	} else {
 		pr_warn("Invalid section \"%s\" in %s:%d", section,
 			ctx->userfile, lineno);
@@ -121,19 +169,15 @@ out:
 }
 
 
-bool teavpn2_auth(const char *username, const char *password,
-		  struct if_info *iff)
+static FILE *open_userfile(const char *username, char *userfile, size_t len)
 {
-	int err = 0;
+	int err;
 	FILE *handle;
-	bool ret = true;
-	char userfile[512];
 
 	if (unlikely(!data_dir))
 		panic("data_dir is NULL");
 
-	snprintf(userfile, sizeof(userfile), "%s/users/%s.ini", data_dir,
-		 username);
+	snprintf(userfile, len, "%s/users/%s.ini", data_dir, username);
 
 	handle = fopen(userfile, "rb");
 	if (!handle) {
@@ -141,9 +185,24 @@ bool teavpn2_auth(const char *username, const char *password,
 		prl_notice(2, "Cannot open user file: \"%s\": " PRERF, userfile,
 			   PREAR(err));
 		errno = err;
-		return false;
 	}
 
+	return handle;
+}
+
+
+bool teavpn2_auth(const char *username, const char *password,
+		  struct if_info *iff)
+{
+	int err = 0;
+	FILE *handle;
+	bool ret = true;
+	char userfile[512];
+
+	handle = open_userfile(username, userfile, sizeof(userfile));
+	if (!handle)
+		return false;
+
 	err = _teavpn2_auth(handle, userfile, username, password, iff);
 	if (err) {
 		errno = -err;
@@ -153,3 +212,58 @@ bool teavpn2_auth(const char *username, const char *password,
 	fclose(handle);
 	return ret;
 }
+
+
+/*
+ * Compile the [acl] section of the user file into *@acl_p, NULL if
+ * there is none. A broken ACL is an error rather than no ACL.
+ */
+int teavpn2_user_acl(const char *username, struct tacl **acl_p)
+{
+	int ret = 0;
+	FILE *handle;
+	char userfile[512];
+	struct user_parse_ctx *ctx;
+
+	handle = open_userfile(username, userfile, sizeof(userfile));
+	if (!handle)
+		return -errno;
+
+	ctx = calloc_wrp(1ul, sizeof(*ctx));
+	if (unlikely(!ctx)) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	ctx->userfile = userfile;
+	ctx->want_acl = true;
+	if (ini_parse_file(handle, userfile_parser, ctx)) {
+		prl_notice(2, "Failed to parse config file \"%s\"", userfile);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	*acl_p = NULL;
+	if (!ctx->has_acl)
+		goto out;
+
+	if (ctx->acl_bad) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	*acl_p = tacl_compile(ctx->rules, ctx->nr_rules, ctx->acl_def_allow);
+	if (unlikely(!*acl_p)) {
+		ret = -errno;
+		pr_err("Cannot compile the ACL of %s: " PRERF, username,
+		       PREAR(-ret));
+	}
+
+out:
+	memset(ctx, 0, sizeof(*ctx));
+	__asm__ volatile("":"+m"(*ctx)::"memory");
+	al64_free(ctx);
+out_close:
+	fclose(handle);
+	return ret;
+}
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__BARRIER_H
+#define TEAVPN2__BARRIER_H
+
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Start gate for the event loop threads, built on futex(2).
+ *
+ * Every thread calls tbarrier_arrive() once it is ready. The main
+ * thread sleeps in tbarrier_wait_arrivals() until all of them have
+ * arrived, then calls tbarrier_open() to release the sub threads
+ * sleeping in tbarrier_wait_open().
+ *
+ * The waits wake up every TBARRIER_POLL_MS to look at @stop, so a
+ * signal during startup is still honoured, but the normal release
+ * path doesn't sleep at all.
+ */
+#define TBARRIER_OPEN		(1u << 31u)
+#define TBARRIER_POLL_MS	100
+
+struct tbarrier {
+	/*
+	 * Number of arrived threads, TBARRIER_OPEN is or'ed in
+	 * once the gate is open.
+	 */
+	_Atomic(uint32_t)		word;
+};
+
+
+static __always_inline void __tbarrier_futex_wait(struct tbarrier *b,
+						  uint32_t val)
+{
+	struct timespec ts = {
+		.tv_sec  = 0,
+		.tv_nsec = TBARRIER_POLL_MS * 1000000l
+	};
+
+	syscall(SYS_futex, &b->word, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+
+static __always_inline void __tbarrier_futex_wake(struct tbarrier *b)
+{
+	syscall(SYS_futex, &b->word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL,
+		0);
+}
+
+
+static __always_inline void tbarrier_init(struct tbarrier *b)
+{
+	atomic_store(&b->word, 0u);
+}
+
+
+static __always_inline void tbarrier_arrive(struct tbarrier *b)
+{
+	atomic_fetch_add(&b->word, 1u);
+	__tbarrier_futex_wake(b);
+}
+
+
+/*
+ * Returns false if @stop was set before @n threads arrived.
+ */
+static __always_inline bool tbarrier_wait_arrivals(struct tbarrier *b,
+						   uint32_t n,
+						   volatile bool *stop)
+{
+	uint32_t val;
+
+	while (((val = atomic_load(&b->word)) & ~TBARRIER_OPEN) < n) {
+		if (unlikely(*stop))
+			return false;
+		__tbarrier_futex_wait(b, val);
+	}
+	return true;
+}
+
+
+static __always_inline void tbarrier_open(struct tbarrier *b)
+{
+	atomic_fetch_or(&b->word, TBARRIER_OPEN);
+	__tbarrier_futex_wake(b);
+}
+
+
+/*
+ * Returns false if @stop was set before the gate was opened.
+ */
+static __always_inline bool tbarrier_wait_open(struct tbarrier *b,
+					       volatile bool *stop)
+{
+	uint32_t val;
+
+	while (!((val = atomic_load(&b->word)) & TBARRIER_OPEN)) {
+		if (unlikely(*stop))
+			return false;
+		__tbarrier_futex_wait(b, val);
+	}
+	return true;
+}
+
+#endif /* #ifndef TEAVPN2__BARRIER_H */
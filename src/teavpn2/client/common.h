@@ -18,9 +18,20 @@ struct cli_cfg_sys {
 
 struct cli_cfg_sock {
 	bool			use_encryption;
+	bool			qos;
+	bool			aggregate;
+	bool			fec;
+	bool			timestamping;
+	bool			probe;
+	bool			roaming;
 	sock_type		type;
 	char			server_addr[64];
 	uint16_t		server_port;
+	uint16_t		agg_size;
+	uint32_t		agg_latency_us;
+	uint8_t			fec_k;
+	uint8_t			fec_m_max;
+	uint32_t		probe_interval_ms;
 	char			event_loop[64];
 };
 
@@ -56,6 +56,18 @@ static void dump_client_cfg(struct cli_cfg *cfg)
 	putchar('\n');
 	printf("   cfg->sock.use_encryption = %hhu\n",
 		(uint8_t)cfg->sock.use_encryption);
+	printf("   cfg->sock.qos = %hhu\n", (uint8_t)cfg->sock.qos);
+	printf("   cfg->sock.aggregate = %hhu\n", (uint8_t)cfg->sock.aggregate);
+	PR_CFG(cfg->sock.agg_size, "%hu");
+	PR_CFG(cfg->sock.agg_latency_us, "%u");
+	printf("   cfg->sock.fec = %hhu\n", (uint8_t)cfg->sock.fec);
+	PR_CFG(cfg->sock.fec_k, "%hhu");
+	PR_CFG(cfg->sock.fec_m_max, "%hhu");
+	printf("   cfg->sock.timestamping = %hhu\n",
+	       (uint8_t)cfg->sock.timestamping);
+	printf("   cfg->sock.probe = %hhu\n", (uint8_t)cfg->sock.probe);
+	PR_CFG(cfg->sock.probe_interval_ms, "%u");
+	printf("   cfg->sock.roaming = %hhu\n", (uint8_t)cfg->sock.roaming);
 	printf("   cfg->sock.type = %s\n",
 		(cfg->sock.type == SOCK_TCP) ? "SOCK_TCP" :
 		((cfg->sock.type == SOCK_UDP) ? "SOCK_UDP" : "unknown"));
@@ -197,6 +209,28 @@ static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
 	struct cli_cfg *cfg = ctx->cfg;
 	if (!strcmp(name, "use_encryption")) {
 		cfg->sock.use_encryption = atoi(val) ? true : false;
+	} else if (!strcmp(name, "qos")) {
+		cfg->sock.qos = atoi(val) ? true : false;
+	} else if (!strcmp(name, "aggregate")) {
+		cfg->sock.aggregate = atoi(val) ? true : false;
+	} else if (!strcmp(name, "agg_size")) {
+		cfg->sock.agg_size = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "agg_latency_us")) {
+		cfg->sock.agg_latency_us = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "fec")) {
+		cfg->sock.fec = atoi(val) ? true : false;
+	} else if (!strcmp(name, "fec_k")) {
+		cfg->sock.fec_k = (uint8_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "fec_m_max")) {
+		cfg->sock.fec_m_max = (uint8_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "timestamping")) {
+		cfg->sock.timestamping = atoi(val) ? true : false;
+	} else if (!strcmp(name, "probe")) {
+		cfg->sock.probe = atoi(val) ? true : false;
+	} else if (!strcmp(name, "probe_interval_ms")) {
+		cfg->sock.probe_interval_ms = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "roaming")) {
+		cfg->sock.roaming = atoi(val) ? true : false;
 	} else if (!strcmp(name, "event_loop")) {
 		strncpy(cfg->sock.event_loop, val, sizeof(cfg->sock.event_loop));
 		cfg->sock.event_loop[sizeof(cfg->sock.event_loop) - 1] = '\0';
@@ -347,6 +381,13 @@ int run_client(int argc, char *argv[])
 	if (ret)
 		return -ret;
 
+#if defined(CONFIG_SINGLE_THREAD)
+	if (cfg.sys.thread_num != 1) {
+		pr_warn("Single-threaded build, forcing thread num to 1");
+		cfg.sys.thread_num = 1;
+	}
+#endif
+
 	dump_client_cfg(&cfg);
 
 	switch (cfg.sock.type) {
@@ -31,6 +31,14 @@ static void interrupt_handler(int sig)
 }
 
 
+static void stats_handler(int sig)
+{
+	if (likely(g_state))
+		g_state->dump_stats = true;
+	(void)sig;
+}
+
+
 static int init_tun_fds(struct cli_udp_state *state)
 {
 	uint8_t i, nn = (uint8_t)state->cfg->sys.thread_num;
@@ -75,6 +83,30 @@ static int init_state(struct cli_udp_state *state)
 	g_state = state;
 	state->udp_fd = -1;
 	state->sig = -1;
+	state->qos_cmsg_prio = state->cfg->sock.qos;
+
+	if (state->cfg->sock.aggregate) {
+		tagg_fix_limits(&state->cfg->sock.agg_size,
+				&state->cfg->sock.agg_latency_us);
+		prl_notice(2, "Small-packet aggregation: up to %hu bytes, "
+			   "%u us latency bound", state->cfg->sock.agg_size,
+			   state->cfg->sock.agg_latency_us);
+	}
+
+	if (state->cfg->sock.fec) {
+		fec_fix_limits(&state->cfg->sock.fec_k,
+			       &state->cfg->sock.fec_m_max);
+		prl_notice(2, "FEC: %hhu data + up to %hhu parity packets (%s)",
+			   state->cfg->sock.fec_k, state->cfg->sock.fec_m_max,
+			   fec_init());
+	}
+
+	if (state->cfg->sock.probe) {
+		if (!state->cfg->sock.probe_interval_ms)
+			state->cfg->sock.probe_interval_ms = 1000u;
+		prl_notice(2, "Path probing every %u ms",
+			   state->cfg->sock.probe_interval_ms);
+	}
 
 	ret = init_tun_fds(state);
 	if (unlikely(ret))
@@ -105,6 +137,8 @@ static int init_state(struct cli_udp_state *state)
 		goto sig_err;
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 		goto sig_err;
+	if (signal(SIGUSR1, stats_handler) == SIG_ERR)
+		goto sig_err;
 
 	prl_notice(2, "Client state initialized successfully!");
 	return ret;
@@ -136,21 +170,18 @@ static int socket_setup(int udp_fd, struct cli_udp_state *state)
 	}
 
 
-	y = 1024 * 1024 * 50;
-	ret = setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUFFORCE, py, len);
-	if (unlikely(ret)) {
-		lv = "SOL_SOCKET";
-		on = "SO_RCVBUFFORCE";
-		goto out_err;
+	ret = tsbuf_init(&state->sbuf, udp_fd, 0, 0, 0, 0);
+	if (ret == -EPERM) {
+		pr_warn("SO_RCVBUFFORCE/SO_SNDBUFFORCE are not permitted, the "
+			"UDP socket buffers are capped by net.core.rmem_max "
+			"and net.core.wmem_max");
+		ret = 0;
 	}
 
-
-	y = 1024 * 1024 * 50;
-	ret = setsockopt(udp_fd, SOL_SOCKET, SO_SNDBUFFORCE, py, len);
 	if (unlikely(ret)) {
-		lv = "SOL_SOCKET";
-		on = "SO_SNDBUFFORCE";
-		goto out_err;
+		pr_err("setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF/SO_SNDBUF): "
+		       PRERF, PREAR(-ret));
+		return ret;
 	}
 
 
@@ -163,10 +194,17 @@ static int socket_setup(int udp_fd, struct cli_udp_state *state)
 	}
 
 
-	/*
-	 * TODO: Use cfg to set some socket options.
-	 */
-	(void)cfg;
+	if (cfg->sock.timestamping) {
+		ret = tts_sock_setup(udp_fd);
+		if (unlikely(ret)) {
+			pr_warn("setsockopt(udp_fd, SOL_SOCKET, SO_TIMESTAMPING): "
+				PRERF, PREAR(-ret));
+			pr_warn("Kernel timestamping is disabled");
+			cfg->sock.timestamping = false;
+			ret = 0;
+		}
+	}
+
 	return ret;
 out_err:
 	err = errno;
@@ -336,127 +374,27 @@ poll_again:
 }
 
 
-static int _do_handshake(struct cli_udp_state *state)
-{
-	size_t send_len;
-	ssize_t send_ret;
-	int udp_fd = state->udp_fd;
-	struct cli_pkt *cli_pkt = &state->pkt.cli;
-
-	prl_notice(2, "Initializing protocol handshake...");
-	send_len = cli_pprep_handshake(cli_pkt);
-	send_ret = do_send_to(udp_fd, cli_pkt, send_len);
-	return (send_ret >= 0) ? 0 : (int)send_ret;
-}
-
-
-static int server_handshake_chk(struct srv_pkt *srv_pkt, size_t len)
-{
-	struct pkt_handshake *hand = &srv_pkt->handshake;
-	struct teavpn2_version *cur = &hand->cur;
-	const size_t expected_len = sizeof(*hand);
-
-	if (srv_pkt->type == TSRV_PKT_CLOSE) {
-		prl_notice(2, "Server has closed the connection!");
-		return -ECONNRESET;
-	}
-
-	if (len < (PKT_MIN_LEN + expected_len)) {
-		pr_err("Invalid handshake packet length (expected_len = %zu;"
-		       " actual = %zu)", PKT_MIN_LEN + expected_len, len);
-		return -EBADMSG;
-	}
-
-	srv_pkt->len = ntohs(srv_pkt->len);
-	if ((size_t)srv_pkt->len != expected_len) {
-		pr_err("Invalid handshake packet length (expected_len = %zu;"
-		       " srv_pkt->len = %hu)", expected_len, srv_pkt->len);
-		return -EBADMSG;
-	}
-
-	if (srv_pkt->type != TSRV_PKT_HANDSHAKE) {
-		pr_err("Invalid packet type "
-		       "(expected = TSRV_PKT_HANDSHAKE (%u);"
-		       " actual = %hhu",
-		       TSRV_PKT_HANDSHAKE, srv_pkt->type);
-		return -EBADMSG;
-	}
-
-	/* For printing safety! */
-	cur->extra[sizeof(cur->extra) - 1] = '\0';
-	prl_notice(2, "Got server handshake response "
-		   "(server version: TeaVPN2-%hhu.%hhu.%hhu%s)",
-		   cur->ver,
-		   cur->patch_lvl,
-		   cur->sub_lvl,
-		   cur->extra);
-
-
-	if ((cur->ver != VERSION) || (cur->patch_lvl != PATCHLEVEL) ||
-	    (cur->sub_lvl != SUBLEVEL)) {
-	    	pr_err("Server version is not supported for this client");
-		return -EBADMSG;
-	}
-
-	return 0;
-}
-
-
-static int wait_for_handshake_response(struct cli_udp_state *state)
-{
-	int ret;
-	ssize_t recv_ret;
-	int udp_fd = state->udp_fd;
-	struct srv_pkt *srv_pkt = &state->pkt.srv;
-
-	prl_notice(2, "Waiting for server handshake response...");
-	ret = poll_fd_input(state, udp_fd, 5000);
-	if (unlikely(ret < 0))
-		return ret;
-
-	recv_ret = do_recv_from(udp_fd, srv_pkt, PKT_MAX_LEN);
-	if (unlikely(recv_ret < 0))
-		return (int)recv_ret;
-
-	return server_handshake_chk(srv_pkt, (size_t)recv_ret);
-}
-
-
-static int do_handshake(struct cli_udp_state *state)
-{
-	int ret;
-	uint8_t try_count = 0;
-	const uint8_t max_try = 5;
-
-try_again:
-	ret = _do_handshake(state);
-	if (unlikely(ret))
-		return ret;
-
-	ret = wait_for_handshake_response(state);
-	if (ret == -ETIMEDOUT && try_count++ < max_try)
-		goto try_again;
-
-	return ret;
-}
-
-
-static int _do_auth(struct cli_udp_state *state)
+static int send_handshake_auth(struct cli_udp_state *state)
 {
 	size_t send_len;
 	ssize_t send_ret;
 	struct cli_pkt *cli_pkt = &state->pkt.cli;
 	struct cli_cfg_auth *auth_c = &state->cfg->auth;
 
-	prl_notice(2, "Authenticating as %s...", auth_c->username);
-	send_len = cli_pprep_auth(cli_pkt, auth_c->username, auth_c->password);
+	prl_notice(2, "Connecting as %s...", auth_c->username);
+	send_len = cli_pprep_handshake_auth(cli_pkt, auth_c->username,
+					    auth_c->password);
 	send_ret = do_send_to(state->udp_fd, cli_pkt, send_len);
+	memset(cli_pkt->hs_auth.auth.password, 0,
+	       sizeof(cli_pkt->hs_auth.auth.password));
 	return (send_ret >= 0) ? 0 : (int)send_ret;
 }
 
 
-static int server_auth_res_chk(struct srv_pkt *srv_pkt, size_t len)
+static int server_auth_res_chk(struct cli_udp_state *state,
+			       struct srv_pkt *srv_pkt, size_t len)
 {
+	struct pkt_roam_key roam_key;
 	struct pkt_auth_res *auth_res = &srv_pkt->auth_res;
 	const size_t expected_len = sizeof(*auth_res);
 
@@ -465,6 +403,15 @@ static int server_auth_res_chk(struct srv_pkt *srv_pkt, size_t len)
 		return -ECONNRESET;
 	}
 
+	if (srv_pkt->type == TSRV_PKT_HANDSHAKE_REJECT) {
+		struct pkt_handshake_reject *rej = &srv_pkt->hs_reject;
+
+		rej->msg[sizeof(rej->msg) - 1] = '\0';
+		pr_err("Server rejected the handshake (reason = %hhu): %s",
+		       rej->reason, rej->msg);
+		return -EBADMSG;
+	}
+
 	if (srv_pkt->type == TSRV_PKT_AUTH_REJECT) {
 		pr_err("Server rejected the authentication (TSRV_PKT_AUTH_REJECT)");
 		pr_warn("Could be wrong username or password");
@@ -491,6 +438,21 @@ static int server_auth_res_chk(struct srv_pkt *srv_pkt, size_t len)
 	}
 
 	prl_notice(2, "Authentication success (got TSRV_PKT_AUTH_OK)!");
+
+	if (!state->cfg->sock.roaming)
+		return 0;
+
+	if (srv_pkt->pad_len != sizeof(struct pkt_roam_key) ||
+	    len < PKT_MIN_LEN + expected_len + sizeof(struct pkt_roam_key)) {
+		pr_warn("Server does not support roaming, it is disabled");
+		return 0;
+	}
+
+	memcpy(&roam_key, &srv_pkt->__raw[expected_len], sizeof(roam_key));
+	state->roam_idx = troam_key_import(&state->roam, &roam_key,
+					   state->cfg->auth.password);
+	state->roam_on  = true;
+	prl_notice(2, "Roaming is enabled (session %hu)", state->roam_idx);
 	return 0;
 }
 
@@ -518,15 +480,15 @@ static int bring_up_iface(struct cli_udp_state *state)
 }
 
 
-static int wait_for_auth_response(struct cli_udp_state *state)
+static int wait_for_auth_response(struct cli_udp_state *state, int timeout)
 {
 	int ret;
 	ssize_t recv_ret;
 	int udp_fd = state->udp_fd;
 	struct srv_pkt *srv_pkt = &state->pkt.srv;
 
-	prl_notice(2, "Waiting for server auth response...");
-	ret = poll_fd_input(state, udp_fd, 5000);
+	prl_notice(2, "Waiting for server auth response (%d ms)...", timeout);
+	ret = poll_fd_input(state, udp_fd, timeout);
 	if (unlikely(ret < 0))
 		return ret;
 
@@ -534,7 +496,7 @@ static int wait_for_auth_response(struct cli_udp_state *state)
 	if (unlikely(recv_ret < 0))
 		return (int)recv_ret;
 
-	ret = server_auth_res_chk(srv_pkt, (size_t)recv_ret);
+	ret = server_auth_res_chk(state, srv_pkt, (size_t)recv_ret);
 	if (!ret) {
 		prl_notice(2, "Authenticated as \"%s\"",
 			   state->cfg->auth.username);
@@ -545,25 +507,78 @@ static int wait_for_auth_response(struct cli_udp_state *state)
 }
 
 
-static int do_auth(struct cli_udp_state *state)
+/*
+ * Connect in one round trip: the handshake and the credentials go
+ * in one packet, the server answers with TSRV_PKT_AUTH_OK. A lost
+ * packet (or an ICMP port unreachable) is sent again after
+ * CONNECT_RTO_MIN_MS, doubling up to CONNECT_RTO_MAX_MS.
+ */
+#define CONNECT_RTO_MIN_MS	50
+#define CONNECT_RTO_MAX_MS	5000
+#define CONNECT_MAX_TRY		12u
+
+static int do_connect(struct cli_udp_state *state)
 {
 	int ret;
 	uint8_t try_count = 0;
-	const uint8_t max_try = 5;
+	int timeout = CONNECT_RTO_MIN_MS;
 
 try_again:
-	ret = _do_auth(state);
+	ret = send_handshake_auth(state);
 	if (unlikely(ret))
 		return ret;
 
-	ret = wait_for_auth_response(state);
-	if (ret == -ETIMEDOUT && try_count++ < max_try)
+	ret = wait_for_auth_response(state, timeout);
+	if (ret == -ECONNREFUSED && !state->stop) {
+		/*
+		 * Nothing listens there (yet), the server may be
+		 * restarting. Wait the timeout out like a lost packet.
+		 */
+		usleep((useconds_t)timeout * 1000u);
+		ret = -ETIMEDOUT;
+	}
+
+	if (ret == -ETIMEDOUT && try_count++ < CONNECT_MAX_TRY) {
+		timeout *= 2;
+		if (timeout > CONNECT_RTO_MAX_MS)
+			timeout = CONNECT_RTO_MAX_MS;
 		goto try_again;
+	}
 
 	return ret;
 }
 
 
+/*
+ * The packet buffers (and the FEC shards) are sized for the MTU the
+ * server gave us.
+ */
+static int init_pkt_bufs(struct cli_udp_state *state)
+{
+	int ret;
+	uint16_t mtu = state->cfg->iface.iff.ipv4_mtu;
+
+	state->pkt_data_size = tpkt_data_size(mtu);
+	state->pkt_buf_size  = TPKT_BUF_SIZE(state->pkt_data_size);
+	prl_notice(2, "Packet buffers: %zu bytes of payload (MTU %hu)",
+		   state->pkt_data_size, mtu);
+
+	if (!state->cfg->sock.fec)
+		return 0;
+
+	state->fec = fec_state_new(state->cfg->sock.fec_k,
+				   state->cfg->sock.fec_m_max,
+				   FEC_SHARD_SIZE(state->pkt_data_size));
+	if (unlikely(!state->fec)) {
+		ret = errno;
+		pr_err("fec_state_new(): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	return 0;
+}
+
+
 static int run_client_event_loop(struct cli_udp_state *state)
 {
 	switch (state->evt_loop) {
@@ -620,6 +635,7 @@ static void destroy_state(struct cli_udp_state *state)
 
 	close_tun_fds(state);
 	close_udp_fd(state);
+	fec_state_free(state->fec);
 	al64_free(state);
 }
 
@@ -644,10 +660,10 @@ int teavpn2_client_udp_run(struct cli_cfg *cfg)
 	ret = init_iface(state);
 	if (unlikely(ret))
 		goto out;
-	ret = do_handshake(state);
+	ret = do_connect(state);
 	if (unlikely(ret))
 		goto out;
-	ret = do_auth(state);
+	ret = init_pkt_bufs(state);
 	if (unlikely(ret))
 		goto out;
 	ret = run_client_event_loop(state);
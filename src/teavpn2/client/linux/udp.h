@@ -10,6 +10,15 @@
 #include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <teavpn2/qos.h>
+#include <teavpn2/agg.h>
+#include <teavpn2/fec.h>
+#include <teavpn2/flight.h>
+#include <teavpn2/probe.h>
+#include <teavpn2/roam.h>
+#include <teavpn2/sockbuf.h>
+#include <teavpn2/tstamp.h>
+#include <teavpn2/barrier.h>
 #include <teavpn2/packet.h>
 #include <teavpn2/client/common.h>
 
@@ -40,12 +49,60 @@ struct epl_thread {
 	int					epoll_timeout;
 	struct cli_udp_state			*state;
 	struct epoll_event			events[EPOLL_EVT_ARR_NUM];
+
+	/*
+	 * Packets drained from the TUN fd in a single event,
+	 * they are dispatched by priority class via @tun_q.
+	 */
+	struct sc_pkt				*tun_pkts;
+	struct tqos_mark			tun_marks[TQOS_BATCH];
+	struct tqos_queue			tun_q;
+
+	/*
+	 * Small-packet aggregate of the current TUN batch, see
+	 * teavpn2/agg.h.
+	 */
+	const struct tqos_mark			*agg_mark;
+	struct tagg				agg;
+
+	/*
+	 * Whether the current TUN batch has put data in the open
+	 * FEC group, it is closed when the batch is done.
+	 */
+	bool					fec_touched;
+	const struct tqos_mark			*fec_mark;
+
+	/*
+	 * Kernel timestamping, see teavpn2/tstamp.h.
+	 */
+	struct tts_rx_stamp			rx_stamp;
+	uint64_t				wake_ns;
+
+	/*
+	 * When the next REQSYNC probe is due (CLOCK_MONOTONIC, us), only
+	 * used by the thread that receives from the server.
+	 */
+	uint64_t				probe_due_us;
+
+	/*
+	 * The last datapath events of this thread, see
+	 * teavpn2/flight.h.
+	 */
+	struct tfr_ring				fr;
+
 	alignas(64) struct sc_pkt		pkt;
 };
 
 
 struct cli_udp_state {
 	volatile bool				stop;
+	volatile bool				qos_cmsg_prio;
+
+	/*
+	 * Set by SIGUSR1, the next thread that wakes up prints the
+	 * statistics.
+	 */
+	volatile bool				dump_stats;
 	bool					threads_wont_exit;
 	bool					need_remove_iff;
 	int					sig;
@@ -54,6 +111,52 @@ struct cli_udp_state {
 	int					*tun_fds;
 	struct cli_cfg				*cfg;
 	_Atomic(uint16_t)			ready_thread;
+	struct tbarrier				thread_gate;
+
+	/*
+	 * Payload capacity of the TUN read buffers, by the MTU the
+	 * server gave us (see tpkt_data_size()), and the size of one
+	 * struct sc_pkt buffer with it.
+	 */
+	size_t					pkt_data_size;
+	size_t					pkt_buf_size;
+
+	/*
+	 * Forward error correction, NULL unless [socket] fec is
+	 * set. See teavpn2/fec.h.
+	 */
+	struct fec_state			*fec;
+
+	/*
+	 * Kernel timestamp statistics. @rx_ts is only touched by
+	 * the thread that receives from the server, @tx_ts by the
+	 * senders (@tx_seq picks the samples) and that thread.
+	 */
+	struct tts_rx				rx_ts;
+	struct tts_tx				tx_ts;
+	mt_atomic(uint32_t)			tx_seq;
+
+	/*
+	 * Buffer sizing of @udp_fd, see teavpn2/sockbuf.h. Resized
+	 * by the thread that receives from the server.
+	 */
+	struct tsbuf				sbuf;
+
+	/*
+	 * Path probe state, see teavpn2/probe.h. Only touched by
+	 * the thread that receives from the server.
+	 */
+	struct tprobe				probe;
+
+	/*
+	 * Session roaming, see teavpn2/roam.h. @roam_on is set after
+	 * auth if [socket] roaming is set and the server handed out a
+	 * key salt. @roam_ctr is the tag counter of the senders.
+	 */
+	bool					roam_on;
+	uint16_t				roam_idx;
+	struct troam				roam;
+	mt_atomic(uint32_t)			roam_ctr;
 	union {
 		struct {
 			struct epld_struct	*epl_udata;
@@ -77,32 +180,24 @@ static inline size_t cli_pprep(struct cli_pkt *cli_pkt, uint8_t type,
 }
 
 
-static inline size_t cli_pprep_handshake(struct cli_pkt *cli_pkt)
+static inline size_t cli_pprep_handshake_auth(struct cli_pkt *cli_pkt,
+					      const char *user,
+					      const char *pass)
 {
-	struct pkt_handshake *hand = &cli_pkt->handshake;
-	struct teavpn2_version *cur = &hand->cur;
+	struct pkt_handshake_auth *hs_auth = &cli_pkt->hs_auth;
+	struct teavpn2_version *cur = &hs_auth->handshake.cur;
 
-	memset(hand, 0, sizeof(*hand));
+	memset(&hs_auth->handshake, 0, sizeof(hs_auth->handshake));
 	cur->ver = VERSION;
 	cur->patch_lvl = PATCHLEVEL;
 	cur->sub_lvl = SUBLEVEL;
 	strncpy2(cur->extra, EXTRAVERSION, sizeof(cur->extra));
 
-	return cli_pprep(cli_pkt, TCLI_PKT_HANDSHAKE, (uint16_t)sizeof(*hand),
-			 0);
+	strncpy2(hs_auth->auth.username, user, sizeof(hs_auth->auth.username));
+	strncpy2(hs_auth->auth.password, pass, sizeof(hs_auth->auth.password));
+	return cli_pprep(cli_pkt, TCLI_PKT_HANDSHAKE_AUTH,
+			 (uint16_t)sizeof(*hs_auth), 0);
 }
 
 
-static inline size_t cli_pprep_auth(struct cli_pkt *cli_pkt, const char *user,
-				    const char *pass)
-{
-	struct pkt_auth *auth = &cli_pkt->auth;
-
-	strncpy2(auth->username, user, sizeof(auth->username));
-	strncpy2(auth->password, pass, sizeof(auth->password));
-	return cli_pprep(cli_pkt, TCLI_PKT_AUTH, (uint16_t)sizeof(*auth), 0);
-}
-
-
-
 #endif /* #ifndef TEAVPN2__CLIENT__LINUX__UDP_H */
@@ -4,6 +4,7 @@
  */
 
 #include <unistd.h>
+#include <inttypes.h>
 #include <sys/epoll.h>
 #include <teavpn2/client/common.h>
 #include <teavpn2/client/linux/udp.h>
@@ -86,6 +87,7 @@ static int init_epoll_thread_data(struct cli_udp_state *state)
 	int ret = 0;
 	int *tun_fds = state->tun_fds;
 	struct epl_thread *threads, *thread;
+	char name[sizeof(((struct tfr_ring *)0)->name)];
 	uint8_t i, nn = (uint8_t)state->cfg->sys.thread_num;
 
 	state->epl_threads = NULL;
@@ -107,6 +109,15 @@ static int init_epoll_thread_data(struct cli_udp_state *state)
 	for (i = 0; i < nn; i++) {
 		thread = &threads[i];
 		thread->idx = i;
+		snprintf(name, sizeof(name), "client thread %hhu", i);
+		tfr_register(&thread->fr, name);
+
+		thread->tun_pkts = calloc_wrp(TQOS_BATCH, state->pkt_buf_size);
+		if (unlikely(!thread->tun_pkts)) {
+			ret = -errno;
+			goto out;
+		}
+		tagg_init(&thread->agg, TCLI_PKT_TUN_AGG);
 
 		ret = create_epoll_fd();
 		if (unlikely(ret < 0))
@@ -153,47 +164,134 @@ out:
 
 static void thread_wait(struct epl_thread *thread, struct cli_udp_state *state)
 {
-	static _Atomic(bool) release_sub_thread = false;
 	uint8_t nn = (uint8_t)state->cfg->sys.thread_num;
 
+	tbarrier_arrive(&state->thread_gate);
 	if (thread->idx != 0) {
 		/*
 		 * We are the sub thread.
 		 * Waiting for the main thread be ready...
 		 */
-		while (!atomic_load(&release_sub_thread)) {
-			if (unlikely(state->stop))
-				return;
-			usleep(100000);
-		}
+		tbarrier_wait_open(&state->thread_gate, &state->stop);
 		return;
 	}
 
 	/*
 	 * We are the main thread...
 	 */
-	while (atomic_load(&state->ready_thread) != nn) {
-		prl_notice(2, "(thread=%u) "
-			   "Waiting for subthread(s) to be ready...",
-			   thread->idx);
-		if (unlikely(state->stop))
-			return;
-		usleep(100000);
-	}
+	prl_notice(2, "(thread=%u) Waiting for subthread(s) to be ready...",
+		   thread->idx);
+	if (!tbarrier_wait_arrivals(&state->thread_gate, nn, &state->stop))
+		return;
 
 	if (nn > 1)
 		prl_notice(2, "All threads are ready!");
 
 	prl_notice(2, "Initialization Sequence Completed");
-	atomic_store(&release_sub_thread, true);
+	tbarrier_open(&state->thread_gate);
+}
+
+
+/*
+ * @mark may be NULL.
+ */
+static ssize_t do_send_iov(struct cli_udp_state *state, struct iovec *iov,
+			   int iovcnt, const struct tqos_mark *mark)
+{
+	int i, ret;
+	bool tx_stamp;
+	ssize_t send_ret;
+	struct msghdr msg;
+	size_t send_len = 0;
+	struct pkt_roam tag;
+	union tqos_cmsg_buf cbuf;
+	struct iovec roam_iov[TAGG_IOV_NR + 1u];
+
+	if (state->roam_on) {
+		/*
+		 * Append the roaming tag as the padding of the packet,
+		 * @iov[0] starts with its header.
+		 */
+		if (unlikely((size_t)iovcnt >= TAGG_IOV_NR + 1u))
+			return -E2BIG;
+
+		((uint8_t *)iov[0].iov_base)[1] = (uint8_t)sizeof(tag);
+		troam_tag(&state->roam, state->roam_idx,
+			  mt_fetch_add(&state->roam_ctr, 1u) + 1u, iov, iovcnt,
+			  &tag);
+		memcpy(roam_iov, iov, (size_t)iovcnt * sizeof(*iov));
+		roam_iov[iovcnt].iov_base = &tag;
+		roam_iov[iovcnt].iov_len  = sizeof(tag);
+		iov = roam_iov;
+		iovcnt++;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		send_len += iov[i].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = (size_t)iovcnt;
+	if (mark)
+		tqos_cmsg_fill(&msg, &cbuf, mark, state->qos_cmsg_prio);
+
+	tx_stamp = state->cfg->sock.timestamping &&
+		   tts_tx_sample(&state->tx_ts,
+				 mt_fetch_add(&state->tx_seq, 1u) + 1u);
+	if (tx_stamp)
+		tts_cmsg_add(&msg, &cbuf);
+
+send_again:
+	send_ret = sendmsg(state->udp_fd, &msg, 0);
+	if (unlikely(send_ret < 0)) {
+		ret = errno;
+		if (ret == EINVAL && mark && state->qos_cmsg_prio) {
+			pr_warn("SO_PRIORITY cmsg is not supported, "
+				"only DSCP will be marked");
+			state->qos_cmsg_prio = false;
+			tqos_cmsg_fill(&msg, &cbuf, mark, false);
+			if (tx_stamp)
+				tts_cmsg_add(&msg, &cbuf);
+			goto send_again;
+		}
+		if (ret == EAGAIN)
+			tsbuf_note_tx_full(&state->sbuf);
+		pr_err("sendmsg(): " PRERF, PREAR(ret));
+		return -ret;
+	}
+	if (unlikely((size_t)send_ret != send_len)) {
+		pr_err("send_ret != send_len");
+		return -EBADMSG;
+	}
+	pr_debug("sendmsg() %zd bytes", send_ret);
+	return send_ret;
 }
 
 
-static ssize_t do_send_to(int udp_fd, const void *pkt, size_t send_len)
+static ssize_t do_send_mark(struct cli_udp_state *state, const void *pkt,
+			    size_t send_len, const struct tqos_mark *mark)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)(uintptr_t)pkt;
+	iov.iov_len  = send_len;
+	return do_send_iov(state, &iov, 1, mark);
+}
+
+
+/*
+ * Send a whole packet without a QoS mark.
+ */
+static ssize_t do_send_to(struct cli_udp_state *state, const void *pkt,
+			  size_t send_len)
 {
 	int ret;
 	ssize_t send_ret;
-	send_ret = sendto(udp_fd, pkt, send_len, 0, NULL, 0);
+
+	if (state->roam_on)
+		return do_send_mark(state, pkt, send_len, NULL);
+
+	send_ret = sendto(state->udp_fd, pkt, send_len, 0, NULL, 0);
 	if (unlikely(send_ret < 0)) {
 		ret = errno;
 		pr_err("sendto(): " PRERF, PREAR(ret));
@@ -234,11 +332,186 @@ static int handle_tun_data(struct epl_thread *thread)
 
 	data_len  = ntohs(srv_pkt->len);
 	write_ret = write(tun_fd, srv_pkt->__raw, data_len);
+	tfr_rec(&thread->fr, TFR_EV_TUN_TX, tun_fd, 0u,
+		(write_ret > 0) ? (size_t)write_ret : 0u, TFR_NO_SESS,
+		(write_ret < 0) ? -errno : 0);
 	pr_debug("tun write, write_ret = %zd", write_ret);
 	return write_ret < 0 ? -errno : 0;
 }
 
 
+/*
+ * Split a TSRV_PKT_TUN_AGG packet and write every inner packet to
+ * the TUN fd.
+ */
+static int handle_tun_agg(struct epl_thread *thread)
+{
+	size_t rem;
+	uint16_t len;
+	ssize_t write_ret;
+	const uint8_t *p, *data;
+	int tun_fd = thread->state->tun_fds[0];
+	struct srv_pkt *srv_pkt = &thread->pkt.srv;
+
+	if (unlikely(thread->pkt.len < PKT_MIN_LEN))
+		return 0;
+
+	rem = (size_t)ntohs(srv_pkt->len);
+	if (unlikely(rem > thread->pkt.len - PKT_MIN_LEN))
+		rem = thread->pkt.len - PKT_MIN_LEN;
+
+	p = (const uint8_t *)srv_pkt->__raw;
+	while (tagg_next(&p, &rem, &data, &len)) {
+		write_ret = write(tun_fd, data, len);
+		pr_debug("tun write, write_ret = %zd", write_ret);
+		if (unlikely(write_ret < 0))
+			return -errno;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write the data shards in @rec to TUN and report the loss rate to
+ * the server when it is due.
+ */
+static int fec_deliver(struct epl_thread *thread, struct fec_state *fs,
+		       uint32_t rec)
+{
+	uint8_t i;
+	uint16_t len;
+	ssize_t ret;
+	const uint8_t *data;
+	int tun_fd = thread->state->tun_fds[0];
+	uint8_t buf[PKT_MIN_LEN + sizeof(struct pkt_fec_report)];
+
+	while (rec) {
+		i    = (uint8_t)__builtin_ctz(rec);
+		rec &= rec - 1u;
+		data = fec_dec_shard(&fs->dec, i, &len);
+		ret  = write(tun_fd, data, len);
+		pr_debug("FEC recovered, tun write, write_ret = %zd", ret);
+		if (unlikely(ret < 0))
+			return -errno;
+	}
+
+	if (fec_dec_report_due(&fs->dec)) {
+		ret = do_send_to(thread->state, buf,
+				 fec_pkt_report(buf, TCLI_PKT_FEC_REPORT,
+						fs->dec.loss));
+		if (unlikely(ret < 0))
+			return (int)ret;
+	}
+
+	return 0;
+}
+
+
+static int handle_fec_data(struct epl_thread *thread)
+{
+	int ret;
+	uint16_t len;
+	bool dup = false;
+	uint32_t rec = 0;
+	const uint8_t *data;
+	const struct pkt_fec_hdr *hdr;
+	struct fec_state *fs = thread->state->fec;
+
+	hdr = fec_pkt_hdr(&thread->pkt.srv, thread->pkt.len, &data, &len);
+	if (unlikely(!hdr))
+		return 0;
+
+	if (fs)
+		rec = fec_dec_data(&fs->dec, hdr, data, len, &dup);
+
+	if (!dup) {
+		ret = (int)write(thread->state->tun_fds[0], data, len);
+		pr_debug("tun write, write_ret = %d", ret);
+		if (unlikely(ret < 0))
+			return -errno;
+	}
+
+	return fs ? fec_deliver(thread, fs, rec) : 0;
+}
+
+
+static int handle_fec_parity(struct epl_thread *thread)
+{
+	uint16_t len;
+	uint32_t rec;
+	const uint8_t *data;
+	const struct pkt_fec_hdr *hdr;
+	struct fec_state *fs = thread->state->fec;
+
+	if (!fs)
+		return 0;
+
+	hdr = fec_pkt_hdr(&thread->pkt.srv, thread->pkt.len, &data, &len);
+	if (unlikely(!hdr))
+		return 0;
+
+	rec = fec_dec_parity(&fs->dec, hdr, data, len);
+	return fec_deliver(thread, fs, rec);
+}
+
+
+static int handle_fec_report(struct epl_thread *thread)
+{
+	uint16_t loss;
+	struct fec_state *fs = thread->state->fec;
+
+	if (!fs || thread->pkt.len < PKT_MIN_LEN + sizeof(struct pkt_fec_report))
+		return 0;
+
+	loss = ntohs(thread->pkt.srv.fec_report.loss);
+	mutex_lock(&fs->enc_lock);
+	fec_enc_set_loss(&fs->enc, loss);
+	mutex_unlock(&fs->enc_lock);
+	pr_debug("FEC loss %hu/%u, %hhu parity", loss, FEC_LOSS_SCALE,
+		 fs->enc.m);
+	return 0;
+}
+
+
+static uint64_t probe_rx_ns(struct epl_thread *thread)
+{
+	if (thread->state->cfg->sock.timestamping && thread->rx_stamp.sw_ns)
+		return thread->rx_stamp.sw_ns;
+
+	return tts_now_ns();
+}
+
+
+static int send_probe(struct epl_thread *thread, uint8_t type)
+{
+	ssize_t ret;
+	struct cli_udp_state *state = thread->state;
+	uint8_t buf[PKT_MIN_LEN + sizeof(struct pkt_sync)];
+
+	ret = do_send_to(state, buf,
+			 tprobe_pkt(buf, type, &state->probe, tts_now_ns()));
+	return (ret < 0) ? (int)ret : 0;
+}
+
+
+static int handle_sync(struct epl_thread *thread)
+{
+	int ret;
+	struct srv_pkt *srv_pkt = &thread->pkt.srv;
+
+	ret = tprobe_rx(&thread->state->probe, &srv_pkt->sync,
+			thread->pkt.len - PKT_MIN_LEN, probe_rx_ns(thread));
+	if (unlikely(ret))
+		return 0;
+
+	if (srv_pkt->type == TSRV_PKT_REQSYNC)
+		return send_probe(thread, TCLI_PKT_SYNC);
+
+	return 0;
+}
+
+
 static int _handle_event_udp(struct epl_thread *thread)
 {
 	struct srv_pkt *srv_pkt = &thread->pkt.srv;
@@ -249,10 +522,17 @@ static int _handle_event_udp(struct epl_thread *thread)
 		return 0;
 	case TSRV_PKT_TUN_DATA:
 		return handle_tun_data(thread);
+	case TSRV_PKT_TUN_AGG:
+		return handle_tun_agg(thread);
+	case TSRV_PKT_FEC_DATA:
+		return handle_fec_data(thread);
+	case TSRV_PKT_FEC_PARITY:
+		return handle_fec_parity(thread);
+	case TSRV_PKT_FEC_REPORT:
+		return handle_fec_report(thread);
 	case TSRV_PKT_REQSYNC:
-		return 0;
 	case TSRV_PKT_SYNC:
-		return 0;
+		return handle_sync(thread);
 	case TSRV_PKT_CLOSE:
 	case TSRV_PKT_HANDSHAKE_REJECT:
 	case TSRV_PKT_AUTH_REJECT:
@@ -267,10 +547,24 @@ static int handle_event_udp(int udp_fd, struct epl_thread *thread)
 {
 	int ret;
 	ssize_t recv_ret;
-	char *buf = thread->pkt.__raw;
-	size_t recv_size = sizeof(thread->pkt.cli.__raw);
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		char		buf[sizeof(union tts_cmsg_buf) +
+				    TSBUF_CMSG_SPACE];
+		struct cmsghdr	__align;
+	} cbuf;
+	struct cli_udp_state *state = thread->state;
+
+	iov.iov_base = thread->pkt.__raw;
+	iov.iov_len  = sizeof(thread->pkt.cli.__raw);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
 
-	recv_ret = recvfrom(udp_fd, buf, recv_size, 0, NULL, 0);
+	recv_ret = recvmsg(udp_fd, &msg, 0);
 	if (unlikely(recv_ret <= 0)) {
 
 		if (recv_ret == 0) {
@@ -282,38 +576,307 @@ static int handle_event_udp(int udp_fd, struct epl_thread *thread)
 		if (ret == EAGAIN)
 			return 0;
 
-		pr_err("recvfrom(udp_fd) (fd=%d): " PRERF, udp_fd, PREAR(ret));
+		pr_err("recvmsg(udp_fd) (fd=%d): " PRERF, udp_fd, PREAR(ret));
 		return -ret;
 	}
 	thread->pkt.len = (size_t)recv_ret;
 
-	pr_debug("recvfrom() server %zd bytes", recv_ret);
-	return _handle_event_udp(thread);
+	if (msg.msg_controllen) {
+		tsbuf_cmsg_rx(&state->sbuf, &msg);
+		if (state->cfg->sock.timestamping) {
+			thread->rx_stamp.recv_ns = tts_now_ns();
+			tts_cmsg_rx(&msg, &thread->rx_stamp);
+			tts_rx_account(&state->rx_ts, &thread->rx_stamp,
+				       thread->wake_ns);
+		}
+	}
+
+	pr_debug("recvmsg() server %zd bytes", recv_ret);
+	ret = _handle_event_udp(thread);
+	tfr_rec(&thread->fr, TFR_EV_UDP_RX, udp_fd, thread->pkt.srv.type,
+		thread->pkt.len, TFR_NO_SESS, ret);
+	return ret;
 }
 
 
-static int handle_event_tun(int tun_fd, struct epl_thread *thread)
+static ssize_t send_fec_pkt(struct cli_udp_state *state, uint8_t type,
+			    const struct pkt_fec_hdr *hdr, const void *data,
+			    uint16_t len, const struct tqos_mark *mark)
+{
+	struct iovec iov[3];
+	uint8_t head[PKT_MIN_LEN];
+	uint16_t be_len = htons((uint16_t)(sizeof(*hdr) + len));
+
+	head[0] = type;
+	head[1] = 0;
+	memcpy(&head[2], &be_len, sizeof(be_len));
+	iov[0].iov_base = head;
+	iov[0].iov_len  = sizeof(head);
+	iov[1].iov_base = (void *)(uintptr_t)hdr;
+	iov[1].iov_len  = sizeof(*hdr);
+	iov[2].iov_base = (void *)(uintptr_t)data;
+	iov[2].iov_len  = len;
+	return do_send_iov(state, iov, 3, mark);
+}
+
+
+/*
+ * Close the open FEC group and send its parity packets. The caller
+ * holds @state->fec->enc_lock.
+ */
+static ssize_t send_fec_parity(struct cli_udp_state *state,
+			       const struct tqos_mark *mark)
+{
+	uint8_t j, m;
+	ssize_t ret = 0;
+	const uint8_t *parity;
+	struct pkt_fec_hdr hdr;
+	struct fec_enc *enc = &state->fec->enc;
+
+	m = fec_enc_close(enc);
+	if (!m)
+		return 0;
+
+	for (j = 0; j < m; j++) {
+		parity = fec_enc_parity(enc, j, &hdr);
+		ret = send_fec_pkt(state, TCLI_PKT_FEC_PARITY, &hdr, parity,
+				   enc->plen, mark);
+		if (unlikely(ret < 0))
+			break;
+	}
+
+	fec_enc_next(enc);
+	return ret;
+}
+
+
+static ssize_t send_fec_data(struct epl_thread *thread, struct sc_pkt *pkt,
+			     const struct tqos_mark *mark)
+{
+	ssize_t ret;
+	struct pkt_fec_hdr hdr;
+	struct cli_udp_state *state = thread->state;
+	struct fec_state *fs = state->fec;
+	const uint16_t len = (uint16_t)pkt->len;
+
+	mutex_lock(&fs->enc_lock);
+	fec_enc_data(&fs->enc, pkt->cli.__raw, len, &hdr);
+	ret = send_fec_pkt(state, TCLI_PKT_FEC_DATA, &hdr, pkt->cli.__raw,
+			   len, mark);
+	if (ret >= 0 && fec_enc_full(&fs->enc))
+		ret = send_fec_parity(state, mark);
+	mutex_unlock(&fs->enc_lock);
+
+	thread->fec_touched = true;
+	thread->fec_mark    = mark;
+	return ret;
+}
+
+
+/*
+ * Close the FEC group the current TUN batch has put data in.
+ */
+static int flush_fec(struct epl_thread *thread)
+{
+	ssize_t ret;
+	struct fec_state *fs = thread->state->fec;
+
+	if (!thread->fec_touched)
+		return 0;
+
+	thread->fec_touched = false;
+	mutex_lock(&fs->enc_lock);
+	ret = send_fec_parity(thread->state, thread->fec_mark);
+	mutex_unlock(&fs->enc_lock);
+	return (ret < 0) ? (int)ret : 0;
+}
+
+
+static int flush_agg(struct epl_thread *thread)
+{
+	int iovcnt;
+	ssize_t send_ret;
+	struct tagg *agg = &thread->agg;
+
+	if (!agg->nr)
+		return 0;
+
+	iovcnt   = tagg_finish(agg, TCLI_PKT_TUN_DATA);
+	send_ret = do_send_iov(thread->state, &agg->iov[1], iovcnt,
+			       thread->agg_mark);
+	tagg_init(agg, TCLI_PKT_TUN_AGG);
+	if (unlikely(send_ret < 0))
+		return (int)send_ret;
+
+	return 0;
+}
+
+
+/*
+ * return -ENOENT if @pkt is too big to be aggregated.
+ * return 0 if it is queued.
+ * return -errno if it errors.
+ */
+static int agg_tun_packet(struct epl_thread *thread, struct sc_pkt *pkt,
+			  const struct tqos_mark *mark)
+{
+	int ret;
+	struct tagg *agg = &thread->agg;
+	const uint16_t max_size = thread->state->cfg->sock.agg_size;
+
+	if (!tagg_is_small(pkt->len))
+		return -ENOENT;
+
+	if (!agg->nr)
+		thread->agg_mark = mark;
+
+	if (tagg_add(agg, pkt->cli.__raw, (uint16_t)pkt->len, max_size))
+		return 0;
+
+	/*
+	 * Full, send it and start over with this packet.
+	 */
+	ret = flush_agg(thread);
+	if (unlikely(ret))
+		return ret;
+
+	thread->agg_mark = mark;
+	tagg_add(agg, pkt->cli.__raw, (uint16_t)pkt->len, max_size);
+	return 0;
+}
+
+
+static int dispatch_tun_queue(struct epl_thread *thread)
 {
 	int ret;
+	uint8_t cls, i;
 	size_t send_len;
-	ssize_t read_ret;
 	ssize_t send_ret;
-	struct cli_pkt *cli_pkt = &thread->pkt.cli;
+	struct tqos_queue *q = &thread->tun_q;
+	struct cli_udp_state *state = thread->state;
+	const bool use_agg = state->cfg->sock.aggregate;
 
-	read_ret = read(tun_fd, cli_pkt->__raw, sizeof(thread->pkt.cli.__raw));
-	if (unlikely(read_ret < 0)) {
-		ret = errno;
-		if (likely(ret == EAGAIN))
-			return 0;
+	/*
+	 * Strict priority: voice, then interactive, then bulk.
+	 */
+	for (cls = 0; cls < TQOS_NR_CLASS; cls++) {
+		for (i = 0; i < q->nr[cls]; i++) {
+			uint8_t idx = q->idx[cls][i];
+			struct sc_pkt *pkt = tpkt_at(thread->tun_pkts, idx,
+						     state->pkt_buf_size);
+			struct cli_pkt *cli_pkt = &pkt->cli;
+			const struct tqos_mark *mark;
+
+			mark = state->cfg->sock.qos ? &thread->tun_marks[idx]
+						    : NULL;
+			if (state->fec) {
+				send_ret = send_fec_data(thread, pkt, mark);
+				if (unlikely(send_ret < 0))
+					return (int)send_ret;
+				continue;
+			}
+
+			if (use_agg) {
+				ret = agg_tun_packet(thread, pkt, mark);
+				if (ret != -ENOENT) {
+					if (unlikely(ret))
+						return ret;
+					continue;
+				}
+
+				/*
+				 * Don't let this one overtake the packets
+				 * that are already aggregated.
+				 */
+				ret = flush_agg(thread);
+				if (unlikely(ret))
+					return ret;
+			}
+
+			send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA,
+					     (uint16_t)pkt->len, 0);
+			if (mark || state->cfg->sock.timestamping)
+				send_ret = do_send_mark(state, cli_pkt, send_len,
+							mark);
+			else
+				send_ret = do_send_to(state, cli_pkt, send_len);
+			tfr_rec(&thread->fr, TFR_EV_UDP_TX, state->udp_fd,
+				TCLI_PKT_TUN_DATA,
+				(send_ret > 0) ? (size_t)send_ret : 0u,
+				TFR_NO_SESS, (send_ret < 0) ? (int)send_ret : 0);
+			if (unlikely(send_ret < 0))
+				return (int)send_ret;
+		}
 
-		pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd, PREAR(ret));
-		return -ret;
+		if (use_agg) {
+			ret = flush_agg(thread);
+			if (unlikely(ret))
+				return ret;
+		}
 	}
 
-	pr_debug("read() from tun_fd %zd bytes", read_ret);
-	send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA, (uint16_t)read_ret, 0);
-	send_ret = do_send_to(thread->state->udp_fd, cli_pkt, send_len);
-	return (send_ret < 0) ? (int)send_ret : 0;
+	return 0;
+}
+
+
+static int handle_event_tun(int tun_fd, struct epl_thread *thread)
+{
+	int ret;
+	uint8_t i, cls;
+	ssize_t read_ret;
+	uint64_t first_us = 0;
+	struct tqos_queue *q = &thread->tun_q;
+	struct cli_cfg_sock *sock = &thread->state->cfg->sock;
+	const bool use_qos = sock->qos;
+	const bool use_agg = sock->aggregate;
+	const size_t read_size = thread->state->pkt_data_size;
+
+	tqos_queue_reset(q);
+	for (i = 0; i < TQOS_BATCH; i++) {
+		struct sc_pkt *pkt = tpkt_at(thread->tun_pkts, i,
+					     thread->state->pkt_buf_size);
+		char *buf = pkt->cli.__raw;
+
+		if (use_agg && i > 0 &&
+		    tagg_now_us() - first_us >= sock->agg_latency_us)
+			/*
+			 * The first packet has waited long enough,
+			 * the rest is left for the next event.
+			 */
+			break;
+
+		read_ret = read(tun_fd, buf, read_size);
+		tfr_rec(&thread->fr, TFR_EV_TUN_RX, tun_fd, 0u,
+			(read_ret > 0) ? (size_t)read_ret : 0u, TFR_NO_SESS,
+			(read_ret < 0) ? -errno : 0);
+		if (unlikely(read_ret < 0)) {
+			ret = errno;
+			if (likely(ret == EAGAIN))
+				break;
+
+			pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
+			       PREAR(ret));
+			return -ret;
+		}
+
+		pkt->len = (size_t)read_ret;
+		pr_debug("read() from tun_fd %zd bytes", read_ret);
+
+		if (use_agg && i == 0)
+			first_us = tagg_now_us();
+
+		cls = TQOS_CLASS_BULK;
+		if (use_qos)
+			cls = tqos_classify(buf, pkt->len,
+					    &thread->tun_marks[i]);
+		tqos_enqueue(q, cls, i);
+	}
+
+	ret = dispatch_tun_queue(thread);
+	if (likely(!ret))
+		ret = flush_fec(thread);
+
+	return ret;
 }
 
 
@@ -336,6 +899,13 @@ static int handle_event(struct epl_thread *thread, struct epoll_event *evt)
 	int fd = evt->data.fd;
 
 	if (fd == thread->state->udp_fd) {
+		if (unlikely(evt->events & EPOLLERR))
+			/*
+			 * TX timestamps (or an ICMP error) are
+			 * waiting on the error queue.
+			 */
+			tts_drain_errqueue(fd, &thread->state->tx_ts);
+
 		ret = handle_event_udp(fd, thread);
 	} else {
 		/* It's a TUN fd. */
@@ -377,7 +947,7 @@ static int send_ping_packet(struct epl_thread *thread)
 	ssize_t send_ret;
 	struct cli_pkt *cli_pkt = &thread->pkt.cli;
 	send_len = cli_pprep(cli_pkt, TCLI_PKT_PING, 0, 0);
-	send_ret = do_send_to(thread->state->udp_fd, cli_pkt, send_len);
+	send_ret = do_send_to(thread->state, cli_pkt, send_len);
 	return (send_ret < 0) ? (int)send_ret : 0;
 }
 
@@ -391,16 +961,78 @@ static int send_close_packet(struct epl_thread *thread)
 	prl_notice(2, "Sending close packet to server...");
 	send_len = cli_pprep(cli_pkt, TCLI_PKT_CLOSE, 0, 0);
 	for (i = 0; i < 5; i++)
-		do_send_to(thread->state->udp_fd, cli_pkt, send_len);
+		do_send_to(thread->state, cli_pkt, send_len);
 
 	return 0;
 }
 
 
+#define US(NS) ((NS) / 1000u)
+
+/*
+ * Print the statistics (SIGUSR1), a snapshot of counters the other
+ * threads may be updating.
+ */
+static void dump_probe_stats(const struct tprobe *p)
+{
+	if (!p->nr_rx) {
+		pr_notice("  Path: no probes received ([socket] probe)");
+		return;
+	}
+
+	pr_notice("  Path RTT srtt %" PRIu64 " us min %" PRIu64 " us jitter %"
+		  PRIu64 " us (%" PRIu64 " samples)", US(p->srtt_ns),
+		  US(p->rtt_min_ns), US(p->rtt_jit_ns), p->nr_rtt);
+	pr_notice("  Path loss in %u.%u%% out %u.%u%%, queueing %" PRIu64
+		  " us jitter %" PRIu64 " us",
+		  p->in_loss * 100u / TPROBE_LOSS_SCALE,
+		  p->in_loss * 1000u / TPROBE_LOSS_SCALE % 10u,
+		  p->out_loss * 100u / TPROBE_LOSS_SCALE,
+		  p->out_loss * 1000u / TPROBE_LOSS_SCALE % 10u,
+		  US(tprobe_owd_queue(p)), US(p->owd_jit_ns));
+}
+
+
+static void dump_stats(struct cli_udp_state *state)
+{
+	const struct tts_rx *rx = &state->rx_ts;
+	const struct tts_tx *tx = &state->tx_ts;
+	const struct tsbuf *sb = &state->sbuf;
+
+	pr_notice("Statistics:");
+	dump_probe_stats(&state->probe);
+	pr_notice("  UDP buffers rcvbuf %u sndbuf %u (grown %u, shrunk %u "
+		  "time(s)), %u datagram(s) dropped on a full receive queue, "
+		  "%u full send buffer(s)", sb->rcvbuf, sb->sndbuf, sb->nr_grow,
+		  sb->nr_shrink, tsbuf_drops(sb), mt_load(&sb->nr_tx_full));
+	if (!state->cfg->sock.timestamping) {
+		pr_notice("  Kernel timestamping is off ([socket] timestamping)");
+		return;
+	}
+
+	pr_notice("  RX %" PRIu64 " datagrams: socket queue avg %" PRIu64
+		  " us max %" PRIu64 " us, event loop avg %" PRIu64 " us max %"
+		  PRIu64 " us", rx->queue.nr, US(rx->queue.avg_ns),
+		  US(rx->queue.max_ns), US(rx->loop.avg_ns),
+		  US(rx->loop.max_ns));
+
+	if (rx->nic.nr)
+		pr_notice("  RX NIC to kernel avg %" PRIu64 " us max %" PRIu64
+			  " us (%" PRIu64 " hardware stamps)",
+			  US(rx->nic.avg_ns), US(rx->nic.max_ns), rx->nic.nr);
+
+	pr_notice("  TX %" PRIu64 " samples: qdisc avg %" PRIu64 " us max %"
+		  PRIu64 " us, driver avg %" PRIu64 " us max %" PRIu64 " us",
+		  tx->drv.nr, US(tx->sched.avg_ns), US(tx->sched.max_ns),
+		  US(tx->drv.avg_ns), US(tx->drv.max_ns));
+}
+
+
 static int do_epoll_wait(struct epl_thread *thread)
 {
 	int ret, i, tmp;
 	struct epoll_event *events;
+	struct cli_udp_state *state = thread->state;
 
 	ret = _do_epoll_wait(thread);
 	if (unlikely(ret < 0)) {
@@ -408,9 +1040,39 @@ static int do_epoll_wait(struct epl_thread *thread)
 		return ret;
 	}
 
+	if (unlikely(state->dump_stats)) {
+		state->dump_stats = false;
+		dump_stats(state);
+	}
+
+	if (thread->idx == 0) {
+		tmp = tsbuf_tick(&state->sbuf, tagg_now_us());
+		if (unlikely(tmp < 0))
+			pr_warn("Socket buffer tuning: " PRERF, PREAR(-tmp));
+		else if (tmp)
+			prl_notice(2, "UDP socket buffers: rcvbuf %u sndbuf %u "
+				   "(%u datagram(s) dropped)", state->sbuf.rcvbuf,
+				   state->sbuf.sndbuf, tsbuf_drops(&state->sbuf));
+	}
+
+	if (thread->probe_due_us) {
+		uint64_t now = tagg_now_us();
+
+		if (now >= thread->probe_due_us) {
+			thread->probe_due_us = now +
+				state->cfg->sock.probe_interval_ms * 1000ull;
+			tmp = send_probe(thread, TCLI_PKT_REQSYNC);
+			if (unlikely(tmp))
+				return tmp;
+		}
+	}
+
 	if (ret == 0)
 		return send_ping_packet(thread);
 
+	if (state->cfg->sock.timestamping)
+		thread->wake_ns = tts_now_ns();
+
 	events = thread->events;
 	for (i = 0; i < ret; i++) {
 		tmp = handle_event(thread, &events[i]);
@@ -434,6 +1096,16 @@ static void *_run_event_loop(void *thread_p)
 
 	state = thread->state;
 	thread->epoll_timeout = 5000;
+	if (thread->idx == 0 && state->cfg->sock.probe) {
+		/*
+		 * The thread that receives from the server also drives
+		 * the path probes.
+		 */
+		if (state->cfg->sock.probe_interval_ms < 5000u)
+			thread->epoll_timeout =
+				(int)state->cfg->sock.probe_interval_ms;
+		thread->probe_due_us = tagg_now_us();
+	}
 	while (likely(!state->stop)) {
 		ret = do_epoll_wait(thread);
 		if (unlikely(ret))
@@ -474,6 +1146,7 @@ static int run_event_loop(struct cli_udp_state *state)
 	struct epl_thread *threads = state->epl_threads;
 	uint8_t i, nn = (uint8_t)state->cfg->sys.thread_num;
 
+	tbarrier_init(&state->thread_gate);
 	for (i = 1; i < nn; i++) {
 		ret = spawn_thread(&threads[i]);
 		if (unlikely(ret))
@@ -563,7 +1236,13 @@ static void destroy_epoll(struct cli_udp_state *state)
 
 	threads = state->epl_threads;
 	if (threads) {
+		uint8_t i;
+
 		close_epoll_fds(threads, nn);
+		for (i = 0; i < nn; i++) {
+			tfr_unregister(&threads[i].fr);
+			al64_free(threads[i].tun_pkts);
+		}
 		al64_free(threads);
 	}
 	al64_free(state->epl_udata);
@@ -104,6 +104,7 @@
 
 extern int run_client(int argc, char *argv[]);
 extern int run_server(int argc, char *argv[]);
+extern int run_lb(int argc, char *argv[]);
 
 #define IFACENAMESIZ 16u
 
@@ -202,6 +203,8 @@ extern const char *data_dir;
 extern void show_version(void);
 extern bool teavpn2_auth(const char *username, const char *password,
 			 struct if_info *iff);
+struct tacl;
+extern int teavpn2_user_acl(const char *username, struct tacl **acl_p);
 
 static inline void *calloc_wrp(size_t nmemb, size_t size)
 {
@@ -217,6 +220,20 @@ static inline void *calloc_wrp(size_t nmemb, size_t size)
 }
 
 
+static inline void *arena_calloc_wrp(struct al_arena *arena, size_t nmemb,
+				     size_t size)
+{
+	int err;
+	void *ret = al_arena_alloc(arena, nmemb, size);
+	if (unlikely(!ret)) {
+		err = errno;
+		pr_err("arena_calloc_wrp: " PRERF, PREAR(err));
+		errno = err;
+	}
+	return ret;
+}
+
+
 #if !defined(__clang__)
 /*
  * GCC false positive warnings are annoying!
@@ -0,0 +1,630 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <teavpn2/fec.h>
+#include <teavpn2/allocator.h>
+#include <teavpn2/common.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86 1
+#endif
+
+/*
+ * GF(2^8) with the 0x11d polynomial.
+ */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+/*
+ * gf_nib[c][0][x] = c * x and gf_nib[c][1][x] = c * (x << 4), a byte
+ * is multiplied by c with one lookup per nibble. That is what pshufb
+ * does 16 or 32 bytes at a time.
+ */
+static alignas(16) uint8_t gf_nib[256][2][16];
+
+static void (*gf_mul_add_fn)(uint8_t *dst, const uint8_t *src, uint8_t c,
+			     size_t len);
+static const char *gf_impl;
+
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+
+static __always_inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255u - gf_log[a]];
+}
+
+
+/*
+ * Cauchy coefficient of parity row @j for data shard @i, the x and
+ * y sets ({FEC_MAX_K + j} and {i}) never overlap.
+ */
+static __always_inline uint8_t fec_coef(uint8_t j, uint8_t i)
+{
+	return gf_inv((uint8_t)((FEC_MAX_K + j) ^ i));
+}
+
+
+static void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+			      size_t len)
+{
+	size_t i;
+	const uint8_t *lo = gf_nib[c][0];
+	const uint8_t *hi = gf_nib[c][1];
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= lo[src[i] & 0x0fu] ^ hi[src[i] >> 4u];
+}
+
+
+#if defined(FEC_X86)
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			     size_t len)
+{
+	size_t i = 0;
+	const __m128i lo   = _mm_load_si128((const __m128i *)gf_nib[c][0]);
+	const __m128i hi   = _mm_load_si128((const __m128i *)gf_nib[c][1]);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	for (; i + 16u <= len; i += 16u) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(x, mask));
+		__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(
+					     _mm_srli_epi64(x, 4), mask));
+
+		d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+
+	gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+			    size_t len)
+{
+	size_t i = 0;
+	const __m256i lo   = _mm256_broadcastsi128_si256(
+				_mm_load_si128((const __m128i *)gf_nib[c][0]));
+	const __m256i hi   = _mm256_broadcastsi128_si256(
+				_mm_load_si128((const __m128i *)gf_nib[c][1]));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	for (; i + 32u <= len; i += 32u) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask));
+		__m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(
+						_mm256_srli_epi64(x, 4), mask));
+
+		d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+
+	gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif /* #if defined(FEC_X86) */
+
+
+/*
+ * dst[i] ^= c * src[i]
+ */
+static __always_inline void gf_mul_add(uint8_t *dst, const uint8_t *src,
+				       uint8_t c, size_t len)
+{
+	if (c)
+		gf_mul_add_fn(dst, src, c, len);
+}
+
+
+/*
+ * Build the tables and pick the widest region multiply the CPU has.
+ * Must be called before any thread uses FEC, returns the name of the
+ * implementation.
+ */
+const char *fec_init(void)
+{
+	uint16_t i, x = 1;
+	uint16_t c;
+
+	if (gf_impl)
+		return gf_impl;
+
+	for (i = 0; i < 255u; i++) {
+		gf_exp[i] = (uint8_t)x;
+		gf_log[x] = (uint8_t)i;
+		x <<= 1u;
+		if (x & 0x100u)
+			x ^= 0x11du;
+	}
+
+	for (i = 255u; i < 512u; i++)
+		gf_exp[i] = gf_exp[i - 255u];
+
+	for (c = 0; c < 256u; c++) {
+		for (i = 0; i < 16u; i++) {
+			gf_nib[c][0][i] = gf_mul((uint8_t)c, (uint8_t)i);
+			gf_nib[c][1][i] = gf_mul((uint8_t)c, (uint8_t)(i << 4u));
+		}
+	}
+
+	gf_mul_add_fn = gf_mul_add_scalar;
+	gf_impl       = "scalar";
+
+#if defined(FEC_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gf_mul_add_fn = gf_mul_add_avx2;
+		gf_impl       = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		gf_mul_add_fn = gf_mul_add_ssse3;
+		gf_impl       = "ssse3";
+	}
+#endif
+
+	return gf_impl;
+}
+
+
+/*
+ * @shard_max is FEC_SHARD_SIZE() of the largest inner packet, the
+ * payload size of the packet buffers.
+ */
+struct fec_state *fec_state_new(uint8_t k, uint8_t m_max, size_t shard_max)
+{
+	int ret;
+	uint8_t i;
+	uint8_t *mem;
+	size_t stride;
+	struct fec_state *fs;
+	const size_t nr_shard = FEC_MAX_K + FEC_MAX_M;
+
+	if (unlikely(!k || k > FEC_MAX_K || !m_max || m_max > FEC_MAX_M ||
+		     shard_max > UINT16_MAX)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fs = al64_calloc(1ul, sizeof(*fs));
+	if (unlikely(!fs))
+		return NULL;
+
+	stride = (shard_max + 63u) & ~(size_t)63u;
+	mem = al64_calloc(m_max + nr_shard, stride);
+	if (unlikely(!mem)) {
+		al64_free(fs);
+		return NULL;
+	}
+
+	ret = mutex_init(&fs->enc_lock, NULL);
+	if (unlikely(ret)) {
+		al64_free(mem);
+		al64_free(fs);
+		errno = -ret;
+		return NULL;
+	}
+
+	fs->mem       = mem;
+	fs->enc.k     = k;
+	fs->enc.m_max = m_max;
+	fs->dec.shard_max = (uint32_t)shard_max;
+	for (i = 0; i < m_max; i++)
+		fs->enc.parity[i] = mem + (size_t)i * stride;
+
+	mem += (size_t)m_max * stride;
+	for (i = 0; i < nr_shard; i++)
+		fs->dec.shard[i] = mem + (size_t)i * stride;
+
+	fec_state_reset(fs);
+	return fs;
+}
+
+
+/*
+ * Start over, for a new peer.
+ */
+void fec_state_reset(struct fec_state *fs)
+{
+	fs->enc.group  = 0;
+	fs->enc.nr     = 0;
+	fs->enc.m      = (uint8_t)((fs->enc.m_max + 1u) / 2u);
+	fs->dec.active = false;
+	fs->dec.loss   = 0;
+	fs->dec.nr_groups = 0;
+}
+
+
+void fec_state_free(struct fec_state *fs)
+{
+	if (!fs)
+		return;
+
+	mutex_destroy(&fs->enc_lock);
+	al64_free(fs->mem);
+	al64_free(fs);
+}
+
+
+/*
+ * Add a data packet to the open group, @hdr is filled for sending it.
+ */
+void fec_enc_data(struct fec_enc *enc, const void *data, uint16_t len,
+		  struct pkt_fec_hdr *hdr)
+{
+	uint8_t j, c;
+	uint16_t be_len;
+	const uint16_t slen = (uint16_t)(len + 2u);
+
+	if (!enc->nr) {
+		enc->cur_m = enc->m;
+		enc->plen  = 0;
+	}
+
+	if (slen > enc->plen) {
+		for (j = 0; j < enc->cur_m; j++)
+			memset(enc->parity[j] + enc->plen, 0, slen - enc->plen);
+		enc->plen = slen;
+	}
+
+	be_len = htons(len);
+	for (j = 0; j < enc->cur_m; j++) {
+		c = fec_coef(j, enc->nr);
+		gf_mul_add(enc->parity[j], (const uint8_t *)&be_len, c, 2u);
+		gf_mul_add(enc->parity[j] + 2u, data, c, len);
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->group = htons(enc->group);
+	hdr->idx   = enc->nr++;
+	hdr->k     = enc->k;
+	hdr->m     = enc->cur_m;
+}
+
+
+/*
+ * Close the open group. Returns the number of parity shards to send
+ * with fec_enc_parity() before calling fec_enc_next().
+ */
+uint8_t fec_enc_close(struct fec_enc *enc)
+{
+	return enc->nr ? enc->cur_m : 0u;
+}
+
+
+/*
+ * Parity shard @j of the closed group, it is @enc->plen bytes long.
+ */
+const uint8_t *fec_enc_parity(struct fec_enc *enc, uint8_t j,
+			      struct pkt_fec_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->group = htons(enc->group);
+	hdr->idx   = j;
+	hdr->k     = enc->nr;
+	hdr->m     = enc->cur_m;
+	return enc->parity[j];
+}
+
+
+void fec_enc_next(struct fec_enc *enc)
+{
+	enc->group++;
+	enc->nr = 0;
+}
+
+
+/*
+ * Pick the number of parity shards from the loss rate reported by
+ * the peer: twice the expected number of lost shards, plus one.
+ */
+void fec_enc_set_loss(struct fec_enc *enc, uint16_t loss)
+{
+	uint32_t m;
+
+	if (loss > FEC_LOSS_SCALE)
+		loss = FEC_LOSS_SCALE;
+
+	m = 1u + ((uint32_t)loss * 2u * enc->k + FEC_LOSS_SCALE - 1u) /
+		 FEC_LOSS_SCALE;
+	if (m > enc->m_max)
+		m = enc->m_max;
+
+	enc->m = (uint8_t)m;
+}
+
+
+static void fec_dec_finish(struct fec_dec *dec)
+{
+	uint32_t expected, lost, sample;
+
+	if (!dec->active)
+		return;
+
+	expected = (dec->k ? dec->k : dec->max_idx + 1u) + dec->m;
+	lost     = (expected > dec->nr_rx) ? expected - dec->nr_rx : 0u;
+	sample   = lost * FEC_LOSS_SCALE / expected;
+	dec->loss = (uint16_t)((dec->loss * 7u + sample) / 8u);
+	dec->nr_groups++;
+}
+
+
+/*
+ * Returns false if @hdr belongs to a group that is already finished.
+ */
+static bool fec_dec_group(struct fec_dec *dec, const struct pkt_fec_hdr *hdr)
+{
+	uint16_t group = ntohs(hdr->group);
+
+	if (dec->active) {
+		if (group == dec->group)
+			return true;
+
+		if ((int16_t)(group - dec->group) < 0)
+			return false;
+	}
+
+	fec_dec_finish(dec);
+	dec->group   = group;
+	dec->active  = true;
+	dec->done    = false;
+	dec->k       = 0;
+	dec->m       = hdr->m;
+	dec->max_idx = 0;
+	dec->nr_rx   = 0;
+	dec->have    = 0;
+	return true;
+}
+
+
+static bool gf_invert(uint8_t a[FEC_MAX_K][FEC_MAX_K],
+		      uint8_t inv[FEC_MAX_K][FEC_MAX_K], uint8_t n)
+{
+	uint8_t col, r, p, c, f, tmp;
+
+	memset(inv, 0, sizeof(uint8_t[FEC_MAX_K][FEC_MAX_K]));
+	for (r = 0; r < n; r++)
+		inv[r][r] = 1;
+
+	for (col = 0; col < n; col++) {
+		for (p = col; p < n; p++) {
+			if (a[p][col])
+				break;
+		}
+
+		if (unlikely(p == n))
+			return false;
+
+		if (p != col) {
+			for (c = 0; c < n; c++) {
+				tmp = a[p][c]; a[p][c] = a[col][c]; a[col][c] = tmp;
+				tmp = inv[p][c]; inv[p][c] = inv[col][c]; inv[col][c] = tmp;
+			}
+		}
+
+		f = gf_inv(a[col][col]);
+		for (c = 0; c < n; c++) {
+			a[col][c]   = gf_mul(a[col][c], f);
+			inv[col][c] = gf_mul(inv[col][c], f);
+		}
+
+		for (r = 0; r < n; r++) {
+			f = a[r][col];
+			if (r == col || !f)
+				continue;
+
+			for (c = 0; c < n; c++) {
+				a[r][c]   ^= gf_mul(f, a[col][c]);
+				inv[r][c] ^= gf_mul(f, inv[col][c]);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Rebuild the missing data shards once any @k shards are in.
+ * Returns the mask of the recovered ones.
+ */
+static uint32_t fec_dec_try(struct fec_dec *dec)
+{
+	uint8_t a[FEC_MAX_K][FEC_MAX_K], inv[FEC_MAX_K][FEC_MAX_K];
+	uint8_t rows[FEC_MAX_K];
+	uint32_t data_mask, ret = 0;
+	uint16_t L = 0, n;
+	uint8_t i, j, r, nr = 0;
+	const uint8_t k = dec->k;
+
+	if (!k || dec->done)
+		return 0;
+
+	data_mask = (1u << k) - 1u;
+	if ((dec->have & data_mask) == data_mask) {
+		dec->done = true;
+		return 0;
+	}
+
+	for (i = 0; i < k; i++) {
+		if (dec->have & (1u << i))
+			rows[nr++] = i;
+	}
+
+	for (j = 0; j < dec->m && nr < k; j++) {
+		if (dec->have & (1u << (FEC_MAX_K + j)))
+			rows[nr++] = (uint8_t)(FEC_MAX_K + j);
+	}
+
+	if (nr < k)
+		return 0;
+
+	for (j = 0; j < FEC_MAX_M; j++) {
+		if ((dec->have & (1u << (FEC_MAX_K + j))) &&
+		    dec->len[FEC_MAX_K + j] > L)
+			L = dec->len[FEC_MAX_K + j];
+	}
+
+	for (r = 0; r < k; r++) {
+		uint8_t s = rows[r];
+
+		if (unlikely(dec->len[s] > L))
+			/*
+			 * Inconsistent group, give up on it.
+			 */
+			goto out;
+
+		memset(dec->shard[s] + dec->len[s], 0, L - dec->len[s]);
+		dec->len[s] = L;
+
+		for (i = 0; i < k; i++) {
+			if (s < FEC_MAX_K)
+				a[r][i] = (s == i);
+			else
+				a[r][i] = fec_coef((uint8_t)(s - FEC_MAX_K), i);
+		}
+	}
+
+	if (unlikely(!gf_invert(a, inv, k)))
+		goto out;
+
+	for (i = 0; i < k; i++) {
+		uint8_t *out = dec->shard[i];
+
+		if (dec->have & (1u << i))
+			continue;
+
+		memset(out, 0, L);
+		for (r = 0; r < k; r++)
+			gf_mul_add(out, dec->shard[rows[r]], inv[i][r], L);
+
+		memcpy(&n, out, sizeof(n));
+		n = ntohs(n);
+		if (unlikely(!n || n > L - 2u))
+			continue;
+
+		dec->len[i] = L;
+		dec->have  |= 1u << i;
+		ret        |= 1u << i;
+	}
+
+out:
+	dec->done = true;
+	return ret;
+}
+
+
+/*
+ * Store a received data shard. *@dup tells whether the packet was
+ * already received or recovered, it must not be written to TUN again
+ * then. Returns the mask of the recovered data shards.
+ */
+uint32_t fec_dec_data(struct fec_dec *dec, const struct pkt_fec_hdr *hdr,
+		      const void *data, uint16_t len, bool *dup)
+{
+	uint16_t be_len;
+	const uint8_t i = hdr->idx;
+
+	*dup = false;
+	if (unlikely(i >= FEC_MAX_K || hdr->m > FEC_MAX_M ||
+		     len > dec->shard_max - 2u))
+		return 0;
+
+	if (!fec_dec_group(dec, hdr))
+		return 0;
+
+	if (dec->have & (1u << i)) {
+		*dup = true;
+		return 0;
+	}
+
+	dec->have |= 1u << i;
+	dec->nr_rx++;
+	if (i > dec->max_idx)
+		dec->max_idx = i;
+
+	if (dec->done)
+		return 0;
+
+	be_len = htons(len);
+	memcpy(dec->shard[i], &be_len, sizeof(be_len));
+	memcpy(dec->shard[i] + 2u, data, len);
+	dec->len[i] = (uint16_t)(len + 2u);
+	return fec_dec_try(dec);
+}
+
+
+/*
+ * Store a received parity shard. Returns the mask of the recovered
+ * data shards.
+ */
+uint32_t fec_dec_parity(struct fec_dec *dec, const struct pkt_fec_hdr *hdr,
+			const void *parity, uint16_t len)
+{
+	const uint8_t j = hdr->idx;
+	const uint32_t bit = 1u << (FEC_MAX_K + j);
+
+	if (unlikely(j >= FEC_MAX_M || !hdr->k || hdr->k > FEC_MAX_K ||
+		     hdr->m > FEC_MAX_M || j >= hdr->m || len < 3u ||
+		     len > dec->shard_max))
+		return 0;
+
+	if (!fec_dec_group(dec, hdr))
+		return 0;
+
+	if (dec->have & bit)
+		return 0;
+
+	dec->have |= bit;
+	dec->nr_rx++;
+	dec->k = hdr->k;
+	dec->m = hdr->m;
+	if (dec->done)
+		return 0;
+
+	memcpy(dec->shard[FEC_MAX_K + j], parity, len);
+	dec->len[FEC_MAX_K + j] = len;
+	return fec_dec_try(dec);
+}
+
+
+/*
+ * The inner packet of data shard @i (received or recovered).
+ */
+const uint8_t *fec_dec_shard(struct fec_dec *dec, uint8_t i, uint16_t *len)
+{
+	uint16_t n;
+
+	memcpy(&n, dec->shard[i], sizeof(n));
+	*len = ntohs(n);
+	return dec->shard[i] + 2u;
+}
+
+
+/*
+ * True once every FEC_REPORT_GROUPS groups, the caller then sends
+ * @dec->loss to the peer.
+ */
+bool fec_dec_report_due(struct fec_dec *dec)
+{
+	if (dec->nr_groups < FEC_REPORT_GROUPS)
+		return false;
+
+	dec->nr_groups = 0;
+	return true;
+}
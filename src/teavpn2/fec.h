@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__FEC_H
+#define TEAVPN2__FEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/packet.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Forward error correction for TUN data, systematic Reed-Solomon
+ * over GF(256) with a Cauchy generator matrix.
+ *
+ * The sender puts its TUN packets into groups. A group is closed
+ * after @k packets, or at the end of the TUN batch that touched it.
+ * It is then followed by @m parity packets. A data shard is the
+ * inner packet prefixed with its 16-bit length, so a recovered shard
+ * carries its own length. The shards are zero padded to the longest
+ * one in the group.
+ *
+ * The parity is accumulated while the data packets go out, so the
+ * sender never keeps a copy of them. The receiver writes every data
+ * packet to TUN as soon as it arrives. As soon as any @k shards of a
+ * group are in, it rebuilds the missing ones.
+ *
+ * The receiver measures the shard loss rate and reports it back
+ * every FEC_REPORT_GROUPS groups, the sender picks @m from that.
+ */
+#define FEC_MAX_K		16u
+#define FEC_MAX_M		8u
+#define FEC_DEF_K		8u
+#define FEC_DEF_M_MAX		4u
+
+/*
+ * A data shard is the inner packet with its length in front.
+ */
+#define FEC_SHARD_SIZE(DATA)	(2u + (size_t)(DATA))
+#define FEC_REPORT_GROUPS	16u
+#define FEC_LOSS_SCALE		1024u
+
+struct fec_enc {
+	uint16_t		group;
+	uint8_t			k;
+	uint8_t			m_max;
+
+	/*
+	 * Parity shards for the next group.
+	 */
+	uint8_t			m;
+
+	/*
+	 * The open group: @nr data shards so far, @cur_m parity
+	 * shards of @plen bytes.
+	 */
+	uint8_t			nr;
+	uint8_t			cur_m;
+	uint16_t		plen;
+	uint8_t			*parity[FEC_MAX_M];
+};
+
+struct fec_dec {
+	uint16_t		group;
+	bool			active;
+	bool			done;
+
+	/*
+	 * @k is 0 until a parity shard of the group is seen.
+	 */
+	uint8_t			k;
+	uint8_t			m;
+	uint8_t			max_idx;
+	uint8_t			nr_rx;
+
+	/*
+	 * Bit i is data shard i, bit FEC_MAX_K + j is parity j.
+	 */
+	uint32_t		have;
+	uint16_t		len[FEC_MAX_K + FEC_MAX_M];
+	uint8_t			*shard[FEC_MAX_K + FEC_MAX_M];
+
+	/*
+	 * Shard loss rate (EWMA, in FEC_LOSS_SCALE units) and the
+	 * number of groups finished since the last report.
+	 */
+	uint16_t		loss;
+	uint16_t		nr_groups;
+
+	/*
+	 * Size of the shard buffers, see fec_state_new().
+	 */
+	uint32_t		shard_max;
+};
+
+struct fec_state {
+	/*
+	 * The encoder is fed by every thread that reads TUN, the
+	 * decoder is only used by the thread that receives from
+	 * the peer.
+	 */
+	struct tmutex		enc_lock;
+	struct fec_enc		enc;
+	struct fec_dec		dec;
+
+	/*
+	 * Backing memory of the parity and shard buffers.
+	 */
+	uint8_t			*mem;
+};
+
+
+extern const char *fec_init(void);
+extern struct fec_state *fec_state_new(uint8_t k, uint8_t m_max,
+				       size_t shard_max);
+extern void fec_state_reset(struct fec_state *fs);
+extern void fec_state_free(struct fec_state *fs);
+extern void fec_enc_data(struct fec_enc *enc, const void *data, uint16_t len,
+			 struct pkt_fec_hdr *hdr);
+extern uint8_t fec_enc_close(struct fec_enc *enc);
+extern const uint8_t *fec_enc_parity(struct fec_enc *enc, uint8_t j,
+				     struct pkt_fec_hdr *hdr);
+extern void fec_enc_next(struct fec_enc *enc);
+extern void fec_enc_set_loss(struct fec_enc *enc, uint16_t loss);
+extern uint32_t fec_dec_data(struct fec_dec *dec,
+			     const struct pkt_fec_hdr *hdr, const void *data,
+			     uint16_t len, bool *dup);
+extern uint32_t fec_dec_parity(struct fec_dec *dec,
+			       const struct pkt_fec_hdr *hdr,
+			       const void *parity, uint16_t len);
+extern const uint8_t *fec_dec_shard(struct fec_dec *dec, uint8_t i,
+				    uint16_t *len);
+extern bool fec_dec_report_due(struct fec_dec *dec);
+
+
+static __always_inline bool fec_enc_full(const struct fec_enc *enc)
+{
+	return enc->nr >= enc->k;
+}
+
+
+static inline void fec_fix_limits(uint8_t *k, uint8_t *m_max)
+{
+	if (!*k)
+		*k = FEC_DEF_K;
+	else if (*k > FEC_MAX_K)
+		*k = FEC_MAX_K;
+
+	if (!*m_max)
+		*m_max = FEC_DEF_M_MAX;
+	else if (*m_max > FEC_MAX_M)
+		*m_max = FEC_MAX_M;
+}
+
+
+/*
+ * @pkt is a received struct cli_pkt or struct srv_pkt of @pkt_len
+ * bytes carrying a FEC_DATA or FEC_PARITY packet. Returns its FEC
+ * header and sets @data and @len to what follows it, or returns NULL
+ * if the packet is truncated.
+ */
+static inline const struct pkt_fec_hdr *fec_pkt_hdr(const void *pkt,
+						    size_t pkt_len,
+						    const uint8_t **data,
+						    uint16_t *len)
+{
+	uint16_t n;
+	const uint8_t *p = pkt;
+	const size_t hdr_len = sizeof(struct pkt_fec_hdr);
+
+	if (unlikely(pkt_len < PKT_MIN_LEN + hdr_len))
+		return NULL;
+
+	memcpy(&n, p + 2, sizeof(n));
+	n = ntohs(n);
+	if (unlikely(n < hdr_len || n > pkt_len - PKT_MIN_LEN))
+		return NULL;
+
+	*data = p + PKT_MIN_LEN + hdr_len;
+	*len  = (uint16_t)(n - hdr_len);
+	return (const struct pkt_fec_hdr *)(p + PKT_MIN_LEN);
+}
+
+
+/*
+ * Build a FEC_REPORT packet of @type in @buf, returns its length.
+ */
+static inline size_t fec_pkt_report(uint8_t buf[PKT_MIN_LEN + 4u],
+				    uint8_t type, uint16_t loss)
+{
+	uint16_t n = htons((uint16_t)sizeof(struct pkt_fec_report));
+	struct pkt_fec_report rep = {
+		.loss  = htons(loss),
+		.__pad = 0
+	};
+
+	buf[0] = type;
+	buf[1] = 0;
+	memcpy(&buf[2], &n, sizeof(n));
+	memcpy(&buf[PKT_MIN_LEN], &rep, sizeof(rep));
+	return PKT_MIN_LEN + sizeof(rep);
+}
+
+#endif /* #ifndef TEAVPN2__FEC_H */
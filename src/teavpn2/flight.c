@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/flight.h>
+#include <teavpn2/common.h>
+
+
+static struct tfr_ring *volatile tfr_rings[TFR_MAX_RINGS];
+static mt_atomic(uint32_t) tfr_nr_rings;
+
+/*
+ * A (clock, CLOCK_MONOTONIC) pair taken at init, the TSC rate is
+ * measured against it when a ring is printed.
+ */
+static uint64_t tfr_clk0;
+static uint64_t tfr_ns0;
+
+#if defined(__x86_64__)
+static volatile bool tfr_crash;
+#endif
+
+
+static uint64_t tfr_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static const char *tfr_ev_name(uint8_t ev)
+{
+	switch (ev) {
+	case TFR_EV_UDP_RX:
+		return "udp_rx";
+	case TFR_EV_UDP_TX:
+		return "udp_tx";
+	case TFR_EV_TUN_RX:
+		return "tun_rx";
+	case TFR_EV_TUN_TX:
+		return "tun_tx";
+	case TFR_EV_FWD:
+		return "fwd";
+	case TFR_EV_STALL:
+		return "stall";
+	}
+	return "?";
+}
+
+
+/*
+ * This runs from a signal handler, or with the print lock possibly
+ * held by a dead thread, so it writes with plain printf() like the
+ * emerg handler does.
+ */
+void tfr_dump(const struct tfr_ring *ring, const char *why)
+{
+	double clk_per_us = 1000.0;
+	uint32_t i, head = ring->head, nr;
+	uint64_t clk = tfr_clock(), ns = tfr_mono_ns();
+
+	if (ns > tfr_ns0 && clk > tfr_clk0)
+		clk_per_us = (double)(clk - tfr_clk0) * 1000.0 /
+			     (double)(ns - tfr_ns0);
+
+	nr = (head < TFR_NR) ? head : TFR_NR;
+	printf("  Flight recorder of %s (%s), last %u of %u events:\n",
+	       ring->name, why, nr, head);
+
+	for (i = head - nr; i != head; i++) {
+		const struct tfr_ent *e = &ring->ent[i & (TFR_NR - 1u)];
+		double age = (clk > e->ts) ? (double)(clk - e->ts) / clk_per_us
+					   : 0.0;
+
+		printf("    %10.1f us ago %-6s fd=%d type=%hhu len=%hu",
+		       age, tfr_ev_name(e->ev), e->fd, e->type, e->len);
+		if (e->sess != TFR_NO_SESS)
+			printf(" sess=%hu", e->sess);
+		printf(" ret=%d\n", e->ret);
+	}
+	fflush(stdout);
+}
+
+
+void tfr_dump_all(const char *why)
+{
+	uint32_t i, nr = mt_load(&tfr_nr_rings);
+
+	if (nr > TFR_MAX_RINGS)
+		nr = TFR_MAX_RINGS;
+
+	for (i = 0; i < nr; i++) {
+		struct tfr_ring *ring = tfr_rings[i];
+
+		if (ring)
+			tfr_dump(ring, why);
+	}
+}
+
+
+void tfr_register(struct tfr_ring *ring, const char *name)
+{
+	uint32_t i;
+
+	ring->head = 0;
+	strncpy(ring->name, name, sizeof(ring->name) - 1);
+	ring->name[sizeof(ring->name) - 1] = '\0';
+
+	i = mt_fetch_add(&tfr_nr_rings, 1u);
+	if (unlikely(i >= TFR_MAX_RINGS))
+		/*
+		 * Out of slots, the ring still records but is never
+		 * printed.
+		 */
+		return;
+
+	tfr_rings[i] = ring;
+}
+
+
+void tfr_unregister(struct tfr_ring *ring)
+{
+	uint32_t i;
+
+	for (i = 0; i < TFR_MAX_RINGS; i++) {
+		if (tfr_rings[i] == ring)
+			tfr_rings[i] = NULL;
+	}
+}
+
+
+#if defined(__x86_64__)
+/*
+ * The BUG and WARN entries of the emerg handler are recoverable, only
+ * BUG (and the BUG_ON() in panic()) or a fatal signal dump the rings.
+ * Decide that before the trace moves RIP past the ud2.
+ */
+static bool tfr_pre_emerg(int sig, siginfo_t *si, ucontext_t *ctx)
+{
+	int32_t rel;
+	uintptr_t rip = (uintptr_t)ctx->uc_mcontext.gregs[REG_RIP];
+	const struct emerg_entry *entry;
+
+	(void)si;
+	tfr_crash = true;
+	if (sig != SIGILL || memcmp("\x0f\x0b\x48\x8d\x05", (void *)rip, 5))
+		return true;
+
+	memcpy(&rel, (void *)(rip + 5), sizeof(rel));
+	entry = (const struct emerg_entry *)(rip + 5 + 4 + (intptr_t)rel);
+	tfr_crash = (entry->type == EMERG_TYPE_BUG);
+	return true;
+}
+
+
+static bool tfr_post_emerg(int sig, siginfo_t *si, ucontext_t *ctx)
+{
+	(void)si;
+	(void)ctx;
+
+	if (!tfr_crash)
+		return true;
+
+	tfr_dump_all((sig == SIGILL) ? "BUG" : "fatal signal");
+	return true;
+}
+#endif
+
+
+void tfr_init(void)
+{
+	tfr_clk0 = tfr_clock();
+	tfr_ns0  = tfr_mono_ns();
+#if defined(__x86_64__)
+	__pre_emerg_print_trace  = tfr_pre_emerg;
+	__post_emerg_print_trace = tfr_post_emerg;
+#endif
+}
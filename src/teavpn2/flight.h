@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__FLIGHT_H
+#define TEAVPN2__FLIGHT_H
+
+#include <time.h>
+#include <stdint.h>
+#include <teavpn2/common.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/*
+ * Flight recorder.
+ *
+ * Every event loop thread keeps a ring of its last TFR_NR datapath
+ * events. Recording one is a few stores into memory the thread owns,
+ * there is no lock and no atomic. The rings are registered once, and
+ * all of them are printed when the process dies (panic, BUG_ON or a
+ * fatal signal, through the hpc_emerg hooks), or for one thread when
+ * it gets stuck retrying a full socket or TUN queue. A TFR_EV_STALL
+ * event marks where such a retry loop began.
+ *
+ * The stamps are raw TSC ticks where there is a TSC. They are turned
+ * into an age in microseconds when the ring is printed.
+ */
+#define TFR_NR			256u
+#define TFR_MAX_RINGS		256u
+
+#define TFR_EV_UDP_RX		1u
+#define TFR_EV_UDP_TX		2u
+#define TFR_EV_TUN_RX		3u
+#define TFR_EV_TUN_TX		4u
+#define TFR_EV_FWD		5u
+#define TFR_EV_STALL		6u
+
+#define TFR_NO_SESS		0xffffu
+
+struct tfr_ent {
+	uint64_t		ts;
+	int32_t			ret;
+	int32_t			fd;
+	uint16_t		len;
+	uint16_t		sess;
+	uint8_t			ev;
+	uint8_t			type;
+	uint16_t		__pad;
+};
+
+struct tfr_ring {
+	uint32_t		head;
+	char			name[28];
+	struct tfr_ent		ent[TFR_NR];
+};
+
+
+extern void tfr_init(void);
+extern void tfr_register(struct tfr_ring *ring, const char *name);
+extern void tfr_unregister(struct tfr_ring *ring);
+extern void tfr_dump(const struct tfr_ring *ring, const char *why);
+extern void tfr_dump_all(const char *why);
+
+
+static __always_inline uint64_t tfr_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+static __always_inline void tfr_rec(struct tfr_ring *ring, uint8_t ev, int fd,
+				    uint8_t type, size_t len, uint16_t sess,
+				    int ret)
+{
+	struct tfr_ent *e = &ring->ent[ring->head++ & (TFR_NR - 1u)];
+
+	e->ts   = tfr_clock();
+	e->ret  = ret;
+	e->fd   = fd;
+	e->len  = (uint16_t)len;
+	e->sess = sess;
+	e->ev   = ev;
+	e->type = type;
+}
+
+#endif /* #ifndef TEAVPN2__FLIGHT_H */
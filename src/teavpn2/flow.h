@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__FLOW_H
+#define TEAVPN2__FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <teavpn2/acl.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Per-thread flow cache.
+ *
+ * The forwarding decision for an inner IPv4 packet (the destination
+ * session and the ACL verdict) only depends on its 5-tuple while the
+ * sessions, the routes and the ACLs stay as they are. Every thread
+ * keeps the last decisions in a direct-mapped table, a packet of a
+ * known flow takes one hash and one compare.
+ *
+ * An entry is valid only for the generation it was made in. The
+ * generation is bumped whenever a session comes, goes or changes its
+ * route or ACL, which drops every cached decision at once. Read the
+ * generation before making the decision: one that races with a change
+ * is then stored under the old generation and never used.
+ *
+ * The QoS class is not cached, it comes from the DSCP bits which are
+ * not part of the key and are cheaper to read than a lookup.
+ */
+#define TFLOW_BITS		10u
+#define TFLOW_NR		(1u << TFLOW_BITS)
+
+#define TFLOW_TO_CLI		(1u << 0u)
+#define TFLOW_FROM_CLI		(1u << 1u)
+#define TFLOW_HAS_PORT		(1u << 2u)
+
+#define TFLOW_NO_SESS		0xffffu
+
+struct tflow_ent {
+	uint32_t		saddr;
+	uint32_t		daddr;
+	uint16_t		sport;
+	uint16_t		dport;
+
+	/*
+	 * TFLOW_FROM_CLI: the sending session, part of the key.
+	 */
+	uint16_t		sess;
+
+	/*
+	 * The decision: TFLOW_TO_CLI packets go to session @dst
+	 * (TFLOW_NO_SESS if there is no route), @allow is the ACL
+	 * verdict.
+	 */
+	uint16_t		dst;
+	uint8_t			proto;
+	uint8_t			flags;
+	uint8_t			allow;
+	uint8_t			__pad;
+	uint32_t		gen;
+};
+
+static_assert(sizeof(struct tflow_ent) == 24, "Bad sizeof(struct tflow_ent)");
+
+
+/*
+ * Fill the key of the IPv4 packet @buf, false if it is not one.
+ */
+static __always_inline bool tflow_key(struct tflow_ent *k, const void *buf,
+				      size_t len, uint8_t dir, uint16_t sess)
+{
+	int32_t sport, dport;
+
+	if (!tacl_parse(buf, len, &k->saddr, &k->daddr, &k->proto, &sport,
+			&dport))
+		return false;
+
+	k->flags = dir;
+	k->sport = 0;
+	k->dport = 0;
+	if (sport >= 0) {
+		k->flags |= TFLOW_HAS_PORT;
+		k->sport  = (uint16_t)sport;
+		k->dport  = (uint16_t)dport;
+	}
+
+	k->sess = sess;
+	return true;
+}
+
+
+static __always_inline int32_t tflow_sport(const struct tflow_ent *k)
+{
+	return (k->flags & TFLOW_HAS_PORT) ? (int32_t)k->sport : -1;
+}
+
+
+static __always_inline int32_t tflow_dport(const struct tflow_ent *k)
+{
+	return (k->flags & TFLOW_HAS_PORT) ? (int32_t)k->dport : -1;
+}
+
+
+static __always_inline struct tflow_ent *tflow_slot(struct tflow_ent *tab,
+						    const struct tflow_ent *k)
+{
+	uint64_t h;
+
+	h  = (((uint64_t)k->saddr << 32u) | k->daddr) * 0x9e3779b97f4a7c15ull;
+	h ^= (((uint64_t)k->sport << 48u) | ((uint64_t)k->dport << 32u) |
+	      ((uint64_t)k->sess << 16u) | ((uint64_t)k->proto << 8u) |
+	      k->flags) * 0xc2b2ae3d27d4eb4full;
+	h ^= h >> 29u;
+	return &tab[h >> (64u - TFLOW_BITS)];
+}
+
+
+static __always_inline bool tflow_hit(const struct tflow_ent *e,
+				      const struct tflow_ent *k, uint32_t gen)
+{
+	return e->gen == gen && e->saddr == k->saddr &&
+	       e->daddr == k->daddr && e->sport == k->sport &&
+	       e->dport == k->dport && e->sess == k->sess &&
+	       e->proto == k->proto && e->flags == k->flags;
+}
+
+
+static __always_inline void tflow_fill(struct tflow_ent *e,
+				       const struct tflow_ent *k, uint16_t dst,
+				       bool allow, uint32_t gen)
+{
+	*e       = *k;
+	e->dst   = dst;
+	e->allow = allow;
+	e->__pad = 0;
+	e->gen   = gen;
+}
+
+#endif /* #ifndef TEAVPN2__FLOW_H */
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Consistent hash ring for the load balancer.
+ *
+ * Each backend is placed on the ring @vnodes times. The points only
+ * depend on the backend address, not on its position in the config,
+ * so adding or removing a backend only moves the sessions that hash
+ * into the arcs it gains or loses (about 1/N of them).
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <teavpn2/allocator.h>
+#include <teavpn2/lb/chash.h>
+
+
+static uint64_t backend_seed(const struct lb_backend *b)
+{
+	/* FNV-1a of "addr:port" */
+	char buf[80];
+	const char *p = buf;
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	snprintf(buf, sizeof(buf), "%s:%hu", b->addr, b->port);
+	while (*p) {
+		h ^= (uint8_t)*p++;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+
+static int cmp_point(const void *a, const void *b)
+{
+	const struct chash_point *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return (x->hash < y->hash) ? -1 : 1;
+
+	/* Deterministic order on collision. */
+	return (int)x->backend - (int)y->backend;
+}
+
+
+int chash_build(struct chash_ring *ring, const struct lb_cfg_backend *bk,
+		uint16_t vnodes)
+{
+	uint32_t n = 0;
+	uint16_t i, j;
+	struct chash_point *points;
+
+	if (unlikely(!bk->nr || !vnodes))
+		return -EINVAL;
+
+	points = al64_calloc((size_t)bk->nr * vnodes, sizeof(*points));
+	if (unlikely(!points))
+		return -ENOMEM;
+
+	for (i = 0; i < bk->nr; i++) {
+		uint64_t seed = backend_seed(&bk->arr[i]);
+
+		for (j = 0; j < vnodes; j++) {
+			uint64_t h = chash_mix64(seed + j * 0x9e3779b97f4a7c15ull);
+
+			points[n].hash    = (uint32_t)(h >> 32u);
+			points[n].backend = i;
+			n++;
+		}
+	}
+
+	qsort(points, n, sizeof(*points), cmp_point);
+	chash_destroy(ring);
+	ring->points    = points;
+	ring->nr_points = n;
+	return 0;
+}
+
+
+void chash_destroy(struct chash_ring *ring)
+{
+	al64_free(ring->points);
+	ring->points    = NULL;
+	ring->nr_points = 0;
+}
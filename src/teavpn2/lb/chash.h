@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Consistent hash ring for the load balancer.
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#ifndef TEAVPN2__LB__CHASH_H
+#define TEAVPN2__LB__CHASH_H
+
+#include <teavpn2/lb/common.h>
+
+
+struct chash_point {
+	uint32_t				hash;
+	uint16_t				backend;
+};
+
+
+struct chash_ring {
+	uint32_t				nr_points;
+	struct chash_point			*points;
+};
+
+
+static __always_inline uint64_t chash_mix64(uint64_t x)
+{
+	/* splitmix64 finalizer */
+	x ^= x >> 30u;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27u;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31u;
+	return x;
+}
+
+
+/*
+ * Hash of a client session key, @addr and @port are in network
+ * byte order (as they come from recvmmsg()).
+ */
+static __always_inline uint32_t chash_key(uint32_t addr, uint16_t port)
+{
+	return (uint32_t)(chash_mix64(((uint64_t)addr << 16u) | port) >> 32u);
+}
+
+
+/*
+ * Returns the backend index owning @key, the ring must not be empty.
+ */
+static __always_inline uint16_t chash_lookup(const struct chash_ring *ring,
+					     uint32_t key)
+{
+	uint32_t lo = 0, hi = ring->nr_points;
+	const struct chash_point *p = ring->points;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2u;
+
+		if (p[mid].hash < key)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+
+	if (lo == ring->nr_points)
+		lo = 0;
+
+	return p[lo].backend;
+}
+
+
+extern int chash_build(struct chash_ring *ring, const struct lb_cfg_backend *bk,
+		       uint16_t vnodes);
+extern void chash_destroy(struct chash_ring *ring);
+
+#endif /* #ifndef TEAVPN2__LB__CHASH_H */
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#ifndef TEAVPN2__LB__COMMON_H
+#define TEAVPN2__LB__COMMON_H
+
+#include <teavpn2/common.h>
+
+#define LB_MAX_BACKEND		64u
+#define LB_DEFAULT_VNODES	160u
+
+struct lb_cfg_sys {
+	const char		*cfg_file;
+	uint8_t			verbose_level;
+};
+
+
+struct lb_cfg_sock {
+	char			bind_addr[64];
+	uint16_t		bind_port;
+
+	/*
+	 * Number of points of each backend on the hash ring.
+	 */
+	uint16_t		vnodes;
+};
+
+
+struct lb_backend {
+	char			addr[64];
+	uint16_t		port;
+};
+
+
+struct lb_cfg_backend {
+	uint16_t		nr;
+	struct lb_backend	arr[LB_MAX_BACKEND];
+};
+
+
+struct lb_cfg {
+	struct lb_cfg_sys	sys;
+	struct lb_cfg_sock	sock;
+	struct lb_cfg_backend	backend;
+};
+
+extern int lb_reload_backend(struct lb_cfg *cfg);
+extern int teavpn2_lb_run(struct lb_cfg *cfg);
+
+#endif
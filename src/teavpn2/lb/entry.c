@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <inih/inih.h>
+#include <teavpn2/lb/common.h>
+
+struct cfg_parse_ctx {
+	struct lb_cfg	*cfg;
+};
+
+/* TODO: Write my own getopt function. */
+
+static const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'},
+	{"version",     no_argument,       0, 'V'},
+	{"verbose",     optional_argument, 0, 'v'},
+
+	{"config",      required_argument, 0, 'c'},
+
+	{"bind-addr",   required_argument, 0, 'H'},
+	{"bind-port",   required_argument, 0, 'P'},
+
+	{0, 0, 0, 0}
+};
+static const char short_opt[] = "hVv::c:H:P:";
+
+
+static void show_help(void)
+{
+}
+
+
+#define PR_CFG(C, FMT) printf("   " #C " = " FMT "\n", C)
+
+
+static __maybe_unused void dump_lb_cfg(struct lb_cfg *cfg)
+{
+	uint16_t i;
+
+	puts("=============================================");
+	puts("   Config dump   ");
+	puts("=============================================");
+	PR_CFG(cfg->sys.cfg_file, "%s");
+	PR_CFG(cfg->sys.verbose_level, "%hhu");
+	putchar('\n');
+	PR_CFG(cfg->sock.bind_addr, "%s");
+	PR_CFG(cfg->sock.bind_port, "%hu");
+	PR_CFG(cfg->sock.vnodes, "%hu");
+	putchar('\n');
+	for (i = 0; i < cfg->backend.nr; i++)
+		printf("   cfg->backend.arr[%hu] = %s:%hu\n", i,
+		       cfg->backend.arr[i].addr, cfg->backend.arr[i].port);
+	puts("=============================================");
+}
+
+
+static int parse_argv(int argc, char *argv[], struct lb_cfg *cfg)
+{
+	int c;
+	struct lb_cfg_sys *sys = &cfg->sys;
+	struct lb_cfg_sock *sock = &cfg->sock;
+
+	while (1) {
+		int opt_idx = 0;
+
+		c = getopt_long(argc, argv, short_opt, long_options, &opt_idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			show_help();
+			exit(0);
+		case 'V':
+			show_version();
+			exit(0);
+		case 'v': {
+			uint8_t level = optarg ? (uint8_t)atoi(optarg) : 6u;
+			set_notice_level(level);
+			sys->verbose_level = level;
+			break;
+		}
+		case 'c':
+			sys->cfg_file = optarg;
+			break;
+		case 'H':
+			strncpy2(sock->bind_addr, optarg, sizeof(sock->bind_addr));
+			break;
+		case 'P':
+			sock->bind_port = (uint16_t)atoi(optarg);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+
+static int cfg_parse_section_sys(struct cfg_parse_ctx *ctx, const char *name,
+				 const char *val, int lineno)
+{
+	struct lb_cfg *cfg = ctx->cfg;
+	if (!strcmp(name, "verbose_level")) {
+		uint8_t level = (uint8_t)strtoul(val, NULL, 10);
+		set_notice_level(level);
+		cfg->sys.verbose_level = level;
+	} else {
+		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
+			"sys", cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+	return 1;
+}
+
+
+static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
+				    const char *val, int lineno)
+{
+	struct lb_cfg *cfg = ctx->cfg;
+	if (!strcmp(name, "bind_addr")) {
+		strncpy2(cfg->sock.bind_addr, val, sizeof(cfg->sock.bind_addr));
+	} else if (!strcmp(name, "bind_port")) {
+		cfg->sock.bind_port = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "vnodes")) {
+		cfg->sock.vnodes = (uint16_t)strtoul(val, NULL, 10);
+	} else {
+		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
+			"socket", cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Each "server = addr:port" line adds a backend.
+ */
+static int cfg_parse_section_backend(struct cfg_parse_ctx *ctx,
+				     const char *name, const char *val,
+				     int lineno)
+{
+	char *port;
+	struct lb_backend *b;
+	struct lb_cfg *cfg = ctx->cfg;
+
+	if (strcmp(name, "server")) {
+		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
+			"backend", cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+
+	if (cfg->backend.nr >= LB_MAX_BACKEND) {
+		pr_err("Too many backends (max %u) at %s:%d", LB_MAX_BACKEND,
+			cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+
+	b = &cfg->backend.arr[cfg->backend.nr];
+	strncpy2(b->addr, val, sizeof(b->addr));
+	port = strchr(b->addr, ':');
+	if (!port || !(b->port = (uint16_t)strtoul(port + 1, NULL, 10))) {
+		pr_err("Invalid backend \"%s\" (expected addr:port) at %s:%d",
+			val, cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+
+	*port = '\0';
+	cfg->backend.nr++;
+	return 1;
+}
+
+
+/*
+ * If success, returns 1.
+ * If failure, returns 0.
+ */
+static int lb_cfg_parser(void *user, const char *section, const char *name,
+			 const char *val, int lineno)
+{
+	struct cfg_parse_ctx *ctx = (struct cfg_parse_ctx *)user;
+	struct lb_cfg *cfg = ctx->cfg;
+
+	if (!strcmp(section, "sys")) {
+		return cfg_parse_section_sys(ctx, name, val, lineno);
+	} else if (!strcmp(section, "socket")) {
+		return cfg_parse_section_socket(ctx, name, val, lineno);
+	} else if (!strcmp(section, "backend")) {
+		return cfg_parse_section_backend(ctx, name, val, lineno);
+	}
+
+	pr_err("Unknown section \"%s\" in at %s:%d", section, cfg->sys.cfg_file,
+		lineno);
+	return 0;
+}
+
+
+static int parse_cfg_file(const char *cfg_file, struct lb_cfg *cfg)
+{
+	int ret;
+	FILE *handle;
+	struct cfg_parse_ctx ctx;
+
+	ctx.cfg = cfg;
+
+	if (!cfg_file)
+		return 0;
+
+	handle = fopen(cfg_file, "rb");
+	if (!handle) {
+		ret = errno;
+		pr_err("Cannot open config file \"%s\": " PRERF, cfg_file,
+			PREAR(ret));
+		return -ret;
+	}
+
+	ret = ini_parse_file(handle, lb_cfg_parser, &ctx);
+	if (ret) {
+		pr_err("Failed to parse config file \"%s\"", cfg_file);
+		ret = -EINVAL;
+	}
+
+	fclose(handle);
+	return ret;
+}
+
+
+/*
+ * Re-read the [backend] section (on SIGHUP). @cfg is left untouched
+ * if the config file is invalid or has no backend.
+ */
+int lb_reload_backend(struct lb_cfg *cfg)
+{
+	int ret;
+	struct lb_cfg *tmp;
+
+	tmp = calloc(1ul, sizeof(*tmp));
+	if (unlikely(!tmp))
+		return -ENOMEM;
+
+	tmp->sys.cfg_file = cfg->sys.cfg_file;
+	ret = parse_cfg_file(tmp->sys.cfg_file, tmp);
+	if (!ret && !tmp->backend.nr) {
+		pr_err("No backend in \"%s\"", tmp->sys.cfg_file);
+		ret = -EINVAL;
+	}
+
+	if (!ret)
+		cfg->backend = tmp->backend;
+
+	free(tmp);
+	return ret;
+}
+
+
+int run_lb(int argc, char *argv[])
+{
+	int ret;
+	struct lb_cfg cfg;
+	memset(&cfg, 0, sizeof(cfg));
+
+	ret = parse_argv(argc, argv, &cfg);
+	if (ret)
+		return -ret;
+
+	ret = parse_cfg_file(cfg.sys.cfg_file, &cfg);
+	if (ret)
+		return -ret;
+
+	if (!cfg.sock.vnodes)
+		cfg.sock.vnodes = LB_DEFAULT_VNODES;
+
+#ifndef NDEBUG
+	dump_lb_cfg(&cfg);
+#endif
+
+	if (!cfg.backend.nr) {
+		pr_err("At least one backend is required in [backend]");
+		return EINVAL;
+	}
+
+	return -teavpn2_lb_run(&cfg);
+}
@@ -0,0 +1,538 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Stateless UDP load balancer.
+ *
+ * Client datagrams arriving on bind_addr:bind_port are forwarded to
+ * the backend that owns the client address on the consistent hash
+ * ring, prefixed with a struct pkt_lb_hdr carrying the client address.
+ * The backend (running with behind_lb = 1) replies to us with the
+ * same header, we strip it and send the payload to the client from
+ * the public socket. Nothing is remembered per client or per packet,
+ * so any number of load balancer instances can run side by side.
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <teavpn2/packet.h>
+#include <teavpn2/allocator.h>
+#include <teavpn2/lb/chash.h>
+
+
+#define LB_BATCH		32u
+#define LB_BUF_SIZE		PKT_MAX_LEN
+#define LB_SOCK_BUF		(1024 * 1024 * 8)
+#define LB_MOVE_SAMPLES		4096u
+
+
+struct lb_batch {
+	struct mmsghdr				msgs[LB_BATCH];
+	struct iovec				iov[LB_BATCH][2];
+	struct sockaddr_in			addr[LB_BATCH];
+	struct pkt_lb_hdr			hdr[LB_BATCH];
+	char					buf[LB_BATCH][LB_BUF_SIZE];
+};
+
+
+struct lb_state {
+	volatile bool				stop;
+	volatile bool				reload;
+	int					sig;
+
+	/*
+	 * @pub_fd faces the clients, @bk_fd faces the backends.
+	 */
+	int					pub_fd;
+	int					bk_fd;
+	int					epoll_fd;
+	struct lb_cfg				*cfg;
+
+	struct chash_ring			ring;
+	uint16_t				nr_bk;
+	struct sockaddr_in			bk_addr[LB_MAX_BACKEND];
+
+	struct lb_batch				*rx;
+	struct lb_batch				*tx;
+};
+
+
+static struct lb_state *g_state = NULL;
+
+
+static void signal_intr_handler(int sig)
+{
+	struct lb_state *state = g_state;
+
+	if (unlikely(!state)) {
+		panic("signal_intr_handler is called when g_state is NULL");
+		__builtin_unreachable();
+	}
+
+	if (sig == SIGHUP) {
+		state->reload = true;
+		return;
+	}
+
+	if (state->sig == -1) {
+		state->stop = true;
+		state->sig  = sig;
+		putchar('\n');
+	}
+}
+
+
+static int init_state(struct lb_state *state)
+{
+	int ret;
+
+	g_state         = state;
+	state->sig      = -1;
+	state->pub_fd   = -1;
+	state->bk_fd    = -1;
+	state->epoll_fd = -1;
+
+	state->rx = al64_calloc(1ul, sizeof(*state->rx));
+	state->tx = al64_calloc(1ul, sizeof(*state->tx));
+	if (unlikely(!state->rx || !state->tx))
+		return -ENOMEM;
+
+	if (unlikely(signal(SIGINT, signal_intr_handler) == SIG_ERR))
+		goto sig_err;
+	if (unlikely(signal(SIGTERM, signal_intr_handler) == SIG_ERR))
+		goto sig_err;
+	if (unlikely(signal(SIGHUP, signal_intr_handler) == SIG_ERR))
+		goto sig_err;
+	if (unlikely(signal(SIGPIPE, SIG_IGN) == SIG_ERR))
+		goto sig_err;
+
+	return 0;
+
+sig_err:
+	ret = errno;
+	pr_err("signal(): " PRERF, PREAR(ret));
+	return -ret;
+}
+
+
+static int build_backends(struct lb_state *state)
+{
+	int ret;
+	uint16_t i;
+	struct sockaddr_in *a;
+	const struct lb_cfg_backend *bk = &state->cfg->backend;
+
+	for (i = 0; i < bk->nr; i++) {
+		a = &state->bk_addr[i];
+		memset(a, 0, sizeof(*a));
+		a->sin_family = AF_INET;
+		a->sin_port   = htons(bk->arr[i].port);
+		if (!inet_pton(AF_INET, bk->arr[i].addr, &a->sin_addr)) {
+			pr_err("Invalid backend address: %s", bk->arr[i].addr);
+			return -EINVAL;
+		}
+	}
+
+	ret = chash_build(&state->ring, bk, state->cfg->sock.vnodes);
+	if (unlikely(ret)) {
+		pr_err("chash_build(): " PRERF, PREAR(-ret));
+		return ret;
+	}
+
+	state->nr_bk = bk->nr;
+	for (i = 0; i < bk->nr; i++)
+		prl_notice(2, "Backend %hu: %s:%hu", i, bk->arr[i].addr,
+			   bk->arr[i].port);
+	return 0;
+}
+
+
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return (a->sin_addr.s_addr == b->sin_addr.s_addr) &&
+	       (a->sin_port == b->sin_port);
+}
+
+
+/*
+ * Apply a new [backend] section and report the share of the key
+ * space whose backend has changed.
+ */
+static void reload_backends(struct lb_state *state)
+{
+	uint32_t k, moved = 0;
+	struct chash_ring old_ring;
+	uint16_t old_nr = state->nr_bk;
+	struct sockaddr_in old_addr[LB_MAX_BACKEND];
+
+	state->reload = false;
+	prl_notice(2, "Reloading backends from %s...", state->cfg->sys.cfg_file);
+	if (lb_reload_backend(state->cfg))
+		return;
+
+	memcpy(old_addr, state->bk_addr, sizeof(old_addr));
+	old_ring = state->ring;
+	state->ring.points = NULL;
+	state->ring.nr_points = 0;
+
+	if (build_backends(state)) {
+		pr_err("Keeping the old backend set");
+		chash_destroy(&state->ring);
+		state->ring  = old_ring;
+		state->nr_bk = old_nr;
+		memcpy(state->bk_addr, old_addr, sizeof(old_addr));
+		return;
+	}
+
+	for (k = 0; k < LB_MOVE_SAMPLES; k++) {
+		uint32_t key = k * (uint32_t)(0x100000000ull / LB_MOVE_SAMPLES);
+		uint16_t o = chash_lookup(&old_ring, key);
+		uint16_t n = chash_lookup(&state->ring, key);
+
+		moved += !same_addr(&old_addr[o], &state->bk_addr[n]);
+	}
+
+	chash_destroy(&old_ring);
+	prl_notice(2, "Backends reloaded (%hu -> %hu), about %u.%u%% of the "
+		   "sessions moved", old_nr, state->nr_bk,
+		   moved * 100u / LB_MOVE_SAMPLES,
+		   (moved * 1000u / LB_MOVE_SAMPLES) % 10u);
+}
+
+
+static int create_udp_sock(const char *addr, uint16_t port)
+{
+	int y;
+	int fd;
+	int ret;
+	struct sockaddr_in sa;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (unlikely(fd < 0)) {
+		ret = errno;
+		pr_err("socket(AF_INET, SOCK_DGRAM): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	/*
+	 * Best effort, the default buffer is still usable.
+	 */
+	y = LB_SOCK_BUF;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &y, sizeof(y)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &y, sizeof(y));
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &y, sizeof(y)))
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &y, sizeof(y));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(port);
+	sa.sin_addr.s_addr = inet_addr(addr);
+	ret = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("bind(%s:%hu): " PRERF, addr, port, PREAR(ret));
+		close(fd);
+		return -ret;
+	}
+
+	return fd;
+}
+
+
+static int init_socket(struct lb_state *state)
+{
+	int ret;
+	struct epoll_event evt;
+	struct lb_cfg_sock *sock = &state->cfg->sock;
+
+	prl_notice(2, "Binding public UDP socket to %s:%hu...", sock->bind_addr,
+		   sock->bind_port);
+	ret = create_udp_sock(sock->bind_addr, sock->bind_port);
+	if (unlikely(ret < 0))
+		return ret;
+	state->pub_fd = ret;
+
+	ret = create_udp_sock("0.0.0.0", 0);
+	if (unlikely(ret < 0))
+		return ret;
+	state->bk_fd = ret;
+
+	ret = epoll_create(255);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("epoll_create(): " PRERF, PREAR(ret));
+		return -ret;
+	}
+	state->epoll_fd = ret;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events  = EPOLLIN;
+	evt.data.fd = state->pub_fd;
+	if (unlikely(epoll_ctl(ret, EPOLL_CTL_ADD, state->pub_fd, &evt)))
+		goto epoll_err;
+
+	evt.data.fd = state->bk_fd;
+	if (unlikely(epoll_ctl(ret, EPOLL_CTL_ADD, state->bk_fd, &evt)))
+		goto epoll_err;
+
+	return 0;
+
+epoll_err:
+	ret = errno;
+	pr_err("epoll_ctl(): " PRERF, PREAR(ret));
+	return -ret;
+}
+
+
+/*
+ * Receive a batch. With @with_hdr, the first 12 bytes of every
+ * datagram are scattered into @b->hdr.
+ */
+static int lb_recv_batch(int fd, struct lb_batch *b, bool with_hdr)
+{
+	int ret;
+	uint32_t i;
+
+	for (i = 0; i < LB_BATCH; i++) {
+		struct msghdr *h = &b->msgs[i].msg_hdr;
+		struct iovec *iov = b->iov[i];
+
+		iov[0].iov_base = &b->hdr[i];
+		iov[0].iov_len  = sizeof(b->hdr[i]);
+		iov[1].iov_base = b->buf[i];
+		iov[1].iov_len  = sizeof(b->buf[i]);
+
+		memset(h, 0, sizeof(*h));
+		h->msg_name    = &b->addr[i];
+		h->msg_namelen = sizeof(b->addr[i]);
+		h->msg_iov     = with_hdr ? &iov[0] : &iov[1];
+		h->msg_iovlen  = with_hdr ? 2 : 1;
+	}
+
+	ret = recvmmsg(fd, b->msgs, LB_BATCH, MSG_DONTWAIT, NULL);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		if (ret == EAGAIN || ret == EINTR)
+			return 0;
+
+		pr_err("recvmmsg(fd=%d): " PRERF, fd, PREAR(ret));
+		return -ret;
+	}
+
+	return ret;
+}
+
+
+static void lb_send_batch(int fd, struct mmsghdr *msgs, uint32_t n)
+{
+	uint32_t off = 0;
+
+	while (off < n) {
+		int ret = sendmmsg(fd, &msgs[off], n - off, 0);
+
+		if (unlikely(ret < 0)) {
+			int err = errno;
+
+			if (err == EINTR)
+				continue;
+
+			/*
+			 * Drop the datagram that can't be sent, and
+			 * carry on with the rest of the batch.
+			 */
+			pr_debug("sendmmsg(fd=%d): " PRERF, fd, PREAR(err));
+			off++;
+			continue;
+		}
+
+		off += (uint32_t)ret;
+	}
+}
+
+
+static int forward_to_backend(struct lb_state *state)
+{
+	int n;
+	uint32_t i;
+	struct lb_batch *rx = state->rx, *tx = state->tx;
+
+	n = lb_recv_batch(state->pub_fd, rx, false);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < (uint32_t)n; i++) {
+		struct msghdr *h = &tx->msgs[i].msg_hdr;
+		const struct sockaddr_in *src = &rx->addr[i];
+		uint32_t key = chash_key(src->sin_addr.s_addr, src->sin_port);
+		uint16_t bk = chash_lookup(&state->ring, key);
+
+		tx->hdr[i].magic = htonl(TLB_MAGIC);
+		tx->hdr[i].addr  = src->sin_addr.s_addr;
+		tx->hdr[i].port  = src->sin_port;
+		tx->hdr[i].__pad = 0;
+
+		tx->iov[i][0].iov_base = &tx->hdr[i];
+		tx->iov[i][0].iov_len  = sizeof(tx->hdr[i]);
+		tx->iov[i][1].iov_base = rx->buf[i];
+		tx->iov[i][1].iov_len  = rx->msgs[i].msg_len;
+
+		memset(h, 0, sizeof(*h));
+		h->msg_name    = &state->bk_addr[bk];
+		h->msg_namelen = sizeof(state->bk_addr[bk]);
+		h->msg_iov     = tx->iov[i];
+		h->msg_iovlen  = 2;
+	}
+
+	lb_send_batch(state->bk_fd, tx->msgs, (uint32_t)n);
+	return n;
+}
+
+
+static bool is_backend(struct lb_state *state, const struct sockaddr_in *a)
+{
+	uint16_t i;
+
+	for (i = 0; i < state->nr_bk; i++) {
+		if (same_addr(a, &state->bk_addr[i]))
+			return true;
+	}
+	return false;
+}
+
+
+static int forward_to_client(struct lb_state *state)
+{
+	int n;
+	uint32_t i, j = 0;
+	struct lb_batch *rx = state->rx, *tx = state->tx;
+
+	n = lb_recv_batch(state->bk_fd, rx, true);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < (uint32_t)n; i++) {
+		struct msghdr *h = &tx->msgs[j].msg_hdr;
+		uint32_t len = rx->msgs[i].msg_len;
+
+		/*
+		 * Only relay for our backends, otherwise we are
+		 * an open reflector.
+		 */
+		if (unlikely(len <= sizeof(rx->hdr[i]) ||
+			     rx->hdr[i].magic != htonl(TLB_MAGIC) ||
+			     !is_backend(state, &rx->addr[i])))
+			continue;
+
+		memset(&tx->addr[j], 0, sizeof(tx->addr[j]));
+		tx->addr[j].sin_family      = AF_INET;
+		tx->addr[j].sin_addr.s_addr = rx->hdr[i].addr;
+		tx->addr[j].sin_port        = rx->hdr[i].port;
+
+		tx->iov[j][0].iov_base = rx->buf[i];
+		tx->iov[j][0].iov_len  = len - sizeof(rx->hdr[i]);
+
+		memset(h, 0, sizeof(*h));
+		h->msg_name    = &tx->addr[j];
+		h->msg_namelen = sizeof(tx->addr[j]);
+		h->msg_iov     = tx->iov[j];
+		h->msg_iovlen  = 1;
+		j++;
+	}
+
+	lb_send_batch(state->pub_fd, tx->msgs, j);
+	return n;
+}
+
+
+static int run_event_loop(struct lb_state *state)
+{
+	int i, ret = 0;
+	struct epoll_event events[2];
+
+	prl_notice(2, "Initialization Sequence Completed");
+	while (likely(!state->stop)) {
+		int n;
+
+		if (unlikely(state->reload))
+			reload_backends(state);
+
+		n = epoll_wait(state->epoll_fd, events, 2, 1000);
+		if (unlikely(n < 0)) {
+			ret = errno;
+			if (ret == EINTR) {
+				ret = 0;
+				continue;
+			}
+			pr_err("epoll_wait(): " PRERF, PREAR(ret));
+			return -ret;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			/*
+			 * Drain up to a few batches per wakeup, then give
+			 * the other direction a turn.
+			 */
+			int k = 8;
+
+			do {
+				if (fd == state->pub_fd)
+					ret = forward_to_backend(state);
+				else
+					ret = forward_to_client(state);
+			} while (ret == (int)LB_BATCH && --k);
+
+			if (unlikely(ret < 0))
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+
+static void destroy_state(struct lb_state *state)
+{
+	if (state->epoll_fd != -1)
+		close(state->epoll_fd);
+	if (state->bk_fd != -1)
+		close(state->bk_fd);
+	if (state->pub_fd != -1)
+		close(state->pub_fd);
+
+	chash_destroy(&state->ring);
+	al64_free(state->rx);
+	al64_free(state->tx);
+	al64_free(state);
+}
+
+
+int teavpn2_lb_run(struct lb_cfg *cfg)
+{
+	int ret;
+	struct lb_state *state;
+
+	state = al64_calloc(1ul, sizeof(*state));
+	if (unlikely(!state))
+		return -ENOMEM;
+
+	state->cfg = cfg;
+	ret = init_state(state);
+	if (unlikely(ret))
+		goto out;
+	ret = build_backends(state);
+	if (unlikely(ret))
+		goto out;
+	ret = init_socket(state);
+	if (unlikely(ret))
+		goto out;
+	ret = run_event_loop(state);
+out:
+	destroy_state(state);
+	return ret;
+}
@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__MAGAZINE_H
+#define TEAVPN2__MAGAZINE_H
+
+#include <stdint.h>
+#include <emerg/emerg.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Free index allocator in two layers:
+ *
+ *   - struct idx_depot is a lock-free Treiber stack shared by all
+ *     threads. The head carries a 32-bit tag that is bumped on
+ *     every update to avoid ABA.
+ *
+ *   - struct idx_mag is a small per-thread cache (magazine) in
+ *     front of the depot. It is refilled from and flushed to the
+ *     depot in batches of half its capacity, so the depot is only
+ *     touched once every few allocations.
+ *
+ * Both pop and push are O(1).
+ */
+#define IDX_MAG_MAX	32u
+
+struct idx_depot {
+	/*
+	 * (tag << 32) | (top index + 1), 0 in the low half means
+	 * the depot is empty.
+	 */
+	mt_atomic(uint64_t)	head;
+	mt_atomic(uint32_t)	*next;
+	uint16_t		capacity;
+};
+
+struct idx_mag {
+	uint16_t		nr;
+	uint16_t		cap;
+	uint16_t		idx[IDX_MAG_MAX];
+};
+
+
+static inline int32_t idx_depot_pop(struct idx_depot *dp)
+{
+	uint64_t head, new_head;
+	uint32_t top;
+
+	head = mt_load(&dp->head);
+	do {
+		top = (uint32_t)head;
+		if (unlikely(top == 0))
+			/* Depot is empty. */
+			return -1;
+
+		new_head  = ((head >> 32u) + 1u) << 32u;
+		new_head |= mt_load(&dp->next[top - 1]);
+	} while (!mt_cmpxchg(&dp->head, &head, new_head));
+
+	return (int32_t)(top - 1);
+}
+
+
+static inline void idx_depot_push(struct idx_depot *dp, uint16_t n)
+{
+	uint64_t head, new_head;
+
+	head = mt_load(&dp->head);
+	do {
+		mt_store(&dp->next[n], (uint32_t)head);
+		new_head  = ((head >> 32u) + 1u) << 32u;
+		new_head |= (uint32_t)n + 1u;
+	} while (!mt_cmpxchg(&dp->head, &head, new_head));
+}
+
+
+static inline struct idx_depot *idx_depot_init(struct idx_depot *dp,
+					       uint16_t capacity)
+{
+	if (unlikely(!dp)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	dp->next = calloc_wrp(capacity, sizeof(*dp->next));
+	if (unlikely(!dp->next))
+		return NULL;
+
+	mt_store(&dp->head, 0);
+	dp->capacity = capacity;
+	return dp;
+}
+
+
+static inline void idx_depot_destroy(struct idx_depot *dp)
+{
+	if (dp->next) {
+		al64_free(dp->next);
+		dp->next = NULL;
+	}
+}
+
+
+/*
+ * @cap is clamped to IDX_MAG_MAX, 0 disables the magazine and
+ * every call goes straight to the depot.
+ */
+static inline void idx_mag_init(struct idx_mag *mag, uint16_t cap)
+{
+	mag->nr  = 0;
+	mag->cap = (cap > IDX_MAG_MAX) ? IDX_MAG_MAX : cap;
+}
+
+
+static inline int32_t idx_mag_get(struct idx_mag *mag, struct idx_depot *dp)
+{
+	int32_t ret;
+	uint16_t batch;
+
+	if (likely(mag->nr))
+		return (int32_t)mag->idx[--mag->nr];
+
+	batch = mag->cap / 2u;
+	while (mag->nr < batch) {
+		ret = idx_depot_pop(dp);
+		if (ret == -1)
+			break;
+		mag->idx[mag->nr++] = (uint16_t)ret;
+	}
+
+	if (mag->nr)
+		return (int32_t)mag->idx[--mag->nr];
+
+	return idx_depot_pop(dp);
+}
+
+
+static inline void idx_mag_put(struct idx_mag *mag, struct idx_depot *dp,
+			       uint16_t n)
+{
+	uint16_t batch;
+
+	if (unlikely(!mag->cap)) {
+		idx_depot_push(dp, n);
+		return;
+	}
+
+	if (unlikely(mag->nr == mag->cap)) {
+		batch = (mag->cap + 1u) / 2u;
+		while (batch--)
+			idx_depot_push(dp, mag->idx[--mag->nr]);
+	}
+
+	mag->idx[mag->nr++] = n;
+}
+
+
+/*
+ * Return every cached index to the depot, so that an idle thread
+ * does not keep free slots away from the busy ones.
+ */
+static inline void idx_mag_flush(struct idx_mag *mag, struct idx_depot *dp)
+{
+	while (mag->nr)
+		idx_depot_push(dp, mag->idx[--mag->nr]);
+}
+
+#endif /* #ifndef TEAVPN2__MAGAZINE_H */
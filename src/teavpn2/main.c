@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <teavpn2/flight.h>
 #include <teavpn2/common.h>
 
 
@@ -18,11 +19,12 @@ void show_version(void)
 
 static void show_general_usage(const char *app)
 {
-	printf(" Usage: %s [client|server] [options]\n\n", app);
+	printf(" Usage: %s [client|server|lb] [options]\n\n", app);
 	printf(" See:\n");
 	printf("  [Help]\n");
 	printf("    %s server --help\n", app);
 	printf("    %s client --help\n", app);
+	printf("    %s lb --help\n", app);
 	printf("\n");
 	printf("  [Version]\n");
 	printf("    %s --version, -V\n\n", app);
@@ -37,6 +39,9 @@ static int run_teavpn2(int argc, char *argv[])
 	if (!strcmp("client", argv[1]))
 		return run_client(argc - 1, argv + 1);
 
+	if (!strcmp("lb", argv[1]))
+		return run_lb(argc - 1, argv + 1);
+
 	if (!strcmp("--version", argv[1]) || !strcmp("-V", argv[1])) {
 		show_version();
 		return 0;
@@ -62,12 +67,14 @@ int main(int argc, char *argv[])
 	}
 
 #if defined(__x86_64__)
-	if (emerg_init_handler(EMERG_INIT_BUG | EMERG_INIT_WARN)) {
+	if (emerg_init_handler(EMERG_INIT_BUG | EMERG_INIT_WARN |
+			       EMERG_INIT_SIGSEGV)) {
 		int ret = errno;
 		printf("Cannot set emerg handler: %s\n", strerror(ret));
 		return -ret;
 	}
 #endif
+	tfr_init();
 
 	return run_teavpn2(argc, argv);
 }
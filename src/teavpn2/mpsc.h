@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__MPSC_H
+#define TEAVPN2__MPSC_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Bounded lock-free multi-producer single-consumer ring of fixed
+ * size slots. Each slot carries a sequence number, so producers
+ * only contend on @tail and the consumer never touches it.
+ *
+ * Producer:
+ *
+ *	slot = mpsc_reserve(ring);
+ *	if (slot) {
+ *		fill the slot payload (slot + 1)...
+ *		mpsc_commit(slot);
+ *	}
+ *
+ * Consumer:
+ *
+ *	while ((slot = mpsc_peek(ring))) {
+ *		use the slot payload...
+ *		mpsc_release(ring, slot);
+ *	}
+ *
+ * The slot memory is provided by the caller, MPSC_RING_MEM() tells
+ * how much is needed.
+ */
+struct mpsc_slot {
+	_Atomic(uint64_t)		seq;
+	uint64_t			pos;
+};
+
+struct mpsc_ring {
+	alignas(64) _Atomic(uint64_t)	tail;
+	alignas(64) uint64_t		head;
+	uint32_t			mask;
+	uint32_t			slot_size;
+	char				*slots;
+};
+
+#define MPSC_SLOT_SIZE(PAYLOAD) \
+	((sizeof(struct mpsc_slot) + (PAYLOAD) + 63ul) & ~63ul)
+
+#define MPSC_RING_MEM(NR, PAYLOAD) ((size_t)(NR) * MPSC_SLOT_SIZE(PAYLOAD))
+
+
+static __always_inline struct mpsc_slot *__mpsc_slot(struct mpsc_ring *ring,
+						     uint64_t pos)
+{
+	size_t off = (size_t)(pos & ring->mask) * ring->slot_size;
+
+	return (struct mpsc_slot *)(ring->slots + off);
+}
+
+
+/*
+ * @nr must be a power of two.
+ */
+static inline void mpsc_ring_init(struct mpsc_ring *ring, void *mem,
+				  uint32_t nr, size_t payload)
+{
+	uint32_t i;
+
+	ring->slots     = mem;
+	ring->mask      = nr - 1u;
+	ring->slot_size = (uint32_t)MPSC_SLOT_SIZE(payload);
+	ring->head      = 0;
+	atomic_store(&ring->tail, 0);
+	for (i = 0; i < nr; i++)
+		atomic_store(&__mpsc_slot(ring, i)->seq, i);
+}
+
+
+/*
+ * Returns NULL if the ring is full.
+ */
+static inline struct mpsc_slot *mpsc_reserve(struct mpsc_ring *ring)
+{
+	int64_t diff;
+	uint64_t pos, seq;
+	struct mpsc_slot *slot;
+
+	pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	for (;;) {
+		slot = __mpsc_slot(ring, pos);
+		seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (int64_t)(seq - pos);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&ring->tail, &pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring->tail,
+						   memory_order_relaxed);
+		}
+	}
+
+	slot->pos = pos;
+	return slot;
+}
+
+
+static __always_inline void mpsc_commit(struct mpsc_slot *slot)
+{
+	atomic_store_explicit(&slot->seq, slot->pos + 1,
+			      memory_order_release);
+}
+
+
+/*
+ * Returns NULL if the ring is empty.
+ */
+static inline struct mpsc_slot *mpsc_peek(struct mpsc_ring *ring)
+{
+	uint64_t seq;
+	struct mpsc_slot *slot = __mpsc_slot(ring, ring->head);
+
+	seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+	if (seq != ring->head + 1)
+		return NULL;
+
+	return slot;
+}
+
+
+static __always_inline void mpsc_release(struct mpsc_ring *ring,
+					 struct mpsc_slot *slot)
+{
+	atomic_store_explicit(&slot->seq, ring->head + ring->mask + 1,
+			      memory_order_release);
+	ring->head++;
+}
+
+#endif /* #ifndef TEAVPN2__MPSC_H */
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <teavpn2/common.h>
 
 #define MUTEX_LEAK_ASSERT 0
@@ -55,6 +56,34 @@ static __always_inline int mutex_init(struct tmutex *m,
 }
 
 
+#if defined(CONFIG_SINGLE_THREAD)
+
+/*
+ * SINGLE_THREAD=1 build: nobody to race with, the lock operations
+ * compile to nothing.
+ */
+static __always_inline int mutex_lock(struct tmutex *m)
+{
+	(void)m;
+	return 0;
+}
+
+
+static __always_inline int mutex_unlock(struct tmutex *m)
+{
+	(void)m;
+	return 0;
+}
+
+
+static __always_inline int mutex_trylock(struct tmutex *m)
+{
+	(void)m;
+	return 0;
+}
+
+#else /* #if defined(CONFIG_SINGLE_THREAD) */
+
 static __always_inline int mutex_lock(struct tmutex *m)
 {
 	int ret;
@@ -85,6 +114,8 @@ static __always_inline int mutex_trylock(struct tmutex *m)
 	return pthread_mutex_trylock(&m->mutex);
 }
 
+#endif /* #if defined(CONFIG_SINGLE_THREAD) */
+
 
 static inline int mutex_destroy(struct tmutex *m)
 {
@@ -105,4 +136,51 @@ static inline int mutex_destroy(struct tmutex *m)
 	return 0;
 }
 
+
+/*
+ * Atomics on state shared between the event loop threads. In a
+ * SINGLE_THREAD=1 build they are plain loads and stores.
+ */
+#if defined(CONFIG_SINGLE_THREAD)
+#define mt_atomic(TYPE)		TYPE
+#define mt_load(PTR)		(*(PTR))
+#define mt_store(PTR, VAL)	((void)(*(PTR) = (VAL)))
+#define mt_fetch_add(PTR, VAL)						\
+({									\
+	__typeof__(*(PTR)) ____old = *(PTR);				\
+	*(PTR) = (__typeof__(____old))(____old + (VAL));		\
+	____old;							\
+})
+#define mt_fetch_sub(PTR, VAL)						\
+({									\
+	__typeof__(*(PTR)) ____old = *(PTR);				\
+	*(PTR) = (__typeof__(____old))(____old - (VAL));		\
+	____old;							\
+})
+#define mt_xchg(PTR, VAL)						\
+({									\
+	__typeof__(*(PTR)) ____old = *(PTR);				\
+	*(PTR) = (VAL);							\
+	____old;							\
+})
+#define mt_cmpxchg(PTR, EXP, NEW)					\
+({									\
+	bool ____ok = (*(PTR) == *(EXP));				\
+	if (____ok)							\
+		*(PTR) = (NEW);						\
+	else								\
+		*(EXP) = *(PTR);					\
+	____ok;								\
+})
+#else
+#define mt_atomic(TYPE)		_Atomic(TYPE)
+#define mt_load(PTR)		atomic_load(PTR)
+#define mt_store(PTR, VAL)	atomic_store(PTR, VAL)
+#define mt_fetch_add(PTR, VAL)	atomic_fetch_add(PTR, VAL)
+#define mt_fetch_sub(PTR, VAL)	atomic_fetch_sub(PTR, VAL)
+#define mt_xchg(PTR, VAL)	atomic_exchange(PTR, VAL)
+#define mt_cmpxchg(PTR, EXP, NEW)					\
+	atomic_compare_exchange_weak(PTR, EXP, NEW)
+#endif /* #if defined(CONFIG_SINGLE_THREAD) */
+
 #endif /* #ifndef TEAVPN2__MUTEX_H */
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__PACE_H
+#define TEAVPN2__PACE_H
+
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <teavpn2/qos.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Egress pacing.
+ *
+ * Every peer has its own rate. Each datagram gets a departure time
+ * that is at least len / rate after the previous one of the same
+ * peer, so a burst is spread out instead of hitting a shallow
+ * buffer on the path all at once.
+ *
+ * TPACE_MODE_TXTIME hands the departure time to the kernel with an
+ * SCM_TXTIME control message, the fq qdisc holds the datagram until
+ * then. The times are CLOCK_MONOTONIC, which is what fq expects.
+ *
+ * TPACE_MODE_USER is used when the socket does not take SO_TXTIME.
+ * The datagram is copied to a per-thread queue and sent from a
+ * timerfd event when it is due.
+ *
+ * A peer that has more than TPACE_HORIZON_NS of data waiting is
+ * over its rate, the datagram is dropped like a full qdisc would.
+ */
+#define TPACE_MODE_OFF		0u
+#define TPACE_MODE_TXTIME	1u
+#define TPACE_MODE_USER		2u
+
+#define TPACE_HORIZON_NS	(100ull * 1000000ull)
+#define TPACE_SLACK_NS		(50ull * 1000ull)
+#define TPACE_QUEUE_NR		256u
+
+struct tpace {
+	/*
+	 * Departure time of the next datagram.
+	 */
+	mt_atomic(uint64_t)	next_ns;
+
+	/*
+	 * Current rate in kbit/s, 0 means the configured one.
+	 */
+	mt_atomic(uint32_t)	rate_kbps;
+};
+
+/*
+ * Userspace pacer queue entry, a binary min-heap on @t.
+ */
+struct tpace_ent {
+	uint64_t		t;
+	uint32_t		slot;
+};
+
+
+static __always_inline uint64_t tpace_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static inline void tpace_reset(struct tpace *p)
+{
+	mt_store(&p->next_ns, 0);
+	mt_store(&p->rate_kbps, 0);
+}
+
+
+/*
+ * Reserve the departure time of a @len byte datagram. Returns 0 if
+ * the datagram should be dropped.
+ */
+static inline uint64_t tpace_reserve(struct tpace *p, size_t len,
+				     uint64_t now, uint32_t def_kbps)
+{
+	uint64_t t, gap, next;
+	uint32_t kbps = mt_load(&p->rate_kbps);
+
+	if (!kbps)
+		kbps = def_kbps;
+
+	gap  = (uint64_t)len * 8000000ull / kbps;
+	next = mt_load(&p->next_ns);
+	do {
+		t = (next > now) ? next : now;
+		if (unlikely(t - now > TPACE_HORIZON_NS))
+			return 0;
+	} while (!mt_cmpxchg(&p->next_ns, &next, t + gap));
+
+	return t;
+}
+
+
+/*
+ * AIMD on the loss the peer reports: back off by 1/8 while it sees
+ * loss, otherwise probe back up to @max_kbps in 1/32 steps.
+ */
+static inline uint32_t tpace_adjust(struct tpace *p, bool lossy,
+				    uint32_t max_kbps)
+{
+	uint32_t kbps = mt_load(&p->rate_kbps);
+
+	if (!kbps)
+		kbps = max_kbps;
+
+	if (lossy) {
+		kbps -= kbps / 8u;
+		if (kbps < max_kbps / 16u)
+			kbps = max_kbps / 16u;
+	} else {
+		kbps += max_kbps / 32u;
+		if (kbps > max_kbps)
+			kbps = max_kbps;
+	}
+
+	if (unlikely(!kbps))
+		kbps = 1u;
+
+	mt_store(&p->rate_kbps, kbps);
+	return kbps;
+}
+
+
+/*
+ * Append an SCM_TXTIME control message to @msg, after the ones
+ * tqos_cmsg_fill() may have put in @cbuf.
+ */
+static inline void tpace_cmsg_add(struct msghdr *msg, union tqos_cmsg_buf *cbuf,
+				  uint64_t t)
+{
+	struct cmsghdr *cmsg;
+
+	if (!msg->msg_control) {
+		msg->msg_control    = cbuf->buf;
+		msg->msg_controllen = 0;
+	}
+
+	cmsg = (struct cmsghdr *)(cbuf->buf + msg->msg_controllen);
+	memset(cmsg, 0, CMSG_SPACE(sizeof(t)));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_TXTIME;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(t));
+	memcpy(CMSG_DATA(cmsg), &t, sizeof(t));
+	msg->msg_controllen += CMSG_SPACE(sizeof(t));
+}
+
+
+static inline int tpace_sock_setup(int fd)
+{
+	struct sock_txtime txt = {
+		.clockid = CLOCK_MONOTONIC,
+		.flags   = 0
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txt, sizeof(txt)))
+		return -errno;
+
+	return 0;
+}
+
+
+static inline void tpace_heap_push(struct tpace_ent *h, uint32_t *nr,
+				   uint64_t t, uint32_t slot)
+{
+	uint32_t i = (*nr)++, parent;
+
+	while (i > 0) {
+		parent = (i - 1u) / 2u;
+		if (h[parent].t <= t)
+			break;
+		h[i] = h[parent];
+		i = parent;
+	}
+
+	h[i].t    = t;
+	h[i].slot = slot;
+}
+
+
+static inline struct tpace_ent tpace_heap_pop(struct tpace_ent *h,
+					      uint32_t *nr)
+{
+	struct tpace_ent top = h[0], last = h[--(*nr)];
+	uint32_t i = 0, c, n = *nr;
+
+	while ((c = 2u * i + 1u) < n) {
+		if (c + 1u < n && h[c + 1u].t < h[c].t)
+			c++;
+		if (last.t <= h[c].t)
+			break;
+		h[i] = h[c];
+		i = c;
+	}
+
+	if (n)
+		h[i] = last;
+
+	return top;
+}
+
+#endif /* #ifndef TEAVPN2__PACE_H */
@@ -17,6 +17,11 @@
 #define TCLI_PKT_SYNC			4u
 #define TCLI_PKT_CLOSE			5u
 #define TCLI_PKT_PING			6u
+#define TCLI_PKT_TUN_AGG		7u
+#define TCLI_PKT_FEC_DATA		8u
+#define TCLI_PKT_FEC_PARITY		9u
+#define TCLI_PKT_FEC_REPORT		10u
+#define TCLI_PKT_HANDSHAKE_AUTH		11u
 
 
 #define TSRV_PKT_HANDSHAKE		0u
@@ -27,6 +32,10 @@
 #define TSRV_PKT_CLOSE			5u
 #define TSRV_PKT_HANDSHAKE_REJECT	6u
 #define TSRV_PKT_AUTH_REJECT		7u
+#define TSRV_PKT_TUN_AGG		8u
+#define TSRV_PKT_FEC_DATA		9u
+#define TSRV_PKT_FEC_PARITY		10u
+#define TSRV_PKT_FEC_REPORT		11u
 
 
 
@@ -40,6 +49,25 @@
 		      "Bad " __stringify(offsetof(TYPE, MEM) == (EQU)))
 
 
+/*
+ * Packet payload sizes.
+ *
+ * The packet structs below are declared with the largest payload
+ * that fits in one UDP datagram over IPv4 (65507 bytes) next to the
+ * packet header and a struct pkt_lb_hdr. Only their header part is
+ * ever sized by the compiler: the buffers are allocated for the MTU
+ * in use, tpkt_data_size() bytes of payload each (TPKT_BUF_SIZE()
+ * for a struct sc_pkt), and never less than TPKT_DATA_DEF.
+ *
+ * TPKT_DATA_ROOM is what a packet may carry beyond an inner packet
+ * of MTU bytes: the FEC header and length prefix, and the padding.
+ */
+#define TPKT_DATA_DEF			4096u
+#define TPKT_DATA_MAX			65488u
+#define TPKT_DATA_ROOM			512u
+#define TPKT_MTU_MAX			(TPKT_DATA_MAX - TPKT_DATA_ROOM)
+
+
 struct pkt_handshake {
 	struct teavpn2_version			cur;
 	struct teavpn2_version			min;
@@ -71,6 +99,20 @@ OFFSET_ASSERT(struct pkt_auth, password, 256);
 SIZE_ASSERT(struct pkt_auth, 512);
 
 
+/*
+ * Handshake and auth in one packet, the first thing a client sends.
+ * The server answers it with TSRV_PKT_AUTH_OK (or a reject) right
+ * away, there is no separate TSRV_PKT_HANDSHAKE.
+ */
+struct pkt_handshake_auth {
+	struct pkt_handshake			handshake;
+	struct pkt_auth				auth;
+};
+OFFSET_ASSERT(struct pkt_handshake_auth, handshake, 0);
+OFFSET_ASSERT(struct pkt_handshake_auth, auth, 96);
+SIZE_ASSERT(struct pkt_handshake_auth, 608);
+
+
 struct pkt_auth_res {
 	uint8_t					status;
 	struct if_info				iff;
@@ -83,11 +125,104 @@ SIZE_ASSERT(struct pkt_auth_res, 1 + 1 + sizeof(struct if_info));
 struct pkt_tun_data {
 	union {
 		struct iphdr			iphdr;
-		uint8_t				__raw[4096];
+		uint8_t				__raw[TPKT_DATA_MAX];
 	};
 };
 OFFSET_ASSERT(struct pkt_tun_data, __raw, 0);
-SIZE_ASSERT(struct pkt_tun_data, 4096);
+SIZE_ASSERT(struct pkt_tun_data, TPKT_DATA_MAX);
+
+
+/*
+ * Prepended to the payload of FEC_DATA and FEC_PARITY packets (see
+ * teavpn2/fec.h). For data, @idx is the shard index in @group and @k
+ * is not final yet. For parity, @idx is the parity row and @k is the
+ * number of data shards the group was closed with.
+ */
+struct pkt_fec_hdr {
+	uint16_t				group;
+	uint8_t					idx;
+	uint8_t					k;
+	uint8_t					m;
+	uint8_t					__pad[3];
+};
+OFFSET_ASSERT(struct pkt_fec_hdr, group, 0);
+OFFSET_ASSERT(struct pkt_fec_hdr, idx, 2);
+OFFSET_ASSERT(struct pkt_fec_hdr, k, 3);
+OFFSET_ASSERT(struct pkt_fec_hdr, m, 4);
+SIZE_ASSERT(struct pkt_fec_hdr, 8);
+
+
+/*
+ * Shard loss rate seen by the receiver, in FEC_LOSS_SCALE units.
+ */
+struct pkt_fec_report {
+	uint16_t				loss;
+	uint16_t				__pad;
+};
+OFFSET_ASSERT(struct pkt_fec_report, loss, 0);
+SIZE_ASSERT(struct pkt_fec_report, 4);
+
+
+/*
+ * Path probe, carried by REQSYNC and SYNC packets (see
+ * teavpn2/probe.h). All fields are in network byte order.
+ *
+ * @seq numbers the probes of the sender. @echo_seq and @echo_ns are
+ * @seq and @tx_ns of the last probe received from the peer, which
+ * was received @dwell_ns ago. @rx_cnt is the number of probes
+ * received from the peer so far.
+ *
+ * The nanosecond times are split into a high and a low 32-bit word,
+ * the packet unions are only 4-byte aligned.
+ */
+struct pkt_sync {
+	uint32_t				seq;
+	uint32_t				echo_seq;
+	uint32_t				rx_cnt;
+	uint32_t				__pad;
+	uint32_t				tx_ns[2];
+	uint32_t				echo_ns[2];
+	uint32_t				dwell_ns[2];
+};
+OFFSET_ASSERT(struct pkt_sync, seq, 0);
+OFFSET_ASSERT(struct pkt_sync, echo_seq, 4);
+OFFSET_ASSERT(struct pkt_sync, rx_cnt, 8);
+OFFSET_ASSERT(struct pkt_sync, tx_ns, 16);
+OFFSET_ASSERT(struct pkt_sync, echo_ns, 24);
+OFFSET_ASSERT(struct pkt_sync, dwell_ns, 32);
+SIZE_ASSERT(struct pkt_sync, 40);
+
+
+/*
+ * Session roaming (see teavpn2/roam.h). Both are carried in the
+ * padding of a packet: @pad_len bytes right after the @len bytes of
+ * payload, so a peer that does not know them skips them.
+ *
+ * The server gives the client its session index and key salt in the
+ * padding of TSRV_PKT_AUTH_OK. A roaming client then tags every
+ * packet with struct pkt_roam, @mac authenticates the header, the
+ * payload, @idx and @ctr.
+ */
+struct pkt_roam_key {
+	uint16_t				idx;
+	uint16_t				__pad;
+	uint32_t				salt[4];
+};
+OFFSET_ASSERT(struct pkt_roam_key, idx, 0);
+OFFSET_ASSERT(struct pkt_roam_key, salt, 4);
+SIZE_ASSERT(struct pkt_roam_key, 20);
+
+
+struct pkt_roam {
+	uint16_t				idx;
+	uint16_t				__pad;
+	uint32_t				ctr;
+	uint32_t				mac[2];
+};
+OFFSET_ASSERT(struct pkt_roam, idx, 0);
+OFFSET_ASSERT(struct pkt_roam, ctr, 4);
+OFFSET_ASSERT(struct pkt_roam, mac, 8);
+SIZE_ASSERT(struct pkt_roam, 16);
 
 
 /*
@@ -102,7 +237,9 @@ struct srv_pkt {
 		struct pkt_auth_res		auth_res;
 		struct pkt_tun_data		tun_data;
 		struct pkt_handshake_reject	hs_reject;
-		char				__raw[4096];
+		struct pkt_fec_report		fec_report;
+		struct pkt_sync			sync;
+		char				__raw[TPKT_DATA_MAX];
 	};
 };
 OFFSET_ASSERT(struct srv_pkt, type, 0);
@@ -111,7 +248,7 @@ OFFSET_ASSERT(struct srv_pkt, len, 2);
 OFFSET_ASSERT(struct srv_pkt, handshake, 4);
 OFFSET_ASSERT(struct srv_pkt, auth_res, 4);
 OFFSET_ASSERT(struct srv_pkt, __raw, 4);
-SIZE_ASSERT(struct srv_pkt, 2 + 1 + 1 + 4096);
+SIZE_ASSERT(struct srv_pkt, 2 + 1 + 1 + TPKT_DATA_MAX);
 
 
 /*
@@ -124,8 +261,11 @@ struct cli_pkt {
 	union {
 		struct pkt_handshake		handshake;
 		struct pkt_auth			auth;
+		struct pkt_handshake_auth	hs_auth;
 		struct pkt_tun_data		tun_data;
-		char				__raw[4096];
+		struct pkt_fec_report		fec_report;
+		struct pkt_sync			sync;
+		char				__raw[TPKT_DATA_MAX];
 	};
 };
 OFFSET_ASSERT(struct cli_pkt, type, 0);
@@ -133,7 +273,7 @@ OFFSET_ASSERT(struct cli_pkt, pad_len, 1);
 OFFSET_ASSERT(struct cli_pkt, len, 2);
 OFFSET_ASSERT(struct cli_pkt, handshake, 4);
 OFFSET_ASSERT(struct cli_pkt, __raw, 4);
-SIZE_ASSERT(struct cli_pkt, 2 + 1 + 1 + 4096);
+SIZE_ASSERT(struct cli_pkt, 2 + 1 + 1 + TPKT_DATA_MAX);
 
 
 struct sc_pkt {
@@ -148,7 +288,61 @@ struct sc_pkt {
 #define PKT_MIN_LEN (2 + 1 + 1)
 #define PKT_MAX_LEN (sizeof(struct cli_pkt))
 
+/*
+ * Bytes of a struct sc_pkt buffer with @DATA bytes of payload,
+ * rounded to a cache line so they can be laid out in arrays.
+ */
+#define TPKT_BUF_SIZE(DATA)						\
+	((offsetof(struct sc_pkt, __raw) + PKT_MIN_LEN + (size_t)(DATA) +	\
+	  63u) & ~(size_t)63u)
+
+
+/*
+ * Payload capacity of the packet buffers for @mtu.
+ */
+static inline size_t tpkt_data_size(uint16_t mtu)
+{
+	size_t n = ((size_t)mtu + TPKT_DATA_ROOM + 63u) & ~(size_t)63u;
+
+	if (n < TPKT_DATA_DEF)
+		return TPKT_DATA_DEF;
+	if (n > TPKT_DATA_MAX)
+		return TPKT_DATA_MAX;
+	return n;
+}
+
+
+/*
+ * Element @i of an array of packet buffers of @buf_size bytes each.
+ */
+static __always_inline struct sc_pkt *tpkt_at(struct sc_pkt *base, size_t i,
+					      size_t buf_size)
+{
+	return (struct sc_pkt *)((uint8_t *)base + i * buf_size);
+}
+
+/*
+ * Header prepended by the load balancer (teavpn2 lb) to every datagram
+ * it forwards, in both directions. The backend server keys the session
+ * by @addr and @port (the client address in network byte order), and
+ * sends the reply back to the load balancer with the same header.
+ */
+#define TLB_MAGIC			0x544c4231u /* "TLB1" */
+struct pkt_lb_hdr {
+	uint32_t				magic;
+	uint32_t				addr;
+	uint16_t				port;
+	uint16_t				__pad;
+};
+OFFSET_ASSERT(struct pkt_lb_hdr, magic, 0);
+OFFSET_ASSERT(struct pkt_lb_hdr, addr, 4);
+OFFSET_ASSERT(struct pkt_lb_hdr, port, 8);
+SIZE_ASSERT(struct pkt_lb_hdr, 12);
+
+
 static_assert(sizeof(struct cli_pkt) == sizeof(struct srv_pkt),
 	      "Fail to assert sizeof(struct cli_pkt) == sizeof(struct srv_pkt)");
+static_assert(PKT_MIN_LEN + TPKT_DATA_MAX + sizeof(struct pkt_lb_hdr) <= 65507u,
+	      "A packet must fit in one UDP datagram");
 
 #endif /* #ifndef TEAVPN2__PACKET_H */
@@ -0,0 +1,394 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <teavpn2/pool.h>
+#include <teavpn2/allocator.h>
+#include <teavpn2/common.h>
+
+
+static void tpool_bm_set(struct tpool *pool, uint32_t i)
+{
+	pool->l0[i >> 6u] |= 1ull << (i & 63u);
+	pool->l1[i >> 12u] |= 1ull << ((i >> 6u) & 63u);
+	pool->top |= 1ull << (i >> 12u);
+	pool->nr_free++;
+}
+
+
+static void tpool_bm_clear(struct tpool *pool, uint32_t i)
+{
+	pool->l0[i >> 6u] &= ~(1ull << (i & 63u));
+	if (!pool->l0[i >> 6u]) {
+		pool->l1[i >> 12u] &= ~(1ull << ((i >> 6u) & 63u));
+		if (!pool->l1[i >> 12u])
+			pool->top &= ~(1ull << (i >> 12u));
+	}
+	pool->nr_free--;
+}
+
+
+static uint32_t tpool_bm_first(const struct tpool *pool)
+{
+	uint32_t a, b, c;
+
+	if (!pool->top)
+		return TPOOL_NIL;
+
+	a = (uint32_t)__builtin_ctzll(pool->top);
+	b = (uint32_t)__builtin_ctzll(pool->l1[a]) + a * 64u;
+	c = (uint32_t)__builtin_ctzll(pool->l0[b]) + b * 64u;
+	return c;
+}
+
+
+static uint32_t tpool_hash(const struct tpool *pool, const char *user)
+{
+	uint32_t h = 0x811c9dc5u;
+
+	while (*user)
+		h = (h ^ (uint8_t)*user++) * 0x01000193u;
+
+	return h & pool->hmask;
+}
+
+
+static uint32_t tpool_lookup(const struct tpool *pool, const char *user)
+{
+	uint32_t i = pool->htab[tpool_hash(pool, user)];
+
+	while (i != TPOOL_NIL) {
+		if (!strcmp(pool->leases[i].user, user))
+			return i;
+		i = pool->leases[i].hnext;
+	}
+
+	return TPOOL_NIL;
+}
+
+
+static void tpool_unhash(struct tpool *pool, uint32_t i)
+{
+	uint32_t *p = &pool->htab[tpool_hash(pool, pool->leases[i].user)];
+
+	while (*p != i)
+		p = &pool->leases[*p].hnext;
+
+	*p = pool->leases[i].hnext;
+	pool->leases[i].hashed = false;
+}
+
+
+static void tpool_lru_del(struct tpool *pool, uint32_t i)
+{
+	struct tpool_lease *l = &pool->leases[i];
+
+	if (l->lru_prev != TPOOL_NIL)
+		pool->leases[l->lru_prev].lru_next = l->lru_next;
+	else
+		pool->lru_head = l->lru_next;
+
+	if (l->lru_next != TPOOL_NIL)
+		pool->leases[l->lru_next].lru_prev = l->lru_prev;
+	else
+		pool->lru_tail = l->lru_prev;
+
+	pool->nr_idle--;
+}
+
+
+static void tpool_lru_add(struct tpool *pool, uint32_t i)
+{
+	struct tpool_lease *l = &pool->leases[i];
+
+	l->lru_prev = pool->lru_tail;
+	l->lru_next = TPOOL_NIL;
+	if (pool->lru_tail != TPOOL_NIL)
+		pool->leases[pool->lru_tail].lru_next = i;
+	else
+		pool->lru_head = i;
+
+	pool->lru_tail = i;
+	pool->nr_idle++;
+}
+
+
+/*
+ * Forget the user of the idle lease @i, the address is neither free
+ * nor leased afterwards.
+ */
+static void tpool_evict(struct tpool *pool, uint32_t i)
+{
+	struct tpool_lease *l = &pool->leases[i];
+
+	tpool_lru_del(pool, i);
+	if (l->hashed)
+		tpool_unhash(pool, i);
+	free(l->user);
+	l->user  = NULL;
+	l->state = TPOOL_FREE;
+	pool->nr_evict++;
+}
+
+
+static int tpool_bind(struct tpool *pool, uint32_t i, const char *user)
+{
+	uint32_t h;
+	struct tpool_lease *l = &pool->leases[i];
+
+	l->user = strdup(user);
+	if (unlikely(!l->user))
+		return -ENOMEM;
+
+	h = tpool_hash(pool, user);
+	l->hnext     = pool->htab[h];
+	pool->htab[h] = i;
+	l->hashed    = true;
+	l->refcnt    = 1u;
+	l->state     = TPOOL_ACTIVE;
+	pool->nr_active++;
+	return 0;
+}
+
+
+static void tpool_activate(struct tpool *pool, uint32_t i)
+{
+	struct tpool_lease *l = &pool->leases[i];
+
+	if (l->state == TPOOL_IDLE) {
+		tpool_lru_del(pool, i);
+		l->state = TPOOL_ACTIVE;
+		pool->nr_active++;
+	}
+	l->refcnt++;
+}
+
+
+/*
+ * @want is a static address of @user inside the pool.
+ */
+static int tpool_claim(struct tpool *pool, const char *user, uint32_t want)
+{
+	int ret;
+	uint32_t old, i = want - pool->base;
+	struct tpool_lease *l = &pool->leases[i];
+
+	switch (l->state) {
+	case TPOOL_RESERVED:
+		return -EADDRINUSE;
+	case TPOOL_ACTIVE:
+		if (strcmp(l->user, user))
+			return -EADDRINUSE;
+		tpool_activate(pool, i);
+		return 0;
+	case TPOOL_IDLE:
+		if (!strcmp(l->user, user)) {
+			tpool_activate(pool, i);
+			return 0;
+		}
+		tpool_evict(pool, i);
+		break;
+	default:
+		tpool_bm_clear(pool, i);
+		break;
+	}
+
+	/*
+	 * The user may still hold another address from before it got
+	 * a static one. An idle one goes back to the pool, an active
+	 * one is only unhashed and goes when its session does.
+	 */
+	old = tpool_lookup(pool, user);
+	if (old != TPOOL_NIL) {
+		if (pool->leases[old].state == TPOOL_IDLE) {
+			tpool_evict(pool, old);
+			tpool_bm_set(pool, old);
+		} else {
+			tpool_unhash(pool, old);
+		}
+	}
+
+	ret = tpool_bind(pool, i, user);
+	if (unlikely(ret))
+		tpool_bm_set(pool, i);
+	return ret;
+}
+
+
+static int tpool_alloc(struct tpool *pool, const char *user, uint32_t *i_p)
+{
+	int ret;
+	uint32_t i;
+
+	i = tpool_lookup(pool, user);
+	if (i != TPOOL_NIL) {
+		tpool_activate(pool, i);
+		*i_p = i;
+		return 0;
+	}
+
+	i = tpool_bm_first(pool);
+	if (i != TPOOL_NIL) {
+		tpool_bm_clear(pool, i);
+	} else {
+		i = pool->lru_head;
+		if (i == TPOOL_NIL)
+			return -ENOSPC;
+		tpool_evict(pool, i);
+	}
+
+	ret = tpool_bind(pool, i, user);
+	if (unlikely(ret)) {
+		tpool_bm_set(pool, i);
+		return ret;
+	}
+
+	*i_p = i;
+	return 0;
+}
+
+
+/*
+ * Take an address for @user: @want (host byte order) if it is not 0,
+ * it must then be inside the pool, else the user's sticky lease or a
+ * new one. Every successful call is paired with a tpool_release().
+ */
+int tpool_acquire(struct tpool *pool, const char *user, uint32_t want,
+		  uint32_t *addr_p)
+{
+	int ret;
+	uint32_t i;
+
+	if (want && unlikely(!tpool_has(pool, want)))
+		return -EINVAL;
+
+	mutex_lock(&pool->lock);
+	if (want) {
+		ret = tpool_claim(pool, user, want);
+		i = want - pool->base;
+	} else {
+		ret = tpool_alloc(pool, user, &i);
+	}
+	mutex_unlock(&pool->lock);
+
+	if (likely(!ret))
+		*addr_p = pool->base + i;
+	return ret;
+}
+
+
+void tpool_release(struct tpool *pool, uint32_t addr)
+{
+	uint32_t i = addr - pool->base;
+	struct tpool_lease *l;
+
+	if (unlikely(!tpool_has(pool, addr)))
+		return;
+
+	mutex_lock(&pool->lock);
+	l = &pool->leases[i];
+	if (WARN_ON(l->state != TPOOL_ACTIVE || !l->refcnt))
+		goto out;
+
+	if (--l->refcnt)
+		goto out;
+
+	pool->nr_active--;
+	if (l->hashed) {
+		l->state = TPOOL_IDLE;
+		tpool_lru_add(pool, i);
+	} else {
+		free(l->user);
+		l->user  = NULL;
+		l->state = TPOOL_FREE;
+		tpool_bm_set(pool, i);
+	}
+out:
+	mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Keep @addr out of the pool (the server's own address).
+ */
+void tpool_reserve(struct tpool *pool, uint32_t addr)
+{
+	uint32_t i = addr - pool->base;
+
+	if (!tpool_has(pool, addr) || pool->leases[i].state != TPOOL_FREE)
+		return;
+
+	tpool_bm_clear(pool, i);
+	pool->leases[i].state = TPOOL_RESERVED;
+}
+
+
+/*
+ * The pool of the addresses @first..@last (host byte order), at most
+ * TPOOL_MAX of them. @last < @first makes an empty pool.
+ */
+int tpool_init(struct tpool *pool, uint32_t first, uint32_t last)
+{
+	int ret;
+	uint32_t i, nr, nr_hash = 16u;
+
+	memset(pool, 0, sizeof(*pool));
+	nr = (last >= first) ? last - first + 1u : 0u;
+	if (unlikely(nr > TPOOL_MAX || (last >= first && !nr)))
+		return -E2BIG;
+
+	while (nr_hash < nr)
+		nr_hash <<= 1u;
+
+	pool->base     = first;
+	pool->nr       = nr;
+	pool->hmask    = nr_hash - 1u;
+	pool->lru_head = TPOOL_NIL;
+	pool->lru_tail = TPOOL_NIL;
+	pool->l0       = al64_calloc(nr / 64u + 1u, sizeof(*pool->l0));
+	pool->htab     = al64_calloc(nr_hash, sizeof(*pool->htab));
+	pool->leases   = al64_calloc(nr + 1u, sizeof(*pool->leases));
+	if (unlikely(!pool->l0 || !pool->htab || !pool->leases)) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	ret = mutex_init(&pool->lock, NULL);
+	if (unlikely(ret))
+		goto out_free;
+
+	memset(pool->htab, 0xff, nr_hash * sizeof(*pool->htab));
+	for (i = 0; i < nr; i++)
+		tpool_bm_set(pool, i);
+
+	return 0;
+
+out_free:
+	al64_free(pool->l0);
+	al64_free(pool->htab);
+	al64_free(pool->leases);
+	memset(pool, 0, sizeof(*pool));
+	return ret;
+}
+
+
+void tpool_destroy(struct tpool *pool)
+{
+	uint32_t i;
+
+	if (!pool->leases)
+		return;
+
+	for (i = 0; i < pool->nr; i++)
+		free(pool->leases[i].user);
+
+	mutex_destroy(&pool->lock);
+	al64_free(pool->l0);
+	al64_free(pool->htab);
+	al64_free(pool->leases);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__POOL_H
+#define TEAVPN2__POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Tunnel address pool.
+ *
+ * A user file without "ipv4 =" gets its tunnel address from the
+ * pool. The pool is a range of the [iface] subnet, an address is
+ * either free, reserved (the server's own), or leased to a username.
+ *
+ * Leases are sticky: when the last session of a user goes, the lease
+ * only becomes idle, the user gets the same address back on the next
+ * auth. Idle leases are taken back, oldest first, only when there is
+ * no free address left.
+ *
+ * Every operation is O(1): the free addresses are a three level
+ * bitmap (a set bit in a summary word means the word below it has a
+ * free address) searched with ctz, the leases of the usernames are in
+ * a hash table and the idle leases in an LRU list.
+ *
+ * The route map keys on the low 16 bits of the address, a pool holds
+ * at most TPOOL_MAX addresses.
+ */
+#define TPOOL_MAX		0x10000u
+#define TPOOL_NIL		0xffffffffu
+
+#define TPOOL_FREE		0u
+#define TPOOL_RESERVED		1u
+#define TPOOL_ACTIVE		2u
+#define TPOOL_IDLE		3u
+
+struct tpool_lease {
+	char			*user;
+	uint32_t		hnext;
+	uint32_t		lru_prev;
+	uint32_t		lru_next;
+	uint16_t		refcnt;
+	uint8_t			state;
+	bool			hashed;
+};
+
+struct tpool {
+	struct tmutex		lock;
+
+	/*
+	 * The addresses are @base..@base+@nr-1 (host byte order).
+	 */
+	uint32_t		base;
+	uint32_t		nr;
+
+	/*
+	 * Free address bitmap, @top has bit i set if @l1[i] is not
+	 * zero, @l1[i] has bit j set if @l0[i * 64 + j] is not zero.
+	 */
+	uint64_t		top;
+	uint64_t		l1[TPOOL_MAX / 64u / 64u];
+	uint64_t		*l0;
+
+	/*
+	 * Username hash, @htab[h] heads a chain through @hnext.
+	 */
+	uint32_t		*htab;
+	uint32_t		hmask;
+
+	/*
+	 * Idle leases, the oldest is at @lru_head.
+	 */
+	uint32_t		lru_head;
+	uint32_t		lru_tail;
+
+	uint32_t		nr_free;
+	uint32_t		nr_active;
+	uint32_t		nr_idle;
+	uint64_t		nr_evict;
+	struct tpool_lease	*leases;
+};
+
+extern int tpool_init(struct tpool *pool, uint32_t first, uint32_t last);
+extern void tpool_reserve(struct tpool *pool, uint32_t addr);
+extern int tpool_acquire(struct tpool *pool, const char *user, uint32_t want,
+			 uint32_t *addr_p);
+extern void tpool_release(struct tpool *pool, uint32_t addr);
+extern void tpool_destroy(struct tpool *pool);
+
+
+static __always_inline bool tpool_has(const struct tpool *pool, uint32_t addr)
+{
+	return addr - pool->base < pool->nr;
+}
+
+#endif /* #ifndef TEAVPN2__POOL_H */
@@ -5,9 +5,10 @@
 
 #include <stdarg.h>
 #include <teavpn2/print.h>
+#include <teavpn2/flight.h>
 #include <teavpn2/common.h>
 
-#if defined(__linux__)
+#if defined(__linux__) && !defined(CONFIG_SINGLE_THREAD)
 	#include <pthread.h>
 	static pthread_mutex_t get_time_lock = PTHREAD_MUTEX_INITIALIZER;
 	static pthread_mutex_t print_lock    = PTHREAD_MUTEX_INITIALIZER;
@@ -135,6 +136,12 @@ __panic(const char *file, int lineno, const char *fmt, ...)
 	/* TODO: Write real dump_stack() */
 	dump_stack();
 	#undef dump_stack
+#if !defined(__x86_64__)
+	/*
+	 * On x86-64 the BUG_ON() in panic() has printed them.
+	 */
+	tfr_dump_all("panic");
+#endif
 	puts("=======================================================");
 	fflush(stdout);
 	abort();
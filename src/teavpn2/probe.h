@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__PROBE_H
+#define TEAVPN2__PROBE_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <teavpn2/packet.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Path probing with REQSYNC/SYNC packets.
+ *
+ * The client sends a REQSYNC every probe interval, the server answers
+ * each one with a SYNC. Every probe carries its own sequence number
+ * and send time, and echoes the last probe received from the peer
+ * together with how long it was held before this one was sent. Both
+ * ends therefore get:
+ *
+ *   - RTT, from the echoed send time minus the hold time.
+ *   - One-way delay variation, from the peer's send time against our
+ *     receive time. The clocks are not synchronized, so only the
+ *     delay above the lowest one seen (queueing) is meaningful.
+ *   - Loss in each direction, per window of TPROBE_LOSS_WIN probes:
+ *     incoming from the gaps in the peer's sequence numbers, outgoing
+ *     from the peer's count of the probes it received.
+ *
+ * The times are CLOCK_REALTIME, the clock of the kernel RX stamps.
+ */
+#define TPROBE_LOSS_WIN		16u
+#define TPROBE_LOSS_SCALE	1024u
+
+struct tprobe {
+	/*
+	 * Our last probe, and the last one received from the peer.
+	 */
+	uint32_t		seq;
+	uint32_t		nr_rx;
+	uint32_t		rx_seq;
+	uint64_t		peer_tx_ns;
+	uint64_t		peer_rx_ns;
+
+	/*
+	 * Loss windows: sequence number and receive count at the
+	 * start of the window, for each direction.
+	 */
+	uint32_t		in_seq0;
+	uint32_t		in_rx0;
+	uint32_t		out_seq0;
+	uint32_t		out_rx0;
+
+	/*
+	 * Loss of the last window, in TPROBE_LOSS_SCALE units.
+	 */
+	uint16_t		in_loss;
+	uint16_t		out_loss;
+
+	/*
+	 * RTT: smoothed (7/8), minimum, last and the mean deviation
+	 * between consecutive samples (1/16, as RFC 3550 jitter).
+	 */
+	uint64_t		nr_rtt;
+	uint64_t		srtt_ns;
+	uint64_t		rtt_min_ns;
+	uint64_t		rtt_jit_ns;
+	uint64_t		last_rtt_ns;
+
+	/*
+	 * One-way delay, offset by the clock difference: the lowest
+	 * one seen, the last one and the RFC 3550 jitter.
+	 */
+	int64_t			owd_min_ns;
+	int64_t			owd_last_ns;
+	uint64_t		owd_jit_ns;
+};
+
+
+static __always_inline uint64_t tprobe_absdiff(uint64_t a, uint64_t b)
+{
+	return (a > b) ? (a - b) : (b - a);
+}
+
+
+static inline uint16_t tprobe_loss(uint32_t expected, uint32_t got)
+{
+	if (got >= expected)
+		return 0;
+
+	return (uint16_t)((uint64_t)(expected - got) * TPROBE_LOSS_SCALE /
+			  expected);
+}
+
+
+static __always_inline void tprobe_put_ns(uint32_t dst[2], uint64_t ns)
+{
+	dst[0] = htonl((uint32_t)(ns >> 32u));
+	dst[1] = htonl((uint32_t)ns);
+}
+
+
+static __always_inline uint64_t tprobe_get_ns(const uint32_t src[2])
+{
+	return ((uint64_t)ntohl(src[0]) << 32u) | (uint64_t)ntohl(src[1]);
+}
+
+
+/*
+ * Queueing delay in the direction peer -> us, in nanoseconds.
+ */
+static __always_inline uint64_t tprobe_owd_queue(const struct tprobe *p)
+{
+	return (uint64_t)(p->owd_last_ns - p->owd_min_ns);
+}
+
+
+/*
+ * Build a probe packet of @type in @buf, returns its length. @now is
+ * the current tts_now_ns().
+ */
+static inline size_t tprobe_pkt(uint8_t buf[PKT_MIN_LEN + sizeof(struct pkt_sync)],
+				uint8_t type, struct tprobe *p, uint64_t now)
+{
+	uint64_t dwell = 0;
+	uint16_t n = htons((uint16_t)sizeof(struct pkt_sync));
+	struct pkt_sync sync = {
+		.seq      = htonl(++p->seq),
+		.echo_seq = htonl(p->rx_seq),
+		.rx_cnt   = htonl(p->nr_rx),
+		.__pad    = 0
+	};
+
+	if (p->peer_rx_ns && now > p->peer_rx_ns)
+		dwell = now - p->peer_rx_ns;
+
+	tprobe_put_ns(sync.tx_ns, now);
+	tprobe_put_ns(sync.echo_ns, p->peer_tx_ns);
+	tprobe_put_ns(sync.dwell_ns, dwell);
+
+	buf[0] = type;
+	buf[1] = 0;
+	memcpy(&buf[2], &n, sizeof(n));
+	memcpy(&buf[PKT_MIN_LEN], &sync, sizeof(sync));
+	return PKT_MIN_LEN + sizeof(sync);
+}
+
+
+static inline void tprobe_rtt_add(struct tprobe *p, uint64_t rtt)
+{
+	if (!p->nr_rtt++) {
+		p->srtt_ns    = rtt;
+		p->rtt_min_ns = rtt;
+		p->rtt_jit_ns = 0;
+	} else {
+		p->srtt_ns = p->srtt_ns - p->srtt_ns / 8u + rtt / 8u;
+		p->rtt_jit_ns = p->rtt_jit_ns - p->rtt_jit_ns / 16u +
+				tprobe_absdiff(rtt, p->last_rtt_ns) / 16u;
+		if (rtt < p->rtt_min_ns)
+			p->rtt_min_ns = rtt;
+	}
+	p->last_rtt_ns = rtt;
+}
+
+
+static inline void tprobe_owd_add(struct tprobe *p, int64_t owd)
+{
+	if (p->nr_rx == 1u) {
+		p->owd_min_ns  = owd;
+		p->owd_jit_ns  = 0;
+	} else {
+		p->owd_jit_ns = p->owd_jit_ns - p->owd_jit_ns / 16u +
+				tprobe_absdiff((uint64_t)owd,
+					       (uint64_t)p->owd_last_ns) / 16u;
+		if (owd < p->owd_min_ns)
+			p->owd_min_ns = owd;
+	}
+	p->owd_last_ns = owd;
+}
+
+
+/*
+ * Account a probe @len bytes long received at @rx_ns (the kernel RX
+ * stamp, or tts_now_ns() if there is none). Returns -EBADMSG if it is
+ * truncated.
+ */
+static inline int tprobe_rx(struct tprobe *p, const struct pkt_sync *sync,
+			    size_t len, uint64_t rx_ns)
+{
+	uint32_t seq, echo_seq, rx_cnt;
+	uint64_t tx_ns, echo_ns, dwell_ns;
+
+	if (unlikely(len < sizeof(*sync)))
+		return -EBADMSG;
+
+	seq      = ntohl(sync->seq);
+	echo_seq = ntohl(sync->echo_seq);
+	rx_cnt   = ntohl(sync->rx_cnt);
+	tx_ns    = tprobe_get_ns(sync->tx_ns);
+	echo_ns  = tprobe_get_ns(sync->echo_ns);
+	dwell_ns = tprobe_get_ns(sync->dwell_ns);
+
+	if (!p->nr_rx++) {
+		p->in_seq0 = seq - 1u;
+		p->in_rx0  = 0;
+	} else if ((int32_t)(seq - p->rx_seq) <= 0) {
+		/*
+		 * Reordered or duplicated, it only counts as received.
+		 */
+		return 0;
+	}
+
+	p->rx_seq     = seq;
+	p->peer_tx_ns = tx_ns;
+	p->peer_rx_ns = rx_ns;
+	tprobe_owd_add(p, (int64_t)(rx_ns - tx_ns));
+
+	if (seq - p->in_seq0 >= TPROBE_LOSS_WIN) {
+		p->in_loss = tprobe_loss(seq - p->in_seq0, p->nr_rx - p->in_rx0);
+		p->in_seq0 = seq;
+		p->in_rx0  = p->nr_rx;
+	}
+
+	if (!echo_seq || !echo_ns)
+		return 0;
+
+	if (echo_ns + dwell_ns < rx_ns)
+		tprobe_rtt_add(p, rx_ns - echo_ns - dwell_ns);
+
+	if (!p->out_seq0 && !p->out_rx0) {
+		p->out_seq0 = echo_seq;
+		p->out_rx0  = rx_cnt;
+	} else if (echo_seq - p->out_seq0 >= TPROBE_LOSS_WIN) {
+		p->out_loss = tprobe_loss(echo_seq - p->out_seq0,
+					  rx_cnt - p->out_rx0);
+		p->out_seq0 = echo_seq;
+		p->out_rx0  = rx_cnt;
+	}
+
+	return 0;
+}
+
+#endif /* #ifndef TEAVPN2__PROBE_H */
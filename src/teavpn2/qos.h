@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * DSCP based priority classes for the tunnel datapath.
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__QOS_H
+#define TEAVPN2__QOS_H
+
+#include <stdint.h>
+#include <linux/ip.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Maximum number of inner packets drained from a TUN fd per event.
+ * The drained packets are dispatched in strict priority order, so
+ * voice and interactive packets never wait behind bulk packets that
+ * were read in the same batch.
+ */
+#define TQOS_BATCH		16u
+
+
+/*
+ * Priority classes. Lower value is dispatched first.
+ */
+#define TQOS_CLASS_VOICE	0u
+#define TQOS_CLASS_INTERACTIVE	1u
+#define TQOS_CLASS_BULK		2u
+#define TQOS_NR_CLASS		3u
+
+
+/*
+ * Per packet marking for the outer datagram.
+ *
+ * @tos is the IP_TOS value (DSCP << 2).
+ * @prio is the SO_PRIORITY value (skb->priority).
+ */
+struct tqos_mark {
+	int					tos;
+	uint32_t				prio;
+};
+
+
+struct tqos_queue {
+	uint8_t					nr[TQOS_NR_CLASS];
+	uint8_t					idx[TQOS_NR_CLASS][TQOS_BATCH];
+};
+
+
+/*
+ * Room for IP_TOS and SO_PRIORITY, plus SCM_TXTIME (teavpn2/pace.h)
+ * and SO_TIMESTAMPING (teavpn2/tstamp.h).
+ */
+union tqos_cmsg_buf {
+	char					buf[CMSG_SPACE(sizeof(int)) +
+						    CMSG_SPACE(sizeof(uint32_t)) +
+						    CMSG_SPACE(sizeof(uint64_t)) +
+						    CMSG_SPACE(sizeof(uint32_t))];
+	struct cmsghdr				__align;
+};
+
+
+/*
+ * Map DSCP to priority class (RFC 4594 service classes).
+ */
+static __always_inline uint8_t tqos_dscp_class(uint8_t dscp)
+{
+	switch (dscp) {
+	case 46: /* EF (telephony) */
+	case 44: /* VOICE-ADMIT */
+	case 48: /* CS6 (network control) */
+	case 56: /* CS7 */
+		return TQOS_CLASS_VOICE;
+	case 40: /* CS5 (signaling) */
+	case 32: /* CS4 (real-time interactive) */
+	case 34: /* AF41 (multimedia conferencing) */
+	case 36: /* AF42 */
+	case 38: /* AF43 */
+	case 24: /* CS3 (broadcast video) */
+	case 26: /* AF31 (multimedia streaming) */
+	case 28: /* AF32 */
+	case 30: /* AF33 */
+	case 16: /* CS2 (OAM) */
+	case 18: /* AF21 (low-latency data) */
+	case 20: /* AF22 */
+	case 22: /* AF23 */
+		return TQOS_CLASS_INTERACTIVE;
+	default:
+		/* BE, AF1x (high-throughput data) and CS1 (scavenger). */
+		return TQOS_CLASS_BULK;
+	}
+}
+
+
+static __always_inline uint32_t tqos_class_prio(uint8_t cls, uint8_t dscp)
+{
+	switch (cls) {
+	case TQOS_CLASS_VOICE:
+		return TC_PRIO_INTERACTIVE;
+	case TQOS_CLASS_INTERACTIVE:
+		return TC_PRIO_INTERACTIVE_BULK;
+	default:
+		return (dscp == 8) ? TC_PRIO_BULK : TC_PRIO_BESTEFFORT;
+	}
+}
+
+
+/*
+ * Classify an inner packet by its DSCP, and fill @mark for the outer
+ * datagram. The outer DSCP is copied from the inner packet (uniform
+ * model, RFC 2983), the ECN bits are not copied.
+ *
+ * Returns the priority class.
+ */
+static __always_inline uint8_t tqos_classify(const void *pkt, size_t len,
+					     struct tqos_mark *mark)
+{
+	uint8_t cls, dscp = 0;
+	const uint8_t *b = (const uint8_t *)pkt;
+
+	if (likely(len >= sizeof(struct iphdr) && (b[0] >> 4u) == 4u)) {
+		dscp = (uint8_t)(((const struct iphdr *)pkt)->tos >> 2u);
+	} else if (len >= 2 && (b[0] >> 4u) == 6u) {
+		/* IPv6 traffic class spans the first two bytes. */
+		dscp = (uint8_t)(((b[0] & 0x0fu) << 2u) | (b[1] >> 6u));
+	}
+
+	cls = tqos_dscp_class(dscp);
+	mark->tos  = (int)(dscp << 2u);
+	mark->prio = tqos_class_prio(cls, dscp);
+	return cls;
+}
+
+
+static __always_inline void tqos_queue_reset(struct tqos_queue *q)
+{
+	memset(q->nr, 0, sizeof(q->nr));
+}
+
+
+static __always_inline void tqos_enqueue(struct tqos_queue *q, uint8_t cls,
+					 uint8_t idx)
+{
+	q->idx[cls][q->nr[cls]++] = idx;
+}
+
+
+/*
+ * Attach IP_TOS (and SO_PRIORITY if @with_prio) control messages
+ * to @msg. Older kernels reject SO_PRIORITY as a cmsg with EINVAL,
+ * the caller is responsible to retry without it.
+ */
+static inline void tqos_cmsg_fill(struct msghdr *msg, union tqos_cmsg_buf *cbuf,
+				  const struct tqos_mark *mark, bool with_prio)
+{
+	struct cmsghdr *cmsg;
+
+	memset(cbuf, 0, sizeof(*cbuf));
+	msg->msg_control    = cbuf->buf;
+	msg->msg_controllen = sizeof(cbuf->buf);
+
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type  = IP_TOS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mark->tos, sizeof(int));
+
+	if (!with_prio) {
+		msg->msg_controllen = CMSG_SPACE(sizeof(int));
+		return;
+	}
+
+	cmsg = CMSG_NXTHDR(msg, cmsg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SO_PRIORITY;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(uint32_t));
+	memcpy(CMSG_DATA(cmsg), &mark->prio, sizeof(uint32_t));
+	msg->msg_controllen = CMSG_SPACE(sizeof(int)) +
+			      CMSG_SPACE(sizeof(uint32_t));
+}
+
+
+#endif /* #ifndef TEAVPN2__QOS_H */
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__ROAM_H
+#define TEAVPN2__ROAM_H
+
+#include <errno.h>
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <teavpn2/packet.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Session roaming.
+ *
+ * The server keys its sessions by the client address. When the NAT
+ * in front of a client rebinds it, the next packet comes from an
+ * address the server has never seen. Without a way to recognize
+ * it, that packet would start a brand-new session.
+ *
+ * After a successful auth the server hands the client a session
+ * index and a random 128-bit salt, both sides derive the key from
+ * the salt and the user's password. A roaming client tags every packet
+ * with the index, a counter that only goes up, and a SipHash-2-4 MAC
+ * of the whole packet: header, payload, index and counter. When a
+ * tagged packet arrives from an unknown address, and its tag
+ * verifies with a counter above the highest one seen on that
+ * session, the session is moved to the new address and the packet is
+ * handled as usual. A replayed (or late) packet of the old address
+ * carries an old counter and cannot move it back, and a tag cut off
+ * one packet does not verify on any other payload.
+ *
+ * The key itself never travels. Whoever saw the auth packet knows
+ * the password anyway, anybody else only gets the salt.
+ */
+
+struct troam {
+	uint64_t		key[2];
+	uint64_t		salt[2];
+};
+
+
+static __always_inline uint64_t troam_rotl(uint64_t x, unsigned b)
+{
+	return (x << b) | (x >> (64u - b));
+}
+
+
+#define TROAM_SIPROUND(V0, V1, V2, V3)				\
+do {								\
+	V0 += V1; V1 = troam_rotl(V1, 13); V1 ^= V0;		\
+	V0 = troam_rotl(V0, 32);				\
+	V2 += V3; V3 = troam_rotl(V3, 16); V3 ^= V2;		\
+	V0 += V3; V3 = troam_rotl(V3, 21); V3 ^= V0;		\
+	V2 += V1; V1 = troam_rotl(V1, 17); V1 ^= V2;		\
+	V2 = troam_rotl(V2, 32);				\
+} while (0)
+
+
+/*
+ * Incremental SipHash-2-4, the message may come in pieces.
+ */
+struct troam_sip {
+	uint64_t		v0;
+	uint64_t		v1;
+	uint64_t		v2;
+	uint64_t		v3;
+	uint64_t		tail;
+	size_t			len;
+};
+
+
+static __always_inline void troam_sip_init(const struct troam *r,
+					   struct troam_sip *s)
+{
+	s->v0   = r->key[0] ^ 0x736f6d6570736575ull;
+	s->v1   = r->key[1] ^ 0x646f72616e646f6dull;
+	s->v2   = r->key[0] ^ 0x6c7967656e657261ull;
+	s->v3   = r->key[1] ^ 0x7465646279746573ull;
+	s->tail = 0;
+	s->len  = 0;
+}
+
+
+static __always_inline void troam_sip_block(struct troam_sip *s, uint64_t m)
+{
+	s->v3 ^= m;
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	s->v0 ^= m;
+}
+
+
+static inline void troam_sip_update(struct troam_sip *s, const void *buf,
+				    size_t n)
+{
+	uint64_t m;
+	const uint8_t *p = buf;
+
+	for (; n && (s->len & 7u); n--) {
+		s->tail |= (uint64_t)*p++ << (8u * (s->len++ & 7u));
+		if (!(s->len & 7u)) {
+			troam_sip_block(s, s->tail);
+			s->tail = 0;
+		}
+	}
+
+	for (; n >= 8u; n -= 8u, p += 8u, s->len += 8u) {
+		memcpy(&m, p, sizeof(m));
+		troam_sip_block(s, le64toh(m));
+	}
+
+	for (; n; n--)
+		s->tail |= (uint64_t)*p++ << (8u * (s->len++ & 7u));
+}
+
+
+static inline uint64_t troam_sip_final(struct troam_sip *s)
+{
+	troam_sip_block(s, s->tail | ((uint64_t)s->len << 56u));
+	s->v2 ^= 0xffu;
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	TROAM_SIPROUND(s->v0, s->v1, s->v2, s->v3);
+	return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+
+/*
+ * key[i] = SipHash-2-4(salt, i || password), the password as it is
+ * carried in struct pkt_auth.
+ */
+static inline void troam_key_derive(struct troam *r, const char *password)
+{
+	uint8_t i;
+	struct troam_sip s;
+	struct troam k = { .key = { r->salt[0], r->salt[1] } };
+	size_t len = strnlen(password, sizeof(((struct pkt_auth *)0)->password)
+				       - 1u);
+
+	for (i = 0; i < 2u; i++) {
+		troam_sip_init(&k, &s);
+		troam_sip_update(&s, &i, sizeof(i));
+		troam_sip_update(&s, password, len);
+		r->key[i] = troam_sip_final(&s);
+	}
+}
+
+
+/*
+ * A new salt, and the key of @password under it.
+ */
+static inline int troam_keygen(struct troam *r, const char *password)
+{
+	if (getrandom(r->salt, sizeof(r->salt), 0) != (ssize_t)sizeof(r->salt))
+		return -errno;
+
+	troam_key_derive(r, password);
+	return 0;
+}
+
+
+static __always_inline bool troam_has_salt(const struct troam *r)
+{
+	return r->salt[0] || r->salt[1];
+}
+
+
+static inline void troam_key_export(const struct troam *r, uint16_t idx,
+				    struct pkt_roam_key *out)
+{
+	out->idx     = htons(idx);
+	out->__pad   = 0;
+	out->salt[0] = htonl((uint32_t)(r->salt[0] >> 32u));
+	out->salt[1] = htonl((uint32_t)r->salt[0]);
+	out->salt[2] = htonl((uint32_t)(r->salt[1] >> 32u));
+	out->salt[3] = htonl((uint32_t)r->salt[1]);
+}
+
+
+static inline uint16_t troam_key_import(struct troam *r,
+					const struct pkt_roam_key *in,
+					const char *password)
+{
+	r->salt[0] = ((uint64_t)ntohl(in->salt[0]) << 32u) | ntohl(in->salt[1]);
+	r->salt[1] = ((uint64_t)ntohl(in->salt[2]) << 32u) | ntohl(in->salt[3]);
+	troam_key_derive(r, password);
+	return ntohs(in->idx);
+}
+
+
+/*
+ * Tag the packet in @iov (header and payload, @pad_len already set
+ * to the size of the tag) with @idx and @ctr.
+ */
+static inline void troam_tag(const struct troam *r, uint16_t idx, uint32_t ctr,
+			     const struct iovec *iov, int iovcnt,
+			     struct pkt_roam *tag)
+{
+	int i;
+	uint64_t mac;
+	struct troam_sip s;
+
+	tag->idx   = htons(idx);
+	tag->__pad = 0;
+	tag->ctr   = htonl(ctr);
+
+	troam_sip_init(r, &s);
+	for (i = 0; i < iovcnt; i++)
+		troam_sip_update(&s, iov[i].iov_base, iov[i].iov_len);
+	troam_sip_update(&s, tag, offsetof(struct pkt_roam, mac));
+	mac = troam_sip_final(&s);
+
+	tag->mac[0] = htonl((uint32_t)(mac >> 32u));
+	tag->mac[1] = htonl((uint32_t)mac);
+}
+
+
+/*
+ * @pkt is a received packet that passed troam_pad(), @tag its tag.
+ */
+static inline bool troam_verify(const struct troam *r, const void *pkt,
+				const struct pkt_roam *tag)
+{
+	uint16_t n;
+	struct troam_sip s;
+	const uint8_t *p = pkt;
+	uint64_t mac = ((uint64_t)ntohl(tag->mac[0]) << 32u) |
+		       ntohl(tag->mac[1]);
+
+	memcpy(&n, p + 2, sizeof(n));
+	troam_sip_init(r, &s);
+	troam_sip_update(&s, p, PKT_MIN_LEN + (size_t)ntohs(n));
+	troam_sip_update(&s, tag, offsetof(struct pkt_roam, mac));
+	return troam_sip_final(&s) == mac;
+}
+
+
+/*
+ * @pkt is a received packet of @pkt_len bytes (struct cli_pkt or
+ * struct srv_pkt, the header is the same). If its padding is @size
+ * bytes long, copy it to @out (it is not aligned) and return true.
+ */
+static inline bool troam_pad(const void *pkt, size_t pkt_len, void *out,
+			     size_t size)
+{
+	uint16_t n;
+	const uint8_t *p = pkt;
+
+	if (pkt_len < PKT_MIN_LEN || p[1] != size)
+		return false;
+
+	memcpy(&n, p + 2, sizeof(n));
+	n = ntohs(n);
+	if (pkt_len < PKT_MIN_LEN + (size_t)n + size)
+		return false;
+
+	memcpy(out, p + PKT_MIN_LEN + n, size);
+	return true;
+}
+
+#endif /* #ifndef TEAVPN2__ROAM_H */
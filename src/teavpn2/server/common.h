@@ -13,19 +13,53 @@ struct srv_cfg_sys {
 	char			data_dir[128];
 	uint8_t			thread_num;
 	uint8_t			verbose_level;
+	bool			upgrade;
+	char			upgrade_sock[108];
+	bool			prefault;
+	bool			mlock;
+	bool			shared_nothing;
 };
 
 
+/*
+ * The most load balancers behind_lb takes datagrams from.
+ */
+#define SRV_MAX_LB		16u
+
 struct srv_cfg_sock {
 	bool			use_encryption;
+	bool			qos;
+	bool			behind_lb;
+	bool			aggregate;
+	bool			fec;
+	bool			timestamping;
+	bool			load_shedding;
+	bool			connected_sockets;
 	int			backlog;
 	sock_type		type;
 	char			bind_addr[64];
 	uint16_t		bind_port;
 	uint16_t		max_conn;
+	uint16_t		agg_size;
+	uint32_t		agg_latency_us;
+	uint8_t			fec_k;
+	uint8_t			fec_m_max;
+	uint32_t		pacing_rate;
+	uint32_t		rcvbuf_min;
+	uint32_t		rcvbuf_max;
+	uint32_t		sndbuf_min;
+	uint32_t		sndbuf_max;
+	char			pacing_mode[8];
 	char			event_loop[64];
 	char			ssl_cert[256];
 	char			ssl_priv_key[256];
+
+	/*
+	 * behind_lb: the addresses of the load balancers (network
+	 * byte order), datagrams from any other source are dropped.
+	 */
+	uint32_t		lb_addr[SRV_MAX_LB];
+	uint8_t			nr_lb_addr;
 };
 
 
@@ -33,6 +67,36 @@ struct srv_cfg_iface {
 	char			dev[IFACENAMESIZ];
 	uint16_t		mtu;
 	struct if_info		iff;
+	char			pool_start[IPV4_L];
+	char			pool_end[IPV4_L];
+};
+
+
+typedef enum _repl_role_t {
+	REPL_ROLE_NONE,
+	REPL_ROLE_ACTIVE,
+	REPL_ROLE_STANDBY
+} repl_role_t;
+
+
+/*
+ * The most standby addresses the active server takes.
+ */
+#define SRV_MAX_STANDBY		8u
+
+struct srv_cfg_repl {
+	repl_role_t		role;
+	char			peer_addr[64];
+	uint16_t		peer_port;
+	uint32_t		failover_timeout;
+
+	/*
+	 * Active role: the addresses a standby may connect from
+	 * (network byte order), any other connection is refused
+	 * before anything is sent to it.
+	 */
+	uint32_t		standby_addr[SRV_MAX_STANDBY];
+	uint8_t			nr_standby_addr;
 };
 
 
@@ -40,6 +104,7 @@ struct srv_cfg {
 	struct srv_cfg_sys	sys;
 	struct srv_cfg_sock	sock;
 	struct srv_cfg_iface	iface;
+	struct srv_cfg_repl	repl;
 };
 
 extern int teavpn2_server_udp_run(struct srv_cfg *cfg);
@@ -5,6 +5,7 @@
 
 #include <ctype.h>
 #include <getopt.h>
+#include <arpa/inet.h>
 #include <inih/inih.h>
 #include <teavpn2/server/common.h>
 
@@ -22,6 +23,10 @@ static const struct option long_options[] = {
 	{"config",      required_argument, 0, 'c'},
 	{"data-dir",    required_argument, 0, 'd'},
 	{"thread",      required_argument, 0, 't'},
+	{"upgrade",     no_argument,       0, 'U'},
+	{"prefault",    no_argument,       0, 'F'},
+	{"mlock",       no_argument,       0, 'L'},
+	{"shared-nothing", no_argument,    0, 'S'},
 
 	{"sock-type",   required_argument, 0, 's'},
 	{"bind-addr",   required_argument, 0, 'H'},
@@ -33,7 +38,7 @@ static const struct option long_options[] = {
 
 	{0, 0, 0, 0}
 };
-static const char short_opt[] = "hVv::c:d:t:s:H:P:B:ED:";
+static const char short_opt[] = "hVv::c:d:t:UFLSs:H:P:B:ED:";
 
 
 static void show_help(void)
@@ -46,6 +51,8 @@ static void show_help(void)
 
 static __maybe_unused void dump_server_cfg(struct srv_cfg *cfg)
 {
+	uint8_t i;
+
 	puts("=============================================");
 	puts("   Config dump   ");
 	puts("=============================================");
@@ -53,9 +60,42 @@ static __maybe_unused void dump_server_cfg(struct srv_cfg *cfg)
 	PR_CFG(cfg->sys.data_dir, "%s");
 	PR_CFG(cfg->sys.thread_num, "%hhu");
 	PR_CFG(cfg->sys.verbose_level, "%hhu");
+	printf("   cfg->sys.upgrade = %hhu\n", (uint8_t)cfg->sys.upgrade);
+	PR_CFG(cfg->sys.upgrade_sock, "%s");
+	printf("   cfg->sys.prefault = %hhu\n", (uint8_t)cfg->sys.prefault);
+	printf("   cfg->sys.mlock = %hhu\n", (uint8_t)cfg->sys.mlock);
+	printf("   cfg->sys.shared_nothing = %hhu\n",
+	       (uint8_t)cfg->sys.shared_nothing);
 	putchar('\n');
 	printf("   cfg->sock.use_encryption = %hhu\n",
 		(uint8_t)cfg->sock.use_encryption);
+	printf("   cfg->sock.qos = %hhu\n", (uint8_t)cfg->sock.qos);
+	printf("   cfg->sock.behind_lb = %hhu\n", (uint8_t)cfg->sock.behind_lb);
+	for (i = 0; i < cfg->sock.nr_lb_addr; i++) {
+		char lb_str[IPV4_L];
+
+		inet_ntop(AF_INET, &cfg->sock.lb_addr[i], lb_str,
+			  sizeof(lb_str));
+		printf("   cfg->sock.lb_addr[%hhu] = %s\n", i, lb_str);
+	}
+	printf("   cfg->sock.connected_sockets = %hhu\n",
+		(uint8_t)cfg->sock.connected_sockets);
+	printf("   cfg->sock.aggregate = %hhu\n", (uint8_t)cfg->sock.aggregate);
+	PR_CFG(cfg->sock.agg_size, "%hu");
+	PR_CFG(cfg->sock.agg_latency_us, "%u");
+	printf("   cfg->sock.fec = %hhu\n", (uint8_t)cfg->sock.fec);
+	PR_CFG(cfg->sock.fec_k, "%hhu");
+	PR_CFG(cfg->sock.fec_m_max, "%hhu");
+	PR_CFG(cfg->sock.pacing_rate, "%u");
+	PR_CFG(cfg->sock.pacing_mode, "%s");
+	printf("   cfg->sock.timestamping = %hhu\n",
+	       (uint8_t)cfg->sock.timestamping);
+	printf("   cfg->sock.load_shedding = %hhu\n",
+	       (uint8_t)cfg->sock.load_shedding);
+	PR_CFG(cfg->sock.rcvbuf_min, "%u");
+	PR_CFG(cfg->sock.rcvbuf_max, "%u");
+	PR_CFG(cfg->sock.sndbuf_min, "%u");
+	PR_CFG(cfg->sock.sndbuf_max, "%u");
 	printf("   cfg->sock.type = %s\n",
 		(cfg->sock.type == SOCK_TCP) ? "SOCK_TCP" :
 		((cfg->sock.type == SOCK_UDP) ? "SOCK_UDP" : "unknown"));
@@ -70,6 +110,22 @@ static __maybe_unused void dump_server_cfg(struct srv_cfg *cfg)
 	PR_CFG(cfg->iface.mtu, "%hu");
 	PR_CFG(cfg->iface.iff.ipv4, "%s");
 	PR_CFG(cfg->iface.iff.ipv4_netmask, "%s");
+	PR_CFG(cfg->iface.pool_start, "%s");
+	PR_CFG(cfg->iface.pool_end, "%s");
+	putchar('\n');
+	printf("   cfg->repl.role = %s\n",
+		(cfg->repl.role == REPL_ROLE_ACTIVE) ? "active" :
+		((cfg->repl.role == REPL_ROLE_STANDBY) ? "standby" : "none"));
+	PR_CFG(cfg->repl.peer_addr, "%s");
+	PR_CFG(cfg->repl.peer_port, "%hu");
+	PR_CFG(cfg->repl.failover_timeout, "%u");
+	for (i = 0; i < cfg->repl.nr_standby_addr; i++) {
+		char sb_str[IPV4_L];
+
+		inet_ntop(AF_INET, &cfg->repl.standby_addr[i], sb_str,
+			  sizeof(sb_str));
+		printf("   cfg->repl.standby_addr[%hhu] = %s\n", i, sb_str);
+	}
 	puts("=============================================");
 }
 
@@ -121,6 +177,19 @@ static int parse_argv(int argc, char *argv[], struct srv_cfg *cfg)
 			sys->thread_num = (uint8_t)tmp;
 			break;
 		}
+		case 'U':
+			sys->upgrade = true;
+			break;
+		case 'F':
+			sys->prefault = true;
+			break;
+		case 'L':
+			sys->prefault = true;
+			sys->mlock = true;
+			break;
+		case 'S':
+			sys->shared_nothing = true;
+			break;
 
 
 		/*
@@ -184,6 +253,17 @@ static int cfg_parse_section_sys(struct cfg_parse_ctx *ctx, const char *name,
 		cfg->sys.verbose_level = level;
 	} else if (!strcmp(name, "data_dir")) {
 		strncpy2(cfg->sys.data_dir, val, sizeof(cfg->sys.data_dir));
+	} else if (!strcmp(name, "upgrade_sock")) {
+		strncpy2(cfg->sys.upgrade_sock, val,
+			 sizeof(cfg->sys.upgrade_sock));
+	} else if (!strcmp(name, "prefault")) {
+		cfg->sys.prefault = atoi(val) ? true : false;
+	} else if (!strcmp(name, "mlock")) {
+		cfg->sys.mlock = atoi(val) ? true : false;
+		if (cfg->sys.mlock)
+			cfg->sys.prefault = true;
+	} else if (!strcmp(name, "shared_nothing")) {
+		cfg->sys.shared_nothing = atoi(val) ? true : false;
 	} else {
 		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
 			"sys", cfg->sys.cfg_file, lineno);
@@ -199,6 +279,60 @@ static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
 	struct srv_cfg *cfg = ctx->cfg;
 	if (!strcmp(name, "use_encryption")) {
 		cfg->sock.use_encryption = atoi(val) ? true : false;
+	} else if (!strcmp(name, "qos")) {
+		cfg->sock.qos = atoi(val) ? true : false;
+	} else if (!strcmp(name, "behind_lb")) {
+		cfg->sock.behind_lb = atoi(val) ? true : false;
+	} else if (!strcmp(name, "lb_addr")) {
+		/*
+		 * Each "lb_addr = addr" line adds a load balancer.
+		 */
+		struct in_addr in;
+
+		if (cfg->sock.nr_lb_addr >= SRV_MAX_LB) {
+			pr_err("Too many lb_addr (max %u) at %s:%d", SRV_MAX_LB,
+				cfg->sys.cfg_file, lineno);
+			return 0;
+		}
+
+		if (!inet_pton(AF_INET, val, &in)) {
+			pr_err("Invalid lb_addr \"%s\" at %s:%d", val,
+				cfg->sys.cfg_file, lineno);
+			return 0;
+		}
+
+		cfg->sock.lb_addr[cfg->sock.nr_lb_addr++] = in.s_addr;
+	} else if (!strcmp(name, "connected_sockets")) {
+		cfg->sock.connected_sockets = atoi(val) ? true : false;
+	} else if (!strcmp(name, "aggregate")) {
+		cfg->sock.aggregate = atoi(val) ? true : false;
+	} else if (!strcmp(name, "agg_size")) {
+		cfg->sock.agg_size = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "agg_latency_us")) {
+		cfg->sock.agg_latency_us = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "fec")) {
+		cfg->sock.fec = atoi(val) ? true : false;
+	} else if (!strcmp(name, "fec_k")) {
+		cfg->sock.fec_k = (uint8_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "fec_m_max")) {
+		cfg->sock.fec_m_max = (uint8_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "pacing_rate")) {
+		cfg->sock.pacing_rate = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "pacing_mode")) {
+		strncpy2(cfg->sock.pacing_mode, val,
+			 sizeof(cfg->sock.pacing_mode));
+	} else if (!strcmp(name, "timestamping")) {
+		cfg->sock.timestamping = atoi(val) ? true : false;
+	} else if (!strcmp(name, "load_shedding")) {
+		cfg->sock.load_shedding = atoi(val) ? true : false;
+	} else if (!strcmp(name, "rcvbuf_min")) {
+		cfg->sock.rcvbuf_min = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "rcvbuf_max")) {
+		cfg->sock.rcvbuf_max = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "sndbuf_min")) {
+		cfg->sock.sndbuf_min = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "sndbuf_max")) {
+		cfg->sock.sndbuf_max = (uint32_t)strtoul(val, NULL, 10);
 	} else if (!strcmp(name, "event_loop")) {
 		strncpy2(cfg->sock.event_loop, val, sizeof(cfg->sock.event_loop));
 	} else if (!strcmp(name, "sock_type")) {
@@ -257,6 +391,12 @@ static int cfg_parse_section_iface(struct cfg_parse_ctx *ctx, const char *name,
 	} else if (!strcmp(name, "ipv4_netmask")) {
 		strncpy2(cfg->iface.iff.ipv4_netmask, val, sizeof(cfg->iface.iff.ipv4_netmask));
 		cfg->iface.iff.ipv4_netmask[sizeof(cfg->iface.iff.ipv4_netmask) - 1] = '\0';
+	} else if (!strcmp(name, "pool_start")) {
+		strncpy2(cfg->iface.pool_start, val, sizeof(cfg->iface.pool_start));
+		cfg->iface.pool_start[sizeof(cfg->iface.pool_start) - 1] = '\0';
+	} else if (!strcmp(name, "pool_end")) {
+		strncpy2(cfg->iface.pool_end, val, sizeof(cfg->iface.pool_end));
+		cfg->iface.pool_end[sizeof(cfg->iface.pool_end) - 1] = '\0';
 	} else {
 		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
 			"iface", cfg->sys.cfg_file, lineno);
@@ -266,6 +406,57 @@ static int cfg_parse_section_iface(struct cfg_parse_ctx *ctx, const char *name,
 }
 
 
+static int cfg_parse_section_replication(struct cfg_parse_ctx *ctx,
+					 const char *name, const char *val,
+					 int lineno)
+{
+	struct srv_cfg *cfg = ctx->cfg;
+	if (!strcmp(name, "role")) {
+		if (!strcmp(val, "active")) {
+			cfg->repl.role = REPL_ROLE_ACTIVE;
+		} else if (!strcmp(val, "standby")) {
+			cfg->repl.role = REPL_ROLE_STANDBY;
+		} else if (!strcmp(val, "none")) {
+			cfg->repl.role = REPL_ROLE_NONE;
+		} else {
+			pr_err("Invalid replication role \"%s\" at %s:%d", val,
+				cfg->sys.cfg_file, lineno);
+			return 0;
+		}
+	} else if (!strcmp(name, "peer_addr")) {
+		strncpy2(cfg->repl.peer_addr, val, sizeof(cfg->repl.peer_addr));
+	} else if (!strcmp(name, "peer_port")) {
+		cfg->repl.peer_port = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "failover_timeout")) {
+		cfg->repl.failover_timeout = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "standby_addr")) {
+		/*
+		 * Each "standby_addr = addr" line allows a standby.
+		 */
+		struct in_addr in;
+
+		if (cfg->repl.nr_standby_addr >= SRV_MAX_STANDBY) {
+			pr_err("Too many standby_addr (max %u) at %s:%d",
+				SRV_MAX_STANDBY, cfg->sys.cfg_file, lineno);
+			return 0;
+		}
+
+		if (!inet_pton(AF_INET, val, &in)) {
+			pr_err("Invalid standby_addr \"%s\" at %s:%d", val,
+				cfg->sys.cfg_file, lineno);
+			return 0;
+		}
+
+		cfg->repl.standby_addr[cfg->repl.nr_standby_addr++] = in.s_addr;
+	} else {
+		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d", name,
+			"replication", cfg->sys.cfg_file, lineno);
+		return 0;
+	}
+	return 1;
+}
+
+
 /*
  * If success, returns 1.
  * If failure, returns 0.
@@ -282,6 +473,8 @@ static int server_cfg_parser(void *user, const char *section, const char *name,
 		return cfg_parse_section_socket(ctx, name, val, lineno);
 	} else if (!strcmp(section, "iface")) {
 		return cfg_parse_section_iface(ctx, name, val, lineno);
+	} else if (!strcmp(section, "replication")) {
+		return cfg_parse_section_replication(ctx, name, val, lineno);
 	}
 
 	pr_err("Unknown section \"%s\" in at %s:%d", section, cfg->sys.cfg_file,
@@ -334,6 +527,12 @@ int run_server(int argc, char *argv[])
 	if (ret)
 		return -ret;
 
+#if defined(CONFIG_SINGLE_THREAD)
+	if (cfg.sys.thread_num != 1) {
+		pr_warn("Single-threaded build, forcing thread num to 1");
+		cfg.sys.thread_num = 1;
+	}
+#endif
 
 #ifndef NDEBUG
 	dump_server_cfg(&cfg);
@@ -32,6 +32,14 @@ static void signal_intr_handler(int sig)
 }
 
 
+static void signal_stats_handler(int sig)
+{
+	if (likely(g_state))
+		g_state->dump_stats = true;
+	(void)sig;
+}
+
+
 static int alloc_tun_fds_array(struct srv_udp_state *state)
 {
 	int *tun_fds;
@@ -50,6 +58,106 @@ static int alloc_tun_fds_array(struct srv_udp_state *state)
 }
 
 
+static int alloc_udp_fds_array(struct srv_udp_state *state)
+{
+	int *udp_fds;
+	uint8_t i, nn;
+
+	nn      = state->cfg->sys.thread_num;
+	udp_fds = calloc_wrp(nn, sizeof(*udp_fds));
+	if (unlikely(!udp_fds))
+		return -errno;
+
+	for (i = 0; i < nn; i++)
+		udp_fds[i] = -1;
+
+	state->udp_fds = udp_fds;
+	return 0;
+}
+
+
+/*
+ * Shared-nothing mode keeps the sessions in per-thread maps that
+ * the upgrade handoff and the replication stream don't know about.
+ */
+static int check_shared_nothing(struct srv_cfg *cfg)
+{
+	if (!cfg->sys.shared_nothing)
+		return 0;
+
+	if (cfg->sys.upgrade || cfg->sys.upgrade_sock[0]) {
+		pr_err("shared_nothing cannot be used with upgrade");
+		return -EINVAL;
+	}
+
+	if (cfg->repl.role != REPL_ROLE_NONE) {
+		pr_err("shared_nothing cannot be used with replication");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+/*
+ * The per-session sockets are neither handed over on upgrade nor
+ * known to the standby, and only the epoll loop polls them. They
+ * also join the reuseport group, which would reshuffle the flows
+ * of the shared-nothing sockets every time a session comes or goes.
+ */
+static int check_connected_sockets(struct srv_udp_state *state)
+{
+	struct srv_cfg *cfg = state->cfg;
+
+	if (!cfg->sock.connected_sockets)
+		return 0;
+
+	if (cfg->sock.behind_lb) {
+		pr_err("connected_sockets cannot be used with behind_lb");
+		return -EINVAL;
+	}
+
+	if (cfg->sys.shared_nothing) {
+		pr_err("connected_sockets cannot be used with shared_nothing");
+		return -EINVAL;
+	}
+
+	if (cfg->sys.upgrade || cfg->sys.upgrade_sock[0]) {
+		pr_err("connected_sockets cannot be used with upgrade");
+		return -EINVAL;
+	}
+
+	if (cfg->repl.role != REPL_ROLE_NONE) {
+		pr_err("connected_sockets cannot be used with replication");
+		return -EINVAL;
+	}
+
+	if (state->evt_loop != EVTL_EPOLL) {
+		pr_err("connected_sockets needs the epoll event loop");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+static int check_behind_lb(struct srv_udp_state *state)
+{
+	const struct srv_cfg_sock *sock = &state->cfg->sock;
+
+	if (sock->behind_lb && !sock->nr_lb_addr) {
+		/*
+		 * Anybody could claim to be any client otherwise.
+		 */
+		pr_err("behind_lb needs the load balancer addresses "
+		       "([socket] lb_addr)");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
 static int select_event_loop(struct srv_udp_state *state)
 {
 	struct srv_cfg_sock *sock = &state->cfg->sock;
@@ -83,6 +191,33 @@ static int select_event_loop(struct srv_udp_state *state)
 }
 
 
+static int select_pacing_mode(struct srv_udp_state *state)
+{
+	struct srv_cfg_sock *sock = &state->cfg->sock;
+	const char *mode = sock->pacing_mode;
+
+	if (!sock->pacing_rate) {
+		state->pace_mode = TPACE_MODE_OFF;
+		return 0;
+	}
+
+	if ((mode[0] == '\0') || (!strcmp(mode, "txtime"))) {
+		state->pace_mode = TPACE_MODE_TXTIME;
+	} else if (!strcmp(mode, "user")) {
+		state->pace_mode = TPACE_MODE_USER;
+	} else {
+		pr_err("Invalid pacing mode: \"%s\"", mode);
+		return -EINVAL;
+	}
+
+	prl_notice(2, "Egress pacing: %u kbit/s per session (%s)",
+		   sock->pacing_rate,
+		   (state->pace_mode == TPACE_MODE_TXTIME) ? "SO_TXTIME" :
+							     "userspace");
+	return 0;
+}
+
+
 static int init_state(struct srv_udp_state *state)
 {
 	int ret;
@@ -90,17 +225,75 @@ static int init_state(struct srv_udp_state *state)
 	prl_notice(2, "Initializing server state...");
 
 	g_state       = state;
-	state->udp_fd = -1;
-	state->sig    = -1;
+	state->udp_fd      = -1;
+	state->sig         = -1;
+	state->upg_fd      = -1;
+	state->upg_cli_fd  = -1;
+	state->repl_fd     = -1;
+	state->repl_cli_fd = -1;
+
+	state->qos_cmsg_prio = state->cfg->sock.qos;
+
+	/*
+	 * The flow caches start zeroed, generation 0 never matches.
+	 */
+	mt_store(&state->flow_gen, 1u);
+
+	if (unlikely(state->cfg->iface.mtu > TPKT_MTU_MAX)) {
+		pr_err("MTU %hu is too big, the maximum is %u",
+		       state->cfg->iface.mtu, TPKT_MTU_MAX);
+		return -EINVAL;
+	}
+
+	state->pkt_data_size = tpkt_data_size(state->cfg->iface.mtu);
+	state->pkt_buf_size  = TPKT_BUF_SIZE(state->pkt_data_size);
+	prl_notice(2, "Packet buffers: %zu bytes of payload (MTU %hu)",
+		   state->pkt_data_size, state->cfg->iface.mtu);
+
+	if (state->cfg->sock.aggregate) {
+		tagg_fix_limits(&state->cfg->sock.agg_size,
+				&state->cfg->sock.agg_latency_us);
+		prl_notice(2, "Small-packet aggregation: up to %hu bytes, "
+			   "%u us latency bound", state->cfg->sock.agg_size,
+			   state->cfg->sock.agg_latency_us);
+	}
+
+	if (state->cfg->sock.fec) {
+		fec_fix_limits(&state->cfg->sock.fec_k,
+			       &state->cfg->sock.fec_m_max);
+		prl_notice(2, "FEC: %hhu data + up to %hhu parity packets (%s)",
+			   state->cfg->sock.fec_k, state->cfg->sock.fec_m_max,
+			   fec_init());
+	}
+
+	ret = select_pacing_mode(state);
+	if (unlikely(ret))
+		return ret;
+
+	ret = check_shared_nothing(state->cfg);
+	if (unlikely(ret))
+		return ret;
 
 	ret = alloc_tun_fds_array(state);
 	if (unlikely(ret))
 		return ret;
 
+	ret = alloc_udp_fds_array(state);
+	if (unlikely(ret))
+		return ret;
+
 	ret = select_event_loop(state);
 	if (unlikely(ret))
 		return ret;
 
+	ret = check_connected_sockets(state);
+	if (unlikely(ret))
+		return ret;
+
+	ret = check_behind_lb(state);
+	if (unlikely(ret))
+		return ret;
+
 	prl_notice(2, "Setting up signal interrupt handler...");
 	if (unlikely(signal(SIGINT, signal_intr_handler) == SIG_ERR))
 		goto sig_err;
@@ -110,6 +303,8 @@ static int init_state(struct srv_udp_state *state)
 		goto sig_err;
 	if (unlikely(signal(SIGPIPE, SIG_IGN) == SIG_ERR))
 		goto sig_err;
+	if (unlikely(signal(SIGUSR1, signal_stats_handler) == SIG_ERR))
+		goto sig_err;
 
 	prl_notice(2, "Server state is initialized successfully!");
 	return ret;
@@ -141,24 +336,10 @@ static int socket_setup(int udp_fd, struct srv_udp_state *state)
 	}
 
 
-	y = 1024 * 1024 * 200;
-	ret = setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUFFORCE, py, len);
-	if (unlikely(ret)) {
-		lv = "SOL_SOCKET";
-		on = "SO_RCVBUFFORCE";
-		goto out_err;
-	}
-
-
-	y = 1024 * 1024 * 50;
-	ret = setsockopt(udp_fd, SOL_SOCKET, SO_SNDBUFFORCE, py, len);
-	if (unlikely(ret)) {
-		lv = "SOL_SOCKET";
-		on = "SO_SNDBUFFORCE";
-		goto out_err;
-	}
-
-
+	/*
+	 * The buffer sizes are set (and tuned) by the thread that
+	 * owns the socket, see init_epoll_thread_array().
+	 */
 	y = 50000;
 	ret = setsockopt(udp_fd, SOL_SOCKET, SO_BUSY_POLL, py, len);
 	if (unlikely(ret)) {
@@ -168,10 +349,17 @@ static int socket_setup(int udp_fd, struct srv_udp_state *state)
 	}
 
 
-	/*
-	 * TODO: Use cfg to set some socket options.
-	 */
-	(void)cfg;
+	if (cfg->sock.timestamping) {
+		ret = tts_sock_setup(udp_fd);
+		if (unlikely(ret)) {
+			pr_warn("setsockopt(udp_fd, SOL_SOCKET, SO_TIMESTAMPING): "
+				PRERF, PREAR(-ret));
+			pr_warn("Kernel timestamping is disabled");
+			cfg->sock.timestamping = false;
+			ret = 0;
+		}
+	}
+
 	return ret;
 
 
@@ -182,7 +370,7 @@ out_err:
 }
 
 
-static int init_socket(struct srv_udp_state *state)
+static int open_udp_socket(struct srv_udp_state *state, bool reuseport)
 {
 	int ret;
 	int type;
@@ -213,6 +401,20 @@ static int init_socket(struct srv_udp_state *state)
 		goto out_err;
 
 
+	if (reuseport) {
+		int y = 1;
+
+		ret = setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT, &y,
+				 sizeof(y));
+		if (unlikely(ret)) {
+			ret = errno;
+			pr_err("setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT): "
+			       PRERF, PREAR(ret));
+			goto out_err;
+		}
+	}
+
+
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(sock->bind_port);
@@ -229,8 +431,7 @@ static int init_socket(struct srv_udp_state *state)
 	}
 
 
-	state->udp_fd = udp_fd;
-	return 0;
+	return udp_fd;
 
 
 out_err:
@@ -239,51 +440,218 @@ out_err:
 }
 
 
-static int init_iface(struct srv_udp_state *state)
+/*
+ * Open the connect()ed socket of a session (connected_sockets mode).
+ * It shares bind_addr:bind_port with the main socket, the kernel
+ * prefers it over the others for the datagrams coming from @peer.
+ */
+int srv_conn_sock_open(struct srv_udp_state *state,
+		       const struct sockaddr_in *peer)
 {
-	uint8_t i, nn;
-	int ret = 0, tun_fd, *tun_fds;
-	const char *dev = state->cfg->iface.dev;
-	short flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+	int y = 1;
+	int ret;
+	int udp_fd;
+	struct sockaddr_in addr;
+	struct srv_cfg_sock *sock = &state->cfg->sock;
 
+	udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (unlikely(udp_fd < 0)) {
+		ret = errno;
+		pr_err("socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0): "
+		       PRERF, PREAR(ret));
+		return -ret;
+	}
 
-	if (unlikely(!dev || !*dev)) {
-		pr_err("iface dev cannot be empty!");
-		return -EINVAL;
+	ret = socket_setup(udp_fd, state);
+	if (unlikely(ret)) {
+		ret = errno;
+		goto out_err;
 	}
 
+	ret = setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y));
+	if (unlikely(ret)) {
+		ret = errno;
+		pr_err("setsockopt(conn_fd, SOL_SOCKET, SO_REUSEPORT): " PRERF,
+		       PREAR(ret));
+		goto out_err;
+	}
 
-	prl_notice(2, "Initializing virtual network interface (%s)...", dev);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(sock->bind_port);
+	addr.sin_addr.s_addr = inet_addr(sock->bind_addr);
+	ret = bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("bind(conn_fd): " PRERF, PREAR(ret));
+		goto out_err;
+	}
+
+	ret = connect(udp_fd, (const struct sockaddr *)peer, sizeof(*peer));
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("connect(conn_fd): " PRERF, PREAR(ret));
+		goto out_err;
+	}
 
+	return udp_fd;
+
+out_err:
+	close(udp_fd);
+	return -ret;
+}
+
+
+static int init_socket(struct srv_udp_state *state)
+{
+	int ret;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	bool sn = state->cfg->sys.shared_nothing;
+
+	/*
+	 * The per-session sockets of connected_sockets join the
+	 * reuseport group of the main socket.
+	 */
+	ret = open_udp_socket(state, sn || state->cfg->sock.connected_sockets);
+	if (unlikely(ret < 0))
+		return ret;
+
+	state->udp_fd = ret;
+	if (!sn)
+		return 0;
+
+	/*
+	 * One socket per thread on the same port, the kernel
+	 * steers each client (4-tuple) to a single one of them.
+	 */
+	for (i = 1; i < nn; i++) {
+		ret = open_udp_socket(state, true);
+		if (unlikely(ret < 0))
+			return ret;
+
+		state->udp_fds[i] = ret;
+	}
+
+	return 0;
+}
+
+
+struct tun_alloc_work {
+	pthread_t	thread;
+	bool		spawned;
+	const char	*dev;
+	short		flags;
+	int		ret;
+};
+
+
+static void *tun_alloc_worker(void *arg)
+{
+	struct tun_alloc_work *w = arg;
+
+	w->ret = tun_alloc(w->dev, w->flags);
+	return NULL;
+}
+
+
+/*
+ * The first queue creates the device, the others only attach to
+ * it, so they are opened in parallel.
+ */
+static int alloc_tun_queues(struct srv_udp_state *state, const char *dev,
+			    short flags)
+{
+	int ret = 0, *tun_fds = state->tun_fds;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct tun_alloc_work work[0x100];
+
+	if (unlikely(!nn))
+		return -EINVAL;
+
+	for (i = 0; i < nn; i++) {
+		work[i].spawned = false;
+		work[i].dev     = dev;
+		work[i].flags   = flags;
+		work[i].ret     = -EAGAIN;
+	}
+
+	tun_alloc_worker(&work[0]);
+	if (likely(work[0].ret >= 0)) {
+		for (i = 1; i < nn; i++) {
+			if (!pthread_create(&work[i].thread, NULL,
+					    tun_alloc_worker, &work[i]))
+				work[i].spawned = true;
+			else
+				tun_alloc_worker(&work[i]);
+		}
+
+		for (i = 1; i < nn; i++) {
+			if (work[i].spawned)
+				pthread_join(work[i].thread, NULL);
+		}
+	}
 
-	tun_fds = state->tun_fds;
-	nn = state->cfg->sys.thread_num;
 	for (i = 0; i < nn; i++) {
-		prl_notice(4, "Initializing tun_fds[%hhu]...", i);
+		if (likely(work[i].ret >= 0)) {
+			tun_fds[i] = work[i].ret;
+			continue;
+		}
 
-		tun_fd = tun_alloc(dev, flags);
-		if (unlikely(tun_fd < 0)) {
+		if (!ret) {
 			pr_err("tun_alloc(\"%s\", %d): " PRERF, dev, flags,
-			       PREAR(-tun_fd));
-			ret = tun_fd;
-			goto err;
+			       PREAR(-work[i].ret));
+			ret = work[i].ret;
 		}
+	}
+
+	if (unlikely(ret))
+		goto err;
 
+	for (i = 0; i < nn; i++) {
 		if (state->evt_loop != EVTL_IO_URING) {
-			ret = fd_set_nonblock(tun_fd);
+			ret = fd_set_nonblock(tun_fds[i]);
 			if (unlikely(ret < 0)) {
-				pr_err("fd_set_nonblock(%d): " PRERF, tun_fd,
-				       PREAR(-ret));
-				close(tun_fd);
+				pr_err("fd_set_nonblock(%d): " PRERF,
+				       tun_fds[i], PREAR(-ret));
 				goto err;
 			}
 		}
 
-		tun_fds[i] = tun_fd;
 		prl_notice(4, "Successfully initialized tun_fds[%hhu] (fd=%d)",
-			   i, tun_fd);
+			   i, tun_fds[i]);
+	}
+
+	return 0;
+err:
+	for (i = 0; i < nn; i++) {
+		if (tun_fds[i] != -1) {
+			close(tun_fds[i]);
+			tun_fds[i] = -1;
+		}
+	}
+	return ret;
+}
+
+
+static int init_iface(struct srv_udp_state *state)
+{
+	int ret;
+	const char *dev = state->cfg->iface.dev;
+	short flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+
+
+	if (unlikely(!dev || !*dev)) {
+		pr_err("iface dev cannot be empty!");
+		return -EINVAL;
 	}
 
+
+	prl_notice(2, "Initializing virtual network interface (%s)...", dev);
+
+	ret = alloc_tun_queues(state, dev, flags);
+	if (unlikely(ret))
+		return ret;
+
 	if (unlikely(!teavpn_iface_up(&state->cfg->iface.iff))) {
 		pr_err("teavpn_iface_up(): cannot bring up network interface");
 		return -ENETDOWN;
@@ -292,12 +660,49 @@ static int init_iface(struct srv_udp_state *state)
 	state->need_remove_iff = true;
 	prl_notice(2, "Virtual network interface initialized successfully!");
 	return ret;
-err:
-	while (i--) {
-		close(tun_fds[i]);
-		tun_fds[i] = -1;
+}
+
+
+/*
+ * One mapping for all large long-lived tables and the packet
+ * buffers, backed by huge pages to cut TLB misses.
+ */
+static int init_arena(struct srv_udp_state *state)
+{
+	int ret;
+	size_t size = 0;
+	uint8_t nn = state->cfg->sys.thread_num;
+	uint16_t max_conn = state->cfg->sock.max_conn;
+
+	size += (size_t)max_conn * sizeof(struct udp_sess) + 64u;
+	size += 0x10000ul * sizeof(struct udp_map_bucket) + 64u;
+	size += 0x10000ul * sizeof(uint16_t) + 64u;
+	size += (size_t)nn * ((1u + TQOS_BATCH) * state->pkt_buf_size + 128u);
+	size += (size_t)nn * (sizeof(struct tfr_ring) + 64u);
+	size += (size_t)nn * (TFLOW_NR * sizeof(struct tflow_ent) + 64u);
+	if (state->cfg->sys.shared_nothing) {
+		size += (size_t)nn * (0x10000ul * sizeof(struct udp_map_bucket) +
+				      64u);
+		size += (size_t)nn * (MPSC_RING_MEM(SN_RING_NR,
+					SN_FWD_SIZE(state->pkt_data_size)) + 64u);
 	}
-	return ret;
+
+	ret = al_arena_init(&state->arena, size);
+	if (unlikely(ret))
+		return ret;
+
+	if (state->cfg->sys.prefault) {
+		ret = al_arena_prefault(&state->arena, state->cfg->sys.mlock);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	prl_notice(2, "Datapath arena: %zu KiB mapped, %zu KiB resident (%s%s)",
+		   state->arena.size / 1024,
+		   al_arena_resident(&state->arena) / 1024,
+		   state->arena.hugetlb ? "MAP_HUGETLB" : "MADV_HUGEPAGE",
+		   state->arena.locked ? ", mlocked" : "");
+	return 0;
 }
 
 
@@ -305,17 +710,20 @@ static int init_udp_session_array(struct srv_udp_state *state)
 {
 	int ret = 0;
 	struct udp_sess *sess_arr;
-	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	uint16_t max_conn = state->cfg->sock.max_conn;
 
 	prl_notice(4, "Initializing UDP session array...");
-	sess_arr = calloc_wrp((size_t)max_conn, sizeof(*sess_arr));
+	sess_arr = arena_calloc_wrp(&state->arena, (size_t)max_conn,
+				    sizeof(*sess_arr));
 	if (unlikely(!sess_arr))
 		return -errno;
 
+	/*
+	 * The arena is zeroed, which is a valid disconnected slot.
+	 * get_udp_sess() resets a slot when it hands it out, so
+	 * the array is faulted in lazily as sessions arrive.
+	 */
 	state->sess_arr = sess_arr;
-	for (i = 0; i < max_conn; i++)
-		reset_udp_session(&sess_arr[i], i);
-
 	return ret;
 }
 
@@ -327,7 +735,8 @@ static int init_udp_session_map(struct srv_udp_state *state)
 	struct udp_map_bucket (*sess_map)[0x100u];
 
 	prl_notice(4, "Initializing UDP session map...");
-	sess_map = calloc_wrp(len, sizeof(struct udp_map_bucket));
+	sess_map = arena_calloc_wrp(&state->arena, len,
+				    sizeof(struct udp_map_bucket));
 	if (unlikely(!sess_map))
 		return -errno;
 
@@ -335,6 +744,11 @@ static int init_udp_session_map(struct srv_udp_state *state)
 	if (unlikely(ret))
 		return -ret;
 
+	ret = al_slab_init(&state->bkt_slab, sizeof(struct udp_map_bucket),
+			   256u);
+	if (unlikely(ret))
+		return ret;
+
 	state->sess_map = sess_map;
 	return ret;
 }
@@ -342,23 +756,21 @@ static int init_udp_session_map(struct srv_udp_state *state)
 
 static int init_udp_session_stack(struct srv_udp_state *state)
 {
-	int ret;
 	uint16_t i, max_conn = state->cfg->sock.max_conn;
 
-	prl_notice(4, "Initializing UDP session stack...");
-	if (unlikely(!bt_stack_init(&state->sess_stk, max_conn)))
+	prl_notice(4, "Initializing UDP session depot...");
+	if (unlikely(!idx_depot_init(&state->sess_depot, max_conn)))
 		return -errno;
 
-	ret = mutex_init(&state->sess_stk_lock, NULL);
-	if (unlikely(ret))
-		return -ret;
-
 	for (i = max_conn; i--;) {
-		int32_t tmp = bt_stack_push(&state->sess_stk, (uint16_t)i);
-		if (unlikely(tmp == -1)) {
-			panic("Fatal bug in init_udp_session_stack!");
-			__builtin_unreachable();
-		}
+		if (mt_load(&state->sess_arr[i].is_connected))
+			/*
+			 * This slot is used by a session imported
+			 * from the old process.
+			 */
+			continue;
+
+		idx_depot_push(&state->sess_depot, i);
 	}
 
 	return 0;
@@ -369,7 +781,8 @@ static int init_ipv4_map(struct srv_udp_state *state)
 {
 	uint16_t (*ipv4_map)[0x100];
 
-	ipv4_map = calloc_wrp(0x100ul * 0x100ul, sizeof(uint16_t));
+	ipv4_map = arena_calloc_wrp(&state->arena, 0x100ul * 0x100ul,
+				    sizeof(uint16_t));
 	if (unlikely(!ipv4_map))
 		return -errno;
 
@@ -378,6 +791,91 @@ static int init_ipv4_map(struct srv_udp_state *state)
 }
 
 
+static int parse_pool_addr(const char *str, const char *name, uint32_t *addr)
+{
+	struct in_addr in;
+
+	if (!inet_pton(AF_INET, str, &in)) {
+		pr_err("Invalid [iface] %s: \"%s\"", name, str);
+		return -EINVAL;
+	}
+
+	*addr = ntohl(in.s_addr);
+	return 0;
+}
+
+
+/*
+ * The pool defaults to the hosts of the [iface] subnet, the server
+ * address is kept out of it.
+ */
+static int init_addr_pool(struct srv_udp_state *state)
+{
+	int ret;
+	char first_str[IPV4_L], last_str[IPV4_L];
+	uint32_t srv, mask, net, bcast, first, last, tmp;
+	const struct srv_cfg_iface *iface = &state->cfg->iface;
+
+	ret = parse_pool_addr(iface->iff.ipv4, "ipv4", &srv);
+	if (unlikely(ret))
+		return ret;
+	ret = parse_pool_addr(iface->iff.ipv4_netmask, "ipv4_netmask", &mask);
+	if (unlikely(ret))
+		return ret;
+
+	net   = srv & mask;
+	bcast = net | ~mask;
+	first = net + 1u;
+	last  = bcast - 1u;
+	if (iface->pool_start[0] != '\0') {
+		ret = parse_pool_addr(iface->pool_start, "pool_start", &first);
+		if (unlikely(ret))
+			return ret;
+	}
+	if (iface->pool_end[0] != '\0') {
+		ret = parse_pool_addr(iface->pool_end, "pool_end", &last);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (unlikely((first & mask) != net || (last & mask) != net ||
+		     first > last)) {
+		if (iface->pool_start[0] == '\0' && iface->pool_end[0] == '\0')
+			/*
+			 * A /31 or /32 [iface] has no room for a pool.
+			 */
+			return tpool_init(&state->pool, 1u, 0u);
+
+		pr_err("[iface] pool_start..pool_end must be a range inside "
+		       "the ipv4/ipv4_netmask subnet");
+		return -EINVAL;
+	}
+
+	if (last - first >= TPOOL_MAX) {
+		/*
+		 * The route map keys on the low 16 bits.
+		 */
+		last = first + TPOOL_MAX - 1u;
+		pr_warn("The address pool is cut to %u addresses", TPOOL_MAX);
+	}
+
+	ret = tpool_init(&state->pool, first, last);
+	if (unlikely(ret)) {
+		pr_err("tpool_init(): " PRERF, PREAR(-ret));
+		return ret;
+	}
+
+	tpool_reserve(&state->pool, srv);
+	tmp = htonl(first);
+	inet_ntop(AF_INET, &tmp, first_str, sizeof(first_str));
+	tmp = htonl(last);
+	inet_ntop(AF_INET, &tmp, last_str, sizeof(last_str));
+	prl_notice(2, "Address pool %s - %s (%u free)", first_str, last_str,
+		   state->pool.nr_free);
+	return 0;
+}
+
+
 static int run_server_event_loop(struct srv_udp_state *state)
 {
 	switch (state->evt_loop) {
@@ -399,10 +897,24 @@ static void close_udp_fd(struct srv_udp_state *state)
 {
 	int udp_fd = state->udp_fd;
 
+	uint8_t i, nn;
+
 	if (udp_fd != -1) {
 		prl_notice(2, "Closing udp_fd (fd=%d)...", udp_fd);
 		close(udp_fd);
 	}
+
+	if (!state->udp_fds)
+		return;
+
+	nn = state->cfg->sys.thread_num;
+	for (i = 1; i < nn; i++) {
+		udp_fd = state->udp_fds[i];
+		if (udp_fd == -1)
+			continue;
+		prl_notice(2, "Closing udp_fds[%hhu] (fd=%d)...", i, udp_fd);
+		close(udp_fd);
+	}
 }
 
 
@@ -425,13 +937,48 @@ static void close_tun_fds(struct srv_udp_state *state)
 }
 
 
+static void close_conn_fds(struct srv_udp_state *state)
+{
+	uint16_t i;
+	struct udp_sess *sess;
+
+	if (!state->sess_arr || !state->cfg->sock.connected_sockets)
+		return;
+
+	for (i = 0; i < state->cfg->sock.max_conn; i++) {
+		sess = &state->sess_arr[i];
+		if (!mt_load(&sess->is_connected) ||
+		    mt_load(&sess->conn_fd) == -1)
+			continue;
+
+		close(mt_xchg(&sess->conn_fd, -1));
+	}
+}
+
+
 static void close_fds_state(struct srv_udp_state *state)
 {
+	close_conn_fds(state);
 	close_udp_fd(state);
 	close_tun_fds(state);
 }
 
 
+static void free_sess_states(struct srv_udp_state *state)
+{
+	uint16_t i;
+
+	if (!state->sess_arr)
+		return;
+
+	for (i = 0; i < state->cfg->sock.max_conn; i++) {
+		fec_state_free(state->sess_arr[i].fec);
+		state->sess_arr[i].fec = NULL;
+		tacl_free(mt_xchg(&state->sess_arr[i].acl, NULL));
+	}
+}
+
+
 static void destroy_state(struct srv_udp_state *state)
 {
 
@@ -446,12 +993,17 @@ static void destroy_state(struct srv_udp_state *state)
 		 */
 		return;
 
+	srv_upgrade_close(state);
+	srv_repl_close(state);
 	close_fds_state(state);
-	bt_stack_destroy(&state->sess_stk);
-	al64_free(state->sess_arr);
-	al64_free(state->sess_map);
-	al64_free(state->ipv4_map);
+	idx_depot_destroy(&state->sess_depot);
+	free_sess_states(state);
+	tpool_destroy(&state->pool);
+	if (state->bkt_slab.gen)
+		al_slab_destroy(&state->bkt_slab);
+	al_arena_destroy(&state->arena);
 	al64_free(state->tun_fds);
+	al64_free(state->udp_fds);
 	al64_free(state);
 }
 
@@ -466,25 +1018,65 @@ int teavpn2_server_udp_run(struct srv_cfg *cfg)
 		return -errno;
 
 	state->cfg = cfg;
+	clock_gettime(CLOCK_MONOTONIC, &state->start_ts);
 	ret = init_state(state);
 	if (unlikely(ret))
 		goto out;
-	ret = init_socket(state);
-	if (unlikely(ret))
-		goto out;
-	ret = init_iface(state);
+	ret = init_arena(state);
 	if (unlikely(ret))
 		goto out;
 	ret = init_udp_session_array(state);
 	if (unlikely(ret))
 		goto out;
 	ret = init_udp_session_map(state);
+	if (unlikely(ret))
+		goto out;
+	ret = init_ipv4_map(state);
+	if (unlikely(ret))
+		goto out;
+	ret = init_addr_pool(state);
+	if (unlikely(ret))
+		goto out;
+	if (cfg->repl.role == REPL_ROLE_STANDBY) {
+		/*
+		 * Keep a warm copy of the active server's sessions
+		 * until it is gone, then take over.
+		 */
+		ret = srv_repl_standby(state);
+		if (unlikely(ret || state->stop))
+			goto out;
+
+		/*
+		 * Time the promotion, not the standby period.
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &state->start_ts);
+	}
+	if (cfg->sys.upgrade) {
+		/*
+		 * Take the UDP socket and the TUN queues over from
+		 * the running server instead of creating new ones.
+		 */
+		ret = srv_upgrade_takeover(state);
+		if (unlikely(ret))
+			goto out;
+	} else {
+		ret = init_socket(state);
+		if (unlikely(ret))
+			goto out;
+		ret = init_iface(state);
+		if (unlikely(ret))
+			goto out;
+	}
+	ret = srv_upgrade_import(state);
 	if (unlikely(ret))
 		goto out;
 	ret = init_udp_session_stack(state);
 	if (unlikely(ret))
 		goto out;
-	ret = init_ipv4_map(state);
+	ret = srv_upgrade_listen(state);
+	if (unlikely(ret))
+		goto out;
+	ret = srv_repl_listen(state);
 	if (unlikely(ret))
 		goto out;
 	ret = run_server_event_loop(state);
@@ -11,8 +11,23 @@
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <stdatomic.h>
+#include <teavpn2/acl.h>
+#include <teavpn2/qos.h>
+#include <teavpn2/agg.h>
+#include <teavpn2/fec.h>
+#include <teavpn2/flow.h>
+#include <teavpn2/flight.h>
+#include <teavpn2/pace.h>
+#include <teavpn2/pool.h>
+#include <teavpn2/probe.h>
+#include <teavpn2/roam.h>
+#include <teavpn2/shed.h>
+#include <teavpn2/sockbuf.h>
+#include <teavpn2/tstamp.h>
 #include <teavpn2/mutex.h>
-#include <teavpn2/stack.h>
+#include <teavpn2/barrier.h>
+#include <teavpn2/magazine.h>
+#include <teavpn2/mpsc.h>
 #include <teavpn2/packet.h>
 #include <teavpn2/client/common.h>
 
@@ -20,6 +35,16 @@
 #define EPOLL_EVT_ARR_NUM 3u
 #define UDP_SESS_MAX_ERR 5u
 
+/*
+ * Replication message types (active -> standby).
+ */
+#define REPL_MSG_SNAPSHOT	1u
+#define REPL_MSG_SNAPSHOT_END	2u
+#define REPL_MSG_SESS_CREATE	3u
+#define REPL_MSG_SESS_AUTH	4u
+#define REPL_MSG_SESS_CLOSE	5u
+#define REPL_MSG_HEARTBEAT	6u
+
 /*
  * UDP session struct.
  *
@@ -50,6 +75,12 @@ struct udp_sess {
 	 */
 	uint16_t				err_c;
 
+	/*
+	 * Index of the thread that owns this session in
+	 * shared-nothing mode, only that thread touches it.
+	 */
+	uint8_t					owner;
+
 	/*
 	 * UDP is stateless, we may not know whether the
 	 * client is still online or not, @last_act can
@@ -59,9 +90,28 @@ struct udp_sess {
 	time_t					last_act;
 
 	/*
-	 * Big endian src_addr and src_port for sendto() call.
+	 * Big endian src_addr and src_port for sendto() call, packed
+	 * by udp_addr_pack(). Roaming rewrites it while the TUN
+	 * threads send to it.
+	 */
+	mt_atomic(uint64_t)			addr;
+
+	/*
+	 * The load balancer this session came through (behind_lb
+	 * mode), packed like @addr, 0 if none. The replies are sent
+	 * to it with a struct pkt_lb_hdr that carries @addr.
 	 */
-	struct sockaddr_in			addr;
+	mt_atomic(uint64_t)			lb_addr;
+
+	/*
+	 * The connect()ed socket of this session in connected_sockets
+	 * mode, -1 while the replies go through the shared socket.
+	 * The TUN threads send on it without a lock, they hold
+	 * @conn_ref over each sendmsg() (see udp_sess_conn_get()).
+	 * @conn_ref is never reset, it is 0 whenever nobody sends.
+	 */
+	mt_atomic(int)				conn_fd;
+	mt_atomic(uint32_t)			conn_ref;
 
 	/*
 	 * Session username.
@@ -74,7 +124,88 @@ struct udp_sess {
 	char					str_src_addr[IPV4_L];
 
 	bool					is_authenticated;
-	_Atomic(bool)				is_connected;
+	mt_atomic(bool)				is_connected;
+
+	/*
+	 * Forward error correction, see teavpn2/fec.h. @fec is
+	 * allocated on the first FEC packet from the client and
+	 * kept when the slot is reused, @fec_on is set while the
+	 * client talks FEC.
+	 */
+	mt_atomic(bool)				fec_on;
+	struct fec_state			*fec;
+
+	/*
+	 * Egress pacing state, see teavpn2/pace.h.
+	 */
+	struct tpace				pace;
+
+	/*
+	 * Kernel timestamp statistics of the datagrams received
+	 * from this client, see teavpn2/tstamp.h.
+	 */
+	struct tts_rx				rx_ts;
+
+	/*
+	 * Path RTT and loss from the REQSYNC/SYNC probes, see
+	 * teavpn2/probe.h.
+	 */
+	struct tprobe				probe;
+
+	/*
+	 * Roaming key handed out on auth, and the highest tag
+	 * counter seen from the client, see teavpn2/roam.h.
+	 */
+	struct troam				roam;
+	uint32_t				roam_ctr;
+
+	/*
+	 * The compiled [acl] of the user file, NULL if it has none
+	 * (see teavpn2/acl.h). The TUN threads use it without a lock,
+	 * they pin it with @acl_ref (see udp_sess_acl_get()), it is
+	 * freed once the session is gone and the pins are dropped.
+	 * @acl_ref is never reset. @acl_drop counts the packets it
+	 * dropped.
+	 */
+	mt_atomic(struct tacl *)		acl;
+	mt_atomic(uint32_t)			acl_ref;
+	mt_atomic(uint32_t)			acl_drop;
+
+	/*
+	 * Packets from the client that were not IPv4 from its tunnel
+	 * address.
+	 */
+	mt_atomic(uint32_t)			spoof_drop;
+
+	/*
+	 * The address this session holds in @state->pool, 0 if none.
+	 */
+	uint32_t				pool_addr;
+};
+
+
+/*
+ * Serialized form of struct udp_sess. This is what gets transferred
+ * to another server process (e.g. on zero-downtime upgrade), the
+ * session map and the route map are rebuilt from it. It is in host
+ * byte order, the replication stream converts it (see udp_repl.c).
+ */
+struct udp_sess_rec {
+	uint32_t				ipv4_iff;
+	uint32_t				src_addr;
+	uint16_t				src_port;
+	uint16_t				idx;
+	uint16_t				err_c;
+	uint8_t					is_authenticated;
+	uint8_t					__pad;
+	uint32_t				lb_addr;
+	uint16_t				lb_port;
+	uint16_t				__pad2;
+	int64_t					last_act;
+	char					username[0x100];
+	uint64_t				roam_key[2];
+	uint32_t				roam_ctr;
+	uint32_t				__pad3;
 };
 
 
@@ -89,6 +220,68 @@ struct udp_map_bucket {
 };
 
 
+/*
+ * Shared-nothing mode: a TUN packet read by a thread that does not
+ * own the destination session is handed to the owner through the
+ * owner's @fwd_ring.
+ */
+#define SN_RING_NR		256u
+#define SN_DST_BCAST		0xffffu
+
+struct sn_fwd {
+	uint16_t				dst;
+	bool					has_mark;
+	struct tqos_mark			mark;
+	size_t					len;
+
+	/*
+	 * Only @srv_udp_state->pkt_data_size bytes of payload, the
+	 * ring elements are SN_FWD_SIZE() bytes.
+	 */
+	struct srv_pkt				pkt;
+};
+
+#define SN_FWD_SIZE(DATA)						\
+	((offsetof(struct sn_fwd, pkt) + PKT_MIN_LEN + (size_t)(DATA) +	\
+	  7u) & ~(size_t)7u)
+
+
+/*
+ * A small-packet aggregate being built for @sess, see teavpn2/agg.h.
+ */
+struct srv_agg {
+	struct udp_sess				*sess;
+	const struct tqos_mark			*mark;
+	struct tagg				agg;
+};
+
+
+/*
+ * A datagram held by the userspace pacer until its departure time.
+ * @ipv4_iff tells whether @sess still belongs to the same client
+ * when it is due.
+ */
+struct pace_slot {
+	struct udp_sess				*sess;
+	uint32_t				ipv4_iff;
+	bool					has_mark;
+	struct tqos_mark			mark;
+	uint16_t				len;
+
+	/*
+	 * PACE_DATA_SIZE() bytes, the slots are PACE_SLOT_SIZE()
+	 * bytes apart.
+	 */
+	uint8_t					data[];
+};
+
+#define PACE_DATA_SIZE(DATA)						\
+	(PKT_MIN_LEN + (size_t)(DATA) + sizeof(struct pkt_fec_hdr) + 2u)
+
+#define PACE_SLOT_SIZE(DATA)						\
+	((sizeof(struct pace_slot) + PACE_DATA_SIZE(DATA) + 7u) & ~(size_t)7u)
+
+
 struct srv_udp_state;
 
 
@@ -110,10 +303,108 @@ struct epl_thread {
 	/*
 	 * Is this thread online?
 	 */
-	_Atomic(bool)				is_online;
+	mt_atomic(bool)				is_online;
 
 	uint16_t				idx;
 	struct sc_pkt				*pkt;
+
+	/*
+	 * Packets drained from the TUN fd in a single event,
+	 * they are dispatched by priority class via @tun_q.
+	 */
+	struct sc_pkt				*tun_pkts;
+	struct tqos_mark			tun_marks[TQOS_BATCH];
+	struct tqos_queue			tun_q;
+
+	/*
+	 * Free session indexes cached by this thread, see
+	 * teavpn2/magazine.h.
+	 */
+	struct idx_mag				sess_mag;
+
+	/*
+	 * The UDP socket this thread receives from and sends to.
+	 * In shared-nothing mode each thread has its own socket
+	 * (SO_REUSEPORT), otherwise it is @state->udp_fd.
+	 */
+	int					udp_fd;
+
+	/*
+	 * Shared-nothing mode only: the private session map, the
+	 * ring other threads forward packets for our sessions
+	 * through, and the eventfd that signals it.
+	 */
+	struct udp_map_bucket			(*sess_map)[0x100];
+	struct mpsc_ring			fwd_ring;
+	int					evt_fd;
+
+	/*
+	 * Threads we forwarded to in the current TUN batch, they
+	 * are signalled once when the batch is done.
+	 */
+	uint64_t				fwd_kick[4];
+
+	/*
+	 * Small-packet aggregates of the current TUN batch, at
+	 * most one per destination session.
+	 */
+	uint8_t					nr_aggs;
+	struct srv_agg				aggs[TQOS_BATCH];
+
+	/*
+	 * Sessions whose FEC group got data in the current TUN
+	 * batch, the group is closed when the batch is done.
+	 */
+	uint8_t					nr_fec;
+	struct udp_sess				*fec_sess[TQOS_BATCH];
+	const struct tqos_mark			*fec_mark[TQOS_BATCH];
+
+	/*
+	 * Userspace pacer (TPACE_MODE_USER only): the queued
+	 * datagrams ordered by departure time, their free slots,
+	 * and the timerfd armed for @pace_armed.
+	 */
+	int					pace_fd;
+	uint32_t				nr_paced;
+	uint32_t				nr_pace_free;
+	uint64_t				pace_armed;
+	struct tpace_ent			*pace_heap;
+	uint32_t				*pace_free;
+	struct pace_slot			*pace_slots;
+
+	/*
+	 * Kernel timestamping: the stamps of the datagram being
+	 * handled, when epoll_wait() last returned, and the TX
+	 * statistics of our socket. @tx_ts points to the ones of
+	 * the thread that owns the socket (and reads its error
+	 * queue), @tx_cnt picks the datagrams to sample.
+	 */
+	struct tts_rx_stamp			rx_stamp;
+	uint64_t				wake_ns;
+	uint32_t				tx_cnt;
+	struct tts_tx				*tx_ts;
+	struct tts_tx				tx_ts_own;
+
+	/*
+	 * Buffer sizing of our socket, see teavpn2/sockbuf.h. Like
+	 * @tx_ts, @sbuf points to the one of the thread that owns
+	 * the socket, only that thread resizes it.
+	 */
+	struct tsbuf				*sbuf;
+	struct tsbuf				sbuf_own;
+
+	/*
+	 * The last datapath events of this thread, see
+	 * teavpn2/flight.h.
+	 */
+	struct tfr_ring				*fr;
+
+	/*
+	 * Forwarding decisions of recent flows, see teavpn2/flow.h.
+	 */
+	struct tflow_ent			*flows;
+	uint64_t				flow_hit;
+	uint64_t				flow_miss;
 };
 
 
@@ -131,6 +422,31 @@ struct srv_udp_state {
 	 */
 	volatile bool				in_emergency;
 
+	/*
+	 * @qos_cmsg_prio is true when the kernel accepts
+	 * SO_PRIORITY as a sendmsg() control message. It
+	 * is cleared on the first EINVAL.
+	 */
+	volatile bool				qos_cmsg_prio;
+
+	/*
+	 * Set by SIGUSR1, the next thread that wakes up prints the
+	 * statistics.
+	 */
+	volatile bool				dump_stats;
+
+	/*
+	 * Egress pacing mode (TPACE_MODE_*), it falls back to
+	 * TPACE_MODE_USER if the socket rejects SO_TXTIME.
+	 */
+	uint8_t					pace_mode;
+
+	/*
+	 * Load shedding level and counters, see teavpn2/shed.h.
+	 * The level only moves with [socket] load_shedding set.
+	 */
+	struct tshed				shed;
+
 	/*
 	 * When we're exiting, the main thread will wait for
 	 * the subthreads to exit for the given timeout. If
@@ -161,11 +477,50 @@ struct srv_udp_state {
 	struct srv_cfg				*cfg;
 
 	/*
-	 * Stack to retrieve free UDP session index in O(1)
-	 * time complexity.
+	 * Zero-downtime upgrade.
+	 *
+	 * @upg_fd is the listening unix socket at upgrade_sock.
+	 * @upg_cli_fd is the accepted new process waiting for
+	 * the handoff after the event loop is stopped.
+	 * @upg_recs is the session snapshot received from the
+	 * old process, waiting to be imported.
 	 */
-	struct bt_stack				sess_stk;
-	struct tmutex				sess_stk_lock;
+	int					upg_fd;
+	int					upg_cli_fd;
+	uint16_t				upg_nr_recs;
+	struct udp_sess_rec			*upg_recs;
+
+	/*
+	 * Active/standby session replication.
+	 *
+	 * @repl_fd is the listening TCP socket on the active
+	 * server, @repl_cli_fd is the connected standby.
+	 * @repl_last_tx is the monotonic time (in ms) of the
+	 * last message sent to the standby.
+	 *
+	 * The messages go through @repl_txq, bytes @repl_txq_head
+	 * to @repl_txq_tail are not sent yet. They are sent as the
+	 * socket takes them, the rest waits for EPOLLOUT
+	 * (@repl_txq_armed) so a slow standby never blocks the
+	 * event loop.
+	 *
+	 * Session events are only produced by the thread that
+	 * owns udp_fd, so these need no lock.
+	 */
+	int					repl_fd;
+	int					repl_cli_fd;
+	uint64_t				repl_last_tx;
+	char					*repl_txq;
+	size_t					repl_txq_cap;
+	size_t					repl_txq_head;
+	size_t					repl_txq_tail;
+	bool					repl_txq_armed;
+
+	/*
+	 * Lock-free depot of free UDP session indexes, each
+	 * thread caches a few of them in its @sess_mag.
+	 */
+	struct idx_depot			sess_depot;
 
 	/*
 	 * Small hash table for session lookup after recvfrom().
@@ -173,6 +528,25 @@ struct srv_udp_state {
 	struct udp_map_bucket			(*sess_map)[0x100];
 	struct tmutex				sess_map_lock;
 
+	/*
+	 * Chained (collided) buckets of @sess_map.
+	 */
+	struct al_slab				bkt_slab;
+
+	/*
+	 * Huge-page backed memory for @sess_arr, @sess_map,
+	 * @ipv4_map and the per-thread packet buffers.
+	 */
+	struct al_arena				arena;
+
+	/*
+	 * Payload capacity of the packet buffers, by the MTU (see
+	 * tpkt_data_size()), and the size of one struct sc_pkt
+	 * buffer with it.
+	 */
+	size_t					pkt_data_size;
+	size_t					pkt_buf_size;
+
 	/*
 	 * @sess_arr is an array of UDP sessions.
 	 */
@@ -181,10 +555,26 @@ struct srv_udp_state {
 	/*
 	 * Number of active sessions in @sess_arr.
 	 */
-	_Atomic(uint16_t)			n_on_sess;
+	mt_atomic(uint16_t)			n_on_sess;
+
+	/*
+	 * Generation of the flow caches, see srv_flow_flush().
+	 */
+	mt_atomic(uint32_t)			flow_gen;
+
 
+	mt_atomic(uint16_t)			n_on_threads;
 
-	_Atomic(uint16_t)			n_on_threads;
+	/*
+	 * Releases the sub threads once every thread is ready.
+	 */
+	struct tbarrier				thread_gate;
+
+	/*
+	 * CLOCK_MONOTONIC time at which the startup began, for
+	 * the startup time report.
+	 */
+	struct timespec				start_ts;
 
 
 	/*
@@ -195,11 +585,23 @@ struct srv_udp_state {
 	 */
 	int					*tun_fds;
 
+	/*
+	 * Shared-nothing mode: the SO_REUSEPORT sockets of the
+	 * sub threads, @udp_fds[0] is unused (@udp_fd).
+	 */
+	int					*udp_fds;
+
 	/*
 	 * Map @ipv4_ff to @sess_arr index.
 	 */
 	uint16_t				(*ipv4_map)[0x100];
 
+	/*
+	 * Tunnel addresses for the users without a static one, see
+	 * teavpn2/pool.h.
+	 */
+	struct tpool				pool;
+
 	union {
 		/*
 		 * For epoll event loop.
@@ -228,10 +630,60 @@ struct srv_udp_state {
 extern int teavpn2_udp_server_epoll(struct srv_udp_state *state);
 extern int teavpn2_udp_server_io_uring(struct srv_udp_state *state);
 extern struct udp_sess *map_find_udp_sess(struct srv_udp_state *state,
+					  uint8_t owner,
 					  uint32_t addr, uint16_t port);
-extern struct udp_sess *get_udp_sess(struct srv_udp_state *state, uint32_t addr,
+extern struct udp_sess *get_udp_sess(struct epl_thread *thread, uint32_t addr,
 				     uint16_t port);
-extern int put_udp_session(struct srv_udp_state *state, struct udp_sess *sess);
+extern int put_udp_session(struct epl_thread *thread, struct udp_sess *sess);
+extern int rebind_udp_sess(struct srv_udp_state *state, struct udp_sess *sess,
+			   const struct sockaddr_in *saddr);
+extern void udp_sess_export_rec(const struct udp_sess *sess,
+				struct udp_sess_rec *rec);
+extern int udp_sess_import_rec(struct srv_udp_state *state,
+			       const struct udp_sess_rec *rec);
+extern int srv_upgrade_listen(struct srv_udp_state *state);
+extern int srv_upgrade_accept(struct srv_udp_state *state);
+extern int srv_upgrade_takeover(struct srv_udp_state *state);
+extern int srv_upgrade_handoff(struct srv_udp_state *state);
+extern int srv_upgrade_import(struct srv_udp_state *state);
+extern void srv_upgrade_close(struct srv_udp_state *state);
+extern void udp_sess_drop(struct srv_udp_state *state, struct udp_sess *sess);
+extern int udp_sess_load_acl(struct udp_sess *sess, const char *username);
+extern int udp_sess_lease_addr(struct srv_udp_state *state,
+			       struct udp_sess *sess, const char *username,
+			       struct if_info *iff);
+extern int srv_conn_sock_open(struct srv_udp_state *state,
+			      const struct sockaddr_in *peer);
+extern int srv_repl_listen(struct srv_udp_state *state);
+extern int srv_repl_accept(struct srv_udp_state *state);
+extern void srv_repl_event(struct srv_udp_state *state, uint32_t events);
+extern int srv_repl_standby(struct srv_udp_state *state);
+extern void __srv_repl_sess_event(struct srv_udp_state *state, uint8_t type,
+				  const struct udp_sess *sess);
+extern void __srv_repl_tick(struct srv_udp_state *state);
+extern void srv_repl_close(struct srv_udp_state *state);
+extern void srv_stats_dump(struct srv_udp_state *state);
+
+
+/*
+ * An IPv4 socket address in one word (s_addr << 16 | sin_port, both
+ * big endian), a thread that loads it never sees half of an address
+ * that another thread is rewriting.
+ */
+static __always_inline uint64_t udp_addr_pack(const struct sockaddr_in *addr)
+{
+	return ((uint64_t)addr->sin_addr.s_addr << 16u) | addr->sin_port;
+}
+
+
+static __always_inline void udp_addr_unpack(uint64_t val,
+					    struct sockaddr_in *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family      = AF_INET;
+	addr->sin_addr.s_addr = (uint32_t)(val >> 16u);
+	addr->sin_port        = (uint16_t)val;
+}
 
 
 static __always_inline void reset_udp_session(struct udp_sess *sess, uint16_t idx)
@@ -241,12 +693,72 @@ static __always_inline void reset_udp_session(struct udp_sess *sess, uint16_t id
 	sess->src_port = 0u;
 	sess->idx      = idx;
 	sess->err_c    = 0u;
+	sess->owner    = 0u;
 	sess->last_act = 0;
-	memset(&sess->addr, 0, sizeof(sess->addr));
+	mt_store(&sess->addr, 0u);
+	mt_store(&sess->lb_addr, 0u);
+	mt_store(&sess->conn_fd, -1);
 	sess->username[0] = '_';
 	sess->username[1] = '\0';
 	sess->is_authenticated = false;
-	atomic_store(&sess->is_connected, false);
+	mt_store(&sess->is_connected, false);
+	mt_store(&sess->fec_on, false);
+	tpace_reset(&sess->pace);
+	memset(&sess->rx_ts, 0, sizeof(sess->rx_ts));
+	memset(&sess->probe, 0, sizeof(sess->probe));
+	memset(&sess->roam, 0, sizeof(sess->roam));
+	sess->roam_ctr = 0u;
+	mt_store(&sess->acl_drop, 0u);
+	mt_store(&sess->spoof_drop, 0u);
+	sess->pool_addr = 0u;
+}
+
+
+/*
+ * Pin the connected socket of @sess for one send, -1 if it has none.
+ * A non-negative return must be paired with udp_sess_conn_put(), the
+ * fd is not closed (and so not reused) before that.
+ */
+static __always_inline int udp_sess_conn_get(struct udp_sess *sess)
+{
+	int fd;
+
+	mt_fetch_add(&sess->conn_ref, 1u);
+	fd = mt_load(&sess->conn_fd);
+	if (fd == -1)
+		mt_fetch_sub(&sess->conn_ref, 1u);
+	return fd;
+}
+
+
+static __always_inline void udp_sess_conn_put(struct udp_sess *sess)
+{
+	mt_fetch_sub(&sess->conn_ref, 1u);
+}
+
+
+/*
+ * Pin the ACL of @sess, NULL if it has none. A non-NULL return must
+ * be paired with udp_sess_acl_put().
+ */
+static __always_inline const struct tacl *udp_sess_acl_get(struct udp_sess *sess)
+{
+	struct tacl *acl;
+
+	if (likely(!mt_load(&sess->acl)))
+		return NULL;
+
+	mt_fetch_add(&sess->acl_ref, 1u);
+	acl = mt_load(&sess->acl);
+	if (!acl)
+		mt_fetch_sub(&sess->acl_ref, 1u);
+	return acl;
+}
+
+
+static __always_inline void udp_sess_acl_put(struct udp_sess *sess)
+{
+	mt_fetch_sub(&sess->acl_ref, 1u);
 }
 
 
@@ -315,6 +827,16 @@ static __always_inline int udp_sess_tv_update(struct udp_sess *cur_sess)
 }
 
 
+/*
+ * Drop the cached forwarding decisions of every thread, a session
+ * came, went or changed its route or ACL.
+ */
+static __always_inline void srv_flow_flush(struct srv_udp_state *state)
+{
+	mt_fetch_add(&state->flow_gen, 1u);
+}
+
+
 static inline void add_ipv4_route_map(uint16_t (*ipv4_map)[0x100], uint32_t addr,
 				      uint16_t idx)
 {
@@ -369,4 +891,31 @@ static inline int32_t get_route_map(uint16_t (*ipv4_map)[0x100], uint32_t addr)
 }
 
 
+/*
+ * Heartbeat interval of the replication channel. The standby
+ * promotes itself after @failover_timeout without a message.
+ */
+static __always_inline int repl_hb_interval(const struct srv_cfg *cfg)
+{
+	uint32_t ret = cfg->repl.failover_timeout / 4u;
+	return (int)((ret < 100u) ? 100u : ret);
+}
+
+
+static __always_inline void srv_repl_sess_event(struct srv_udp_state *state,
+						uint8_t type,
+						const struct udp_sess *sess)
+{
+	if (state->repl_cli_fd != -1)
+		__srv_repl_sess_event(state, type, sess);
+}
+
+
+static __always_inline void srv_repl_tick(struct srv_udp_state *state)
+{
+	if (state->repl_cli_fd != -1)
+		__srv_repl_tick(state);
+}
+
+
 #endif /* #ifndef TEAVPN2__SERVER__LINUX__UDP_H */
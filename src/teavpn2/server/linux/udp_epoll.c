@@ -4,13 +4,138 @@
  */
 
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <linux/sockios.h>
 #include <teavpn2/server/common.h>
 #include <teavpn2/net/linux/iface.h>
 #include <teavpn2/server/linux/udp.h>
 
 
+static __always_inline bool shed_active(struct srv_udp_state *state)
+{
+	return tshed_level(&state->shed) != TSHED_OFF;
+}
+
+
+/*
+ * Fill of the send queue of @fd in percent of its send buffer.
+ */
+static uint32_t udp_outq_pct(int fd)
+{
+	int outq = 0, sndbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+
+	if (ioctl(fd, SIOCOUTQ, &outq) < 0 ||
+	    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 ||
+	    sndbuf <= 0 || outq <= 0)
+		return 0;
+
+	return (uint32_t)((uint64_t)outq * 100u / (uint64_t)sndbuf);
+}
+
+
+static void shed_tick(struct epl_thread *thread, struct srv_udp_state *state)
+{
+	uint16_t i;
+	uint8_t old, level;
+	uint32_t windows, pct, tmp;
+	struct tshed *s = &state->shed;
+
+	if (!state->cfg->sock.load_shedding ||
+	    !tshed_due(s, tagg_now_us(), &windows))
+		return;
+
+	pct = udp_outq_pct(thread->udp_fd);
+	if (state->cfg->sys.shared_nothing) {
+		for (i = 0; i < state->cfg->sys.thread_num; i++) {
+			tmp = udp_outq_pct(state->epl_threads[i].udp_fd);
+			if (tmp > pct)
+				pct = tmp;
+		}
+	}
+
+	old   = tshed_level(s);
+	level = tshed_eval(s, pct, state->in_emergency, windows);
+	if (level == old)
+		return;
+
+	if (level > old)
+		pr_warn("Load shedding: %s (send queue %u%%, %u full queue "
+			"event(s))", tshed_level_name(level), pct,
+			mt_load(&s->nr_full));
+	else
+		pr_notice("Load shedding: %s (send queue %u%%)",
+			  tshed_level_name(level), pct);
+}
+
+
+/*
+ * recvmsg() control buffer, the kernel timestamps and the
+ * SO_RXQ_OVFL counter.
+ */
+union rx_cmsg_buf {
+	char			buf[sizeof(union tts_cmsg_buf) + TSBUF_CMSG_SPACE];
+	struct cmsghdr		__align;
+};
+
+
+static int init_sockbuf(struct srv_udp_state *state, struct epl_thread *thread)
+{
+	int ret;
+	struct srv_cfg_sock *sock = &state->cfg->sock;
+	struct tsbuf *sb = &thread->sbuf_own;
+
+	ret = tsbuf_init(sb, thread->udp_fd, sock->rcvbuf_min,
+			 sock->rcvbuf_max, sock->sndbuf_min, sock->sndbuf_max);
+	if (ret == -EPERM) {
+		pr_warn("SO_RCVBUFFORCE/SO_SNDBUFFORCE are not permitted, the "
+			"UDP socket buffers are capped by net.core.rmem_max "
+			"and net.core.wmem_max");
+		ret = 0;
+	}
+
+	if (unlikely(ret)) {
+		pr_err("setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF/SO_SNDBUF) "
+		       "(fd=%d): " PRERF, thread->udp_fd, PREAR(-ret));
+		return ret;
+	}
+
+	prl_notice(2, "[thread=%hu] UDP socket buffers (fd=%d): rcvbuf %u "
+		   "(%u..%u) sndbuf %u (%u..%u)", thread->idx, thread->udp_fd,
+		   sb->rcvbuf, sb->rcv_min, sb->rcv_max, sb->sndbuf,
+		   sb->snd_min, sb->snd_max);
+	return 0;
+}
+
+
+static void sockbuf_tick(struct epl_thread *thread)
+{
+	int ret;
+	struct tsbuf *sb = &thread->sbuf_own;
+
+	if (thread->sbuf != sb)
+		return;
+
+	ret = tsbuf_tick(sb, tagg_now_us());
+	if (likely(!ret))
+		return;
+
+	if (unlikely(ret < 0)) {
+		pr_warn("[thread=%hu] Socket buffer tuning (fd=%d): " PRERF,
+			thread->idx, sb->fd, PREAR(-ret));
+		return;
+	}
+
+	prl_notice(2, "[thread=%hu] UDP socket buffers (fd=%d): rcvbuf %u "
+		   "sndbuf %u (%u datagram(s) dropped)", thread->idx, sb->fd,
+		   sb->rcvbuf, sb->sndbuf, tsbuf_drops(sb));
+}
+
+
 static int create_epoll_fd(void)
 {
 	int ret = 0;
@@ -68,6 +193,32 @@ static int do_epoll_fd_registration(struct srv_udp_state *state,
 		__builtin_unreachable();
 	}
 
+	if (thread->pace_fd != -1) {
+		data.fd = thread->pace_fd;
+		ret = epoll_add(thread, data.fd, EPOLLIN, data);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (state->cfg->sys.shared_nothing) {
+		/*
+		 * Every thread serves its own socket, its own TUN
+		 * queue and the packets forwarded to it.
+		 */
+		data.fd = thread->udp_fd;
+		ret = epoll_add(thread, data.fd, events, data);
+		if (unlikely(ret))
+			return ret;
+
+		data.fd = tun_fds[thread->idx];
+		ret = epoll_add(thread, data.fd, events, data);
+		if (unlikely(ret))
+			return ret;
+
+		data.fd = thread->evt_fd;
+		return epoll_add(thread, data.fd, events, data);
+	}
+
 	if (thread->idx == 0) {
 
 		/*
@@ -79,6 +230,24 @@ static int do_epoll_fd_registration(struct srv_udp_state *state,
 		if (unlikely(ret))
 			return ret;
 
+		if (state->upg_fd != -1) {
+			/*
+			 * Upgrade requests are also handled by
+			 * the main thread.
+			 */
+			data.fd = state->upg_fd;
+			ret = epoll_add(thread, data.fd, events, data);
+			if (unlikely(ret))
+				return ret;
+		}
+
+		if (state->repl_fd != -1) {
+			data.fd = state->repl_fd;
+			ret = epoll_add(thread, data.fd, events, data);
+			if (unlikely(ret))
+				return ret;
+		}
+
 		if (state->cfg->sys.thread_num == 1) {
 			/*
 			 * If we are singlethreaded, the main thread
@@ -112,18 +281,114 @@ static int do_epoll_fd_registration(struct srv_udp_state *state,
 }
 
 
+/*
+ * Turn SO_TXTIME on for every UDP socket we send from. If the kernel
+ * doesn't have it, fall back to the userspace pacer.
+ */
+static void init_pacing(struct srv_udp_state *state)
+{
+	int ret;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct epl_thread *threads = state->epl_threads;
+
+	if (state->pace_mode != TPACE_MODE_TXTIME)
+		return;
+
+	for (i = 0; i < nn; i++) {
+		if (i > 0 && threads[i].udp_fd == threads[0].udp_fd)
+			continue;
+
+		ret = tpace_sock_setup(threads[i].udp_fd);
+		if (likely(!ret))
+			continue;
+
+		pr_warn("setsockopt(udp_fd, SOL_SOCKET, SO_TXTIME): " PRERF,
+			PREAR(-ret));
+		pr_warn("Falling back to the userspace pacer");
+		state->pace_mode = TPACE_MODE_USER;
+		return;
+	}
+}
+
+
+static int init_pace_thread(struct epl_thread *thread)
+{
+	int ret;
+	uint32_t i;
+
+	ret = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("timerfd_create(): " PRERF, PREAR(ret));
+		return -ret;
+	}
+	thread->pace_fd = ret;
+
+	thread->pace_heap = calloc_wrp(TPACE_QUEUE_NR,
+				       sizeof(*thread->pace_heap));
+	if (unlikely(!thread->pace_heap))
+		return -errno;
+
+	thread->pace_free = calloc_wrp(TPACE_QUEUE_NR,
+				       sizeof(*thread->pace_free));
+	if (unlikely(!thread->pace_free))
+		return -errno;
+
+	thread->pace_slots = calloc_wrp(TPACE_QUEUE_NR,
+			PACE_SLOT_SIZE(thread->state->pkt_data_size));
+	if (unlikely(!thread->pace_slots))
+		return -errno;
+
+	for (i = 0; i < TPACE_QUEUE_NR; i++)
+		thread->pace_free[i] = TPACE_QUEUE_NR - 1u - i;
+
+	thread->nr_pace_free = TPACE_QUEUE_NR;
+	return 0;
+}
+
+
 static int init_epoll_thread(struct srv_udp_state *state,
 			     struct epl_thread *thread)
 {
 	int ret;
+	uint16_t mag_cap;
 
 	ret = create_epoll_fd();
 	if (unlikely(ret < 0))
 		return ret;
 
+	/*
+	 * Keep at most a quarter of the slots in the magazines, so
+	 * a thread can't starve the others out of free sessions.
+	 */
+	mag_cap = state->cfg->sock.max_conn / (state->cfg->sys.thread_num * 4u);
+	idx_mag_init(&thread->sess_mag, mag_cap);
+
 	thread->epoll_fd = ret;
 	thread->epoll_timeout = 10000;
 
+	if (state->cfg->sys.shared_nothing) {
+		ret = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (unlikely(ret < 0)) {
+			ret = errno;
+			pr_err("eventfd(): " PRERF, PREAR(ret));
+			return -ret;
+		}
+		thread->evt_fd = ret;
+	}
+
+	if (state->pace_mode == TPACE_MODE_USER) {
+		ret = init_pace_thread(thread);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (thread->idx == 0 && state->repl_fd != -1)
+		/*
+		 * The main thread sends replication heartbeats.
+		 */
+		thread->epoll_timeout = repl_hb_interval(state->cfg);
+
 	ret = do_epoll_fd_registration(state, thread);
 	if (unlikely(ret))
 		return ret;
@@ -132,9 +397,32 @@ static int init_epoll_thread(struct srv_udp_state *state,
 }
 
 
+static int init_sn_thread(struct srv_udp_state *state,
+			  struct epl_thread *thread)
+{
+	void *mem;
+
+	thread->sess_map = arena_calloc_wrp(&state->arena, 0x10000ul,
+					    sizeof(struct udp_map_bucket));
+	if (unlikely(!thread->sess_map))
+		return -errno;
+
+	mem = arena_calloc_wrp(&state->arena, 1ul,
+			       MPSC_RING_MEM(SN_RING_NR,
+					     SN_FWD_SIZE(state->pkt_data_size)));
+	if (unlikely(!mem))
+		return -errno;
+
+	mpsc_ring_init(&thread->fwd_ring, mem, SN_RING_NR,
+		       SN_FWD_SIZE(state->pkt_data_size));
+	return 0;
+}
+
+
 static int init_epoll_thread_array(struct srv_udp_state *state)
 {
 	int ret = 0;
+	char name[sizeof(((struct tfr_ring *)0)->name)];
 	struct epl_thread *threads;
 	uint8_t i, nn = state->cfg->sys.thread_num;
 
@@ -154,8 +442,29 @@ static int init_epoll_thread_array(struct srv_udp_state *state)
 		threads[i].idx = i;
 		threads[i].state = state;
 		threads[i].epoll_fd = -1;
+		threads[i].evt_fd = -1;
+		threads[i].pace_fd = -1;
+		threads[i].udp_fd = state->udp_fd;
+		threads[i].tx_ts = &threads[0].tx_ts_own;
+		threads[i].sbuf = &threads[0].sbuf_own;
+		if (i > 0 && state->cfg->sys.shared_nothing) {
+			threads[i].udp_fd = state->udp_fds[i];
+			threads[i].tx_ts = &threads[i].tx_ts_own;
+			threads[i].sbuf = &threads[i].sbuf_own;
+		}
+	}
+
+	for (i = 0; i < nn; i++) {
+		if (threads[i].sbuf != &threads[i].sbuf_own)
+			continue;
+
+		ret = init_sockbuf(state, &threads[i]);
+		if (unlikely(ret))
+			return ret;
 	}
 
+	init_pacing(state);
+
 	for (i = 0; i < nn; i++) {
 		struct sc_pkt *pkt;
 
@@ -163,11 +472,37 @@ static int init_epoll_thread_array(struct srv_udp_state *state)
 		if (unlikely(ret))
 			return ret;
 
-		pkt = calloc_wrp(1ul, sizeof(*pkt));
+		pkt = arena_calloc_wrp(&state->arena, 1ul, state->pkt_buf_size);
 		if (unlikely(!pkt))
 			return -errno;
 
 		threads[i].pkt = pkt;
+
+		pkt = arena_calloc_wrp(&state->arena, TQOS_BATCH,
+				       state->pkt_buf_size);
+		if (unlikely(!pkt))
+			return -errno;
+
+		threads[i].tun_pkts = pkt;
+
+		threads[i].fr = arena_calloc_wrp(&state->arena, 1ul,
+						 sizeof(*threads[i].fr));
+		if (unlikely(!threads[i].fr))
+			return -errno;
+
+		threads[i].flows = arena_calloc_wrp(&state->arena, TFLOW_NR,
+						    sizeof(struct tflow_ent));
+		if (unlikely(!threads[i].flows))
+			return -errno;
+
+		snprintf(name, sizeof(name), "server thread %hhu", i);
+		tfr_register(threads[i].fr, name);
+
+		if (state->cfg->sys.shared_nothing) {
+			ret = init_sn_thread(state, &threads[i]);
+			if (unlikely(ret))
+				return ret;
+		}
 	}
 
 	return ret;
@@ -199,35 +534,137 @@ static int _do_epoll_wait(struct epl_thread *thread)
 }
 
 
-static ssize_t send_to_client(struct epl_thread *thread,
-			      struct udp_sess *sess, const void *buf,
-			      size_t pkt_len)
+/*
+ * Send @iovcnt iovecs starting at @iov to @sess. The iovec right
+ * before @iov must be writable, it carries the load balancer header
+ * for sessions behind one. A non-zero @txtime is the departure time
+ * for the fq qdisc (TPACE_MODE_TXTIME).
+ */
+static ssize_t sendmsg_to_client(struct epl_thread *thread,
+				 struct udp_sess *sess, struct iovec *iov,
+				 int iovcnt, const struct tqos_mark *mark,
+				 uint64_t txtime)
 {
 	int err;
+	int udp_fd;
+	void *name;
+	bool tx_stamp;
+	uint64_t lb_val;
 	ssize_t send_ret;
+	struct msghdr msg;
+	socklen_t namelen;
+	struct pkt_lb_hdr lb_hdr;
+	union tqos_cmsg_buf cbuf;
+	struct sockaddr_in dst, lb_dst;
 	uint32_t emergency_count = 0;
-	socklen_t len = sizeof(sess->addr);
-	struct sockaddr *dst_addr = (struct sockaddr *)&sess->addr;
+	struct srv_udp_state *state = thread->state;
+
+	/*
+	 * One load each, the owner thread may move the session
+	 * (roaming) or its load balancer meanwhile.
+	 */
+	udp_addr_unpack(mt_load(&sess->addr), &dst);
+	lb_val = mt_load(&sess->lb_addr);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = &dst;
+	msg.msg_namelen = sizeof(dst);
+	msg.msg_iov     = iov;
+	msg.msg_iovlen  = (size_t)iovcnt;
+
+	if (lb_val) {
+		/*
+		 * Reply through the load balancer, it takes the
+		 * client address from the header.
+		 */
+		udp_addr_unpack(lb_val, &lb_dst);
+		lb_hdr.magic    = htonl(TLB_MAGIC);
+		lb_hdr.addr     = dst.sin_addr.s_addr;
+		lb_hdr.port     = dst.sin_port;
+		lb_hdr.__pad    = 0;
+		iov[-1].iov_base = &lb_hdr;
+		iov[-1].iov_len  = sizeof(lb_hdr);
+		msg.msg_name    = &lb_dst;
+		msg.msg_namelen = sizeof(lb_dst);
+		msg.msg_iov     = &iov[-1];
+		msg.msg_iovlen  = (size_t)iovcnt + 1u;
+	}
+
+	name    = msg.msg_name;
+	namelen = msg.msg_namelen;
+
+	if (mark)
+		tqos_cmsg_fill(&msg, &cbuf, mark, state->qos_cmsg_prio);
+
+	if (txtime)
+		tpace_cmsg_add(&msg, &cbuf, txtime);
+
+	tx_stamp = state->cfg->sock.timestamping &&
+		   tts_tx_sample(thread->tx_ts, ++thread->tx_cnt);
+	if (tx_stamp)
+		tts_cmsg_add(&msg, &cbuf);
 
 send_again:
-	send_ret = sendto(thread->state->udp_fd, buf, pkt_len, 0, dst_addr, len);
+	/*
+	 * Pinned for this sendmsg() only, the session may be closed
+	 * by another thread meanwhile (see udp_sess_conn_close()).
+	 */
+	udp_fd = udp_sess_conn_get(sess);
+	if (udp_fd != -1) {
+		/*
+		 * The socket is connected to the client, no route
+		 * lookup for the destination.
+		 */
+		msg.msg_name    = NULL;
+		msg.msg_namelen = 0;
+	} else {
+		udp_fd          = thread->udp_fd;
+		msg.msg_name    = name;
+		msg.msg_namelen = namelen;
+	}
+
+	send_ret = sendmsg(udp_fd, &msg, 0);
+	err = (send_ret < 0) ? errno : 0;
+	if (udp_fd != thread->udp_fd)
+		udp_sess_conn_put(sess);
+
+	tfr_rec(thread->fr, TFR_EV_UDP_TX, udp_fd,
+		iov[0].iov_len ? *(const uint8_t *)iov[0].iov_base : 0u,
+		(send_ret > 0) ? (size_t)send_ret : 0u, sess->idx, -err);
 	if (unlikely(send_ret <= 0)) {
 
 		if (send_ret == 0) {
-			if (pkt_len == 0)
+			if (iov[0].iov_len == 0 && iovcnt == 1)
 				return 0;
 
 			pr_err("UDP socket disconnected!");
 			return -ENETDOWN;
 		}
 
-		err = errno;
 		if (err == EAGAIN) {
-			thread->state->in_emergency = true;
+			tshed_note_full(&state->shed);
+			tsbuf_note_tx_full(thread->sbuf);
+			if (shed_active(state)) {
+				/*
+				 * Shedding load, drop the packet rather
+				 * than stall the thread.
+				 */
+				tshed_count(&state->shed.drop_full);
+				if (emergency_count > 0)
+					state->in_emergency = false;
+				return 0;
+			}
+
+			state->in_emergency = true;
 
 			if (emergency_count++ == 0) {
 				pr_emerg("UDP buffer is full, cannot send!");
-				pr_emerg("Initiate soft loop on sys_sendto...");
+				pr_emerg("Initiate soft loop on sys_sendmsg...");
+				tfr_rec(thread->fr, TFR_EV_STALL, udp_fd,
+					iov[0].iov_len ?
+					*(const uint8_t *)iov[0].iov_base : 0u,
+					0u, sess->idx, -EAGAIN);
+				tfr_dump(thread->fr, "UDP send stall");
 			}
 
 			if (emergency_count > 5000) {
@@ -237,18 +674,44 @@ send_again:
 
 			/* Calm down a bit... */
 			usleep(100000);
+			shed_tick(thread, state);
+			goto send_again;
+		}
+
+		if (err == ECONNREFUSED && udp_fd != thread->udp_fd)
+			/*
+			 * A connected socket reports the ICMP errors
+			 * of earlier datagrams, the client may be
+			 * restarting. Drop this one, the session
+			 * timeout deals with a dead client.
+			 */
+			return 0;
+
+		if (err == EINVAL && mark && state->qos_cmsg_prio) {
+			/*
+			 * This kernel doesn't take SO_PRIORITY as a cmsg,
+			 * keep the DSCP marking only.
+			 */
+			pr_warn("SO_PRIORITY cmsg is not supported, "
+				"only DSCP will be marked");
+			state->qos_cmsg_prio = false;
+			tqos_cmsg_fill(&msg, &cbuf, mark, false);
+			if (txtime)
+				tpace_cmsg_add(&msg, &cbuf, txtime);
+			if (tx_stamp)
+				tts_cmsg_add(&msg, &cbuf);
 			goto send_again;
 		}
 
-		pr_err("sendto(): " PRERF, PREAR(err));
+		pr_err("sendmsg(): " PRERF, PREAR(err));
 		return (ssize_t)-err;
 	}
 
-	pr_debug("[thread=%hu] sendto() %zd bytes to " PRWIU, thread->idx,
+	pr_debug("[thread=%hu] sendmsg() %zd bytes to " PRWIU, thread->idx,
 		 send_ret, W_IU(sess));
 
 	if (unlikely(emergency_count > 0)) {
-		thread->state->in_emergency = false;
+		state->in_emergency = false;
 		pr_emerg("Recovered from EAGAIN!");
 	}
 
@@ -256,63 +719,341 @@ send_again:
 }
 
 
-static int close_udp_session(struct epl_thread *thread, struct udp_sess *sess)
+static int pace_arm(struct epl_thread *thread, uint64_t t)
 {
-	size_t send_len;
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	int ret;
+	struct itimerspec its;
 
-	if (sess->ipv4_iff != 0)
-		del_ipv4_route_map(thread->state->ipv4_map, sess->ipv4_iff);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = (time_t)(t / 1000000000ull);
+	its.it_value.tv_nsec = (long)(t % 1000000000ull);
+	ret = timerfd_settime(thread->pace_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	if (unlikely(ret)) {
+		ret = errno;
+		pr_err("timerfd_settime(): " PRERF, PREAR(ret));
+		return -ret;
+	}
 
-	send_len = srv_pprep(srv_pkt, TSRV_PKT_CLOSE, 0, 0);
-	send_to_client(thread, sess, srv_pkt, send_len);
-	return put_udp_session(thread->state, sess);
+	thread->pace_armed = t;
+	return 0;
 }
 
 
-static int send_handshake(struct epl_thread *thread, struct udp_sess *sess)
+/*
+ * Copy the datagram to the userspace pacer queue, it is sent by
+ * handle_event_pace() at @t.
+ */
+static __always_inline struct pace_slot *pace_slot_at(struct epl_thread *thread,
+						      uint32_t idx)
 {
-	size_t send_len;
-	ssize_t send_ret;
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
-
-	send_len = srv_pprep_handshake(srv_pkt);
-	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
-	if (unlikely(send_ret < 0))
-		return (int)send_ret;
+	size_t size = PACE_SLOT_SIZE(thread->state->pkt_data_size);
 
-	return 0;
+	return (struct pace_slot *)((uint8_t *)thread->pace_slots +
+				    (size_t)idx * size);
 }
 
 
-static int send_handshake_reject(struct epl_thread *thread,
-				 struct udp_sess *sess, uint8_t reason,
-				 const char *msg)
+static ssize_t pace_defer(struct epl_thread *thread, struct udp_sess *sess,
+			  const struct iovec *iov, int iovcnt,
+			  const struct tqos_mark *mark, uint64_t t, size_t len)
 {
-	size_t send_len;
-	ssize_t send_ret;
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	int i;
+	uint32_t idx;
+	uint8_t *p;
+	struct pace_slot *slot;
+
+	if (unlikely(!thread->nr_pace_free)) {
+		pr_debug("[thread=%hu] Pacer queue is full, dropping %zu "
+			 "bytes to " PRWIU, thread->idx, len, W_IU(sess));
+		return 0;
+	}
 
-	send_len = srv_pprep_handshake_reject(srv_pkt, reason, msg);
-	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
-	if (unlikely(send_ret < 0))
-		return (int)send_ret;
+	idx  = thread->pace_free[--thread->nr_pace_free];
+	slot = pace_slot_at(thread, idx);
+	p    = slot->data;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
 
-	return 0;
+	slot->sess     = sess;
+	slot->ipv4_iff = sess->ipv4_iff;
+	slot->has_mark = (mark != NULL);
+	if (mark)
+		slot->mark = *mark;
+	slot->len      = (uint16_t)len;
+	tpace_heap_push(thread->pace_heap, &thread->nr_paced, t, idx);
+
+	if (!thread->pace_armed || t < thread->pace_armed) {
+		int ret = pace_arm(thread, t);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return (ssize_t)len;
 }
 
 
-static int handle_client_handshake(struct epl_thread *thread,
-				   struct udp_sess *sess)
+/*
+ * Send TUN data to @sess at its pacing rate, see teavpn2/pace.h.
+ */
+static ssize_t send_data_iov(struct epl_thread *thread, struct udp_sess *sess,
+			     struct iovec *iov, int iovcnt,
+			     const struct tqos_mark *mark)
 {
-	int ret;
-	char rej_msg[512];
+	int i;
+	uint64_t now, t;
+	size_t len = 0;
+	struct srv_udp_state *state = thread->state;
+
+	if (state->pace_mode == TPACE_MODE_OFF)
+		return sendmsg_to_client(thread, sess, iov, iovcnt, mark, 0);
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	now = tpace_now_ns();
+	t   = tpace_reserve(&sess->pace, len, now,
+			    state->cfg->sock.pacing_rate);
+	if (unlikely(!t)) {
+		pr_debug("[thread=%hu] " PRWIU " is over its pacing rate, "
+			 "dropping %zu bytes", thread->idx, W_IU(sess), len);
+		return 0;
+	}
+
+	if (state->pace_mode == TPACE_MODE_TXTIME)
+		return sendmsg_to_client(thread, sess, iov, iovcnt, mark, t);
+
+	if (t <= now + TPACE_SLACK_NS ||
+	    unlikely(len > PACE_DATA_SIZE(state->pkt_data_size)))
+		return sendmsg_to_client(thread, sess, iov, iovcnt, mark, 0);
+
+	return pace_defer(thread, sess, iov, iovcnt, mark, t, len);
+}
+
+
+static ssize_t __send_to_client(struct epl_thread *thread,
+				struct udp_sess *sess, const void *buf,
+				size_t pkt_len, const struct tqos_mark *mark)
+{
+	struct iovec iov[2];
+
+	iov[1].iov_base = (void *)(uintptr_t)buf;
+	iov[1].iov_len  = pkt_len;
+	return sendmsg_to_client(thread, sess, &iov[1], 1, mark, 0);
+}
+
+
+static ssize_t send_data_to_client(struct epl_thread *thread,
+				   struct udp_sess *sess, const void *buf,
+				   size_t pkt_len, const struct tqos_mark *mark)
+{
+	struct iovec iov[2];
+
+	iov[1].iov_base = (void *)(uintptr_t)buf;
+	iov[1].iov_len  = pkt_len;
+	return send_data_iov(thread, sess, &iov[1], 1, mark);
+}
+
+
+static ssize_t send_to_client(struct epl_thread *thread,
+			      struct udp_sess *sess, const void *buf,
+			      size_t pkt_len)
+{
+	return __send_to_client(thread, sess, buf, pkt_len, NULL);
+}
+
+
+static ssize_t send_fec_pkt(struct epl_thread *thread, struct udp_sess *sess,
+			    uint8_t type, const struct pkt_fec_hdr *hdr,
+			    const void *data, uint16_t len,
+			    const struct tqos_mark *mark)
+{
+	struct iovec iov[4];
+	uint8_t head[PKT_MIN_LEN];
+	uint16_t be_len = htons((uint16_t)(sizeof(*hdr) + len));
+
+	head[0] = type;
+	head[1] = 0;
+	memcpy(&head[2], &be_len, sizeof(be_len));
+	iov[1].iov_base = head;
+	iov[1].iov_len  = sizeof(head);
+	iov[2].iov_base = (void *)(uintptr_t)hdr;
+	iov[2].iov_len  = sizeof(*hdr);
+	iov[3].iov_base = (void *)(uintptr_t)data;
+	iov[3].iov_len  = len;
+	return send_data_iov(thread, sess, &iov[1], 3, mark);
+}
+
+
+/*
+ * Close the open FEC group of @sess and send its parity packets.
+ * The caller holds @sess->fec->enc_lock.
+ */
+static ssize_t send_fec_parity(struct epl_thread *thread,
+			       struct udp_sess *sess,
+			       const struct tqos_mark *mark)
+{
+	uint8_t j, m;
+	ssize_t ret = 0;
+	const uint8_t *parity;
+	struct pkt_fec_hdr hdr;
+	struct fec_enc *enc = &sess->fec->enc;
+
+	m = fec_enc_close(enc);
+	if (!m)
+		return 0;
+
+	for (j = 0; j < m; j++) {
+		parity = fec_enc_parity(enc, j, &hdr);
+		ret = send_fec_pkt(thread, sess, TSRV_PKT_FEC_PARITY, &hdr,
+				   parity, enc->plen, mark);
+		if (unlikely(ret < 0))
+			break;
+	}
+
+	fec_enc_next(enc);
+	return ret;
+}
+
+
+static ssize_t send_fec_data(struct epl_thread *thread, struct udp_sess *sess,
+			     const void *data, uint16_t len,
+			     const struct tqos_mark *mark)
+{
+	uint8_t i;
+	ssize_t ret;
+	struct pkt_fec_hdr hdr;
+	struct fec_state *fs = sess->fec;
+
+	mutex_lock(&fs->enc_lock);
+	fec_enc_data(&fs->enc, data, len, &hdr);
+	ret = send_fec_pkt(thread, sess, TSRV_PKT_FEC_DATA, &hdr, data, len,
+			   mark);
+	if (ret >= 0 && fec_enc_full(&fs->enc))
+		ret = send_fec_parity(thread, sess, mark);
+	mutex_unlock(&fs->enc_lock);
+
+	if (unlikely(ret < 0))
+		return ret;
+
+	for (i = 0; i < thread->nr_fec; i++) {
+		if (thread->fec_sess[i] == sess)
+			return 0;
+	}
+
+	if (likely(thread->nr_fec < TQOS_BATCH)) {
+		thread->fec_sess[thread->nr_fec] = sess;
+		thread->fec_mark[thread->nr_fec] = mark;
+		thread->nr_fec++;
+	}
+	return 0;
+}
+
+
+/*
+ * Close the FEC groups the current TUN batch has put data in.
+ */
+static int flush_fec(struct epl_thread *thread)
+{
+	uint8_t i;
+	ssize_t ret = 0;
+	struct udp_sess *sess;
+
+	for (i = 0; i < thread->nr_fec; i++) {
+		sess = thread->fec_sess[i];
+		if (unlikely(!mt_load(&sess->fec_on)))
+			continue;
+
+		mutex_lock(&sess->fec->enc_lock);
+		ret = send_fec_parity(thread, sess, thread->fec_mark[i]);
+		mutex_unlock(&sess->fec->enc_lock);
+		if (unlikely(ret < 0))
+			break;
+	}
+
+	thread->nr_fec = 0;
+	return (ret < 0) ? (int)ret : 0;
+}
+
+
+/*
+ * Send a TUN packet prepared with srv_pprep() to @sess, through FEC
+ * if the client talks it.
+ */
+static ssize_t send_tun_to_client(struct epl_thread *thread,
+				  struct udp_sess *sess,
+				  struct srv_pkt *srv_pkt, size_t send_len,
+				  const struct tqos_mark *mark)
+{
+	if (mt_load(&sess->fec_on))
+		return send_fec_data(thread, sess, srv_pkt->__raw,
+				     (uint16_t)(send_len - PKT_MIN_LEN), mark);
+
+	return send_data_to_client(thread, sess, srv_pkt, send_len, mark);
+}
+
+
+static int close_udp_session(struct epl_thread *thread, struct udp_sess *sess)
+{
+	size_t send_len;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	if (sess->ipv4_iff != 0)
+		del_ipv4_route_map(thread->state->ipv4_map, sess->ipv4_iff);
+
+	srv_repl_sess_event(thread->state, REPL_MSG_SESS_CLOSE, sess);
+	send_len = srv_pprep(srv_pkt, TSRV_PKT_CLOSE, 0, 0);
+	send_to_client(thread, sess, srv_pkt, send_len);
+	return put_udp_session(thread, sess);
+}
+
+
+static int send_handshake(struct epl_thread *thread, struct udp_sess *sess)
+{
+	size_t send_len;
+	ssize_t send_ret;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	send_len = srv_pprep_handshake(srv_pkt);
+	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
+	if (unlikely(send_ret < 0))
+		return (int)send_ret;
+
+	return 0;
+}
+
+
+static int send_handshake_reject(struct epl_thread *thread,
+				 struct udp_sess *sess, uint8_t reason,
+				 const char *msg)
+{
+	size_t send_len;
+	ssize_t send_ret;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	send_len = srv_pprep_handshake_reject(srv_pkt, reason, msg);
+	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
+	if (unlikely(send_ret < 0))
+		return (int)send_ret;
+
+	return 0;
+}
+
+
+static int handle_client_handshake(struct epl_thread *thread,
+				   struct udp_sess *sess)
+{
+	int ret;
+	char rej_msg[512];
 	uint8_t rej_reason = 0;
 	size_t len = thread->pkt->len;
 	struct cli_pkt *cli_pkt = &thread->pkt->cli;
 	struct pkt_handshake *hand = &cli_pkt->handshake;
 	struct teavpn2_version *cur = &hand->cur;
-	const size_t expected_len = sizeof(*hand);
+	const size_t expected_len = (cli_pkt->type == TCLI_PKT_HANDSHAKE_AUTH)
+				    ? sizeof(struct pkt_handshake_auth)
+				    : sizeof(*hand);
 
 	if (len < (PKT_MIN_LEN + expected_len)) {
 		snprintf(rej_msg, sizeof(rej_msg),
@@ -337,7 +1078,8 @@ static int handle_client_handshake(struct epl_thread *thread,
 		goto reject;
 	}
 
-	if (cli_pkt->type != TCLI_PKT_HANDSHAKE) {
+	if (cli_pkt->type != TCLI_PKT_HANDSHAKE &&
+	    cli_pkt->type != TCLI_PKT_HANDSHAKE_AUTH) {
 		snprintf(rej_msg, sizeof(rej_msg),
 			 "Invalid first packet type from " PRWIU
 			 " (expected = TCLI_PKT_HANDSHAKE (%u); actual = %hhu)",
@@ -369,8 +1111,12 @@ static int handle_client_handshake(struct epl_thread *thread,
 
 
 	/*
-	 * Good handshake packet, send back.
+	 * Good handshake packet. With the credentials in it, the
+	 * auth response is the answer.
 	 */
+	if (cli_pkt->type == TCLI_PKT_HANDSHAKE_AUTH)
+		return 0;
+
 	return send_handshake(thread, sess);
 
 reject:
@@ -380,38 +1126,152 @@ reject:
 }
 
 
-static int handle_clpkt_auth(struct epl_thread *thread, struct udp_sess *sess)
+/*
+ * epoll data of a session's connected socket: the tag bit and the
+ * session index. The other fds go in data.fd, a non-negative int
+ * never reaches the top bit.
+ */
+#define EPL_CONN_TAG	(1ull << 63u)
+
+
+/*
+ * connected_sockets mode: give @sess its own connect()ed socket and
+ * poll it from this thread, the one that serves the main socket. On
+ * error the session keeps using the main socket.
+ */
+static void conn_sock_attach(struct epl_thread *thread, struct udp_sess *sess)
+{
+	int fd, ret;
+	epoll_data_t data;
+	struct sockaddr_in addr;
+	struct srv_udp_state *state = thread->state;
+
+	if (!state->cfg->sock.connected_sockets)
+		return;
+
+	udp_addr_unpack(mt_load(&sess->addr), &addr);
+	fd = srv_conn_sock_open(state, &addr);
+	if (unlikely(fd < 0)) {
+		ret = fd;
+		goto out_warn;
+	}
+
+	if (state->pace_mode == TPACE_MODE_TXTIME) {
+		ret = tpace_sock_setup(fd);
+		if (unlikely(ret))
+			goto out_close;
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.u64 = EPL_CONN_TAG | sess->idx;
+	ret = epoll_add(thread, fd, EPOLLIN | EPOLLPRI, data);
+	if (unlikely(ret))
+		goto out_close;
+
+	mt_store(&sess->conn_fd, fd);
+	prl_notice(4, "Connected socket (fd=%d) for " PRWIU, fd, W_IU(sess));
+	return;
+
+out_close:
+	close(fd);
+out_warn:
+	pr_warn("Cannot open a connected socket for " PRWIU ": " PRERF,
+		W_IU(sess), PREAR(-ret));
+}
+
+
+static int handle_clpkt_auth(struct epl_thread *thread, struct udp_sess *sess,
+			     const struct pkt_auth *auth_p)
 {
 	int ret = 0;
 	size_t send_len;
 	ssize_t send_ret;
+	bool resend = false;
 	struct srv_pkt *srv_pkt = &thread->pkt->srv;
-	struct cli_pkt *cli_pkt = &thread->pkt->cli;
 	struct pkt_auth_res *auth_res = &srv_pkt->auth_res;
-	struct pkt_auth auth = cli_pkt->auth;
+	struct pkt_auth auth = *auth_p;
+	const uint16_t mtu_max = (uint16_t)(thread->state->pkt_data_size -
+					    TPKT_DATA_ROOM);
+
+	/* Ensure we have NUL terminated credentials. */
+	auth.username[sizeof(auth.username) - 1] = '\0';
+	auth.password[sizeof(auth.password) - 1] = '\0';
 
 	if (sess->is_authenticated) {
 		/*
-		 * If the client has already been authenticated,
-		 * this will be a no-op.
+		 * The client has already been authenticated, this is
+		 * a retry because our TSRV_PKT_AUTH_OK got lost. Answer
+		 * it again, the session stays as it is.
 		 */
-		return 0;
+		if (strncmp(auth.username, sess->username,
+			    sizeof(sess->username)))
+			goto out;
+		resend = true;
+	} else {
+		prl_notice(2, "Got auth packet from (user: %s) " PRWIU,
+			   auth.username, W_IU(sess));
 	}
 
-	/* Ensure we have NUL terminated credentials. */
-	auth.username[sizeof(auth.username) - 1] = '\0';
-	auth.password[sizeof(auth.password) - 1] = '\0';
-
-	prl_notice(2, "Got auth packet from (user: %s) " PRWIU, auth.username,
-		   W_IU(sess));
+	if (!teavpn2_auth(auth.username, auth.password, &auth_res->iff)) {
+		if (resend)
+			goto out;
+		goto reject;
+	}
 
-	if (!teavpn2_auth(auth.username, auth.password, &auth_res->iff))
+	ret = udp_sess_lease_addr(thread->state, sess, auth.username,
+				  &auth_res->iff);
+	if (unlikely(ret)) {
+		pr_err("Cannot get a tunnel address for %s: " PRERF,
+		       auth.username, PREAR(-ret));
+		ret = 0;
+		if (resend)
+			goto out;
 		goto reject;
+	}
+
+	if (unlikely(auth_res->iff.ipv4_mtu > mtu_max)) {
+		/*
+		 * Our packet buffers are sized for [iface] mtu, larger
+		 * packets from the client would be cut.
+		 */
+		pr_warn("MTU %hu of user %s is above what the packet buffers "
+			"take, using %hu", auth_res->iff.ipv4_mtu, auth.username,
+			mtu_max);
+		auth_res->iff.ipv4_mtu = mtu_max;
+	}
+
+	if (!resend) {
+		ret = udp_sess_load_acl(sess, auth.username);
+		if (unlikely(ret)) {
+			/*
+			 * A broken ACL must not let the user in with
+			 * no ACL at all.
+			 */
+			pr_err("Cannot load the ACL of %s: " PRERF,
+			       auth.username, PREAR(-ret));
+			ret = 0;
+			goto reject;
+		}
+	}
 
 	/*
-	 * Auth ok!
+	 * Auth ok! The roaming key salt rides in the padding, a client
+	 * that does not roam ignores it. A resend keeps the salt, but
+	 * a session imported from another process has none.
 	 */
-	send_len = srv_pprep(srv_pkt, TSRV_PKT_AUTH_OK, sizeof(*auth_res), 0);
+	send_len = srv_pprep(srv_pkt, TSRV_PKT_AUTH_OK, sizeof(*auth_res),
+			     sizeof(struct pkt_roam_key));
+	if (!resend || !troam_has_salt(&sess->roam)) {
+		ret = troam_keygen(&sess->roam, auth.password);
+		if (unlikely(ret)) {
+			pr_err("getrandom(): " PRERF, PREAR(-ret));
+			close_udp_session(thread, sess);
+			goto out;
+		}
+	}
+	troam_key_export(&sess->roam, sess->idx,
+			 (struct pkt_roam_key *)&srv_pkt->__raw[sizeof(*auth_res)]);
+	send_len += sizeof(struct pkt_roam_key);
 	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
 	if (unlikely(send_ret < 0)) {
 		ret = (int)send_ret;
@@ -419,11 +1279,17 @@ static int handle_clpkt_auth(struct epl_thread *thread, struct udp_sess *sess)
 		goto out;
 	}
 
+	if (resend)
+		goto out;
+
 	sess->ipv4_iff = ntohl(inet_addr(auth_res->iff.ipv4));
 	add_ipv4_route_map(thread->state->ipv4_map, sess->ipv4_iff, sess->idx);
+	srv_flow_flush(thread->state);
 
 	sess->is_authenticated = true;
 	strncpy2(sess->username, auth.username, sizeof(sess->username));
+	srv_repl_sess_event(thread->state, REPL_MSG_SESS_AUTH, sess);
+	conn_sock_attach(thread, sess);
 	goto out;
 
 
@@ -451,23 +1317,34 @@ out:
 static int handle_new_client(struct epl_thread *thread,
 			     struct srv_udp_state __maybe_unused *state,
 			     uint32_t addr, uint16_t port,
-			     struct sockaddr_in *saddr)
+			     struct sockaddr_in *saddr,
+			     const struct sockaddr_in *lb_addr)
 {
 	int ret;
 	struct udp_sess *sess;
 
-	sess = get_udp_sess(thread->state, addr, port);
+	if (unlikely(shed_active(thread->state))) {
+		/*
+		 * Overloaded, the client backs off and tries again.
+		 */
+		tshed_count(&thread->state->shed.drop_new);
+		return 0;
+	}
+
+	sess = get_udp_sess(thread, addr, port);
 	if (unlikely(!sess))
 		return -errno;
 
-	sess->addr = *saddr;
+	mt_store(&sess->addr, udp_addr_pack(saddr));
+	if (lb_addr)
+		mt_store(&sess->lb_addr, udp_addr_pack(lb_addr));
 
 #ifndef NDEBUG
 	/*
 	 * After calling get_udp_sess(), we must have it
 	 * on the map. If we don't, then it's a bug!
 	 */
-	BUG_ON(map_find_udp_sess(state, addr, port) != sess);
+	BUG_ON(map_find_udp_sess(state, thread->idx, addr, port) != sess);
 #endif
 
 	ret = handle_client_handshake(thread, sess);
@@ -477,24 +1354,90 @@ static int handle_new_client(struct epl_thread *thread,
 		 */
 		close_udp_session(thread, sess);
 		ret = (ret == -EBADMSG) ? 0 : ret;
+	} else {
+		srv_repl_sess_event(thread->state, REPL_MSG_SESS_CREATE, sess);
+		if (thread->pkt->cli.type == TCLI_PKT_HANDSHAKE_AUTH)
+			ret = handle_clpkt_auth(thread, sess,
+						&thread->pkt->cli.hs_auth.auth);
 	}
 
 	return ret;
 }
 
 
-static int handle_tun_data(struct epl_thread *thread, struct udp_sess *sess)
+/*
+ * The ACL of @sess lets the packet @buf it sent through, the verdict
+ * is cached per flow.
+ */
+static bool flow_acl_from(struct epl_thread *thread, struct udp_sess *sess,
+			  const void *buf, size_t len)
+{
+	bool allow;
+	struct tflow_ent k, *e;
+	const struct tacl *acl;
+	const uint32_t gen = mt_load(&thread->state->flow_gen);
+
+	if (unlikely(!tflow_key(&k, buf, len, TFLOW_FROM_CLI, sess->idx)))
+		return false;
+
+	e = tflow_slot(thread->flows, &k);
+	if (likely(tflow_hit(e, &k, gen))) {
+		thread->flow_hit++;
+		return e->allow;
+	}
+
+	thread->flow_miss++;
+	acl = udp_sess_acl_get(sess);
+	if (!acl)
+		return true;
+
+	allow = tacl_match(acl, k.daddr, k.proto, tflow_dport(&k));
+	udp_sess_acl_put(sess);
+	tflow_fill(e, &k, TFLOW_NO_SESS, allow, gen);
+	return allow;
+}
+
+
+/*
+ * Anti-spoofing: a client may only send IPv4 from its own tunnel
+ * address, whether or not it has an ACL.
+ */
+static __always_inline bool from_own_addr(const struct udp_sess *sess,
+					  const void *buf, size_t len)
+{
+	const struct iphdr *iph = buf;
+
+	return len >= sizeof(*iph) && iph->version == 4 &&
+	       ntohl(iph->saddr) == sess->ipv4_iff;
+}
+
+
+static int write_tun(struct epl_thread *thread, struct udp_sess *sess,
+		     const void *buf, uint16_t data_len)
 {
-	uint16_t data_len;
 	ssize_t write_ret;
 	uint32_t emergency_count = 0;
 	int tun_fd = thread->state->tun_fds[0];
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
 
-	data_len  = ntohs(srv_pkt->len);
+	if (thread->state->cfg->sys.shared_nothing)
+		tun_fd = thread->state->tun_fds[thread->idx];
+
+	if (unlikely(!from_own_addr(sess, buf, data_len))) {
+		mt_fetch_add(&sess->spoof_drop, 1u);
+		return 0;
+	}
+
+	if (unlikely(mt_load(&sess->acl)) &&
+	    !flow_acl_from(thread, sess, buf, data_len)) {
+		mt_fetch_add(&sess->acl_drop, 1u);
+		return 0;
+	}
 
 write_again:
-	write_ret = write(tun_fd, srv_pkt->__raw, data_len);
+	write_ret = write(tun_fd, buf, data_len);
+	tfr_rec(thread->fr, TFR_EV_TUN_TX, tun_fd, 0u,
+		(write_ret > 0) ? (size_t)write_ret : 0u, sess->idx,
+		(write_ret < 0) ? -errno : 0);
 	if (unlikely(write_ret <= 0)) {
 		int err = errno;
 
@@ -507,11 +1450,22 @@ write_again:
 		}
 
 		if (err == EAGAIN) {
+			tshed_note_full(&thread->state->shed);
+			if (shed_active(thread->state)) {
+				tshed_count(&thread->state->shed.drop_full);
+				if (emergency_count > 0)
+					thread->state->in_emergency = false;
+				return 0;
+			}
+
 			thread->state->in_emergency = true;
 
 			if (emergency_count++ == 0) {
 				pr_emerg("TUN buffer is full, cannot write!");
 				pr_emerg("Initiate soft loop on sys_write...");
+				tfr_rec(thread->fr, TFR_EV_STALL, tun_fd, 0u,
+					data_len, sess->idx, -EAGAIN);
+				tfr_dump(thread->fr, "TUN write stall");
 			}
 
 			if (emergency_count > 5000) {
@@ -521,6 +1475,7 @@ write_again:
 
 			/* Calm down a bit... */
 			usleep(100000);
+			shed_tick(thread, thread->state);
 			goto write_again;
 		}
 
@@ -545,193 +1500,1143 @@ write_again:
 }
 
 
-static int __handle_event_udp(struct epl_thread *thread,
-			      struct srv_udp_state *state,
-			      struct udp_sess *sess)
+static int handle_tun_data(struct epl_thread *thread, struct udp_sess *sess)
+{
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	return write_tun(thread, sess, srv_pkt->__raw, ntohs(srv_pkt->len));
+}
+
+
+/*
+ * Split a TCLI_PKT_TUN_AGG packet and write every inner packet to
+ * the TUN fd.
+ */
+static int handle_tun_agg(struct epl_thread *thread, struct udp_sess *sess)
+{
+	int ret;
+	size_t rem;
+	uint16_t len;
+	const uint8_t *p, *data;
+	struct cli_pkt *cli_pkt = &thread->pkt->cli;
+
+	if (unlikely(!sess->is_authenticated))
+		return -EBADRQC;
+
+	if (unlikely(thread->pkt->len < PKT_MIN_LEN))
+		return 0;
+
+	rem = (size_t)ntohs(cli_pkt->len);
+	if (unlikely(rem > thread->pkt->len - PKT_MIN_LEN))
+		rem = thread->pkt->len - PKT_MIN_LEN;
+
+	p = (const uint8_t *)cli_pkt->__raw;
+	while (tagg_next(&p, &rem, &data, &len)) {
+		ret = write_tun(thread, sess, data, len);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * The client talks FEC, returns its FEC state or NULL if we don't
+ * do FEC.
+ */
+static struct fec_state *sess_fec_on(struct epl_thread *thread,
+				     struct udp_sess *sess)
+{
+	struct srv_cfg_sock *sock = &thread->state->cfg->sock;
+
+	if (likely(mt_load(&sess->fec_on)))
+		return sess->fec;
+
+	if (!sock->fec)
+		return NULL;
+
+	if (!sess->fec) {
+		sess->fec = fec_state_new(sock->fec_k, sock->fec_m_max,
+			FEC_SHARD_SIZE(thread->state->pkt_data_size));
+		if (unlikely(!sess->fec)) {
+			pr_err("Cannot allocate FEC state for " PRWIU,
+			       W_IU(sess));
+			return NULL;
+		}
+	} else {
+		mutex_lock(&sess->fec->enc_lock);
+		fec_state_reset(sess->fec);
+		mutex_unlock(&sess->fec->enc_lock);
+	}
+
+	mt_store(&sess->fec_on, true);
+	prl_notice(2, "FEC is enabled for " PRWIU, W_IU(sess));
+	return sess->fec;
+}
+
+
+/*
+ * Write the data shards in @rec to TUN and report the loss rate to
+ * the client when it is due.
+ */
+static int fec_deliver(struct epl_thread *thread, struct udp_sess *sess,
+		       struct fec_state *fs, uint32_t rec)
+{
+	int ret;
+	uint8_t i;
+	uint16_t len;
+	ssize_t send_ret;
+	const uint8_t *data;
+	uint8_t buf[PKT_MIN_LEN + sizeof(struct pkt_fec_report)];
+
+	if (!fs)
+		return 0;
+
+	while (rec) {
+		i    = (uint8_t)__builtin_ctz(rec);
+		rec &= rec - 1u;
+		data = fec_dec_shard(&fs->dec, i, &len);
+		pr_debug("[thread=%hu] FEC recovered %hu bytes for " PRWIU,
+			 thread->idx, len, W_IU(sess));
+		ret = write_tun(thread, sess, data, len);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (fec_dec_report_due(&fs->dec)) {
+		send_ret = send_to_client(thread, sess, buf,
+					  fec_pkt_report(buf,
+							 TSRV_PKT_FEC_REPORT,
+							 fs->dec.loss));
+		if (unlikely(send_ret < 0))
+			return (int)send_ret;
+	}
+
+	return 0;
+}
+
+
+static int handle_fec_data(struct epl_thread *thread, struct udp_sess *sess)
+{
+	int ret;
+	uint16_t len;
+	bool dup = false;
+	uint32_t rec = 0;
+	const uint8_t *data;
+	struct fec_state *fs;
+	const struct pkt_fec_hdr *hdr;
+
+	if (unlikely(!sess->is_authenticated))
+		return -EBADRQC;
+
+	hdr = fec_pkt_hdr(&thread->pkt->cli, thread->pkt->len, &data, &len);
+	if (unlikely(!hdr))
+		return 0;
+
+	fs = sess_fec_on(thread, sess);
+	if (fs)
+		rec = fec_dec_data(&fs->dec, hdr, data, len, &dup);
+
+	if (!dup) {
+		ret = write_tun(thread, sess, data, len);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return fec_deliver(thread, sess, fs, rec);
+}
+
+
+static int handle_fec_parity(struct epl_thread *thread, struct udp_sess *sess)
+{
+	uint16_t len;
+	uint32_t rec;
+	const uint8_t *data;
+	struct fec_state *fs;
+	const struct pkt_fec_hdr *hdr;
+
+	if (unlikely(!sess->is_authenticated))
+		return -EBADRQC;
+
+	hdr = fec_pkt_hdr(&thread->pkt->cli, thread->pkt->len, &data, &len);
+	if (unlikely(!hdr))
+		return 0;
+
+	fs = sess_fec_on(thread, sess);
+	if (!fs)
+		return 0;
+
+	rec = fec_dec_parity(&fs->dec, hdr, data, len);
+	return fec_deliver(thread, sess, fs, rec);
+}
+
+
+static int handle_fec_report(struct epl_thread *thread, struct udp_sess *sess)
+{
+	uint16_t loss;
+	struct fec_state *fs = sess->fec;
+
+	if (unlikely(!sess->is_authenticated))
+		return -EBADRQC;
+
+	if (!mt_load(&sess->fec_on) ||
+	    thread->pkt->len < PKT_MIN_LEN + sizeof(struct pkt_fec_report))
+		return 0;
+
+	loss = ntohs(thread->pkt->cli.fec_report.loss);
+	mutex_lock(&fs->enc_lock);
+	fec_enc_set_loss(&fs->enc, loss);
+	mutex_unlock(&fs->enc_lock);
+
+	if (thread->state->pace_mode != TPACE_MODE_OFF) {
+		/*
+		 * The client measures the loss on our egress path, so
+		 * it also drives the pacing rate of this session.
+		 */
+		uint32_t kbps;
+
+		kbps = tpace_adjust(&sess->pace, loss > FEC_LOSS_SCALE / 50u,
+				    thread->state->cfg->sock.pacing_rate);
+		pr_debug("[thread=%hu] Pacing " PRWIU " at %u kbit/s",
+			 thread->idx, W_IU(sess), kbps);
+		(void)kbps;
+	}
+	pr_debug("[thread=%hu] FEC loss %hu/%u, %hhu parity for " PRWIU,
+		 thread->idx, loss, FEC_LOSS_SCALE, fs->enc.m, W_IU(sess));
+	return 0;
+}
+
+
+static int handle_sync(struct epl_thread *thread, struct udp_sess *sess,
+		       uint8_t type)
+{
+	int ret;
+	ssize_t send_ret;
+	uint64_t rx_ns;
+	uint8_t buf[PKT_MIN_LEN + sizeof(struct pkt_sync)];
+
+	if (unlikely(!sess->is_authenticated))
+		return -EBADRQC;
+
+	if (thread->pkt->len < PKT_MIN_LEN + sizeof(struct pkt_sync))
+		return 0;
+
+	if (thread->state->cfg->sock.timestamping && thread->rx_stamp.sw_ns)
+		rx_ns = thread->rx_stamp.sw_ns;
+	else
+		rx_ns = tts_now_ns();
+
+	ret = tprobe_rx(&sess->probe, &thread->pkt->cli.sync,
+			thread->pkt->len - PKT_MIN_LEN, rx_ns);
+	if (unlikely(ret))
+		return 0;
+
+	if (type != TCLI_PKT_REQSYNC)
+		return 0;
+
+	/*
+	 * Answer right away, the time we hold the probe is part of
+	 * the echo and is taken out of the RTT on both sides.
+	 */
+	send_ret = send_to_client(thread, sess, buf,
+				  tprobe_pkt(buf, TSRV_PKT_SYNC, &sess->probe,
+					     tts_now_ns()));
+	if (unlikely(send_ret < 0))
+		return (int)send_ret;
+
+	return 0;
+}
+
+
+static int __handle_event_udp(struct epl_thread *thread,
+			      struct srv_udp_state *state,
+			      struct udp_sess *sess)
+{
+	struct cli_pkt *cli_pkt = &thread->pkt->cli;
+	(void)state;
+
+	switch (cli_pkt->type) {
+	case TCLI_PKT_HANDSHAKE:
+		/*
+		 * We have done the protocol handshake, this is a no-op.
+		 */
+		return 0;
+	case TCLI_PKT_AUTH:
+		return handle_clpkt_auth(thread, sess, &cli_pkt->auth);
+	case TCLI_PKT_HANDSHAKE_AUTH:
+		if (unlikely(thread->pkt->len < PKT_MIN_LEN +
+						sizeof(cli_pkt->hs_auth)))
+			return 0;
+		return handle_clpkt_auth(thread, sess, &cli_pkt->hs_auth.auth);
+	case TCLI_PKT_TUN_DATA:
+		return handle_tun_data(thread, sess);
+	case TCLI_PKT_TUN_AGG:
+		return handle_tun_agg(thread, sess);
+	case TCLI_PKT_FEC_DATA:
+		return handle_fec_data(thread, sess);
+	case TCLI_PKT_FEC_PARITY:
+		return handle_fec_parity(thread, sess);
+	case TCLI_PKT_FEC_REPORT:
+		return handle_fec_report(thread, sess);
+	case TCLI_PKT_REQSYNC:
+	case TCLI_PKT_SYNC:
+		return handle_sync(thread, sess, cli_pkt->type);
+	case TCLI_PKT_PING:
+		return sess->is_authenticated ? 0 : -EBADRQC;
+	case TCLI_PKT_CLOSE:
+		close_udp_session(thread, sess);
+		return 0;
+	default:
+
+		if (sess->is_authenticated) {
+			/*
+			 * If an authenticated client sends an invalid packet,
+			 * give it a chance to sync. It could be a bit network
+			 * problem.
+			 */
+			// return request_sync(thread, sess);
+			return 0;
+		}
+
+		/* Bad packet! */
+		return -EBADRQC;
+	}
+}
+
+
+/*
+ * Keep the highest roaming tag counter of @sess. Only a verified tag
+ * counts, a forged one must not be able to lock the session in place.
+ */
+static __always_inline void roam_ctr_update(struct epl_thread *thread,
+					    struct udp_sess *sess)
+{
+	uint32_t ctr;
+	struct pkt_roam tag;
+
+	if (!troam_pad(&thread->pkt->cli, thread->pkt->len, &tag, sizeof(tag)))
+		return;
+
+	ctr = ntohl(tag.ctr);
+	if ((int32_t)(ctr - sess->roam_ctr) > 0 &&
+	    ntohs(tag.idx) == sess->idx &&
+	    troam_verify(&sess->roam, &thread->pkt->cli, &tag))
+		sess->roam_ctr = ctr;
+}
+
+
+/*
+ * A packet from an unknown address. If it carries a valid roaming tag
+ * newer than anything seen on the session it names, the client moved
+ * (e.g. a NAT rebinding), move the session along with it and store it
+ * in @sess_p. Returns -EAGAIN if the packet has to be dropped.
+ *
+ * In shared-nothing mode the new address usually hashes to another
+ * thread, which cannot take over the session, that case is left to
+ * the normal new client path.
+ */
+static int roam_udp_sess(struct epl_thread *thread, struct srv_udp_state *state,
+			 const struct sockaddr_in *saddr,
+			 struct udp_sess **sess_p)
+{
+	int ret;
+	uint32_t ctr;
+	uint16_t idx, old_port;
+	struct pkt_roam tag;
+	struct udp_sess *sess;
+	char old_addr[IPV4_L];
+
+	if (!troam_pad(&thread->pkt->cli, thread->pkt->len, &tag, sizeof(tag)))
+		return 0;
+
+	idx = ntohs(tag.idx);
+	if (unlikely(idx >= state->cfg->sock.max_conn))
+		return 0;
+
+	sess = &state->sess_arr[idx];
+	if (!mt_load(&sess->is_connected) || !sess->is_authenticated)
+		return 0;
+
+	if (state->cfg->sys.shared_nothing && sess->owner != thread->idx)
+		return 0;
+
+	ctr = ntohl(tag.ctr);
+	if ((int32_t)(ctr - sess->roam_ctr) <= 0 ||
+	    !troam_verify(&sess->roam, &thread->pkt->cli, &tag))
+		return 0;
+
+	strncpy2(old_addr, sess->str_src_addr, sizeof(old_addr));
+	old_port = sess->src_port;
+	ret = rebind_udp_sess(state, sess, saddr);
+	if (unlikely(ret)) {
+		pr_err("Cannot rebind session %hu: " PRERF, idx, PREAR(-ret));
+		close_udp_session(thread, sess);
+		return -EAGAIN;
+	}
+
+	sess->roam_ctr = ctr;
+	prl_notice(2, "Session %hu (user: %s) roamed from %s:%hu to %s:%hu",
+		   idx, sess->username, old_addr, old_port, sess->str_src_addr,
+		   sess->src_port);
+	srv_repl_sess_event(state, REPL_MSG_SESS_AUTH, sess);
+	*sess_p = sess;
+	return 0;
+}
+
+
+static int _handle_event_udp(struct epl_thread *thread,
+			     struct srv_udp_state *state,
+			     struct sockaddr_in *saddr,
+			     const struct sockaddr_in *lb_addr)
+{
+	int ret;
+	uint16_t port;
+	uint32_t addr;
+	struct udp_sess *sess;
+
+	port = ntohs(saddr->sin_port);
+	addr = ntohl(saddr->sin_addr.s_addr);
+	sess = map_find_udp_sess(state, thread->idx, addr, port);
+	if (likely(sess)) {
+		roam_ctr_update(thread, sess);
+	} else {
+		ret = roam_udp_sess(thread, state, saddr, &sess);
+		if (unlikely(ret))
+			return (ret == -EAGAIN) ? 0 : ret;
+	}
+
+	if (unlikely(!sess)) {
+		/*
+		 * It's a new client since we don't find it in
+		 * the session map.
+		 */
+		ret = handle_new_client(thread, state, addr, port, saddr,
+					lb_addr);
+		tfr_rec(thread->fr, TFR_EV_UDP_RX, thread->udp_fd,
+			thread->pkt->cli.type, thread->pkt->len, TFR_NO_SESS,
+			ret);
+		return (ret == -EAGAIN) ? 0 : ret;
+	}
+
+	if (lb_addr) {
+		/*
+		 * Any load balancer instance may forward this client.
+		 */
+		uint64_t lb_val = udp_addr_pack(lb_addr);
+
+		if (unlikely(mt_load(&sess->lb_addr) != lb_val))
+			mt_store(&sess->lb_addr, lb_val);
+	}
+
+	if (state->cfg->sock.timestamping)
+		tts_rx_account(&sess->rx_ts, &thread->rx_stamp, thread->wake_ns);
+
+	ret = __handle_event_udp(thread, state, sess);
+	tfr_rec(thread->fr, TFR_EV_UDP_RX, thread->udp_fd, thread->pkt->cli.type,
+		thread->pkt->len, sess->idx, ret);
+	if (unlikely(ret)) {
+		if (ret == -EBADRQC) {
+			close_udp_session(thread, sess);
+			return 0;
+		}
+		return ret;
+	}
+
+	return 0;
+}
+
+
+static ssize_t do_recvfrom(struct epl_thread *thread,
+			   int udp_fd, struct sockaddr_in *saddr,
+			   socklen_t *saddr_len)
+{
+	int ret;
+	ssize_t recv_ret;
+	struct iovec iov;
+	struct msghdr msg;
+	union rx_cmsg_buf cbuf;
+	const size_t recv_size = PKT_MIN_LEN + thread->state->pkt_data_size;
+
+	iov.iov_base = thread->pkt->__raw;
+	iov.iov_len  = recv_size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = saddr;
+	msg.msg_namelen = *saddr_len;
+	msg.msg_iov     = &iov;
+	msg.msg_iovlen  = 1;
+	msg.msg_control    = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	recv_ret = recvmsg(udp_fd, &msg, 0);
+	if (unlikely(recv_ret <= 0)) {
+
+		if (recv_ret == 0) {
+			if (recv_size == 0)
+				return 0;
+
+			pr_err("UDP socket disconnected!");
+			return -ENETDOWN;
+		}
+
+		ret = errno;
+		if (ret == EAGAIN)
+			return 0;
+
+		if (ret == ECONNREFUSED && udp_fd != thread->udp_fd)
+			/*
+			 * An ICMP error on a connected session socket,
+			 * see sendmsg_to_client().
+			 */
+			return 0;
+
+		pr_err("recvmsg(udp_fd) (fd=%d): " PRERF, udp_fd, PREAR(ret));
+		return -ret;
+	}
+
+	*saddr_len = msg.msg_namelen;
+	thread->pkt->len = (size_t)recv_ret;
+	pr_debug("[thread=%hu] recvmsg() %zd bytes", thread->idx, recv_ret);
+
+	if (msg.msg_controllen) {
+		tsbuf_cmsg_rx(thread->sbuf, &msg);
+		if (thread->state->cfg->sock.timestamping) {
+			thread->rx_stamp.recv_ns = tts_now_ns();
+			tts_cmsg_rx(&msg, &thread->rx_stamp);
+		}
+	}
+
+	return recv_ret;
+}
+
+
+static __always_inline bool from_lb(const struct srv_cfg_sock *sock,
+				    const struct sockaddr_in *addr)
+{
+	uint8_t i;
+
+	for (i = 0; i < sock->nr_lb_addr; i++) {
+		if (addr->sin_addr.s_addr == sock->lb_addr[i])
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * behind_lb mode: every datagram starts with a struct pkt_lb_hdr,
+ * strip it and take the client address from it. @lb_addr is the
+ * load balancer that forwarded the datagram, it must be one of the
+ * [socket] lb_addr, the header is not trusted from anybody else.
+ */
+static ssize_t do_recvfrom_lb(struct epl_thread *thread, int udp_fd,
+			      struct sockaddr_in *saddr,
+			      struct sockaddr_in *lb_addr)
+{
+	int ret;
+	ssize_t recv_ret;
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct pkt_lb_hdr hdr;
+	union rx_cmsg_buf cbuf;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len  = sizeof(hdr);
+	iov[1].iov_base = thread->pkt->__raw;
+	iov[1].iov_len  = PKT_MIN_LEN + thread->state->pkt_data_size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = lb_addr;
+	msg.msg_namelen = sizeof(*lb_addr);
+	msg.msg_iov     = iov;
+	msg.msg_iovlen  = 2;
+	msg.msg_control    = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	recv_ret = recvmsg(udp_fd, &msg, 0);
+	if (unlikely(recv_ret < 0)) {
+		ret = errno;
+		if (ret == EAGAIN)
+			return 0;
+
+		pr_err("recvmsg(udp_fd) (fd=%d): " PRERF, udp_fd, PREAR(ret));
+		return -ret;
+	}
+
+	if (unlikely(!from_lb(&thread->state->cfg->sock, lb_addr))) {
+		pr_debug("Dropping datagram from port %hu, not a load "
+			 "balancer", ntohs(lb_addr->sin_port));
+		return 0;
+	}
+
+	if (unlikely((size_t)recv_ret <= sizeof(hdr) ||
+		     hdr.magic != htonl(TLB_MAGIC))) {
+		pr_debug("Dropping datagram without LB header (%zd bytes)",
+			 recv_ret);
+		return 0;
+	}
+
+	memset(saddr, 0, sizeof(*saddr));
+	saddr->sin_family      = AF_INET;
+	saddr->sin_addr.s_addr = hdr.addr;
+	saddr->sin_port        = hdr.port;
+
+	if (msg.msg_controllen) {
+		tsbuf_cmsg_rx(thread->sbuf, &msg);
+		if (thread->state->cfg->sock.timestamping) {
+			thread->rx_stamp.recv_ns = tts_now_ns();
+			tts_cmsg_rx(&msg, &thread->rx_stamp);
+		}
+	}
+
+	recv_ret -= (ssize_t)sizeof(hdr);
+	thread->pkt->len = (size_t)recv_ret;
+	return recv_ret;
+}
+
+
+static int handle_event_udp(struct epl_thread *thread,
+			    struct srv_udp_state *state, int udp_fd)
+{
+	ssize_t recv_ret;
+	struct sockaddr_in saddr, lb_addr;
+	socklen_t saddr_len = sizeof(saddr);
+
+	if (state->cfg->sock.behind_lb) {
+		recv_ret = do_recvfrom_lb(thread, udp_fd, &saddr, &lb_addr);
+		if (unlikely(recv_ret <= 0))
+			return (int)recv_ret;
+
+		return _handle_event_udp(thread, state, &saddr, &lb_addr);
+	}
+
+	recv_ret = do_recvfrom(thread, udp_fd, &saddr, &saddr_len);
+	if (unlikely(recv_ret <= 0))
+		return (int)recv_ret;
+
+	return _handle_event_udp(thread, state, &saddr, NULL);
+}
+
+
+/*
+ * The ACL of @sess lets the TUN packet in @srv_pkt through to the
+ * client.
+ */
+static __always_inline bool acl_to_client(struct udp_sess *sess,
+					  const struct srv_pkt *srv_pkt,
+					  size_t send_len)
+{
+	bool allow;
+	const struct tacl *acl = udp_sess_acl_get(sess);
+
+	if (likely(!acl))
+		return true;
+
+	allow = tacl_to_client(acl, srv_pkt->__raw, send_len - PKT_MIN_LEN);
+	udp_sess_acl_put(sess);
+	if (!allow)
+		mt_fetch_add(&sess->acl_drop, 1u);
+	return allow;
+}
+
+
+/*
+ * The destination session of the IPv4 TUN packet @buf, through the
+ * flow cache. Returns its index, -ENOENT if no session has the
+ * destination address, -EACCES if the ACL of the session drops it.
+ */
+static int32_t flow_route(struct epl_thread *thread, const void *buf,
+			  size_t len)
+{
+	bool allow;
+	int32_t find;
+	struct udp_sess *sess;
+	struct tflow_ent k, *e;
+	const struct tacl *acl;
+	struct srv_udp_state *state = thread->state;
+	const uint32_t gen = mt_load(&state->flow_gen);
+
+	if (unlikely(!tflow_key(&k, buf, len, TFLOW_TO_CLI, 0u))) {
+		/*
+		 * A bad header, nothing to key on. The ACL drops it
+		 * if there is one.
+		 */
+		const struct iphdr *iph = buf;
+
+		find = get_route_map(state->ipv4_map, ntohl(iph->daddr));
+		if (find == -1)
+			return -ENOENT;
+
+		sess = &state->sess_arr[find];
+		if (mt_load(&sess->acl)) {
+			mt_fetch_add(&sess->acl_drop, 1u);
+			return -EACCES;
+		}
+
+		return find;
+	}
+
+	e = tflow_slot(thread->flows, &k);
+	if (likely(tflow_hit(e, &k, gen))) {
+		thread->flow_hit++;
+		if (e->dst == TFLOW_NO_SESS)
+			return -ENOENT;
+		if (likely(e->allow))
+			return (int32_t)e->dst;
+
+		mt_fetch_add(&state->sess_arr[e->dst].acl_drop, 1u);
+		return -EACCES;
+	}
+
+	thread->flow_miss++;
+	find = get_route_map(state->ipv4_map, k.daddr);
+	if (find == -1) {
+		tflow_fill(e, &k, TFLOW_NO_SESS, true, gen);
+		return -ENOENT;
+	}
+
+	sess  = &state->sess_arr[find];
+	acl   = udp_sess_acl_get(sess);
+	allow = true;
+	if (acl) {
+		allow = tacl_match(acl, k.saddr, k.proto, tflow_sport(&k));
+		udp_sess_acl_put(sess);
+	}
+	tflow_fill(e, &k, (uint16_t)find, allow, gen);
+	if (likely(allow))
+		return find;
+
+	mt_fetch_add(&sess->acl_drop, 1u);
+	return -EACCES;
+}
+
+
+/*
+ * Shared-nothing mode: hand @srv_pkt to thread @owner, which sends
+ * it to session @dst (or to all of its sessions for SN_DST_BCAST).
+ * The packet is dropped if the owner's ring is full.
+ */
+static void sn_forward(struct epl_thread *thread, uint8_t owner, uint16_t dst,
+		       struct srv_pkt *srv_pkt, size_t send_len,
+		       const struct tqos_mark *mark)
+{
+	struct sn_fwd *fwd;
+	struct mpsc_slot *slot;
+	struct epl_thread *to = &thread->state->epl_threads[owner];
+
+	slot = mpsc_reserve(&to->fwd_ring);
+	if (unlikely(!slot)) {
+		pr_debug("[thread=%hu] fwd_ring of thread %hhu is full",
+			 thread->idx, owner);
+		tshed_note_full(&thread->state->shed);
+		return;
+	}
+
+	fwd           = (struct sn_fwd *)(slot + 1);
+	fwd->dst      = dst;
+	fwd->len      = send_len;
+	fwd->has_mark = (mark != NULL);
+	if (mark)
+		fwd->mark = *mark;
+	memcpy(&fwd->pkt, srv_pkt, send_len);
+	mpsc_commit(slot);
+
+	thread->fwd_kick[owner / 64u] |= (1ull << (owner % 64u));
+}
+
+
+/*
+ * Wake up the threads we have forwarded packets to.
+ */
+static void sn_kick(struct epl_thread *thread)
+{
+	uint8_t i, nn = thread->state->cfg->sys.thread_num;
+	struct epl_thread *threads = thread->state->epl_threads;
+
+	for (i = 0; i < nn; i++) {
+		uint64_t bit = 1ull << (i % 64u);
+
+		if (!(thread->fwd_kick[i / 64u] & bit))
+			continue;
+
+		thread->fwd_kick[i / 64u] &= ~bit;
+		eventfd_write(threads[i].evt_fd, 1);
+	}
+}
+
+
+/*
+ * Send to every authenticated session, in shared-nothing mode only
+ * to the sessions this thread owns.
+ */
+static int broadcast_packet(struct epl_thread *thread,
+			    struct srv_pkt *srv_pkt, size_t send_len,
+			    const struct tqos_mark *mark)
+{
+	size_t i;
+	ssize_t send_ret;
+	struct srv_udp_state *state = thread->state;
+	struct udp_sess	*sess_arr = state->sess_arr;
+	uint16_t max_conn = state->cfg->sock.max_conn;
+	const bool sn = state->cfg->sys.shared_nothing;
+
+	for (i = 0; i < max_conn; i++) {
+		struct udp_sess	*sess = &sess_arr[i];
+
+		if (!sess->is_authenticated)
+			continue;
+
+		if (sn && sess->owner != thread->idx)
+			continue;
+
+		if (!acl_to_client(sess, srv_pkt, send_len))
+			continue;
+
+		send_ret = send_data_to_client(thread, sess, srv_pkt, send_len,
+					       mark);
+		if (send_ret < 0)
+			return (int)send_ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * return -ENOENT if cannot find the destination.
+ * return 0 if it finds the destination.
+ * return -errno if it errors.
+ */
+static int route_ipv4_packet(struct epl_thread *thread,
+			     struct udp_sess *sess_arr, struct srv_pkt *srv_pkt,
+			     size_t send_len, const struct tqos_mark *mark)
+{
+	uint16_t idx;
+	int32_t find;
+	ssize_t send_ret;
+	struct udp_sess *dst_sess;
+
+	find = flow_route(thread, srv_pkt->__raw, send_len - PKT_MIN_LEN);
+	if (find == -EACCES)
+		return 0;
+	if (find == -ENOENT)
+		return -ENOENT;
+
+	idx      = (uint16_t)find;
+	dst_sess = &sess_arr[idx];
+
+	if (thread->state->cfg->sys.shared_nothing &&
+	    dst_sess->owner != thread->idx) {
+		sn_forward(thread, dst_sess->owner, idx, srv_pkt, send_len,
+			   mark);
+		return 0;
+	}
+
+	send_ret = send_tun_to_client(thread, dst_sess, srv_pkt, send_len,
+				      mark);
+	if (send_ret < 0)
+		return (int)send_ret;
+
+	return 0;
+}
+
+
+static int route_packet(struct epl_thread *thread, struct srv_udp_state *state,
+			struct sc_pkt *pkt, const struct tqos_mark *mark)
 {
-	struct cli_pkt *cli_pkt = &thread->pkt->cli;
-	(void)state;
+	int ret;
+	uint8_t i, nn;
+	size_t send_len;
+	struct srv_pkt *srv_pkt = &pkt->srv;
+	struct udp_sess	*sess_arr = state->sess_arr;
+	struct iphdr *iphdr = &srv_pkt->tun_data.iphdr;
 
-	switch (cli_pkt->type) {
-	case TCLI_PKT_HANDSHAKE:
-		/*
-		 * We have done the protocol handshake, this is a no-op.
-		 */
-		return 0;
-	case TCLI_PKT_AUTH:
-		return handle_clpkt_auth(thread, sess);
-	case TCLI_PKT_TUN_DATA:
-		return handle_tun_data(thread, sess);
-	case TCLI_PKT_REQSYNC:
-		return 0;
-	case TCLI_PKT_SYNC:
-		return 0;
-	case TCLI_PKT_PING:
-		return sess->is_authenticated ? 0 : -EBADRQC;
-	case TCLI_PKT_CLOSE:
-		close_udp_session(thread, sess);
-		return 0;
-	default:
+	send_len = srv_pprep(srv_pkt, TSRV_PKT_TUN_DATA, (uint16_t)pkt->len, 0);
+	if (likely(iphdr->version == 4)) {
+		ret = route_ipv4_packet(thread, sess_arr, srv_pkt, send_len,
+					mark);
+		if (ret != -ENOENT)
+			return ret;
+	}
 
-		if (sess->is_authenticated) {
-			/*
-			 * If an authenticated client sends an invalid packet,
-			 * give it a chance to sync. It could be a bit network
-			 * problem.
-			 */
-			// return request_sync(thread, sess);
-			return 0;
+	/*
+	 * Broadcast this to all authenticated clients.
+	 */
+	if (state->cfg->sys.shared_nothing) {
+		nn = state->cfg->sys.thread_num;
+		for (i = 0; i < nn; i++) {
+			if (i != thread->idx)
+				sn_forward(thread, i, SN_DST_BCAST, srv_pkt,
+					   send_len, mark);
 		}
-
-		/* Bad packet! */
-		return -EBADRQC;
 	}
+
+	return broadcast_packet(thread, srv_pkt, send_len, mark);
 }
 
 
-static int _handle_event_udp(struct epl_thread *thread,
-			     struct srv_udp_state *state,
-			     struct sockaddr_in *saddr)
+/*
+ * Shared-nothing mode: send the packets other threads forwarded to
+ * the sessions we own.
+ */
+static int handle_event_fwd(struct epl_thread *thread)
 {
 	int ret;
-	uint16_t port;
-	uint32_t addr;
+	eventfd_t val;
+	ssize_t send_ret;
+	struct sn_fwd *fwd;
 	struct udp_sess *sess;
+	struct mpsc_slot *slot;
+	const struct tqos_mark *mark;
+	struct srv_udp_state *state = thread->state;
+
+	eventfd_read(thread->evt_fd, &val);
+	while ((slot = mpsc_peek(&thread->fwd_ring))) {
+		fwd  = (struct sn_fwd *)(slot + 1);
+		mark = fwd->has_mark ? &fwd->mark : NULL;
+		tfr_rec(thread->fr, TFR_EV_FWD, thread->evt_fd, fwd->pkt.type,
+			fwd->len, fwd->dst, 0);
+
+		if (fwd->dst == SN_DST_BCAST) {
+			ret = broadcast_packet(thread, &fwd->pkt, fwd->len,
+					       mark);
+			if (unlikely(ret)) {
+				mpsc_release(&thread->fwd_ring, slot);
+				return ret;
+			}
+			goto next;
+		}
 
-	port = ntohs(saddr->sin_port);
-	addr = ntohl(saddr->sin_addr.s_addr);
-	sess = map_find_udp_sess(state, addr, port);
-	if (unlikely(!sess)) {
-		/*
-		 * It's a new client since we don't find it in
-		 * the session map.
-		 */
-		ret = handle_new_client(thread, state, addr, port, saddr);
-		return (ret == -EAGAIN) ? 0 : ret;
-	}
+		sess = &state->sess_arr[fwd->dst];
+		if (unlikely(sess->owner != thread->idx ||
+			     !sess->is_authenticated))
+			/*
+			 * The session is gone or has moved on.
+			 */
+			goto next;
 
-	ret = __handle_event_udp(thread, state, sess);
-	if (unlikely(ret)) {
-		if (ret == -EBADRQC) {
-			close_udp_session(thread, sess);
-			return 0;
+		send_ret = send_tun_to_client(thread, sess, &fwd->pkt,
+					      fwd->len, mark);
+		if (unlikely(send_ret < 0)) {
+			mpsc_release(&thread->fwd_ring, slot);
+			return (int)send_ret;
 		}
-		return ret;
+	next:
+		mpsc_release(&thread->fwd_ring, slot);
 	}
 
-	return 0;
+	return flush_fec(thread);
 }
 
 
-static ssize_t do_recvfrom(struct epl_thread *thread,
-			   int udp_fd, struct sockaddr_in *saddr,
-			   socklen_t *saddr_len)
+/*
+ * Send the datagrams of the userspace pacer queue that are due.
+ */
+static int handle_event_pace(struct epl_thread *thread)
 {
-	int ret;
-	ssize_t recv_ret;
-	char *buf = thread->pkt->__raw;
-	struct sockaddr *src_addr = (struct sockaddr *)saddr;
-	const size_t recv_size = sizeof(thread->pkt->cli.__raw);
+	uint64_t now, exp;
+	ssize_t send_ret;
+	struct iovec iov[2];
+	struct tpace_ent ent;
+	struct udp_sess *sess;
+	struct pace_slot *slot;
 
-	recv_ret = recvfrom(udp_fd, buf, recv_size, 0, src_addr, saddr_len);
-	if (unlikely(recv_ret <= 0)) {
+	if (read(thread->pace_fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+		pr_err("read(pace_fd): " PRERF, PREAR(errno));
 
-		if (recv_ret == 0) {
-			if (recv_size == 0)
-				return 0;
+	thread->pace_armed = 0;
+	now = tpace_now_ns();
+	while (thread->nr_paced) {
+		if (thread->pace_heap[0].t > now + TPACE_SLACK_NS)
+			return pace_arm(thread, thread->pace_heap[0].t);
 
-			pr_err("UDP socket disconnected!");
-			return -ENETDOWN;
-		}
+		ent  = tpace_heap_pop(thread->pace_heap, &thread->nr_paced);
+		slot = pace_slot_at(thread, ent.slot);
+		sess = slot->sess;
 
-		ret = errno;
-		if (ret == EAGAIN)
-			return 0;
+		/*
+		 * The session may have been closed (or reused by
+		 * another client) while the datagram was waiting.
+		 */
+		send_ret = 0;
+		if (likely(mt_load(&sess->is_connected) &&
+			   sess->ipv4_iff == slot->ipv4_iff)) {
+			iov[1].iov_base = slot->data;
+			iov[1].iov_len  = slot->len;
+			send_ret = sendmsg_to_client(thread, sess, &iov[1], 1,
+						     slot->has_mark ? &slot->mark
+								    : NULL, 0);
+		}
 
-		pr_err("recvfrom(udp_fd) (fd=%d): " PRERF, udp_fd, PREAR(ret));
-		return -ret;
+		thread->pace_free[thread->nr_pace_free++] = ent.slot;
+		if (unlikely(send_ret < 0))
+			return (int)send_ret;
 	}
 
-	thread->pkt->len = (size_t)recv_ret;
-	pr_debug("[thread=%hu] recvfrom() %zd bytes", thread->idx, recv_ret);
+	return 0;
+}
 
-	return recv_ret;
+
+static int send_agg(struct epl_thread *thread, struct srv_agg *sa)
+{
+	int iovcnt;
+	ssize_t send_ret;
+
+	iovcnt   = tagg_finish(&sa->agg, TSRV_PKT_TUN_DATA);
+	send_ret = send_data_iov(thread, sa->sess, &sa->agg.iov[1], iovcnt,
+				 sa->mark);
+	if (unlikely(send_ret < 0))
+		return (int)send_ret;
+
+	return 0;
 }
 
 
-static int handle_event_udp(struct epl_thread *thread,
-			    struct srv_udp_state *state, int udp_fd)
+static int flush_aggs(struct epl_thread *thread)
 {
-	ssize_t recv_ret;
-	struct sockaddr_in saddr;
-	socklen_t saddr_len = sizeof(saddr);
+	int ret = 0;
+	uint8_t i;
 
-	recv_ret = do_recvfrom(thread, udp_fd, &saddr, &saddr_len);
-	if (unlikely(recv_ret <= 0))
-		return (int)recv_ret;
+	for (i = 0; i < thread->nr_aggs; i++) {
+		ret = send_agg(thread, &thread->aggs[i]);
+		if (unlikely(ret))
+			break;
+	}
 
-	return _handle_event_udp(thread, state, &saddr);
+	thread->nr_aggs = 0;
+	return ret;
 }
 
 
 /*
- * return -ENOENT if cannot find the destination.
- * return 0 if it finds the destination.
+ * Queue @pkt on the aggregate of its destination session.
+ *
+ * return -ENOENT if the packet can't be aggregated (too big, not
+ * unicast IPv4, the session talks FEC, or it is owned by another
+ * thread in shared-nothing mode).
+ * return 0 if it is queued.
  * return -errno if it errors.
  */
-static int route_ipv4_packet(struct epl_thread *thread, __be32 dst_addr,
-			     struct udp_sess *sess_arr, size_t send_len)
+static int agg_tun_packet(struct epl_thread *thread,
+			  struct srv_udp_state *state, struct sc_pkt *pkt,
+			  const struct tqos_mark *mark)
 {
-	uint16_t idx;
+	int ret;
+	uint8_t i;
 	int32_t find;
-	ssize_t send_ret;
-	struct udp_sess *dst_sess;
+	struct srv_agg *sa;
+	struct udp_sess *sess;
+	struct iphdr *iphdr = &pkt->srv.tun_data.iphdr;
+	const uint16_t max_size = state->cfg->sock.agg_size;
 
-	find = get_route_map(thread->state->ipv4_map, dst_addr);
-	if (unlikely(find == -1))
+	if (!tagg_is_small(pkt->len) || pkt->len < sizeof(*iphdr) ||
+	    iphdr->version != 4)
 		return -ENOENT;
 
-	idx      = (uint16_t)find;
-	dst_sess = &sess_arr[idx];
-	send_ret = send_to_client(thread, dst_sess, &thread->pkt->srv, send_len);
-	if (send_ret < 0)
-		return (int)send_ret;
+	find = flow_route(thread, pkt->srv.__raw, pkt->len);
+	if (find == -EACCES)
+		return 0;
+	if (find == -ENOENT)
+		return -ENOENT;
+
+	sess = &state->sess_arr[find];
+	if (state->cfg->sys.shared_nothing && sess->owner != thread->idx)
+		return -ENOENT;
+
+	if (mt_load(&sess->fec_on))
+		return -ENOENT;
+
+	for (i = 0; i < thread->nr_aggs; i++) {
+		if (thread->aggs[i].sess == sess)
+			break;
+	}
+
+	sa = &thread->aggs[i];
+	if (i == thread->nr_aggs) {
+		thread->nr_aggs++;
+		sa->sess = sess;
+		sa->mark = mark;
+		tagg_init(&sa->agg, TSRV_PKT_TUN_AGG);
+	}
+
+	if (tagg_add(&sa->agg, pkt->srv.__raw, (uint16_t)pkt->len, max_size))
+		return 0;
 
+	/*
+	 * Full, send it and start over with this packet.
+	 */
+	ret = send_agg(thread, sa);
+	if (unlikely(ret))
+		return ret;
+
+	sa->mark = mark;
+	tagg_init(&sa->agg, TSRV_PKT_TUN_AGG);
+	tagg_add(&sa->agg, pkt->srv.__raw, (uint16_t)pkt->len, max_size);
 	return 0;
 }
 
 
-static int route_packet(struct epl_thread *thread, struct srv_udp_state *state,
-			ssize_t len)
+static int dispatch_tun_queue(struct epl_thread *thread,
+			      struct srv_udp_state *state)
 {
 	int ret;
-	ssize_t send_ret;
-	size_t send_len, i;
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
-	struct udp_sess	*sess_arr = state->sess_arr;
-	uint16_t max_conn = state->cfg->sock.max_conn;
-	struct iphdr *iphdr = &srv_pkt->tun_data.iphdr;
-
-	send_len = srv_pprep(srv_pkt, TSRV_PKT_TUN_DATA, (uint16_t)len, 0);
-	if (likely(iphdr->version == 4)) {
-		ret = route_ipv4_packet(thread, ntohl(iphdr->daddr), sess_arr,
-					send_len);
-		if (ret != -ENOENT)
-			return ret;
-	}
+	uint8_t cls, i;
+	struct tqos_queue *q = &thread->tun_q;
+	const bool use_mark = state->cfg->sock.qos;
+	const bool use_agg = state->cfg->sock.aggregate;
+	const uint8_t shed = tshed_level(&state->shed);
 
 	/*
-	 * Broadcast this to all authenticated clients.
+	 * Strict priority: voice, then interactive, then bulk.
 	 */
-	for (i = 0; i < max_conn; i++) {
-		struct udp_sess	*sess = &sess_arr[i];
+	for (cls = 0; cls < TQOS_NR_CLASS; cls++) {
+		for (i = 0; i < q->nr[cls]; i++) {
+			uint8_t idx = q->idx[cls][i];
+			struct sc_pkt *pkt = tpkt_at(thread->tun_pkts, idx,
+						     state->pkt_buf_size);
+			const struct tqos_mark *mark;
+
+			mark = use_mark ? &thread->tun_marks[idx] : NULL;
+			if (unlikely(shed != TSHED_OFF) && use_mark &&
+			    cls == TQOS_CLASS_BULK) {
+				/*
+				 * Without qos everything is bulk, there
+				 * is nothing to tell apart then.
+				 */
+				if (shed == TSHED_DROP_BULK) {
+					tshed_count(&state->shed.drop_bulk);
+					continue;
+				}
+				thread->tun_marks[idx].tos  = TSHED_BULK_TOS;
+				thread->tun_marks[idx].prio = TC_PRIO_BULK;
+			}
+			if (use_agg) {
+				ret = agg_tun_packet(thread, state, pkt, mark);
+				if (ret != -ENOENT) {
+					if (unlikely(ret))
+						return ret;
+					continue;
+				}
+
+				/*
+				 * Don't let this one overtake the packets
+				 * that are already aggregated.
+				 */
+				ret = flush_aggs(thread);
+				if (unlikely(ret))
+					return ret;
+			}
 
-		if (!sess->is_authenticated)
-			continue;
+			ret = route_packet(thread, state, pkt, mark);
+			if (unlikely(ret))
+				return ret;
+		}
 
-		send_ret = send_to_client(thread, sess, srv_pkt, send_len);
-		if (send_ret < 0)
-			return (int)send_ret;
+		if (use_agg) {
+			ret = flush_aggs(thread);
+			if (unlikely(ret))
+				return ret;
+		}
 	}
 
 	return 0;
@@ -742,25 +2647,115 @@ static int handle_event_tun(struct epl_thread *thread,
 			    struct srv_udp_state *state, int tun_fd)
 {
 	int ret;
+	uint8_t i, cls;
 	ssize_t read_ret;
-	char *buf = thread->pkt->srv.__raw;
-	const size_t read_size = sizeof(thread->pkt->srv.__raw);
+	uint64_t first_us = 0;
+	struct tqos_queue *q = &thread->tun_q;
+	const bool use_qos = state->cfg->sock.qos;
+	const bool use_agg = state->cfg->sock.aggregate;
+	const size_t read_size = state->pkt_data_size;
+
+	tqos_queue_reset(q);
+	for (i = 0; i < TQOS_BATCH; i++) {
+		struct sc_pkt *pkt = tpkt_at(thread->tun_pkts, i,
+					     state->pkt_buf_size);
+		char *buf = pkt->srv.__raw;
+
+		if (use_agg && i > 0 &&
+		    tagg_now_us() - first_us >= state->cfg->sock.agg_latency_us)
+			/*
+			 * The first packet has waited long enough,
+			 * the rest is left for the next event.
+			 */
+			break;
 
-	read_ret = read(tun_fd, buf, read_size);
-	if (unlikely(read_ret < 0)) {
-		ret = errno;
-		if (likely(ret == EAGAIN))
-			return 0;
+		read_ret = read(tun_fd, buf, read_size);
+		tfr_rec(thread->fr, TFR_EV_TUN_RX, tun_fd, 0u,
+			(read_ret > 0) ? (size_t)read_ret : 0u, TFR_NO_SESS,
+			(read_ret < 0) ? -errno : 0);
+		if (unlikely(read_ret < 0)) {
+			ret = errno;
+			if (likely(ret == EAGAIN))
+				break;
+
+			pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
+			       PREAR(ret));
+			return -ret;
+		}
 
-		pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd, PREAR(ret));
-		return -ret;
+		pkt->len = (size_t)read_ret;
+		pr_debug("[thread=%hu] TUN read(%d, buf, %zu) = %zd bytes",
+			 thread->idx, tun_fd, read_size, read_ret);
+
+		if (use_agg && i == 0)
+			first_us = tagg_now_us();
+
+		cls = TQOS_CLASS_BULK;
+		if (use_qos)
+			cls = tqos_classify(buf, pkt->len,
+					    &thread->tun_marks[i]);
+		tqos_enqueue(q, cls, i);
 	}
 
-	thread->pkt->len = (size_t)read_ret;
-	pr_debug("[thread=%hu] TUN read(%d, buf, %zu) = %zd bytes",
-		 thread->idx, tun_fd, read_size, read_ret);
+	ret = dispatch_tun_queue(thread, state);
+	if (likely(!ret))
+		ret = flush_fec(thread);
+	if (state->cfg->sys.shared_nothing)
+		sn_kick(thread);
 
-	return route_packet(thread, state, read_ret);
+	return ret;
+}
+
+
+/*
+ * A datagram on a session's connected socket. It is handled like one
+ * from the main socket, the session is looked up by its address.
+ */
+/*
+ * Outside shared-nothing mode all threads share threads[0].tx_ts_own,
+ * only its owner reads the error queue and updates it. The others do
+ * not poll the main socket, this only keeps it that way.
+ */
+static void drain_errqueue(struct epl_thread *thread, int fd)
+{
+	if (likely(thread->tx_ts == &thread->tx_ts_own))
+		tts_drain_errqueue(fd, thread->tx_ts);
+}
+
+
+static int handle_event_conn(struct epl_thread *thread,
+			     struct srv_udp_state *state,
+			     struct epoll_event *event)
+{
+	int fd;
+	uint16_t idx = (uint16_t)(event->data.u64 & 0xffffu);
+
+	/*
+	 * The sessions are closed on this thread, no need to pin it.
+	 */
+	fd = mt_load(&state->sess_arr[idx].conn_fd);
+	if (unlikely(fd == -1))
+		/*
+		 * The session was closed earlier in this batch.
+		 */
+		return 0;
+
+	if (unlikely(event->events & EPOLLERR)) {
+		int err;
+		socklen_t len = sizeof(err);
+
+		/*
+		 * TX timestamps, or an ICMP error of an earlier
+		 * datagram. Reading SO_ERROR clears the latter,
+		 * or epoll keeps reporting it.
+		 */
+		drain_errqueue(thread, fd);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (!(event->events & EPOLLIN))
+			return 0;
+	}
+
+	return handle_event_udp(thread, state, fd);
 }
 
 
@@ -770,8 +2765,28 @@ static int handle_event(struct epl_thread *thread, struct srv_udp_state *state,
 	int ret = 0;
 	int fd = event->data.fd;
 
-	if (fd == thread->state->udp_fd) {
+	if (event->data.u64 & EPL_CONN_TAG)
+		return handle_event_conn(thread, state, event);
+
+	if (fd == thread->udp_fd) {
+		if (unlikely(event->events & EPOLLERR))
+			/*
+			 * TX timestamps (or an ICMP error) are
+			 * waiting on the error queue.
+			 */
+			drain_errqueue(thread, fd);
+
 		ret = handle_event_udp(thread, state, fd);
+	} else if (fd == thread->evt_fd) {
+		ret = handle_event_fwd(thread);
+	} else if (fd == thread->pace_fd) {
+		ret = handle_event_pace(thread);
+	} else if (fd == state->upg_fd) {
+		ret = srv_upgrade_accept(state);
+	} else if (fd == state->repl_fd) {
+		ret = srv_repl_accept(state);
+	} else if (fd == state->repl_cli_fd) {
+		srv_repl_event(state, event->events);
 	} else {
 		ret = handle_event_tun(thread, state, fd);
 	}
@@ -791,6 +2806,20 @@ static int do_epoll_wait(struct epl_thread *thread, struct srv_udp_state *state)
 		return ret;
 	}
 
+	if (ret == 0)
+		/*
+		 * We are idle, let the busy threads have our free
+		 * session slots.
+		 */
+		idx_mag_flush(&thread->sess_mag, &state->sess_depot);
+	else if (state->cfg->sock.timestamping)
+		thread->wake_ns = tts_now_ns();
+
+	if (unlikely(state->dump_stats)) {
+		state->dump_stats = false;
+		srv_stats_dump(state);
+	}
+
 	events = thread->events;
 	for (i = 0; i < ret; i++) {
 		tmp = handle_event(thread, state, &events[i]);
@@ -798,26 +2827,27 @@ static int do_epoll_wait(struct epl_thread *thread, struct srv_udp_state *state)
 			return tmp;
 	}
 
+	if (thread->idx == 0)
+		srv_repl_tick(state);
+
+	shed_tick(thread, state);
+	sockbuf_tick(thread);
 	return 0;
 }
 
 
 static void thread_wait(struct epl_thread *thread, struct srv_udp_state *state)
 {
-	static _Atomic(bool) release_sub_thread = false;
+	struct timespec now;
 	uint8_t nn = state->cfg->sys.thread_num;
 
+	tbarrier_arrive(&state->thread_gate);
 	if (thread->idx != 0) {
 		/*
 		 * We are the sub thread.
 		 * Waiting for the main thread be ready...
 		 */
-		while (!atomic_load(&release_sub_thread)) {
-			if (unlikely(state->stop))
-				return;
-
-			usleep(100000);
-		}
+		tbarrier_wait_open(&state->thread_gate, &state->stop);
 		return;
 	}
 
@@ -825,23 +2855,19 @@ static void thread_wait(struct epl_thread *thread, struct srv_udp_state *state)
 	 * We are the main thread. Wait for all threads
 	 * to be spawned properly.
 	 */
-	while (atomic_load(&state->n_on_threads) != nn) {
-
-		prl_notice(2, "(thread=%u) "
-			   "Waiting for subthread(s) to be ready...",
-			   thread->idx);
-
-		if (unlikely(state->stop))
-			return;
-
-		usleep(100000);
-	}
+	prl_notice(2, "(thread=%u) Waiting for subthread(s) to be ready...",
+		   thread->idx);
+	if (!tbarrier_wait_arrivals(&state->thread_gate, nn, &state->stop))
+		return;
 
 	if (nn > 1)
 		prl_notice(2, "All threads are ready!");
 
-	prl_notice(2, "Initialization Sequence Completed");
-	atomic_store(&release_sub_thread, true);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	prl_notice(2, "Initialization Sequence Completed (startup took %ld ms)",
+		   (long)((now.tv_sec - state->start_ts.tv_sec) * 1000l +
+			  (now.tv_nsec - state->start_ts.tv_nsec) / 1000000l));
+	tbarrier_open(&state->thread_gate);
 }
 
 
@@ -854,8 +2880,8 @@ static __no_inline void *_run_event_loop(void *thread_p)
 	thread = (struct epl_thread *)thread_p;
 	state  = thread->state;
 
-	atomic_store(&thread->is_online, true);
-	atomic_fetch_add(&state->n_on_threads, 1);
+	mt_store(&thread->is_online, true);
+	mt_fetch_add(&state->n_on_threads, 1);
 	thread_wait(thread, state);
 
 	while (likely(!state->stop)) {
@@ -866,8 +2892,8 @@ static __no_inline void *_run_event_loop(void *thread_p)
 		}
 	}
 
-	atomic_store(&thread->is_online, false);
-	atomic_fetch_sub(&state->n_on_threads, 1);
+	mt_store(&thread->is_online, false);
+	mt_fetch_sub(&state->n_on_threads, 1);
 	return (void *)((intptr_t)ret);
 }
 
@@ -900,7 +2926,8 @@ static int run_event_loop(struct srv_udp_state *state)
 	uint8_t i, nn = state->cfg->sys.thread_num;
 	struct epl_thread *threads = state->epl_threads;
 
-	atomic_store(&state->n_on_threads, 0);
+	mt_store(&state->n_on_threads, 0);
+	tbarrier_init(&state->thread_gate);
 	for (i = 1; i < nn; i++) {
 		/*
 		 * Spawn the subthreads.
@@ -927,7 +2954,7 @@ static bool wait_for_threads_to_exit(struct srv_udp_state *state)
 	uint16_t thread_on = 0, cc;
 	struct epl_thread *threads;
 
-	thread_on = atomic_load(&state->n_on_threads);
+	thread_on = mt_load(&state->n_on_threads);
 	if (thread_on == 0)
 		/*
 		 * All threads have exited, it's good.
@@ -939,7 +2966,7 @@ static bool wait_for_threads_to_exit(struct srv_udp_state *state)
 	for (i = 0; i < nn; i++) {
 		int ret;
 
-		if (!atomic_load(&threads[i].is_online))
+		if (!mt_load(&threads[i].is_online))
 			continue;
 
 		ret = pthread_kill(threads[i].thread, SIGTERM);
@@ -950,7 +2977,7 @@ static bool wait_for_threads_to_exit(struct srv_udp_state *state)
 	}
 
 	prl_notice(2, "Waiting for %hu thread(s) to exit...", thread_on);
-	while ((cc = atomic_load(&state->n_on_threads)) > 0) {
+	while ((cc = mt_load(&state->n_on_threads)) > 0) {
 
 		if (cc != thread_on) {
 			thread_on = cc;
@@ -977,6 +3004,19 @@ static void close_epoll_fds(struct srv_udp_state *state)
 	for (i = 0; i < nn; i++) {
 		int epoll_fd = threads[i].epoll_fd;
 
+		if (threads[i].evt_fd != -1)
+			close(threads[i].evt_fd);
+
+		if (threads[i].pace_fd != -1)
+			close(threads[i].pace_fd);
+
+		al64_free(threads[i].pace_heap);
+		al64_free(threads[i].pace_free);
+		al64_free(threads[i].pace_slots);
+
+		if (threads[i].fr)
+			tfr_unregister(threads[i].fr);
+
 		if (epoll_fd == -1)
 			continue;
 
@@ -996,7 +3036,7 @@ static void close_client_sess(struct srv_udp_state *state)
 
 	for (i = 0; i < max_conn; i++) {
 
-		if (!atomic_load(&sess_arr[i].is_connected))
+		if (!mt_load(&sess_arr[i].is_connected))
 			continue;
 
 		close_udp_session(&state->epl_threads[0], &sess_arr[i]);
@@ -1004,19 +3044,6 @@ static void close_client_sess(struct srv_udp_state *state)
 }
 
 
-static void free_pkt_buffer(struct srv_udp_state *state)
-{
-	uint8_t i, nn = state->cfg->sys.thread_num;
-	struct epl_thread *threads = state->epl_threads;
-
-	if (unlikely(!threads))
-		return;
-
-	for (i = 0; i < nn; i++)
-		al64_free(threads[i].pkt);
-}
-
-
 static void destroy_epoll(struct srv_udp_state *state)
 {
 	if (!wait_for_threads_to_exit(state)) {
@@ -1029,8 +3056,14 @@ static void destroy_epoll(struct srv_udp_state *state)
 	}
 
 	close_epoll_fds(state);
-	close_client_sess(state);
-	free_pkt_buffer(state);
+
+	/*
+	 * If the new process took the sessions over, the clients
+	 * must not be told to close them.
+	 */
+	if (state->upg_cli_fd == -1 || srv_upgrade_handoff(state))
+		close_client_sess(state);
+
 	al64_free(state->epl_threads);
 }
 
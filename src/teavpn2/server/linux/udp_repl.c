@@ -0,0 +1,723 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Active/standby session replication.
+ *
+ * The active server listens on [replication] peer_addr:peer_port
+ * (TCP). When a standby connects from one of the standby_addr, it
+ * gets a snapshot of the session table followed by a stream of
+ * session events (create, auth, close) and heartbeats. The standby
+ * applies them to its own sess_arr, session map and route map without
+ * binding the UDP socket or creating the TUN interface.
+ *
+ * If the active server is gone for failover_timeout, the standby
+ * promotes itself: it binds the UDP socket, brings the interface up
+ * and continues serving the replicated sessions, so the clients do
+ * not have to re-authenticate.
+ *
+ * Messages are fixed size, the integers in them are big endian (see
+ * repl_rec_hton()), so the two instances need not share an
+ * architecture.
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <poll.h>
+#include <endian.h>
+#include <sys/epoll.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <teavpn2/server/common.h>
+#include <teavpn2/server/linux/udp.h>
+
+
+#define REPL_DEFAULT_TIMEOUT	3000u
+#define REPL_SNAPSHOT_BATCH	64u
+#define REPL_RECONNECT_MS	250
+#define REPL_POLL_MS		250
+#define REPL_TXQ_SLACK		4096u
+
+
+struct repl_msg {
+	uint8_t					type;
+	uint8_t					__pad[7];
+	struct udp_sess_rec			rec;
+};
+
+static_assert(sizeof(struct repl_msg) == 320, "Bad sizeof(struct repl_msg)");
+static_assert(offsetof(struct repl_msg, rec.last_act) == 32,
+	      "Bad offsetof(struct repl_msg, rec.last_act)");
+
+
+static uint64_t repl_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+
+/*
+ * Turn an exported record into its wire form and back.
+ */
+static void repl_rec_hton(struct udp_sess_rec *rec)
+{
+	rec->ipv4_iff    = htonl(rec->ipv4_iff);
+	rec->src_addr    = htonl(rec->src_addr);
+	rec->src_port    = htons(rec->src_port);
+	rec->idx         = htons(rec->idx);
+	rec->err_c       = htons(rec->err_c);
+	rec->lb_addr     = htonl(rec->lb_addr);
+	rec->lb_port     = htons(rec->lb_port);
+	rec->last_act    = (int64_t)htobe64((uint64_t)rec->last_act);
+	rec->roam_key[0] = htobe64(rec->roam_key[0]);
+	rec->roam_key[1] = htobe64(rec->roam_key[1]);
+	rec->roam_ctr    = htonl(rec->roam_ctr);
+}
+
+
+static void repl_rec_ntoh(struct udp_sess_rec *rec)
+{
+	rec->ipv4_iff    = ntohl(rec->ipv4_iff);
+	rec->src_addr    = ntohl(rec->src_addr);
+	rec->src_port    = ntohs(rec->src_port);
+	rec->idx         = ntohs(rec->idx);
+	rec->err_c       = ntohs(rec->err_c);
+	rec->lb_addr     = ntohl(rec->lb_addr);
+	rec->lb_port     = ntohs(rec->lb_port);
+	rec->last_act    = (int64_t)be64toh((uint64_t)rec->last_act);
+	rec->roam_key[0] = be64toh(rec->roam_key[0]);
+	rec->roam_key[1] = be64toh(rec->roam_key[1]);
+	rec->roam_ctr    = ntohl(rec->roam_ctr);
+}
+
+
+static void repl_fill_addr(struct sockaddr_in *addr, const struct srv_cfg *cfg)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family      = AF_INET;
+	addr->sin_port        = htons(cfg->repl.peer_port);
+	addr->sin_addr.s_addr = inet_addr(cfg->repl.peer_addr);
+}
+
+
+static int repl_check_cfg(struct srv_cfg *cfg)
+{
+	if (!cfg->repl.failover_timeout)
+		cfg->repl.failover_timeout = REPL_DEFAULT_TIMEOUT;
+
+	if (unlikely(!*cfg->repl.peer_addr || !cfg->repl.peer_port)) {
+		pr_err("[replication] peer_addr and peer_port must be set");
+		return -EINVAL;
+	}
+
+	if (unlikely(cfg->repl.role == REPL_ROLE_ACTIVE &&
+		     !cfg->repl.nr_standby_addr)) {
+		pr_err("[replication] role = active needs standby_addr");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+
+static bool repl_standby_allowed(const struct srv_cfg *cfg, uint32_t addr)
+{
+	uint8_t i;
+
+	for (i = 0; i < cfg->repl.nr_standby_addr; i++) {
+		if (cfg->repl.standby_addr[i] == addr)
+			return true;
+	}
+	return false;
+}
+
+
+int srv_repl_listen(struct srv_udp_state *state)
+{
+	int y = 1;
+	int ret;
+	int fd;
+	struct sockaddr_in addr;
+	struct srv_cfg *cfg = state->cfg;
+
+	if (cfg->repl.role != REPL_ROLE_ACTIVE)
+		return 0;
+
+	ret = repl_check_cfg(cfg);
+	if (unlikely(ret))
+		return ret;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(fd < 0)) {
+		ret = errno;
+		pr_err("socket(AF_INET, SOCK_STREAM): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y));
+	if (unlikely(ret)) {
+		ret = errno;
+		pr_err("setsockopt(repl_fd, SO_REUSEADDR): " PRERF, PREAR(ret));
+		goto out_err;
+	}
+
+	repl_fill_addr(&addr, cfg);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("bind(repl_fd, %s:%hu): " PRERF, cfg->repl.peer_addr,
+		       cfg->repl.peer_port, PREAR(ret));
+		goto out_err;
+	}
+
+	ret = listen(fd, 1);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("listen(repl_fd): " PRERF, PREAR(ret));
+		goto out_err;
+	}
+
+	prl_notice(2, "Listening for replication standby on %s:%hu (fd=%d)",
+		   cfg->repl.peer_addr, cfg->repl.peer_port, fd);
+	state->repl_fd = fd;
+	return 0;
+
+out_err:
+	close(fd);
+	return -ret;
+}
+
+
+static void repl_drop_standby(struct srv_udp_state *state)
+{
+	if (state->repl_cli_fd == -1)
+		return;
+
+	prl_notice(2, "Closing replication standby (fd=%d)...",
+		   state->repl_cli_fd);
+	close(state->repl_cli_fd);
+	state->repl_cli_fd    = -1;
+	state->repl_txq_head  = 0;
+	state->repl_txq_tail  = 0;
+	state->repl_txq_armed = false;
+}
+
+
+static int repl_epoll_ctl(struct srv_udp_state *state, int op, uint32_t events)
+{
+	int ret;
+	struct epoll_event evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events  = events;
+	evt.data.fd = state->repl_cli_fd;
+	ret = epoll_ctl(state->epl_threads[0].epoll_fd, op, state->repl_cli_fd,
+			&evt);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("epoll_ctl(repl_cli_fd): " PRERF, PREAR(ret));
+		return -ret;
+	}
+	return 0;
+}
+
+
+/*
+ * Send what the socket takes from the queue, wait for EPOLLOUT for
+ * the rest.
+ */
+static int repl_flush(struct srv_udp_state *state)
+{
+	int ret;
+	ssize_t sent;
+	uint32_t events;
+
+	while (state->repl_txq_head < state->repl_txq_tail) {
+		sent = send(state->repl_cli_fd,
+			    state->repl_txq + state->repl_txq_head,
+			    state->repl_txq_tail - state->repl_txq_head,
+			    MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent > 0) {
+			state->repl_txq_head += (size_t)sent;
+			continue;
+		}
+
+		ret = (sent < 0) ? errno : ECONNRESET;
+		if (ret == EINTR)
+			continue;
+		if (ret == EAGAIN)
+			break;
+
+		pr_err("send(repl_cli_fd): " PRERF, PREAR(ret));
+		repl_drop_standby(state);
+		return -ret;
+	}
+
+	if (state->repl_txq_head == state->repl_txq_tail) {
+		state->repl_txq_head = 0;
+		state->repl_txq_tail = 0;
+	}
+
+	if (state->repl_txq_armed == (state->repl_txq_tail != 0))
+		return 0;
+
+	state->repl_txq_armed = !state->repl_txq_armed;
+	events = EPOLLRDHUP | (state->repl_txq_armed ? EPOLLOUT : 0u);
+	ret = repl_epoll_ctl(state, EPOLL_CTL_MOD, events);
+	if (unlikely(ret))
+		repl_drop_standby(state);
+	return ret;
+}
+
+
+/*
+ * Room for @len more bytes at the queue tail. A standby that lets
+ * the queue fill up is dropped, it will reconnect and resync from a
+ * fresh snapshot.
+ */
+static void *repl_txq_reserve(struct srv_udp_state *state, size_t len)
+{
+	size_t used = state->repl_txq_tail - state->repl_txq_head;
+
+	if (state->repl_txq_tail + len > state->repl_txq_cap &&
+	    state->repl_txq_head) {
+		memmove(state->repl_txq, state->repl_txq + state->repl_txq_head,
+			used);
+		state->repl_txq_head = 0;
+		state->repl_txq_tail = used;
+	}
+
+	if (unlikely(state->repl_txq_tail + len > state->repl_txq_cap)) {
+		pr_err("Replication standby is too slow, %zu bytes queued",
+		       used);
+		repl_drop_standby(state);
+		return NULL;
+	}
+
+	return state->repl_txq + state->repl_txq_tail;
+}
+
+
+static int repl_send(struct srv_udp_state *state, const struct repl_msg *msg)
+{
+	void *p = repl_txq_reserve(state, sizeof(*msg));
+
+	if (unlikely(!p))
+		return -ENOBUFS;
+
+	memcpy(p, msg, sizeof(*msg));
+	state->repl_txq_tail += sizeof(*msg);
+	state->repl_last_tx = repl_now_ms();
+	return repl_flush(state);
+}
+
+
+/*
+ * Queue the whole session table at once, the queue is sized for it.
+ */
+static int repl_send_snapshot(struct srv_udp_state *state)
+{
+	int ret;
+	struct repl_msg *msgs;
+	size_t n = 0;
+	uint16_t i, nr_sess = 0, max_conn = state->cfg->sock.max_conn;
+
+	msgs = repl_txq_reserve(state, ((size_t)max_conn + 2u) * sizeof(*msgs));
+	if (unlikely(!msgs))
+		return -ENOBUFS;
+
+	memset(&msgs[n], 0, sizeof(*msgs));
+	msgs[n++].type = REPL_MSG_SNAPSHOT;
+	for (i = 0; i < max_conn; i++) {
+		const struct udp_sess *sess = &state->sess_arr[i];
+
+		if (!mt_load(&sess->is_connected))
+			continue;
+
+		memset(&msgs[n], 0, sizeof(*msgs));
+		msgs[n].type = sess->is_authenticated ? REPL_MSG_SESS_AUTH
+						      : REPL_MSG_SESS_CREATE;
+		udp_sess_export_rec(sess, &msgs[n].rec);
+		repl_rec_hton(&msgs[n++].rec);
+		nr_sess++;
+	}
+
+	memset(&msgs[n], 0, sizeof(*msgs));
+	msgs[n++].type = REPL_MSG_SNAPSHOT_END;
+	state->repl_txq_tail += n * sizeof(*msgs);
+	state->repl_last_tx = repl_now_ms();
+
+	ret = repl_flush(state);
+	if (likely(!ret))
+		prl_notice(2, "Queued %hu session(s) for the replication standby",
+			   nr_sess);
+	return ret;
+}
+
+
+/*
+ * Called from the event loop when the replication listener is
+ * readable. A new standby replaces the old one. Failures here
+ * are not fatal for the active server.
+ */
+int srv_repl_accept(struct srv_udp_state *state)
+{
+	int fd;
+	int y = 1;
+	struct sockaddr_in addr;
+	char str_addr[IPV4_L];
+	socklen_t len = sizeof(addr);
+
+	fd = accept4(state->repl_fd, (struct sockaddr *)&addr, &len,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (unlikely(fd < 0)) {
+		int err = errno;
+		if (err != EAGAIN)
+			pr_err("accept4(repl_fd): " PRERF, PREAR(err));
+		return 0;
+	}
+
+	if (!inet_ntop(AF_INET, &addr.sin_addr, str_addr, sizeof(str_addr)))
+		strncpy2(str_addr, "?", sizeof(str_addr));
+
+	if (unlikely(!repl_standby_allowed(state->cfg, addr.sin_addr.s_addr))) {
+		pr_err("Refusing replication connection from %s:%hu (not a "
+		       "standby_addr)", str_addr, ntohs(addr.sin_port));
+		close(fd);
+		return 0;
+	}
+
+	prl_notice(2, "Replication standby connected from %s:%hu", str_addr,
+		   ntohs(addr.sin_port));
+
+	repl_drop_standby(state);
+
+	if (unlikely(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y)))) {
+		pr_err("setsockopt(repl_cli_fd): " PRERF, PREAR(errno));
+		close(fd);
+		return 0;
+	}
+
+	if (!state->repl_txq) {
+		/*
+		 * A snapshot and REPL_TXQ_SLACK events after it.
+		 */
+		state->repl_txq_cap = ((size_t)state->cfg->sock.max_conn + 2u +
+				       REPL_TXQ_SLACK) * sizeof(struct repl_msg);
+		state->repl_txq = calloc_wrp(1u, state->repl_txq_cap);
+		if (unlikely(!state->repl_txq)) {
+			close(fd);
+			return 0;
+		}
+	}
+
+	state->repl_cli_fd = fd;
+	if (unlikely(repl_epoll_ctl(state, EPOLL_CTL_ADD, EPOLLRDHUP))) {
+		repl_drop_standby(state);
+		return 0;
+	}
+
+	repl_send_snapshot(state);
+	return 0;
+}
+
+
+/*
+ * Called from the event loop when the standby socket is writable or
+ * the standby went away. It never sends anything to us.
+ */
+void srv_repl_event(struct srv_udp_state *state, uint32_t events)
+{
+	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		prl_notice(2, "Replication standby disconnected");
+		repl_drop_standby(state);
+		return;
+	}
+
+	if (events & EPOLLOUT)
+		repl_flush(state);
+}
+
+
+void __srv_repl_sess_event(struct srv_udp_state *state, uint8_t type,
+			   const struct udp_sess *sess)
+{
+	struct repl_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	udp_sess_export_rec(sess, &msg.rec);
+	repl_rec_hton(&msg.rec);
+	repl_send(state, &msg);
+}
+
+
+void __srv_repl_tick(struct srv_udp_state *state)
+{
+	struct repl_msg msg;
+	uint64_t now = repl_now_ms();
+
+	if (now - state->repl_last_tx < (uint64_t)repl_hb_interval(state->cfg))
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = REPL_MSG_HEARTBEAT;
+	repl_send(state, &msg);
+}
+
+
+void srv_repl_close(struct srv_udp_state *state)
+{
+	repl_drop_standby(state);
+	al64_free(state->repl_txq);
+	state->repl_txq     = NULL;
+	state->repl_txq_cap = 0;
+
+	if (state->repl_fd != -1) {
+		prl_notice(2, "Closing repl_fd (fd=%d)...", state->repl_fd);
+		close(state->repl_fd);
+		state->repl_fd = -1;
+	}
+}
+
+
+static void repl_drop_all(struct srv_udp_state *state)
+{
+	uint16_t i, max_conn = state->cfg->sock.max_conn;
+
+	for (i = 0; i < max_conn; i++) {
+		struct udp_sess *sess = &state->sess_arr[i];
+
+		if (mt_load(&sess->is_connected))
+			udp_sess_drop(state, sess);
+	}
+}
+
+
+static int repl_apply(struct srv_udp_state *state, struct repl_msg *msg,
+		      bool *synced)
+{
+	struct udp_sess *sess;
+	struct udp_sess_rec *rec = &msg->rec;
+
+	switch (msg->type) {
+	case REPL_MSG_SNAPSHOT:
+		repl_drop_all(state);
+		return 0;
+	case REPL_MSG_SNAPSHOT_END:
+		*synced = true;
+		prl_notice(2, "Replication synced (%hu session(s))",
+			   mt_load(&state->n_on_sess));
+		return 0;
+	case REPL_MSG_HEARTBEAT:
+		return 0;
+	case REPL_MSG_SESS_CREATE:
+	case REPL_MSG_SESS_AUTH:
+	case REPL_MSG_SESS_CLOSE:
+		break;
+	default:
+		pr_err("Invalid replication message type (%hhu)", msg->type);
+		return -EBADMSG;
+	}
+
+	repl_rec_ntoh(rec);
+
+	if (unlikely(rec->idx >= state->cfg->sock.max_conn)) {
+		pr_err("Invalid replicated session idx %hu", rec->idx);
+		return -EBADMSG;
+	}
+
+	sess = &state->sess_arr[rec->idx];
+	if (mt_load(&sess->is_connected))
+		udp_sess_drop(state, sess);
+
+	if (msg->type == REPL_MSG_SESS_CLOSE)
+		return 0;
+
+	return udp_sess_import_rec(state, rec);
+}
+
+
+/*
+ * Follow the active server until the connection is lost or no
+ * message arrives for failover_timeout. @last_rx is updated on
+ * every received message.
+ */
+static int repl_follow(struct srv_udp_state *state, int fd, bool *synced,
+		       uint64_t *last_rx)
+{
+	int ret = 0;
+	size_t have = 0;
+	struct repl_msg *msgs;
+	const size_t cap = REPL_SNAPSHOT_BATCH * sizeof(*msgs);
+	const uint64_t timeout = state->cfg->repl.failover_timeout;
+
+	msgs = calloc_wrp(REPL_SNAPSHOT_BATCH, sizeof(*msgs));
+	if (unlikely(!msgs))
+		return -errno;
+
+	*last_rx = repl_now_ms();
+	while (likely(!state->stop)) {
+		size_t i, n;
+		ssize_t rlen;
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		ret = poll(&pfd, 1, REPL_POLL_MS);
+		if (unlikely(ret < 0)) {
+			ret = errno;
+			if (ret == EINTR)
+				continue;
+			pr_err("poll(repl_fd): " PRERF, PREAR(ret));
+			ret = -ret;
+			break;
+		}
+
+		if (ret == 0) {
+			if (repl_now_ms() - *last_rx < timeout)
+				continue;
+			pr_err("No message from the active server for %" PRIu64
+			       " ms", timeout);
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		rlen = recv(fd, (char *)msgs + have, cap - have, 0);
+		if (unlikely(rlen <= 0)) {
+			ret = (rlen < 0) ? -errno : -ECONNRESET;
+			if (ret == -EINTR)
+				continue;
+			pr_err("Lost the active server: " PRERF, PREAR(-ret));
+			break;
+		}
+
+		*last_rx = repl_now_ms();
+		have += (size_t)rlen;
+		n = have / sizeof(*msgs);
+		for (i = 0; i < n; i++) {
+			ret = repl_apply(state, &msgs[i], synced);
+			if (unlikely(ret))
+				goto out;
+		}
+
+		have -= n * sizeof(*msgs);
+		if (have)
+			memmove(msgs, &msgs[n], have);
+	}
+
+out:
+	al64_free(msgs);
+	return ret;
+}
+
+
+static int repl_connect(struct srv_udp_state *state)
+{
+	int fd;
+	int ret;
+	int err = 0;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(err);
+	struct pollfd pfd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(fd < 0)) {
+		ret = errno;
+		pr_err("socket(AF_INET, SOCK_STREAM): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	repl_fill_addr(&addr, state->cfg);
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0 && errno != EINPROGRESS)
+		goto out_err;
+
+	if (ret < 0) {
+		pfd.fd     = fd;
+		pfd.events = POLLOUT;
+		ret = poll(&pfd, 1, REPL_POLL_MS);
+		if (ret <= 0) {
+			errno = (ret == 0) ? ETIMEDOUT : errno;
+			goto out_err;
+		}
+
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			goto out_err;
+
+		if (err) {
+			errno = err;
+			goto out_err;
+		}
+	}
+
+	return fd;
+
+out_err:
+	ret = errno;
+	close(fd);
+	return -ret;
+}
+
+
+/*
+ * Run the standby until it has to take over (returns 0), or until
+ * we are told to stop (returns 0 with @state->stop set).
+ *
+ * The standby never promotes itself before it has received one
+ * complete snapshot. Otherwise, starting the standby before the
+ * active server would make two active servers.
+ */
+int srv_repl_standby(struct srv_udp_state *state)
+{
+	int ret;
+	int fd;
+	int last_err = 0;
+	bool synced = false;
+	uint64_t last_rx = 0;
+	struct srv_cfg *cfg = state->cfg;
+	const uint64_t timeout = cfg->repl.failover_timeout;
+
+	ret = repl_check_cfg(cfg);
+	if (unlikely(ret))
+		return ret;
+
+	prl_notice(2, "Running as replication standby of %s:%hu "
+		   "(failover_timeout = %u ms)", cfg->repl.peer_addr,
+		   cfg->repl.peer_port, cfg->repl.failover_timeout);
+
+	while (likely(!state->stop)) {
+		fd = repl_connect(state);
+		if (fd < 0) {
+			if (synced && repl_now_ms() - last_rx >= timeout)
+				break;
+
+			if (-fd != last_err) {
+				last_err = -fd;
+				prl_notice(2, "Cannot connect to the active "
+					   "server: " PRERF, PREAR(last_err));
+			}
+			usleep(REPL_RECONNECT_MS * 1000);
+			continue;
+		}
+
+		last_err = 0;
+		prl_notice(2, "Connected to the active server at %s:%hu",
+			   cfg->repl.peer_addr, cfg->repl.peer_port);
+
+		ret = repl_follow(state, fd, &synced, &last_rx);
+		close(fd);
+		if (ret == -ENOMEM)
+			return ret;
+
+		if (synced && ret == -ETIMEDOUT)
+			break;
+	}
+
+	if (!state->stop)
+		prl_notice(2, "Promoting standby to active with %hu session(s)",
+			   mt_load(&state->n_on_sess));
+
+	return 0;
+}
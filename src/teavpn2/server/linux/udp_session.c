@@ -3,6 +3,7 @@
  * Copyright (C) 2021  Ammar Faizi
  */
 
+#include <sched.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
@@ -21,16 +22,53 @@ static __always_inline struct udp_map_bucket *addr_to_bkt(
 }
 
 
-struct udp_sess *map_find_udp_sess(struct srv_udp_state *state, uint32_t addr,
-				   uint16_t port)
+/*
+ * In shared-nothing mode each thread has a private session map that
+ * only the owner thread touches, so it needs no lock. Otherwise all
+ * threads share @state->sess_map behind @state->sess_map_lock.
+ */
+static __always_inline void sess_map_of(struct srv_udp_state *state,
+					uint8_t owner,
+					struct udp_map_bucket (**map)[0x100u],
+					struct tmutex **lock)
+{
+	if (state->cfg->sys.shared_nothing) {
+		*map  = state->epl_threads[owner].sess_map;
+		*lock = NULL;
+	} else {
+		*map  = state->sess_map;
+		*lock = &state->sess_map_lock;
+	}
+}
+
+
+static __always_inline void sess_map_lock(struct tmutex *lock)
+{
+	if (lock)
+		mutex_lock(lock);
+}
+
+
+static __always_inline void sess_map_unlock(struct tmutex *lock)
+{
+	if (lock)
+		mutex_unlock(lock);
+}
+
+
+struct udp_sess *map_find_udp_sess(struct srv_udp_state *state, uint8_t owner,
+				   uint32_t addr, uint16_t port)
 	__acquires(&state->sess_map_lock)
 	__releases(&state->sess_map_lock)
 {
-	struct udp_map_bucket *bkt;
+	struct tmutex *lock;
 	struct udp_sess *ret;
+	struct udp_map_bucket *bkt;
+	struct udp_map_bucket (*map)[0x100u];
 
-	bkt = addr_to_bkt(state->sess_map, addr);
-	mutex_lock(&state->sess_map_lock);
+	sess_map_of(state, owner, &map, &lock);
+	bkt = addr_to_bkt(map, addr);
+	sess_map_lock(lock);
 	do {
 		ret = bkt->sess;
 		if (ret) {
@@ -43,7 +81,7 @@ struct udp_sess *map_find_udp_sess(struct srv_udp_state *state, uint32_t addr,
 		bkt = bkt->next;
 	} while (bkt);
 out:
-	mutex_unlock(&state->sess_map_lock);
+	sess_map_unlock(lock);
 	return ret;
 }
 
@@ -54,11 +92,14 @@ static struct udp_sess *map_insert_udp_sess(struct srv_udp_state *state,
 	__acquires(&state->sess_map_lock)
 	__releases(&state->sess_map_lock)
 {
+	struct tmutex *lock;
 	struct udp_sess *ret = sess;
 	struct udp_map_bucket *bkt, *new_bkt;
+	struct udp_map_bucket (*map)[0x100u];
 
-	bkt = addr_to_bkt(state->sess_map, addr);
-	mutex_lock(&state->sess_map_lock);
+	sess_map_of(state, sess->owner, &map, &lock);
+	bkt = addr_to_bkt(map, addr);
+	sess_map_lock(lock);
 	if (!bkt->sess) {
 		bkt->sess = sess;
 		/* If first entry is empty, there should be no next! */
@@ -67,7 +108,7 @@ static struct udp_sess *map_insert_udp_sess(struct srv_udp_state *state,
 		goto out;
 	}
 
-	new_bkt = malloc(sizeof(*new_bkt));
+	new_bkt = al_slab_alloc(&state->bkt_slab);
 	if (unlikely(!new_bkt)) {
 		ret = NULL;
 		goto out;
@@ -81,23 +122,21 @@ static struct udp_sess *map_insert_udp_sess(struct srv_udp_state *state,
 
 	bkt->next = new_bkt;
 out:
-	mutex_unlock(&state->sess_map_lock);
+	sess_map_unlock(lock);
 	return ret;
 }
 
 
-struct udp_sess *get_udp_sess(struct srv_udp_state *state, uint32_t addr,
+struct udp_sess *get_udp_sess(struct epl_thread *thread, uint32_t addr,
 			      uint16_t port)
-	__acquires(&state->sess_stk_lock)
-	__releases(&state->sess_stk_lock)
 {
 	int err = 0;
 	uint16_t idx;
 	int32_t stk_ret;
 	struct udp_sess *sess, *ret = NULL;
+	struct srv_udp_state *state = thread->state;
 
-	mutex_lock(&state->sess_stk_lock);
-	stk_ret = bt_stack_pop(&state->sess_stk);
+	stk_ret = idx_mag_get(&thread->sess_mag, &state->sess_depot);
 	if (unlikely(stk_ret == -1)) {
 		pr_err("Client slot is full, cannot accept more client!");
 		err = EAGAIN;
@@ -106,11 +145,13 @@ struct udp_sess *get_udp_sess(struct srv_udp_state *state, uint32_t addr,
 
 	idx = (uint16_t)stk_ret;
 	sess = &state->sess_arr[idx];
+	reset_udp_session(sess, idx);
+	sess->owner    = (uint8_t)thread->idx;
 	sess->src_addr = addr;
 	sess->src_port = port;
 	ret = map_insert_udp_sess(state, addr, sess);
 	if (unlikely(!ret)) {
-		BUG_ON(bt_stack_push(&state->sess_stk, idx) == -1);
+		idx_mag_put(&thread->sess_mag, &state->sess_depot, idx);
 		pr_err("Cannot allocate memory on map_insert_udp_sess()!");
 		err = ENOMEM;
 		goto out;
@@ -121,10 +162,9 @@ struct udp_sess *get_udp_sess(struct srv_udp_state *state, uint32_t addr,
 			   sizeof(sess->str_src_addr)));
 
 	udp_sess_tv_update(sess);
-	atomic_store(&sess->is_connected, true);
-	atomic_fetch_add(&state->n_on_sess, 1);
+	mt_store(&sess->is_connected, true);
+	mt_fetch_add(&state->n_on_sess, 1);
 out:
-	mutex_unlock(&state->sess_stk_lock);
 	errno = err;
 	return ret;
 }
@@ -136,11 +176,14 @@ static int remove_sess_from_bkt(struct srv_udp_state *state,
 	__releases(&state->sess_map_lock)
 {
 	int ret = 0;
+	struct tmutex *lock;
 	struct udp_sess *sess;
 	struct udp_map_bucket *prev = NULL, *cur, *tmp;
+	struct udp_map_bucket (*map)[0x100u];
 
-	cur = addr_to_bkt(state->sess_map, cur_sess->src_addr);
-	mutex_lock(&state->sess_map_lock);
+	sess_map_of(state, cur_sess->owner, &map, &lock);
+	cur = addr_to_bkt(map, cur_sess->src_addr);
+	sess_map_lock(lock);
 	do {
 		sess = cur->sess;
 		if (sess == cur_sess)
@@ -158,12 +201,12 @@ do_remove:
 	if (prev == NULL) {
 		/*
 		 * WARNING!!!
-		 * It is illegal to `free(cur)` when `prev == NULL`.
+		 * It is illegal to free `cur` when `prev == NULL`.
 		 */
 		if (cur->next) {
 			tmp = cur->next->next;
 			cur->sess = cur->next->sess;
-			free(cur->next);
+			al_slab_free(&state->bkt_slab, cur->next);
 			cur->next = tmp;
 			pr_debug("put case 0");
 		} else {
@@ -173,28 +216,324 @@ do_remove:
 	} else {
 		pr_debug("put case 2");
 		tmp = cur->next;
-		free(cur);
+		al_slab_free(&state->bkt_slab, cur);
 		prev->next = tmp;
 	}
 out:
-	mutex_unlock(&state->sess_map_lock);
+	sess_map_unlock(lock);
 	if (ret)
 		errno = -ret;
 	return ret;
 }
 
 
-int put_udp_session(struct srv_udp_state *state, struct udp_sess *sess)
-	__acquires(&state->sess_stk_lock)
-	__releases(&state->sess_stk_lock)
+/*
+ * Unpublish the connected socket of @sess before closing it, the
+ * TUN threads pick it up without a lock. A sender that got it before
+ * the swap holds @conn_ref until its sendmsg() returns, wait for it
+ * so that the fd number is not reused under that sendmsg(). Closing
+ * it also takes it out of the epoll set.
+ */
+static void udp_sess_conn_close(struct udp_sess *sess)
+{
+	int fd = mt_xchg(&sess->conn_fd, -1);
+
+	if (fd == -1)
+		return;
+
+	while (mt_load(&sess->conn_ref))
+		sched_yield();
+
+	close(fd);
+}
+
+
+/*
+ * Replace the ACL of @sess with @acl. A TUN thread that looked the
+ * session up before the swap may still match a packet against the
+ * old one, it is freed after the pins on it are dropped.
+ */
+static void udp_sess_acl_swap(struct udp_sess *sess, struct tacl *acl)
+{
+	struct tacl *old = mt_xchg(&sess->acl, acl);
+
+	if (!old)
+		return;
+
+	while (mt_load(&sess->acl_ref))
+		sched_yield();
+
+	tacl_free(old);
+}
+
+
+int put_udp_session(struct epl_thread *thread, struct udp_sess *sess)
 {
 	int ret = 0;
-	mutex_lock(&state->sess_stk_lock);
-	BUG_ON(bt_stack_push(&state->sess_stk, sess->idx) == -1);
+	uint16_t idx = sess->idx;
+	struct srv_udp_state *state = thread->state;
+
 	if (state->sess_map)
 		ret = remove_sess_from_bkt(state, sess);
-	reset_udp_session(sess, sess->idx);
-	mutex_unlock(&state->sess_stk_lock);
-	atomic_fetch_sub(&state->n_on_sess, 1);
+	udp_sess_conn_close(sess);
+	udp_sess_acl_swap(sess, NULL);
+	if (sess->pool_addr)
+		tpool_release(&state->pool, sess->pool_addr);
+	reset_udp_session(sess, idx);
+	srv_flow_flush(state);
+
+	/*
+	 * Only give the index back once the slot is clean, the
+	 * next get_udp_sess() may run on another thread.
+	 */
+	idx_mag_put(&thread->sess_mag, &state->sess_depot, idx);
+	mt_fetch_sub(&state->n_on_sess, 1);
 	return ret;
 }
+
+
+/*
+ * Move @sess to the client address @saddr (session roaming, see
+ * teavpn2/roam.h). The index, and so the route map entry, stays.
+ *
+ * The TUN threads load @sess->addr without the map lock, a reply
+ * goes either to the old address or to the new one.
+ */
+int rebind_udp_sess(struct srv_udp_state *state, struct udp_sess *sess,
+		    const struct sockaddr_in *saddr)
+{
+	int ret;
+	uint32_t addr = ntohl(saddr->sin_addr.s_addr);
+
+	ret = remove_sess_from_bkt(state, sess);
+	if (unlikely(ret))
+		return ret;
+
+	sess->src_addr = addr;
+	sess->src_port = ntohs(saddr->sin_port);
+	mt_store(&sess->addr, udp_addr_pack(saddr));
+	WARN_ON(!inet_ntop(AF_INET, &saddr->sin_addr, sess->str_src_addr,
+			   sizeof(sess->str_src_addr)));
+
+	if (unlikely(!map_insert_udp_sess(state, addr, sess)))
+		return -ENOMEM;
+
+	if (mt_load(&sess->conn_fd) == -1)
+		return 0;
+
+	ret = connect(mt_load(&sess->conn_fd), (const struct sockaddr *)saddr,
+		      sizeof(*saddr));
+	if (unlikely(ret < 0)) {
+		/*
+		 * Keep the session, the replies go through the
+		 * shared socket from now on.
+		 */
+		ret = errno;
+		pr_warn("connect(conn_fd): " PRERF, PREAR(ret));
+		udp_sess_conn_close(sess);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Load the ACL of @username into @sess.
+ */
+int udp_sess_load_acl(struct udp_sess *sess, const char *username)
+{
+	int ret;
+	struct tacl *acl = NULL;
+
+	ret = teavpn2_user_acl(username, &acl);
+	if (unlikely(ret))
+		return ret;
+
+	if (acl)
+		prl_notice(2, "ACL of %s: %hu rules, default %s", username,
+			   acl->nr_rules, acl->def_allow ? "allow" : "deny");
+	udp_sess_acl_swap(sess, acl);
+	return 0;
+}
+
+
+/*
+ * Give @sess its tunnel address from the pool. A user file without
+ * "ipv4 =" gets the user's lease, the rest of @iff defaults to the
+ * server's [iface]. A static address inside the pool is claimed so
+ * that it is not leased to anybody else, one outside of it is left
+ * alone. A retried auth answers with the address @sess already has.
+ */
+int udp_sess_lease_addr(struct srv_udp_state *state, struct udp_sess *sess,
+			const char *username, struct if_info *iff)
+{
+	int ret;
+	uint32_t want = 0u, addr = sess->pool_addr;
+	const struct srv_cfg_iface *siff = &state->cfg->iface;
+
+	if (iff->ipv4[0] != '\0') {
+		want = ntohl(inet_addr(iff->ipv4));
+		if (!tpool_has(&state->pool, want))
+			return 0;
+	}
+
+	if (!addr) {
+		ret = tpool_acquire(&state->pool, username, want, &addr);
+		if (unlikely(ret))
+			return ret;
+		sess->pool_addr = addr;
+	}
+
+	if (want)
+		return 0;
+
+	addr = htonl(addr);
+	WARN_ON(!inet_ntop(AF_INET, &addr, iff->ipv4, sizeof(iff->ipv4)));
+	if (iff->ipv4_netmask[0] == '\0')
+		strncpy2(iff->ipv4_netmask, siff->iff.ipv4_netmask,
+			 sizeof(iff->ipv4_netmask));
+	if (iff->ipv4_dgateway[0] == '\0')
+		strncpy2(iff->ipv4_dgateway, siff->iff.ipv4,
+			 sizeof(iff->ipv4_dgateway));
+	if (!iff->ipv4_mtu)
+		iff->ipv4_mtu = siff->mtu;
+	return 0;
+}
+
+
+void udp_sess_export_rec(const struct udp_sess *sess, struct udp_sess_rec *rec)
+{
+	struct sockaddr_in lb;
+
+	udp_addr_unpack(mt_load(&sess->lb_addr), &lb);
+	memset(rec, 0, sizeof(*rec));
+	rec->ipv4_iff         = sess->ipv4_iff;
+	rec->src_addr         = sess->src_addr;
+	rec->src_port         = sess->src_port;
+	rec->idx              = sess->idx;
+	rec->err_c            = sess->err_c;
+	rec->is_authenticated = sess->is_authenticated ? 1u : 0u;
+	rec->lb_addr          = ntohl(lb.sin_addr.s_addr);
+	rec->lb_port          = ntohs(lb.sin_port);
+	rec->last_act         = (int64_t)sess->last_act;
+	rec->roam_key[0]      = sess->roam.key[0];
+	rec->roam_key[1]      = sess->roam.key[1];
+	rec->roam_ctr         = sess->roam_ctr;
+	strncpy2(rec->username, sess->username, sizeof(rec->username));
+}
+
+
+/*
+ * Restore a session at the exact index it had in the process
+ * that exported it. This must be called before the session
+ * stack is initialized, init_udp_session_stack() skips the
+ * slots that are already connected.
+ */
+int udp_sess_import_rec(struct srv_udp_state *state,
+			const struct udp_sess_rec *rec)
+{
+	uint32_t addr;
+	struct udp_sess *sess;
+	struct sockaddr_in saddr;
+
+	if (unlikely(rec->idx >= state->cfg->sock.max_conn)) {
+		pr_err("Cannot import session idx %hu (max_conn = %hu)",
+		       rec->idx, state->cfg->sock.max_conn);
+		return -EINVAL;
+	}
+
+	sess = &state->sess_arr[rec->idx];
+	if (unlikely(mt_load(&sess->is_connected))) {
+		pr_err("Cannot import session idx %hu (slot is in use)",
+		       rec->idx);
+		return -EEXIST;
+	}
+
+	reset_udp_session(sess, rec->idx);
+	sess->src_addr = rec->src_addr;
+	sess->src_port = rec->src_port;
+	sess->err_c    = rec->err_c;
+	sess->last_act = (time_t)rec->last_act;
+
+	udp_addr_unpack(0u, &saddr);
+	saddr.sin_port        = htons(rec->src_port);
+	saddr.sin_addr.s_addr = htonl(rec->src_addr);
+	mt_store(&sess->addr, udp_addr_pack(&saddr));
+
+	if (rec->lb_port) {
+		saddr.sin_port        = htons(rec->lb_port);
+		saddr.sin_addr.s_addr = htonl(rec->lb_addr);
+		mt_store(&sess->lb_addr, udp_addr_pack(&saddr));
+	}
+
+	addr = htonl(rec->src_addr);
+	WARN_ON(!inet_ntop(AF_INET, &addr, sess->str_src_addr,
+			   sizeof(sess->str_src_addr)));
+
+	if (unlikely(!map_insert_udp_sess(state, rec->src_addr, sess)))
+		return -ENOMEM;
+
+	if (rec->is_authenticated) {
+		int ret = udp_sess_load_acl(sess, rec->username);
+
+		if (unlikely(ret)) {
+			/*
+			 * Don't let the session in without its ACL.
+			 */
+			pr_err("Cannot load the ACL of %s: " PRERF,
+			       rec->username, PREAR(-ret));
+			remove_sess_from_bkt(state, sess);
+			reset_udp_session(sess, rec->idx);
+			return 0;
+		}
+
+		if (tpool_has(&state->pool, rec->ipv4_iff)) {
+			ret = tpool_acquire(&state->pool, rec->username,
+					    rec->ipv4_iff, &sess->pool_addr);
+			if (unlikely(ret)) {
+				pr_err("Cannot lease %s its address back: " PRERF,
+				       rec->username, PREAR(-ret));
+				remove_sess_from_bkt(state, sess);
+				udp_sess_acl_swap(sess, NULL);
+				reset_udp_session(sess, rec->idx);
+				return 0;
+			}
+		}
+
+		strncpy2(sess->username, rec->username, sizeof(sess->username));
+		sess->ipv4_iff = rec->ipv4_iff;
+		sess->roam.key[0] = rec->roam_key[0];
+		sess->roam.key[1] = rec->roam_key[1];
+		sess->roam_ctr    = rec->roam_ctr;
+		if (sess->ipv4_iff != 0)
+			add_ipv4_route_map(state->ipv4_map, sess->ipv4_iff,
+					   sess->idx);
+		sess->is_authenticated = true;
+	}
+
+	mt_store(&sess->is_connected, true);
+	mt_fetch_add(&state->n_on_sess, 1);
+	srv_flow_flush(state);
+	return 0;
+}
+
+
+/*
+ * Like put_udp_session(), but without touching the free index
+ * stack. This is used by the replication standby, which rebuilds
+ * the stack on promotion.
+ */
+void udp_sess_drop(struct srv_udp_state *state, struct udp_sess *sess)
+{
+	if (sess->ipv4_iff != 0)
+		del_ipv4_route_map(state->ipv4_map, sess->ipv4_iff);
+
+	remove_sess_from_bkt(state, sess);
+	udp_sess_conn_close(sess);
+	udp_sess_acl_swap(sess, NULL);
+	if (sess->pool_addr)
+		tpool_release(&state->pool, sess->pool_addr);
+	reset_udp_session(sess, sess->idx);
+	srv_flow_flush(state);
+	mt_fetch_sub(&state->n_on_sess, 1);
+}
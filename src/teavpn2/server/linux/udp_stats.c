@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <inttypes.h>
+#include <teavpn2/server/common.h>
+#include <teavpn2/server/linux/udp.h>
+
+
+#define US(NS) ((NS) / 1000u)
+
+
+static void dump_tx_stats(struct srv_udp_state *state)
+{
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct epl_thread *threads = state->epl_threads;
+
+	for (i = 0; i < nn; i++) {
+		const struct tts_tx *tx = &threads[i].tx_ts_own;
+
+		if (threads[i].tx_ts != tx)
+			/*
+			 * This thread sends through another thread's
+			 * socket, it is accounted there.
+			 */
+			continue;
+
+		pr_notice("  [thread=%hhu] TX %" PRIu64 " samples: qdisc avg %"
+			  PRIu64 " us max %" PRIu64 " us, driver avg %" PRIu64
+			  " us max %" PRIu64 " us", i, tx->drv.nr,
+			  US(tx->sched.avg_ns), US(tx->sched.max_ns),
+			  US(tx->drv.avg_ns), US(tx->drv.max_ns));
+	}
+}
+
+
+static void dump_sockbuf_stats(struct srv_udp_state *state)
+{
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct epl_thread *threads = state->epl_threads;
+
+	for (i = 0; i < nn; i++) {
+		const struct tsbuf *sb = &threads[i].sbuf_own;
+
+		if (threads[i].sbuf != sb)
+			continue;
+
+		pr_notice("  [thread=%hhu] UDP buffers rcvbuf %u sndbuf %u (grown "
+			  "%u, shrunk %u time(s)), %u datagram(s) dropped on "
+			  "a full receive queue, %u full send buffer(s)", i,
+			  sb->rcvbuf, sb->sndbuf, sb->nr_grow, sb->nr_shrink,
+			  tsbuf_drops(sb), mt_load(&sb->nr_tx_full));
+	}
+}
+
+
+static void dump_flow_stats(struct srv_udp_state *state)
+{
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct epl_thread *threads = state->epl_threads;
+
+	for (i = 0; i < nn; i++)
+		pr_notice("  [thread=%hhu] Flow cache %" PRIu64 " hit(s), %"
+			  PRIu64 " miss(es)", i, threads[i].flow_hit,
+			  threads[i].flow_miss);
+}
+
+
+static void dump_pool_stats(struct tpool *pool)
+{
+	mutex_lock(&pool->lock);
+	pr_notice("  Address pool %u active, %u idle, %u free, %" PRIu64
+		  " idle lease(s) taken back", pool->nr_active, pool->nr_idle,
+		  pool->nr_free, pool->nr_evict);
+	mutex_unlock(&pool->lock);
+}
+
+
+static void dump_probe_stats(const struct tprobe *p)
+{
+	if (!p->nr_rx) {
+		pr_notice("    Path: no probes received");
+		return;
+	}
+
+	pr_notice("    Path RTT srtt %" PRIu64 " us min %" PRIu64 " us jitter %"
+		  PRIu64 " us (%" PRIu64 " samples)", US(p->srtt_ns),
+		  US(p->rtt_min_ns), US(p->rtt_jit_ns), p->nr_rtt);
+	pr_notice("    Path loss in %u.%u%% out %u.%u%%, queueing %" PRIu64
+		  " us jitter %" PRIu64 " us",
+		  p->in_loss * 100u / TPROBE_LOSS_SCALE,
+		  p->in_loss * 1000u / TPROBE_LOSS_SCALE % 10u,
+		  p->out_loss * 100u / TPROBE_LOSS_SCALE,
+		  p->out_loss * 1000u / TPROBE_LOSS_SCALE % 10u,
+		  US(tprobe_owd_queue(p)), US(p->owd_jit_ns));
+}
+
+
+static void dump_sess_stats(struct srv_udp_state *state, struct udp_sess *sess)
+{
+	const struct tacl *acl;
+	const struct tts_rx *rx = &sess->rx_ts;
+
+	pr_notice("  " PRWIU, W_IU(sess));
+	dump_probe_stats(&sess->probe);
+	acl = udp_sess_acl_get(sess);
+	if (acl) {
+		pr_notice("    ACL %hu rules, %u packets dropped",
+			  acl->nr_rules, mt_load(&sess->acl_drop));
+		udp_sess_acl_put(sess);
+	}
+	if (mt_load(&sess->spoof_drop))
+		pr_notice("    %u packets dropped with a foreign source address",
+			  mt_load(&sess->spoof_drop));
+	if (!state->cfg->sock.timestamping)
+		return;
+
+	pr_notice("    RX %" PRIu64 " datagrams: socket queue avg %" PRIu64
+		  " us max %" PRIu64 " us, event loop avg %" PRIu64 " us max %"
+		  PRIu64 " us", rx->queue.nr, US(rx->queue.avg_ns),
+		  US(rx->queue.max_ns), US(rx->loop.avg_ns),
+		  US(rx->loop.max_ns));
+
+	if (rx->nic.nr)
+		pr_notice("    RX NIC to kernel avg %" PRIu64 " us max %" PRIu64
+			  " us (%" PRIu64 " hardware stamps)",
+			  US(rx->nic.avg_ns), US(rx->nic.max_ns), rx->nic.nr);
+}
+
+
+/*
+ * Print the statistics (SIGUSR1). The counters are read while the
+ * other threads may be updating them, a dump is only a snapshot.
+ */
+void srv_stats_dump(struct srv_udp_state *state)
+{
+	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	struct udp_sess *sess_arr = state->sess_arr;
+
+	pr_notice("Statistics: %hu session(s) online",
+		  mt_load(&state->n_on_sess));
+
+	if (state->cfg->sock.load_shedding) {
+		struct tshed *s = &state->shed;
+
+		pr_notice("  Load shedding: %s (entered %u time(s), send queue "
+			  "%u%%), refused %" PRIu64 " new client(s), dropped %"
+			  PRIu64 " bulk and %" PRIu64 " on full queues",
+			  tshed_level_name(tshed_level(s)), s->nr_enter,
+			  s->last_pct, (uint64_t)mt_load(&s->drop_new),
+			  (uint64_t)mt_load(&s->drop_bulk),
+			  (uint64_t)mt_load(&s->drop_full));
+	}
+
+	dump_sockbuf_stats(state);
+	dump_flow_stats(state);
+	dump_pool_stats(&state->pool);
+
+	if (state->cfg->sock.timestamping)
+		dump_tx_stats(state);
+	else
+		pr_notice("  Kernel timestamping is off ([socket] timestamping)");
+
+	for (i = 0; i < max_conn; i++) {
+		struct udp_sess *sess = &sess_arr[i];
+
+		if (!mt_load(&sess->is_connected))
+			continue;
+
+		dump_sess_stats(state, sess);
+	}
+}
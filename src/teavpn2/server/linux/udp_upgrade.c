@@ -0,0 +1,572 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Zero-downtime server upgrade.
+ *
+ * The running server listens on a unix socket (upgrade_sock). A new
+ * server started with --upgrade connects to it, then the old process
+ * stops its event loop and passes the UDP socket, the TUN queues and
+ * a snapshot of the session table via SCM_RIGHTS. The sessions stay
+ * alive, so the clients don't redo the handshake and authentication.
+ *
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <teavpn2/server/common.h>
+#include <teavpn2/server/linux/udp.h>
+
+
+#define UPG_MAGIC		0x50555654u /* "TVUP" */
+#define UPG_PROTO_VER		1u
+#define UPG_RECS_PER_MSG	64u
+#define UPG_MAX_FDS		(1u + 0xffu)
+
+/*
+ * The old process has to stop its threads before it can reply,
+ * the new process waits longer than the old one.
+ */
+#define UPG_OLD_TIMEOUT_MS	3000
+#define UPG_NEW_TIMEOUT_MS	15000
+
+
+struct upg_req {
+	uint32_t				magic;
+	uint16_t				ver;
+	uint16_t				max_conn;
+	uint8_t					thread_num;
+	uint8_t					__pad[7];
+};
+
+
+struct upg_res {
+	uint32_t				magic;
+	uint16_t				ver;
+
+	/*
+	 * 0 if the handoff follows, otherwise an errno value.
+	 */
+	uint16_t				status;
+	uint16_t				nr_fds;
+	uint16_t				nr_sess;
+	uint8_t					__pad[4];
+};
+
+
+union upg_cmsg_buf {
+	char					buf[CMSG_SPACE(sizeof(int) *
+							       UPG_MAX_FDS)];
+	struct cmsghdr				__align;
+};
+
+
+static int fill_upg_addr(struct sockaddr_un *addr, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (unlikely(len >= sizeof(addr->sun_path))) {
+		pr_err("upgrade_sock path is too long: \"%s\"", path);
+		return -ENAMETOOLONG;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len + 1);
+	return 0;
+}
+
+
+static int set_io_timeout(int fd, int timeout_ms)
+{
+	int ret;
+	struct timeval tv;
+
+	tv.tv_sec  = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (likely(!ret))
+		ret = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (unlikely(ret)) {
+		ret = errno;
+		pr_err("setsockopt(SO_RCVTIMEO/SO_SNDTIMEO): " PRERF,
+		       PREAR(ret));
+		return -ret;
+	}
+	return 0;
+}
+
+
+int srv_upgrade_listen(struct srv_udp_state *state)
+{
+	int ret;
+	int fd;
+	struct sockaddr_un addr;
+	const char *path = state->cfg->sys.upgrade_sock;
+
+	if (!*path)
+		return 0;
+
+	ret = fill_upg_addr(&addr, path);
+	if (unlikely(ret))
+		return ret;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(fd < 0)) {
+		ret = errno;
+		pr_err("socket(AF_UNIX, SOCK_SEQPACKET): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	/*
+	 * The path may belong to a dead process, or to the old process
+	 * that we have just taken over from.
+	 */
+	unlink(path);
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("bind(\"%s\"): " PRERF, path, PREAR(ret));
+		goto out_err;
+	}
+
+	ret = listen(fd, 1);
+	if (unlikely(ret < 0)) {
+		ret = errno;
+		pr_err("listen(\"%s\"): " PRERF, path, PREAR(ret));
+		goto out_err;
+	}
+
+	prl_notice(2, "Listening for upgrade request on %s (fd=%d)", path, fd);
+	state->upg_fd = fd;
+	return 0;
+
+out_err:
+	close(fd);
+	return -ret;
+}
+
+
+static void send_upg_reject(int fd, int err)
+{
+	struct upg_res res;
+
+	memset(&res, 0, sizeof(res));
+	res.magic  = UPG_MAGIC;
+	res.ver    = UPG_PROTO_VER;
+	res.status = (uint16_t)err;
+	if (send(fd, &res, sizeof(res), MSG_NOSIGNAL) < 0)
+		pr_err("send(upgrade reject): " PRERF, PREAR(errno));
+}
+
+
+/*
+ * Called from the event loop when the upgrade listener is readable.
+ *
+ * On a valid request, the event loop is stopped and the handoff is
+ * done by srv_upgrade_handoff() once all threads have exited. An
+ * invalid request is rejected and we keep serving.
+ */
+int srv_upgrade_accept(struct srv_udp_state *state)
+{
+	int fd;
+	int err;
+	ssize_t rlen;
+	struct upg_req req;
+	struct srv_cfg *cfg = state->cfg;
+
+	fd = accept4(state->upg_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (unlikely(fd < 0)) {
+		err = errno;
+		if (err != EAGAIN)
+			pr_err("accept4(upg_fd): " PRERF, PREAR(err));
+		return 0;
+	}
+
+	if (unlikely(state->upg_cli_fd != -1)) {
+		err = EBUSY;
+		goto reject;
+	}
+
+	if (unlikely(set_io_timeout(fd, UPG_OLD_TIMEOUT_MS))) {
+		close(fd);
+		return 0;
+	}
+
+	rlen = recv(fd, &req, sizeof(req), 0);
+	if (unlikely(rlen != (ssize_t)sizeof(req) || req.magic != UPG_MAGIC ||
+		     req.ver != UPG_PROTO_VER)) {
+		pr_err("Invalid upgrade request (len = %zd)", rlen);
+		err = EBADMSG;
+		goto reject;
+	}
+
+	if (req.thread_num != cfg->sys.thread_num) {
+		pr_err("Rejecting upgrade: thread num mismatch "
+		       "(old = %hhu; new = %hhu)", cfg->sys.thread_num,
+		       req.thread_num);
+		err = EINVAL;
+		goto reject;
+	}
+
+	if (req.max_conn < cfg->sock.max_conn) {
+		pr_err("Rejecting upgrade: max_conn cannot shrink "
+		       "(old = %hu; new = %hu)", cfg->sock.max_conn,
+		       req.max_conn);
+		err = EINVAL;
+		goto reject;
+	}
+
+	prl_notice(2, "Upgrade requested, stopping the event loop...");
+	state->upg_cli_fd = fd;
+	state->stop = true;
+	return 0;
+
+reject:
+	send_upg_reject(fd, err);
+	close(fd);
+	return 0;
+}
+
+
+static int send_fds(int sock, const void *buf, size_t len, const int *fds,
+		    size_t nr_fds)
+{
+	ssize_t ret;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union upg_cmsg_buf cbuf;
+
+	memset(&cbuf, 0, sizeof(cbuf));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)(uintptr_t)buf;
+	iov.iov_len  = len;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nr_fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+
+	ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (unlikely(ret != (ssize_t)len)) {
+		int err = (ret < 0) ? errno : EMSGSIZE;
+		pr_err("sendmsg(SCM_RIGHTS): " PRERF, PREAR(err));
+		return -err;
+	}
+	return 0;
+}
+
+
+static int send_sess_recs(int sock, const struct udp_sess_rec *recs,
+			  uint16_t nr_recs)
+{
+	ssize_t ret;
+	size_t len;
+	uint16_t i, n;
+
+	for (i = 0; i < nr_recs; i = (uint16_t)(i + n)) {
+		n   = (uint16_t)(nr_recs - i);
+		n   = (n > UPG_RECS_PER_MSG) ? UPG_RECS_PER_MSG : n;
+		len = (size_t)n * sizeof(*recs);
+		ret = send(sock, &recs[i], len, MSG_NOSIGNAL);
+		if (unlikely(ret != (ssize_t)len)) {
+			int err = (ret < 0) ? errno : EMSGSIZE;
+			pr_err("send(session records): " PRERF, PREAR(err));
+			return -err;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Old process side. All threads must have exited.
+ *
+ * Returns 0 if the new process now owns the sockets and the sessions,
+ * in that case we must not send TSRV_PKT_CLOSE to the clients.
+ */
+int srv_upgrade_handoff(struct srv_udp_state *state)
+{
+	int ret;
+	struct upg_res res;
+	int fds[UPG_MAX_FDS];
+	struct udp_sess_rec *recs;
+	int sock = state->upg_cli_fd;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	uint16_t j, nr_recs = 0, max_conn = state->cfg->sock.max_conn;
+
+	/*
+	 * Release the replication port now, the new process binds
+	 * it right after the takeover.
+	 */
+	srv_repl_close(state);
+
+	recs = calloc_wrp(max_conn ? max_conn : 1u, sizeof(*recs));
+	if (unlikely(!recs)) {
+		ret = -errno;
+		send_upg_reject(sock, -ret);
+		goto out;
+	}
+
+	for (j = 0; j < max_conn; j++) {
+		struct udp_sess *sess = &state->sess_arr[j];
+
+		if (!mt_load(&sess->is_connected))
+			continue;
+
+		udp_sess_export_rec(sess, &recs[nr_recs++]);
+	}
+
+	fds[0] = state->udp_fd;
+	for (i = 0; i < nn; i++)
+		fds[i + 1] = state->tun_fds[i];
+
+	memset(&res, 0, sizeof(res));
+	res.magic   = UPG_MAGIC;
+	res.ver     = UPG_PROTO_VER;
+	res.nr_fds  = (uint16_t)(nn + 1u);
+	res.nr_sess = nr_recs;
+
+	ret = send_fds(sock, &res, sizeof(res), fds, res.nr_fds);
+	if (unlikely(ret))
+		goto out;
+
+	ret = send_sess_recs(sock, recs, nr_recs);
+	if (unlikely(ret))
+		goto out;
+
+	prl_notice(2, "Handed over udp_fd, %hhu TUN queue(s) and %hu "
+		   "session(s) to the new process", nn, nr_recs);
+out:
+	al64_free(recs);
+	close(sock);
+	state->upg_cli_fd = -1;
+	return ret;
+}
+
+
+static int recv_fds(int sock, struct upg_res *res, int *fds, size_t max_fds,
+		    size_t *nr_fds)
+{
+	ssize_t ret;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union upg_cmsg_buf cbuf;
+
+	*nr_fds = 0;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = res;
+	iov.iov_len  = sizeof(*res);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (unlikely(ret < 0)) {
+		int err = errno;
+		pr_err("recvmsg(upgrade response): " PRERF, PREAR(err));
+		return -err;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t n;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		n = (n > max_fds) ? max_fds : n;
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+		*nr_fds = n;
+		break;
+	}
+
+	if (unlikely(ret != (ssize_t)sizeof(*res) || res->magic != UPG_MAGIC ||
+		     res->ver != UPG_PROTO_VER || (msg.msg_flags & MSG_CTRUNC))) {
+		pr_err("Invalid upgrade response (len = %zd)", ret);
+		return -EBADMSG;
+	}
+
+	return 0;
+}
+
+
+static int recv_sess_recs(int sock, struct udp_sess_rec *recs,
+			  uint16_t nr_recs)
+{
+	ssize_t ret;
+	size_t len;
+	uint16_t i, n;
+
+	for (i = 0; i < nr_recs; i = (uint16_t)(i + n)) {
+		n   = (uint16_t)(nr_recs - i);
+		n   = (n > UPG_RECS_PER_MSG) ? UPG_RECS_PER_MSG : n;
+		len = (size_t)n * sizeof(*recs);
+		ret = recv(sock, &recs[i], len, 0);
+		if (unlikely(ret != (ssize_t)len)) {
+			int err = (ret < 0) ? errno : EBADMSG;
+			pr_err("recv(session records): " PRERF, PREAR(err));
+			return -err;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * New process side. This replaces init_socket() and init_iface().
+ */
+int srv_upgrade_takeover(struct srv_udp_state *state)
+{
+	int ret;
+	int sock;
+	size_t i, nr_fds;
+	struct upg_req req;
+	struct upg_res res;
+	int fds[UPG_MAX_FDS];
+	struct sockaddr_un addr;
+	struct udp_sess_rec *recs;
+	struct srv_cfg *cfg = state->cfg;
+	const char *path = cfg->sys.upgrade_sock;
+
+	if (unlikely(!*path)) {
+		pr_err("upgrade_sock must be set to use --upgrade");
+		return -EINVAL;
+	}
+
+	ret = fill_upg_addr(&addr, path);
+	if (unlikely(ret))
+		return ret;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (unlikely(sock < 0)) {
+		ret = errno;
+		pr_err("socket(AF_UNIX, SOCK_SEQPACKET): " PRERF, PREAR(ret));
+		return -ret;
+	}
+
+	ret = set_io_timeout(sock, UPG_NEW_TIMEOUT_MS);
+	if (unlikely(ret))
+		goto out;
+
+	prl_notice(2, "Connecting to the old process at %s...", path);
+	ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (unlikely(ret < 0)) {
+		ret = -errno;
+		pr_err("connect(\"%s\"): " PRERF, path, PREAR(-ret));
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.magic      = UPG_MAGIC;
+	req.ver        = UPG_PROTO_VER;
+	req.max_conn   = cfg->sock.max_conn;
+	req.thread_num = cfg->sys.thread_num;
+	if (unlikely(send(sock, &req, sizeof(req), MSG_NOSIGNAL) < 0)) {
+		ret = -errno;
+		pr_err("send(upgrade request): " PRERF, PREAR(-ret));
+		goto out;
+	}
+
+	ret = recv_fds(sock, &res, fds, UPG_MAX_FDS, &nr_fds);
+	if (unlikely(ret))
+		goto out_close_fds;
+
+	if (unlikely(res.status)) {
+		ret = -(int)res.status;
+		pr_err("The old process rejected the upgrade: " PRERF,
+		       PREAR(-ret));
+		goto out_close_fds;
+	}
+
+	if (unlikely(nr_fds != res.nr_fds || nr_fds != cfg->sys.thread_num + 1u)) {
+		pr_err("Unexpected number of fds from the old process (%zu)",
+		       nr_fds);
+		ret = -EBADMSG;
+		goto out_close_fds;
+	}
+
+	/*
+	 * From now on, destroy_state() owns the fds.
+	 */
+	state->udp_fd = fds[0];
+	for (i = 1; i < nr_fds; i++)
+		state->tun_fds[i - 1] = fds[i];
+	nr_fds = 0;
+
+	recs = calloc_wrp(res.nr_sess ? res.nr_sess : 1u, sizeof(*recs));
+	if (unlikely(!recs)) {
+		ret = -errno;
+		goto out;
+	}
+
+	state->upg_recs    = recs;
+	state->upg_nr_recs = res.nr_sess;
+	ret = recv_sess_recs(sock, recs, res.nr_sess);
+	if (unlikely(ret))
+		goto out;
+
+	prl_notice(2, "Took over udp_fd (fd=%d), %zu TUN queue(s) and %hu "
+		   "session(s)", state->udp_fd, (size_t)cfg->sys.thread_num,
+		   res.nr_sess);
+
+out_close_fds:
+	for (i = 0; i < nr_fds; i++)
+		close(fds[i]);
+out:
+	close(sock);
+	return ret;
+}
+
+
+int srv_upgrade_import(struct srv_udp_state *state)
+{
+	int ret;
+	uint16_t i;
+
+	if (!state->upg_recs)
+		return 0;
+
+	for (i = 0; i < state->upg_nr_recs; i++) {
+		ret = udp_sess_import_rec(state, &state->upg_recs[i]);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	prl_notice(2, "Imported %hu session(s) from the old process",
+		   state->upg_nr_recs);
+	al64_free(state->upg_recs);
+	state->upg_recs    = NULL;
+	state->upg_nr_recs = 0;
+	return 0;
+}
+
+
+void srv_upgrade_close(struct srv_udp_state *state)
+{
+	if (state->upg_cli_fd != -1) {
+		close(state->upg_cli_fd);
+		state->upg_cli_fd = -1;
+	}
+
+	if (state->upg_fd != -1) {
+		prl_notice(2, "Closing upg_fd (fd=%d)...", state->upg_fd);
+		close(state->upg_fd);
+		state->upg_fd = -1;
+	}
+
+	al64_free(state->upg_recs);
+	state->upg_recs = NULL;
+}
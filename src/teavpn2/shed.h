@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__SHED_H
+#define TEAVPN2__SHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Load shedding.
+ *
+ * The datapath counts every time a queue it writes to is full (UDP
+ * send buffer or TUN queue EAGAIN, shared-nothing forward ring). Once
+ * per TSHED_WIN_US one thread samples the UDP send queue depth and
+ * moves the level:
+ *
+ *   TSHED_OFF        Normal operation.
+ *
+ *   TSHED_ON         Entered after TSHED_ENTER_WIN pressured windows
+ *                    in a row (a full queue, or the send queue above
+ *                    TSHED_HI_PCT). New clients are not accepted,
+ *                    bulk packets are marked down and a full queue
+ *                    drops the packet instead of blocking the thread.
+ *
+ *   TSHED_DROP_BULK  TSHED_ON while the send queue is still above
+ *                    TSHED_HI_PCT: bulk packets are dropped before
+ *                    they reach the socket. Back to TSHED_ON once it
+ *                    is below TSHED_LO_PCT.
+ *
+ * TSHED_OFF comes back after TSHED_LEAVE_WIN calm windows (nothing
+ * full, send queue below TSHED_LO_PCT). Leaving takes a lot longer
+ * than entering so the level does not flap at the edge.
+ */
+#define TSHED_OFF		0u
+#define TSHED_ON		1u
+#define TSHED_DROP_BULK		2u
+
+#define TSHED_WIN_US		100000u
+#define TSHED_ENTER_WIN		3u
+#define TSHED_LEAVE_WIN		20u
+#define TSHED_HI_PCT		75u
+#define TSHED_LO_PCT		25u
+
+/*
+ * Outer IP_TOS of the bulk packets while shedding: CS1, lower than
+ * best effort (RFC 3662).
+ */
+#define TSHED_BULK_TOS		(8 << 2)
+
+struct tshed {
+	mt_atomic(uint8_t)		level;
+	mt_atomic(uint64_t)		next_us;
+	mt_atomic(uint32_t)		nr_full;
+
+	/*
+	 * What was shed: refused new clients, dropped bulk packets
+	 * and packets dropped on a full queue.
+	 */
+	mt_atomic(uint64_t)		drop_new;
+	mt_atomic(uint64_t)		drop_bulk;
+	mt_atomic(uint64_t)		drop_full;
+
+	/*
+	 * Only touched by the thread that won the window.
+	 */
+	uint32_t			last_full;
+	uint32_t			hot;
+	uint32_t			calm;
+	uint32_t			nr_enter;
+	uint32_t			last_pct;
+};
+
+
+static __always_inline uint8_t tshed_level(struct tshed *s)
+{
+	return mt_load(&s->level);
+}
+
+
+static __always_inline void tshed_note_full(struct tshed *s)
+{
+	mt_fetch_add(&s->nr_full, 1u);
+}
+
+
+static __always_inline void tshed_count(mt_atomic(uint64_t) *ctr)
+{
+	mt_fetch_add(ctr, 1u);
+}
+
+
+/*
+ * Returns true for exactly one caller per window. @windows is the
+ * number of windows since the last evaluation, an idle server may
+ * not have looked for a while.
+ */
+static inline bool tshed_due(struct tshed *s, uint64_t now_us,
+			     uint32_t *windows)
+{
+	uint64_t next = mt_load(&s->next_us);
+
+	if (likely(now_us < next))
+		return false;
+
+	if (!mt_cmpxchg(&s->next_us, &next, now_us + TSHED_WIN_US))
+		return false;
+
+	*windows = next ? (uint32_t)((now_us - next) / TSHED_WIN_US) + 1u : 1u;
+	return true;
+}
+
+
+/*
+ * Move the level by the window that just ended. @pct is the fill of
+ * the UDP send queue in percent, @emerg is set while a thread is
+ * still retrying a full queue. Returns the new level.
+ */
+static inline uint8_t tshed_eval(struct tshed *s, uint32_t pct, bool emerg,
+				 uint32_t windows)
+{
+	uint32_t full = mt_load(&s->nr_full);
+	uint8_t level = tshed_level(s);
+	bool hot = emerg || (full != s->last_full) || (pct >= TSHED_HI_PCT);
+
+	s->last_full = full;
+	s->last_pct  = pct;
+	if (hot) {
+		s->hot++;
+		s->calm = 0;
+	} else if (pct < TSHED_LO_PCT) {
+		s->hot   = 0;
+		s->calm += windows;
+	} else {
+		s->hot  = 0;
+		s->calm = 0;
+	}
+
+	switch (level) {
+	case TSHED_OFF:
+		if (s->hot >= TSHED_ENTER_WIN) {
+			level = TSHED_ON;
+			s->nr_enter++;
+		}
+		break;
+	case TSHED_ON:
+		if (pct >= TSHED_HI_PCT)
+			level = TSHED_DROP_BULK;
+		else if (s->calm >= TSHED_LEAVE_WIN)
+			level = TSHED_OFF;
+		break;
+	case TSHED_DROP_BULK:
+		if (pct < TSHED_LO_PCT)
+			level = (s->calm >= TSHED_LEAVE_WIN) ? TSHED_OFF
+							     : TSHED_ON;
+		break;
+	}
+
+	mt_store(&s->level, level);
+	return level;
+}
+
+
+static inline const char *tshed_level_name(uint8_t level)
+{
+	switch (level) {
+	case TSHED_OFF:
+		return "off";
+	case TSHED_ON:
+		return "on";
+	case TSHED_DROP_BULK:
+		return "drop-bulk";
+	}
+	return "?";
+}
+
+#endif /* #ifndef TEAVPN2__SHED_H */
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__SOCKBUF_H
+#define TEAVPN2__SOCKBUF_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL		40
+#endif
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO		55
+#endif
+
+
+/*
+ * Adaptive socket buffer sizing.
+ *
+ * The UDP socket used to be forced to a 200 MB receive buffer and a
+ * 50 MB send buffer whatever the load, that is a lot of memory that
+ * is mostly never touched, and a lot of queueing delay when it is.
+ * Instead the buffers start small (the size the socket already has,
+ * clamped to the bounds) and are resized by what the kernel reports,
+ * once per TSBUF_WIN_US:
+ *
+ *   RX  Datagrams dropped on a full receive queue (SK_MEMINFO_DROPS,
+ *       also carried by every datagram as the SO_RXQ_OVFL cmsg)
+ *       double the receive buffer.
+ *
+ *   TX  A sendmsg() that got EAGAIN, or a send queue at 3/4 of the
+ *       buffer or more, doubles the send buffer.
+ *
+ * A buffer is halved after TSBUF_SHRINK_WIN windows in a row with
+ * nothing dropped and its queue below 1/8 of it. Growing takes one
+ * window, shrinking takes half a minute, so it settles at the size
+ * the peak load needs.
+ *
+ * The sizes are what we ask for, the kernel doubles them for its
+ * bookkeeping overhead (see socket(7)). The FORCE options ignore
+ * rmem_max/wmem_max but need CAP_NET_ADMIN, without it the buffers
+ * are capped by the sysctls.
+ */
+#define TSBUF_WIN_US		1000000u
+#define TSBUF_SHRINK_WIN	30u
+
+#define TSBUF_RCV_MIN		(1024u * 1024u)
+#define TSBUF_RCV_MAX		(1024u * 1024u * 200u)
+#define TSBUF_SND_MIN		(1024u * 1024u)
+#define TSBUF_SND_MAX		(1024u * 1024u * 50u)
+
+/*
+ * tsbuf_tick() flags.
+ */
+#define TSBUF_RCV_CHANGED	(1u << 0u)
+#define TSBUF_SND_CHANGED	(1u << 1u)
+
+struct tsbuf {
+	int			fd;
+	bool			force;
+
+	/*
+	 * Set by the receiving threads when SO_RXQ_OVFL moved, the
+	 * next tick does not wait for the window to end. Outside
+	 * shared-nothing mode they all share the owner's tsbuf.
+	 */
+	mt_atomic(bool)		rx_drop;
+	mt_atomic(uint32_t)	rxq_ovfl;
+
+	uint32_t		rcv_min;
+	uint32_t		rcv_max;
+	uint32_t		snd_min;
+	uint32_t		snd_max;
+	uint32_t		rcvbuf;
+	uint32_t		sndbuf;
+
+	/*
+	 * Full send buffers (EAGAIN), counted by every thread that
+	 * sends through the socket.
+	 */
+	mt_atomic(uint32_t)	nr_tx_full;
+
+	/*
+	 * Only touched by the thread that owns the socket.
+	 */
+	uint64_t		next_us;
+	uint32_t		drops0;
+	uint32_t		last_drops;
+	uint32_t		last_tx_full;
+	uint32_t		rcv_calm;
+	uint32_t		snd_calm;
+	uint32_t		nr_grow;
+	uint32_t		nr_shrink;
+	uint32_t		meminfo[SK_MEMINFO_VARS];
+};
+
+/*
+ * Room for the SO_RXQ_OVFL cmsg in a recvmsg() control buffer.
+ */
+#define TSBUF_CMSG_SPACE	CMSG_SPACE(sizeof(uint32_t))
+
+
+static inline int tsbuf_set(struct tsbuf *sb, int rcv, uint32_t val)
+{
+	int y = (int)val, opt;
+
+	if (sb->force) {
+		opt = rcv ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+		if (!setsockopt(sb->fd, SOL_SOCKET, opt, &y, sizeof(y)))
+			return 0;
+
+		if (errno != EPERM)
+			return -errno;
+
+		sb->force = false;
+	}
+
+	opt = rcv ? SO_RCVBUF : SO_SNDBUF;
+	if (setsockopt(sb->fd, SOL_SOCKET, opt, &y, sizeof(y)))
+		return -errno;
+
+	return 0;
+}
+
+
+static __always_inline uint32_t tsbuf_clamp(uint32_t v, uint32_t lo,
+					    uint32_t hi)
+{
+	return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+
+/*
+ * The size @fd has now, as we would have asked for it.
+ */
+static inline uint32_t tsbuf_get(int fd, int opt)
+{
+	int y = 0;
+	socklen_t len = sizeof(y);
+
+	if (getsockopt(fd, SOL_SOCKET, opt, &y, &len) || y <= 0)
+		return 0;
+
+	return (uint32_t)y / 2u;
+}
+
+
+static inline int tsbuf_meminfo(struct tsbuf *sb)
+{
+	socklen_t len = sizeof(sb->meminfo);
+
+	if (getsockopt(sb->fd, SOL_SOCKET, SO_MEMINFO, sb->meminfo, &len))
+		return -errno;
+
+	return 0;
+}
+
+
+/*
+ * Take over the buffers of @fd. Zero bounds are the defaults. A
+ * socket inherited from an older process keeps its sizes as long
+ * as they are within the bounds.
+ *
+ * Returns -EPERM if the FORCE options were not allowed (the buffers
+ * are set anyway, only capped by the sysctls), other errors are
+ * fatal.
+ */
+static inline int tsbuf_init(struct tsbuf *sb, int fd, uint32_t rcv_min,
+			     uint32_t rcv_max, uint32_t snd_min,
+			     uint32_t snd_max)
+{
+	int y = 1, ret;
+
+	memset(sb, 0, sizeof(*sb));
+	sb->fd      = fd;
+	sb->force   = true;
+	sb->rcv_min = rcv_min ? rcv_min : TSBUF_RCV_MIN;
+	sb->rcv_max = rcv_max ? rcv_max : TSBUF_RCV_MAX;
+	sb->snd_min = snd_min ? snd_min : TSBUF_SND_MIN;
+	sb->snd_max = snd_max ? snd_max : TSBUF_SND_MAX;
+	if (sb->rcv_max < sb->rcv_min)
+		sb->rcv_max = sb->rcv_min;
+	if (sb->snd_max < sb->snd_min)
+		sb->snd_max = sb->snd_min;
+
+	/*
+	 * The kernel takes at most INT_MAX / 2.
+	 */
+	sb->rcv_max = tsbuf_clamp(sb->rcv_max, 0, INT32_MAX / 2);
+	sb->snd_max = tsbuf_clamp(sb->snd_max, 0, INT32_MAX / 2);
+	sb->rcv_min = tsbuf_clamp(sb->rcv_min, 0, sb->rcv_max);
+	sb->snd_min = tsbuf_clamp(sb->snd_min, 0, sb->snd_max);
+
+	sb->rcvbuf = tsbuf_clamp(tsbuf_get(fd, SO_RCVBUF), sb->rcv_min,
+				 sb->rcv_max);
+	sb->sndbuf = tsbuf_clamp(tsbuf_get(fd, SO_SNDBUF), sb->snd_min,
+				 sb->snd_max);
+
+	ret = tsbuf_set(sb, 1, sb->rcvbuf);
+	if (unlikely(ret))
+		return ret;
+
+	ret = tsbuf_set(sb, 0, sb->sndbuf);
+	if (unlikely(ret))
+		return ret;
+
+	/*
+	 * Not fatal, the drops are still read from SO_MEMINFO.
+	 */
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &y, sizeof(y));
+
+	if (!tsbuf_meminfo(sb))
+		sb->drops0 = sb->meminfo[SK_MEMINFO_DROPS];
+
+	sb->last_drops = sb->drops0;
+	mt_store(&sb->rxq_ovfl, sb->drops0);
+	return sb->force ? 0 : -EPERM;
+}
+
+
+static __always_inline void tsbuf_note_tx_full(struct tsbuf *sb)
+{
+	mt_fetch_add(&sb->nr_tx_full, 1u);
+}
+
+
+/*
+ * Datagrams the kernel dropped on a full receive queue since
+ * tsbuf_init().
+ */
+static __always_inline uint32_t tsbuf_drops(const struct tsbuf *sb)
+{
+	return sb->last_drops - sb->drops0;
+}
+
+
+/*
+ * Look for the SO_RXQ_OVFL counter in a received datagram.
+ */
+static inline void tsbuf_cmsg_rx(struct tsbuf *sb, struct msghdr *msg)
+{
+	uint32_t ovfl;
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SO_RXQ_OVFL)
+			continue;
+
+		memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+		if (unlikely(ovfl != mt_load(&sb->rxq_ovfl))) {
+			mt_store(&sb->rxq_ovfl, ovfl);
+			mt_store(&sb->rx_drop, true);
+		}
+		break;
+	}
+}
+
+
+static inline int tsbuf_resize(struct tsbuf *sb, int rcv, uint32_t val)
+{
+	uint32_t *cur = rcv ? &sb->rcvbuf : &sb->sndbuf;
+	int ret;
+
+	if (val == *cur)
+		return 0;
+
+	ret = tsbuf_set(sb, rcv, val);
+	if (unlikely(ret))
+		return ret;
+
+	if (val > *cur)
+		sb->nr_grow++;
+	else
+		sb->nr_shrink++;
+
+	*cur = val;
+	return 1;
+}
+
+
+/*
+ * Run by the thread that owns the socket. Returns the TSBUF_*_CHANGED
+ * flags of the buffers that were resized, or a negative errno.
+ */
+static inline int tsbuf_tick(struct tsbuf *sb, uint64_t now_us)
+{
+	uint32_t drops, tx_full, rmem, wmem, rbuf, wbuf, val;
+	bool rx_hot, tx_hot;
+	int ret, flags = 0;
+
+	if (likely(now_us < sb->next_us) && !mt_load(&sb->rx_drop))
+		return 0;
+
+	sb->next_us = now_us + TSBUF_WIN_US;
+	mt_store(&sb->rx_drop, false);
+
+	ret = tsbuf_meminfo(sb);
+	if (unlikely(ret))
+		return ret;
+
+	rmem    = sb->meminfo[SK_MEMINFO_RMEM_ALLOC];
+	rbuf    = sb->meminfo[SK_MEMINFO_RCVBUF];
+	wmem    = sb->meminfo[SK_MEMINFO_WMEM_ALLOC];
+	wbuf    = sb->meminfo[SK_MEMINFO_SNDBUF];
+	drops   = sb->meminfo[SK_MEMINFO_DROPS];
+	tx_full = mt_load(&sb->nr_tx_full);
+
+	rx_hot = (drops != sb->last_drops);
+	tx_hot = (tx_full != sb->last_tx_full) || (wmem >= wbuf / 4u * 3u);
+	sb->last_drops   = drops;
+	sb->last_tx_full = tx_full;
+
+	if (rx_hot) {
+		sb->rcv_calm = 0;
+		val = (sb->rcvbuf > sb->rcv_max / 2u) ? sb->rcv_max
+						      : sb->rcvbuf * 2u;
+	} else if (rmem < rbuf / 8u && ++sb->rcv_calm >= TSBUF_SHRINK_WIN) {
+		sb->rcv_calm = 0;
+		val = tsbuf_clamp(sb->rcvbuf / 2u, sb->rcv_min, sb->rcv_max);
+	} else {
+		if (rmem >= rbuf / 8u)
+			sb->rcv_calm = 0;
+		val = sb->rcvbuf;
+	}
+
+	ret = tsbuf_resize(sb, 1, val);
+	if (unlikely(ret < 0))
+		return ret;
+	if (ret)
+		flags |= TSBUF_RCV_CHANGED;
+
+	if (tx_hot) {
+		sb->snd_calm = 0;
+		val = (sb->sndbuf > sb->snd_max / 2u) ? sb->snd_max
+						      : sb->sndbuf * 2u;
+	} else if (wmem < wbuf / 8u && ++sb->snd_calm >= TSBUF_SHRINK_WIN) {
+		sb->snd_calm = 0;
+		val = tsbuf_clamp(sb->sndbuf / 2u, sb->snd_min, sb->snd_max);
+	} else {
+		if (wmem >= wbuf / 8u)
+			sb->snd_calm = 0;
+		val = sb->sndbuf;
+	}
+
+	ret = tsbuf_resize(sb, 0, val);
+	if (unlikely(ret < 0))
+		return ret;
+	if (ret)
+		flags |= TSBUF_SND_CHANGED;
+
+	return flags;
+}
+
+#endif /* #ifndef TEAVPN2__SOCKBUF_H */
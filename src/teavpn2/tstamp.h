@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__TSTAMP_H
+#define TEAVPN2__TSTAMP_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <teavpn2/qos.h>
+#include <teavpn2/mutex.h>
+#include <teavpn2/common.h>
+
+
+/*
+ * Kernel timestamping (SO_TIMESTAMPING) of the UDP socket.
+ *
+ * RX: every datagram carries the time the kernel took it off the
+ * device (software, and the NIC time if the device is set up for
+ * hardware stamping, e.g. by ptp4l). Against the time recvmsg()
+ * returns it, that is how long the datagram sat in the socket queue.
+ * The part of that we spent busy in our own event loop is measured
+ * from the moment epoll_wait() returned.
+ *
+ * TX: one of every TTS_TX_SAMPLE datagrams asks for the time it
+ * entered the qdisc and the time it was passed to the driver, they
+ * come back on the socket error queue. Only software stamps are used
+ * on TX, the NIC clock is not comparable with ours.
+ *
+ * The kernel software stamps are CLOCK_REALTIME.
+ */
+#define TTS_TX_SAMPLE		64u
+#define TTS_TX_STALE_NS		1000000000ull
+
+struct tts_stat {
+	uint64_t		nr;
+
+	/*
+	 * EWMA (1/8) and maximum, in nanoseconds.
+	 */
+	uint64_t		avg_ns;
+	uint64_t		max_ns;
+};
+
+/*
+ * RX delays of one peer, updated by the thread that receives from it.
+ */
+struct tts_rx {
+	struct tts_stat		queue;
+	struct tts_stat		loop;
+	struct tts_stat		nic;
+};
+
+/*
+ * TX delays of one socket. @pending_ns is the sendmsg() time of the
+ * sampled datagram whose stamps are not back yet.
+ */
+struct tts_tx {
+	mt_atomic(uint64_t)	pending_ns;
+	struct tts_stat		sched;
+	struct tts_stat		drv;
+};
+
+/*
+ * The stamps of the datagram just received.
+ */
+struct tts_rx_stamp {
+	uint64_t		sw_ns;
+	uint64_t		hw_ns;
+	uint64_t		recv_ns;
+};
+
+union tts_cmsg_buf {
+	char			buf[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+				    CMSG_SPACE(sizeof(struct sock_extended_err)) +
+				    64u];
+	struct cmsghdr		__align;
+};
+
+
+static __always_inline uint64_t tts_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static __always_inline uint64_t tts_ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+
+static inline void tts_stat_add(struct tts_stat *st, uint64_t a, uint64_t b)
+{
+	/*
+	 * The stamps come from different clocks (or CPUs), a
+	 * negative delay is counted as zero.
+	 */
+	uint64_t ns = (b > a) ? (b - a) : 0;
+
+	if (!st->nr++)
+		st->avg_ns = ns;
+	else
+		st->avg_ns = st->avg_ns - st->avg_ns / 8u + ns / 8u;
+
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+}
+
+
+static inline int tts_sock_setup(int fd)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+		    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+		    SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+		return -errno;
+
+	return 0;
+}
+
+
+/*
+ * Decide whether the datagram about to be sent is sampled, @seq
+ * counts the datagrams sent. Returns true after claiming @tx.
+ */
+static inline bool tts_tx_sample(struct tts_tx *tx, uint32_t seq)
+{
+	uint64_t now, pending;
+
+	if (likely(seq % TTS_TX_SAMPLE))
+		return false;
+
+	now = tts_now_ns();
+	pending = mt_load(&tx->pending_ns);
+	if (pending && now - pending < TTS_TX_STALE_NS)
+		return false;
+
+	/*
+	 * @tx may be shared by the threads sending through one
+	 * socket, only one of them gets the sample.
+	 */
+	return mt_cmpxchg(&tx->pending_ns, &pending, now);
+}
+
+
+/*
+ * Append the SO_TIMESTAMPING control message that asks for the TX
+ * stamps of this datagram, after the ones already in @cbuf.
+ */
+static inline void tts_cmsg_add(struct msghdr *msg, union tqos_cmsg_buf *cbuf)
+{
+	struct cmsghdr *cmsg;
+	uint32_t flags = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE;
+
+	if (!msg->msg_control) {
+		msg->msg_control    = cbuf->buf;
+		msg->msg_controllen = 0;
+	}
+
+	cmsg = (struct cmsghdr *)(cbuf->buf + msg->msg_controllen);
+	memset(cmsg, 0, CMSG_SPACE(sizeof(flags)));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SO_TIMESTAMPING;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(flags));
+	memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+	msg->msg_controllen += CMSG_SPACE(sizeof(flags));
+}
+
+
+/*
+ * Pick the RX stamps out of a received @msg.
+ */
+static inline void tts_cmsg_rx(struct msghdr *msg, struct tts_rx_stamp *st)
+{
+	struct cmsghdr *cmsg;
+	struct scm_timestamping tss;
+
+	st->sw_ns = 0;
+	st->hw_ns = 0;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SO_TIMESTAMPING)
+			continue;
+
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+		st->sw_ns = tts_ts_ns(&tss.ts[0]);
+		st->hw_ns = tts_ts_ns(&tss.ts[2]);
+		break;
+	}
+}
+
+
+/*
+ * Account the datagram stamped @st, the event loop woke up at
+ * @wake_ns.
+ */
+static inline void tts_rx_account(struct tts_rx *rx,
+				  const struct tts_rx_stamp *st,
+				  uint64_t wake_ns)
+{
+	if (unlikely(!st->sw_ns))
+		return;
+
+	tts_stat_add(&rx->queue, st->sw_ns, st->recv_ns);
+	tts_stat_add(&rx->loop, (wake_ns > st->sw_ns) ? wake_ns : st->sw_ns,
+		     st->recv_ns);
+	if (st->hw_ns)
+		tts_stat_add(&rx->nic, st->hw_ns, st->sw_ns);
+}
+
+
+/*
+ * Read the TX stamps off the error queue of @fd. The statistics in
+ * @tx are not atomic, only one thread may drain a given @tx.
+ */
+static inline void tts_drain_errqueue(int fd, struct tts_tx *tx)
+{
+	char dummy;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union tts_cmsg_buf cbuf;
+	struct scm_timestamping tss;
+	struct sock_extended_err serr;
+	uint64_t pending, ts_ns;
+
+	for (;;) {
+		iov.iov_base = &dummy;
+		iov.iov_len  = sizeof(dummy);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cbuf.buf;
+		msg.msg_controllen = sizeof(cbuf.buf);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		ts_ns = 0;
+		memset(&serr, 0, sizeof(serr));
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SO_TIMESTAMPING) {
+				memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+				ts_ns = tts_ts_ns(&tss.ts[0]);
+			} else if (cmsg->cmsg_level == SOL_IP &&
+				   cmsg->cmsg_type == IP_RECVERR) {
+				memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+			}
+		}
+
+		pending = mt_load(&tx->pending_ns);
+		if (!pending || !ts_ns ||
+		    serr.ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+
+		if (serr.ee_info == SCM_TSTAMP_SCHED) {
+			tts_stat_add(&tx->sched, pending, ts_ns);
+		} else if (serr.ee_info == SCM_TSTAMP_SND) {
+			tts_stat_add(&tx->drv, pending, ts_ns);
+			mt_store(&tx->pending_ns, 0);
+		}
+	}
+}
+
+#endif /* #ifndef TEAVPN2__TSTAMP_H */